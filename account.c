@@ -85,6 +85,7 @@ pamk5_account(struct pam_args *args)
             putil_err_krb5(args, retval, "cannot get principal from cache");
             return PAM_AUTH_ERR;
         }
+        pamk5_context_principal(args);
     }
     return pamk5_authorized(args);
 }
@@ -24,15 +24,17 @@
 #include <errno.h>
 
 #include <internal.h>
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
+#include <usdt.h>
 
 
 /*
  * Map the user to a Kerberos principal according to alt_auth_map.  Returns 0
- * on success, storing the mapped principal name in newly allocated memory in
- * principal.  The caller is responsible for freeing.  Returns an errno value
- * on any error.
+ * on success, storing the mapped principal name in principal.  The memory is
+ * allocated from the arena for the PAM arguments and must not be freed by the
+ * caller.  Returns an errno value on any error.
  */
 static int
 map_principal(struct pam_args *args, const char *username, char **principal)
@@ -41,7 +43,6 @@ map_principal(struct pam_args *args, const char *username, char **principal)
     char *realm;
     const char *p;
     size_t needed, offset;
-    int oerrno;
 
     /* Makes no sense if alt_auth_map isn't set. */
     if (args->config->alt_auth_map == NULL)
@@ -52,12 +53,10 @@ map_principal(struct pam_args *args, const char *username, char **principal)
     if (realm == NULL)
         user = (char *) username;
     else {
-        user = strdup(username);
+        user = putil_arena_strdup(args, username);
         if (user == NULL)
             return errno;
         realm = strchr(user, '@');
-        if (realm == NULL)
-            goto fail;
         *realm = '\0';
         realm++;
     }
@@ -75,9 +74,9 @@ map_principal(struct pam_args *args, const char *username, char **principal)
     if (realm != NULL && strchr(args->config->alt_auth_map, '@') == NULL)
         needed += 1 + strlen(realm);
     needed++;
-    *principal = malloc(needed);
+    *principal = putil_arena_alloc(args, needed);
     if (*principal == NULL)
-        goto fail;
+        return errno;
     offset = 0;
     for (p = args->config->alt_auth_map; *p != '\0'; p++) {
         if (p[0] == '%' && p[1] == 's') {
@@ -96,17 +95,7 @@ map_principal(struct pam_args *args, const char *username, char **principal)
         offset += strlen(realm);
     }
     (*principal)[offset] = '\0';
-    if (user != username)
-        free(user);
     return 0;
-
-fail:
-    if (user != NULL && user != username) {
-        oerrno = errno;
-        free(user);
-        errno = oerrno;
-    }
-    return errno;
 }
 
 
@@ -132,14 +121,11 @@ pamk5_alt_auth(struct pam_args *args, const char *service,
     if (retval != 0)
         return retval;
     retval = krb5_parse_name(ctx->context, kuser, &princ);
-    if (retval != 0) {
-        free(kuser);
+    if (retval != 0)
         return retval;
-    }
-    free(kuser);
 
     /* Log the principal we're attempting to authenticate as. */
-    if (args->debug) {
+    if (args->debug || args->recorder != NULL) {
         char *principal;
 
         retval = krb5_unparse_name(ctx->context, princ, &principal);
@@ -155,9 +141,10 @@ pamk5_alt_auth(struct pam_args *args, const char *service,
      * Now, attempt to authenticate as that user.  On success, save the
      * principal.  Return the Kerberos status code.
      */
-    retval = krb5_get_init_creds_password(ctx->context, creds, princ,
-                (char *) pass, pamk5_prompter_krb5, args, 0,
-                (char *) service, opts);
+    PROBE_AS_START(args, princ, service);
+    retval = pamk5_init_creds(args, creds, princ, pass, pamk5_prompter_krb5,
+                              args, service, opts);
+    PROBE_AS_DONE(args, princ, service, retval);
     if (retval != 0) {
         putil_debug_krb5(args, retval, "alternate authentication failed");
         krb5_free_principal(ctx->context, princ);
@@ -167,6 +154,7 @@ pamk5_alt_auth(struct pam_args *args, const char *service,
         if (ctx->princ != NULL)
             krb5_free_principal(ctx->context, ctx->princ);
         ctx->princ = princ;
+        pamk5_context_principal(args);
         return 0;
     }
 }
@@ -226,7 +214,6 @@ pamk5_alt_auth_verify(struct pam_args *args)
     }
 
 done:
-    free(name);
     if (authed != NULL)
         krb5_free_unparsed_name(ctx->context, authed);
     if (mapped != NULL)
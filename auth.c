@@ -29,9 +29,11 @@
 #include <sys/stat.h>
 
 #include <internal.h>
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
 #include <pam-util/vector.h>
+#include <usdt.h>
 
 /*
  * If the PKINIT smart card error statuses aren't defined, define them to 0.
@@ -90,20 +92,19 @@ parse_name(struct pam_args *args)
     if (args->config->user_realm)
         user_realm = args->config->user_realm;
     if (user_realm != NULL && strchr(user, '@') == NULL) {
-        if (asprintf(&newuser, "%s@%s", user, user_realm) < 0) {
-            if (user != ctx->name)
-                free(user);
-            return KRB5_CC_NOMEM;
-        }
+        newuser = putil_arena_sprintf(args, "%s@%s", user, user_realm);
         if (user != ctx->name)
             free(user);
+        if (newuser == NULL)
+            return KRB5_CC_NOMEM;
         user = newuser;
     }
     k5_errno = krb5_parse_name(c, user, &ctx->princ);
-    if (user != ctx->name)
+    if (user != ctx->name && user != newuser)
         free(user);
     if (k5_errno != 0)
         return k5_errno;
+    pamk5_context_principal(args);
 
     /*
      * Now that we have a principal to call krb5_aname_to_localname, we can
@@ -259,9 +260,10 @@ maybe_retrieve_password(struct pam_args *args, int authtok, const char **pass)
  * we're authenticating or changing the password), and the place to store the
  * password.  Returns a PAM status code.
  *
- * If we successfully get a password, store it in the PAM data, free it, and
- * then return the password as retrieved from the PAM data so that we don't
- * have to worry about memory allocation later.
+ * If we successfully get a password, store it in the PAM data and then return
+ * the password as retrieved from the PAM data so that we don't have to worry
+ * about memory allocation later.  The password returned by the prompt is in
+ * secret arena memory, which is overwritten when the PAM arguments are freed.
  *
  * The empty password has to be handled separately, since the Kerberos
  * libraries may treat it as equivalent to no password and prompt when we
@@ -283,14 +285,11 @@ prompt_password(struct pam_args *args, int authtok, const char **pass)
     }
     if (password[0] == '\0') {
         putil_debug(args, "rejecting empty password");
-        free(password);
         return PAM_AUTH_ERR;
     }
 
     /* Set this for the next PAM module. */
     status = pam_set_item(args->pamh, authtok, password);
-    memset(password, 0, strlen(password));
-    free(password);
     if (status != PAM_SUCCESS) {
         putil_err_pam(args, status, "error storing password");
         return PAM_AUTH_ERR;
@@ -306,12 +305,187 @@ prompt_password(struct pam_args *args, int authtok, const char **pass)
 }
 
 
+/*
+ * The state of an authentication left incomplete by nonblocking_auth, kept in
+ * the context until a later call finishes it.  The exchange outlives the call
+ * that started it, so it has its own copy of the password, keeps the initial
+ * credential options of that call, and prompts through whichever call is
+ * current.
+ */
+struct pamk5_resume {
+    struct pam_args *args;          /* The current call, for prompting. */
+    struct pamk5_exchange *ex;      /* The exchange, while it is running. */
+    krb5_get_init_creds_opt *opts;  /* Credential options, between calls. */
+    char *pass;                     /* Copy of the password. */
+    bool retry;                     /* Whether to prompt again on failure. */
+};
+
+
+/*
+ * Prompter for an exchange that may outlive the call that started it.
+ */
+static krb5_error_code
+resume_prompter(krb5_context c, void *data, const char *name,
+                const char *banner, int num_prompts, krb5_prompt *prompts)
+{
+    struct pamk5_resume *resume = data;
+
+    return pamk5_prompter_krb5(c, resume->args, name, banner, num_prompts,
+                               prompts);
+}
+
+
+/*
+ * Tell the application what to wait for before calling pam_authenticate
+ * again: a descriptor to wait on for reading, or -1, and the most
+ * milliseconds to wait.  Returns false if the PAM environment couldn't be
+ * set.
+ */
+static bool
+resume_export(struct pam_args *args, int fd, int timeout)
+{
+    char *value;
+
+    value = putil_arena_sprintf(args, "%d", fd);
+    if (value == NULL)
+        return false;
+    if (pamk5_setenv(args, "PAM_KRB5_POLL_FD", value) != PAM_SUCCESS)
+        return false;
+    value = putil_arena_sprintf(args, "%d", timeout);
+    if (value == NULL)
+        return false;
+    if (pamk5_setenv(args, "PAM_KRB5_POLL_TIMEOUT", value) != PAM_SUCCESS)
+        return false;
+    return true;
+}
+
+
+/*
+ * Remove what resume_export set from the PAM environment.  As in setcred.c,
+ * fall back on setting the variables to empty values for PAM libraries that
+ * can't delete them.
+ */
+static void
+resume_unexport(struct pam_args *args)
+{
+    static const char *const keys[] = {
+        "PAM_KRB5_POLL_FD", "PAM_KRB5_POLL_TIMEOUT"
+    };
+    char *empty;
+    size_t i;
+
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (pam_getenv(args->pamh, keys[i]) == NULL)
+            continue;
+        if (pam_putenv(args->pamh, keys[i]) == PAM_SUCCESS)
+            continue;
+        empty = putil_arena_sprintf(args, "%s=", keys[i]);
+        if (empty != NULL)
+            pam_putenv(args->pamh, empty);
+    }
+}
+
+
+/*
+ * Take the running exchange of a resumable authentication as far as it can
+ * go without waiting.  If it is still waiting on a KDC, tell the application
+ * what to wait for and return EAGAIN, or if that isn't possible, wait for it
+ * here after all.  Otherwise, free the exchange and return its result,
+ * storing the credentials in creds on success.
+ */
+static krb5_error_code
+resume_poll(struct pam_args *args, krb5_creds *creds)
+{
+    struct pamk5_resume *resume = args->config->ctx->resume;
+    krb5_error_code retval;
+    size_t winner;
+    bool finished;
+    int fd, timeout;
+
+    retval = pamk5_exchange_poll(args, resume->ex, &fd, &timeout);
+    if (retval == EAGAIN) {
+        if (resume_export(args, fd, timeout))
+            return EAGAIN;
+        putil_debug(args, "cannot return PAM_INCOMPLETE, waiting for KDC");
+        pamk5_exchange_run(args, &resume->ex, 1, 1, false, &winner);
+    }
+    resume_unexport(args);
+    retval = pamk5_exchange_status(resume->ex, &finished);
+    if (retval == 0)
+        pamk5_exchange_creds(resume->ex, creds);
+    pamk5_exchange_free(resume->ex);
+    resume->ex = NULL;
+    return retval;
+}
+
+
+/*
+ * Start a resumable authentication as the principal in the context, which
+ * returns EAGAIN as resume_poll does if the KDC hasn't answered yet.  The
+ * caller has to hand opts over to the resume state in that case.
+ */
+static krb5_error_code
+resume_start(struct pam_args *args, krb5_creds *creds,
+             krb5_get_init_creds_opt *opts, const char *pass)
+{
+    struct context *ctx = args->config->ctx;
+    struct pamk5_resume *resume;
+    krb5_error_code retval;
+
+    if (ctx->resume == NULL) {
+        ctx->resume = calloc(1, sizeof(struct pamk5_resume));
+        if (ctx->resume == NULL)
+            return errno;
+    }
+    resume = ctx->resume;
+    resume->args = args;
+    if (pass != resume->pass) {
+        if (resume->pass != NULL)
+            putil_secret_free(resume->pass);
+        resume->pass = NULL;
+        if (pass != NULL) {
+            resume->pass = putil_secret_strdup(pass);
+            if (resume->pass == NULL)
+                return errno;
+        }
+    }
+    retval = pamk5_exchange_new(args, ctx->princ, resume->pass,
+                                resume_prompter, resume, NULL, opts,
+                                &resume->ex);
+    if (retval != 0)
+        return retval;
+    return resume_poll(args, creds);
+}
+
+
+/*
+ * Free the state of an authentication left incomplete by nonblocking_auth,
+ * abandoning its exchange if it is still running.
+ */
+void
+pamk5_resume_free(krb5_context c, struct pamk5_resume *resume)
+{
+    if (resume == NULL)
+        return;
+    pamk5_exchange_free(resume->ex);
+    if (resume->opts != NULL)
+        krb5_get_init_creds_opt_free(c, resume->opts);
+    if (resume->pass != NULL)
+        putil_secret_free(resume->pass);
+    free(resume);
+}
+
+
 /*
  * Authenticate via password.
  *
  * This is our basic authentication function.  Log what principal we're
  * attempting to authenticate with and then attempt password authentication.
  * Returns 0 on success or a Kerberos error on failure.
+ *
+ * With nonblocking_auth, the exchange for the default TGT is resumable, and
+ * this returns EAGAIN if it's still waiting on the KDC.  Calling this again
+ * then picks up that exchange instead of starting a new one.
  */
 static krb5_error_code
 password_auth(struct pam_args *args, krb5_creds *creds,
@@ -321,8 +495,17 @@ password_auth(struct pam_args *args, krb5_creds *creds,
     struct context *ctx = args->config->ctx;
     krb5_error_code retval;
 
+    /* Pick up an exchange left running by an earlier call. */
+    if (ctx->resume != NULL && ctx->resume->ex != NULL) {
+        ctx->resume->args = args;
+        retval = resume_poll(args, creds);
+        if (retval == EAGAIN)
+            return retval;
+        goto done;
+    }
+
     /* Log the principal as which we're attempting authentication. */
-    if (args->debug) {
+    if (args->debug || args->recorder != NULL) {
         char *principal;
 
         retval = krb5_unparse_name(ctx->context, ctx->princ, &principal);
@@ -340,9 +523,17 @@ password_auth(struct pam_args *args, krb5_creds *creds,
     }
 
     /* Do thet authentication. */
-    retval = krb5_get_init_creds_password(ctx->context, creds, ctx->princ,
-                 (char *) pass, pamk5_prompter_krb5, args, 0,
-                 (char *) service, opts);
+    PROBE_AS_START(args, ctx->princ, service);
+    if (service == NULL && args->config->nonblocking_auth)
+        retval = resume_start(args, creds, opts, pass);
+    else
+        retval = pamk5_init_creds(args, creds, ctx->princ, pass,
+                                  pamk5_prompter_krb5, args, service, opts);
+    if (retval == EAGAIN)
+        return retval;
+
+done:
+    PROBE_AS_DONE(args, ctx->princ, service, retval);
 
     /*
      * Heimdal may return an expired key error even if the password is
@@ -352,9 +543,11 @@ password_auth(struct pam_args *args, krb5_creds *creds,
      * otherwise change the error to invalid password.
      */
     if (retval == KRB5KDC_ERR_KEY_EXP) {
-        retval = krb5_get_init_creds_password(ctx->context, creds,
-                     ctx->princ, (char *) pass, pamk5_prompter_krb5, args, 0,
-                     (char *) "kadmin/changepw", opts);
+        PROBE_AS_START(args, ctx->princ, "kadmin/changepw");
+        retval = pamk5_init_creds(args, creds, ctx->princ, pass,
+                                  pamk5_prompter_krb5, args,
+                                  "kadmin/changepw", opts);
+        PROBE_AS_DONE(args, ctx->princ, "kadmin/changepw", retval);
         if (retval == 0) {
             retval = KRB5KDC_ERR_KEY_EXP;
             krb5_free_cred_contents(ctx->context, creds);
@@ -365,6 +558,30 @@ password_auth(struct pam_args *args, krb5_creds *creds,
 }
 
 
+/*
+ * Try to authenticate as one principal from the .k5login file, whose
+ * unparsed form is name.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+k5login_attempt(struct pam_args *args, krb5_creds *creds,
+                krb5_get_init_creds_opt *opts, const char *service,
+                const char *pass, krb5_principal princ, const char *name)
+{
+    krb5_error_code retval;
+
+    if (service == NULL)
+        putil_debug(args, "attempting authentication as %s", name);
+    else
+        putil_debug(args, "attempting authentication as %s for %s", name,
+                    service);
+    PROBE_AS_START(args, princ, service);
+    retval = pamk5_init_creds(args, creds, princ, pass, pamk5_prompter_krb5,
+                              args, service, opts);
+    PROBE_AS_DONE(args, princ, service, retval);
+    return retval;
+}
+
+
 /*
  * Authenticate by trying each principal in the .k5login file.
  *
@@ -373,6 +590,11 @@ password_auth(struct pam_args *args, krb5_creds *creds,
  * succeed, fill out creds, set princ to the successful principal in the
  * context, and return 0.  Otherwise, return either a Kerberos error code or
  * errno for a system error.
+ *
+ * If search_k5login_hints is set and has a hint for this version of the
+ * file, try the principal that worked last time first.  If
+ * search_k5login_parallel is set, collect all the principals first and try
+ * them at once instead of in turn.
  */
 static krb5_error_code
 k5login_password_auth(struct pam_args *args, krb5_creds *creds,
@@ -388,6 +610,11 @@ k5login_password_auth(struct pam_args *args, krb5_creds *creds,
     struct stat st;
     krb5_error_code k5_errno, retval;
     krb5_principal princ;
+    krb5_principal hinted = NULL;
+    krb5_principal *candidates = NULL;
+    const char *hint_name = NULL;
+    size_t count = 0, i, winner;
+    bool parallel = (args->config->search_k5login_parallel > 1);
 
     /*
      * C sucks at string manipulation.  Generate the filename for the user's
@@ -396,16 +623,19 @@ k5login_password_auth(struct pam_args *args, krb5_creds *creds,
      * and assume ctx->princ is already set properly.
      */
     pwd = pam_modutil_getpwnam(args->pamh, ctx->name);
-    if (pwd != NULL)
-        if (asprintf(&filename, "%s/.k5login", pwd->pw_dir) < 0) {
+    if (pwd != NULL) {
+        filename = putil_arena_sprintf(args, "%s/.k5login", pwd->pw_dir);
+        if (filename == NULL) {
             putil_crit(args, "malloc failure: %s", strerror(errno));
             return errno;
         }
-    if (pwd == NULL || filename == NULL || access(filename, R_OK) != 0) {
-        free(filename);
-        return krb5_get_init_creds_password(ctx->context, creds, ctx->princ,
-                   (char *) pass, pamk5_prompter_krb5, args, 0,
-                   (char *) service, opts);
+    }
+    if (pwd == NULL || access(filename, R_OK) != 0) {
+        PROBE_AS_START(args, ctx->princ, service);
+        retval = pamk5_init_creds(args, creds, ctx->princ, pass,
+                                  pamk5_prompter_krb5, args, service, opts);
+        PROBE_AS_DONE(args, ctx->princ, service, retval);
+        return retval;
     }
 
     /*
@@ -414,30 +644,45 @@ k5login_password_auth(struct pam_args *args, krb5_creds *creds,
      * Kerberos error code to errno.
      */
     k5login = fopen(filename, "r");
-    if (k5login == NULL) {
-        retval = errno;
-        free(filename);
-        return retval;
-    }
-    free(filename);
+    if (k5login == NULL)
+        return errno;
     if (fstat(fileno(k5login), &st) != 0) {
         retval = errno;
-        goto fail;
+        goto done;
     }
     if (st.st_uid != 0 && (st.st_uid != pwd->pw_uid)) {
         retval = EACCES;
         putil_err(args, "unsafe .k5login ownership (saw %lu, expected %lu)",
                   (unsigned long) st.st_uid, (unsigned long) pwd->pw_uid);
-        goto fail;
+        goto done;
+    }
+
+    /*
+     * If the principal that worked last time is known and .k5login hasn't
+     * changed since, try it first.  If it doesn't work now, skip it below.
+     * Assume an invalid password error if there are no valid lines in
+     * .k5login.
+     */
+    retval = KRB5KRB_AP_ERR_BAD_INTEGRITY;
+    hinted = pamk5_k5login_hint(args, &st, &hint_name);
+    if (hinted != NULL) {
+        retval = k5login_attempt(args, creds, opts, service, pass, hinted,
+                                 hint_name);
+        if (retval == 0) {
+            if (ctx->princ != NULL)
+                krb5_free_principal(ctx->context, ctx->princ);
+            ctx->princ = hinted;
+            pamk5_context_principal(args);
+            fclose(k5login);
+            return 0;
+        }
     }
 
     /*
      * Parse the .k5login file and attempt authentication for each principal.
      * Ignore any lines that are too long or that don't parse into a Kerberos
-     * principal.  Assume an invalid password error if there are no valid
-     * lines in .k5login.
+     * principal.
      */
-    retval = KRB5KRB_AP_ERR_BAD_INTEGRITY;
     while (fgets(line, BUFSIZ, k5login) != NULL) {
         len = strlen(line);
         if (line[len - 1] != '\n') {
@@ -452,37 +697,145 @@ k5login_password_auth(struct pam_args *args, krb5_creds *creds,
         k5_errno = krb5_parse_name(ctx->context, line, &princ);
         if (k5_errno != 0)
             continue;
+        if (hinted != NULL && krb5_principal_compare(ctx->context, princ,
+                                                     hinted)) {
+            krb5_free_principal(ctx->context, princ);
+            continue;
+        }
+
+        /* In parallel mode, just collect the principals for now. */
+        if (parallel) {
+            krb5_principal *grown;
+
+            grown = reallocarray(candidates, count + 1, sizeof(*candidates));
+            if (grown == NULL) {
+                retval = errno;
+                putil_crit(args, "cannot allocate memory: %s",
+                           strerror(errno));
+                krb5_free_principal(ctx->context, princ);
+                goto done;
+            }
+            candidates = grown;
+            candidates[count++] = princ;
+            continue;
+        }
 
         /* Now, attempt to authenticate as that user. */
-        if (service == NULL)
-            putil_debug(args, "attempting authentication as %s", line);
-        else
-            putil_debug(args, "attempting authentication as %s for %s",
-                        line, service);
-        retval = krb5_get_init_creds_password(ctx->context, creds, princ,
-                    (char *) pass, pamk5_prompter_krb5, args, 0,
-                    (char *) service, opts);
+        retval = k5login_attempt(args, creds, opts, service, pass, princ,
+                                 line);
 
         /*
-         * If that worked, update ctx->princ and return success.  Otherwise,
-         * continue on to the next line.
+         * If that worked, update ctx->princ, remember it for next time, and
+         * return success.  Otherwise, continue on to the next line.
          */
         if (retval == 0) {
             if (ctx->princ != NULL)
                 krb5_free_principal(ctx->context, ctx->princ);
             ctx->princ = princ;
-            fclose(k5login);
-            return 0;
+            pamk5_context_principal(args);
+            pamk5_k5login_hint_save(args, &st, princ);
+            goto done;
         }
         krb5_free_principal(ctx->context, princ);
     }
 
-fail:
+    /* Try all the collected principals at once and keep the winner. */
+    if (parallel && count > 0) {
+        retval = pamk5_parallel_auth(args, candidates, count,
+                     (size_t) args->config->search_k5login_parallel, false,
+                     opts, service, pass, creds, &winner);
+        if (retval == 0) {
+            if (ctx->princ != NULL)
+                krb5_free_principal(ctx->context, ctx->princ);
+            ctx->princ = candidates[winner];
+            candidates[winner] = NULL;
+            pamk5_context_principal(args);
+            pamk5_k5login_hint_save(args, &st, ctx->princ);
+        }
+    }
+
+done:
+    if (hinted != NULL)
+        krb5_free_principal(ctx->context, hinted);
+    for (i = 0; i < count; i++)
+        if (candidates[i] != NULL)
+            krb5_free_principal(ctx->context, candidates[i]);
+    free(candidates);
     fclose(k5login);
     return retval;
 }
 
 
+/*
+ * Authenticate by trying the user in each of the configured realms at once.
+ *
+ * Build a principal for the user in each realm in the realms option and try
+ * the password with all of them concurrently.  If more than one works, the
+ * one whose realm is listed first wins.  On success, fill out creds, set
+ * princ to the successful principal in the context, and return 0.
+ * Otherwise, set princ to the principal in the first realm that knows the
+ * user and return its error, redoing that exchange through password_auth if
+ * the password has expired so that the expiration is confirmed the same way.
+ * A user who already gave a realm is only tried in that realm.
+ */
+static krb5_error_code
+realms_password_auth(struct pam_args *args, krb5_creds *creds,
+                     krb5_get_init_creds_opt *opts, const char *service,
+                     const char *pass)
+{
+    struct context *ctx = args->config->ctx;
+    const struct vector *realms = args->config->realms;
+    krb5_principal *candidates = NULL;
+    krb5_error_code retval;
+    size_t i, winner;
+    char *name;
+
+    if (strchr(ctx->name, '@') != NULL || realms->count == 0)
+        return password_auth(args, creds, opts, service, pass);
+    candidates = calloc(realms->count, sizeof(krb5_principal));
+    if (candidates == NULL) {
+        retval = errno;
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return retval;
+    }
+    for (i = 0; i < realms->count; i++) {
+        name = putil_arena_sprintf(args, "%s@%s", ctx->name,
+                                   realms->strings[i]);
+        if (name == NULL) {
+            retval = errno;
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+            goto done;
+        }
+        retval = krb5_parse_name(ctx->context, name, &candidates[i]);
+        if (retval != 0) {
+            putil_err_krb5(args, retval, "cannot parse principal %s", name);
+            goto done;
+        }
+    }
+
+    /* Try them all, and keep the principal that decided the result. */
+    retval = pamk5_parallel_auth(args, candidates, realms->count,
+                                 realms->count, true, opts, service, pass,
+                                 creds, &winner);
+    if (winner < realms->count) {
+        if (ctx->princ != NULL)
+            krb5_free_principal(ctx->context, ctx->princ);
+        ctx->princ = candidates[winner];
+        candidates[winner] = NULL;
+        pamk5_context_principal(args);
+    }
+    if (retval == KRB5KDC_ERR_KEY_EXP)
+        retval = password_auth(args, creds, opts, service, pass);
+
+done:
+    for (i = 0; i < realms->count; i++)
+        if (candidates[i] != NULL)
+            krb5_free_principal(ctx->context, candidates[i]);
+    free(candidates);
+    return retval;
+}
+
+
 #if HAVE_KRB5_HEIMDAL && HAVE_KRB5_GET_INIT_CREDS_OPT_SET_PKINIT
 /*
  * Attempt authentication via PKINIT.  Currently, this uses an API specific to
@@ -551,8 +904,10 @@ pkinit_auth(struct pam_args *args, const char *service, krb5_creds **creds)
         goto done;
 
     /* Finally, do the actual work and return the results. */
-    retval = krb5_get_init_creds_password(ctx->context, *creds, ctx->princ,
-                 NULL, NULL, args, 0, (char *) service, opts);
+    PROBE_AS_START(args, ctx->princ, service);
+    retval = pamk5_init_creds(args, *creds, ctx->princ, NULL, NULL, args,
+                              service, opts);
+    PROBE_AS_DONE(args, ctx->princ, service, retval);
 
 done:
     krb5_get_init_creds_opt_free(ctx->context, opts);
@@ -568,19 +923,30 @@ done:
 
 /*
  * Attempt authentication once with a given password.  This is the core of the
- * authentication loop, and handles alt_auth_map and search_k5login.  It takes
- * the PAM arguments, the service for which to get tickets (NULL for the
- * default TGT), the initial credential options, and the password, and returns
- * a Kerberos status code or errno.  On success (return status 0), it stores
- * the obtained credentials in the provided creds argument.
+ * authentication loop, and handles alt_auth_map, search_k5login, and realms.
+ * It takes the PAM arguments, the service for which to get tickets (NULL for
+ * the default TGT), the initial credential options, and the password, and
+ * returns a Kerberos status code or errno.  On success (return status 0), it
+ * stores the obtained credentials in the provided creds argument.
  */
 static krb5_error_code
 password_auth_attempt(struct pam_args *args, const char *service,
                       krb5_get_init_creds_opt *opts, const char *pass,
                       krb5_creds *creds)
 {
+    struct context *ctx = args->config->ctx;
     krb5_error_code retval;
 
+    /*
+     * An exchange left running by an earlier call with nonblocking_auth is
+     * always a regular authentication, so pick it up without redoing what
+     * came before it.
+     */
+    if (ctx->resume != NULL && ctx->resume->ex != NULL) {
+        retval = password_auth(args, creds, opts, service, pass);
+        goto done;
+    }
+
     /*
      * First, try authenticating as the alternate principal if one were
      * configured.  If that fails or wasn't configured, continue on to trying
@@ -605,12 +971,19 @@ password_auth_attempt(struct pam_args *args, const char *service,
                 return retval;
     }
 
-    /* Attempt regular authentication, via either search_k5login or normal. */
+    /*
+     * Attempt regular authentication, via either search_k5login, realms, or
+     * normal.
+     */
     if (args->config->search_k5login)
         retval = k5login_password_auth(args, creds, opts, service, pass);
+    else if (args->config->realms != NULL)
+        retval = realms_password_auth(args, creds, opts, service, pass);
     else
         retval = password_auth(args, creds, opts, service, pass);
-    if (retval != 0)
+
+done:
+    if (retval != 0 && retval != EAGAIN)
         putil_debug_krb5(args, retval, "krb5_get_init_creds_password");
     return retval;
 }
@@ -629,6 +1002,9 @@ password_auth_attempt(struct pam_args *args, const char *service,
  * given.  If we have an explicitly configured keytab, instead read that
  * keytab, find the first principal in that keytab, and use that.
  *
+ * The Kerberos library does the exchange with the KDC, so it can't be cut
+ * short by auth_timeout, but isn't started if the time is already up.
+ *
  * Returns a Kerberos status code (0 for success).
  */
 static krb5_error_code
@@ -643,6 +1019,8 @@ verify_creds(struct pam_args *args, krb5_creds *creds)
     krb5_error_code retval;
     krb5_context c = args->config->ctx->context;
 
+    if (pamk5_deadline_passed(args))
+        return KRB5_KDC_UNREACH;
     memset(&entry, 0, sizeof(entry));
     krb5_verify_init_creds_opt_init(&opts);
     if (args->config->keytab) {
@@ -729,6 +1107,10 @@ report_pkinit_error(struct pam_args *args, krb5_error_code retval UNUSED)
  * non-null case is kadmin/changepw for changing passwords.  Therefore, if it
  * is non-null, we look for the password in PAM_OLDAUTHOK and save it there
  * instead of using PAM_AUTHTOK.
+ *
+ * With nonblocking_auth, returns PAM_INCOMPLETE rather than waiting for the
+ * KDC to answer, keeping the exchange and what's needed to carry on after it
+ * in the context.  The next call then goes straight back to the exchange.
  */
 int
 pamk5_password_auth(struct pam_args *args, const char *service,
@@ -736,30 +1118,37 @@ pamk5_password_auth(struct pam_args *args, const char *service,
 {
     struct context *ctx;
     krb5_get_init_creds_opt *opts = NULL;
-    krb5_error_code retval;
+    krb5_error_code retval = 0;
     int status = PAM_SUCCESS;
     bool retry, prompt;
     bool creds_valid = false;
     const char *pass = NULL;
     int authtok = (service == NULL) ? PAM_AUTHTOK : PAM_OLDAUTHTOK;
+    unsigned long long start;
 
     /* Sanity check and initialization. */
     if (args->config->ctx == NULL)
         return PAM_SERVICE_ERR;
     ctx = args->config->ctx;
+    start = pamk5_metrics_start(args);
 
     /*
      * Fill in the default principal to authenticate as.  alt_auth_map or
      * search_k5login may change this later.
      */
     if (ctx->princ == NULL) {
+        pamk5_timing_start(args, PHASE_NAME);
         retval = parse_name(args);
+        pamk5_timing_stop(args, PHASE_NAME);
         if (retval != 0) {
             putil_err_krb5(args, retval, "parse_name failed");
             return PAM_SERVICE_ERR;
         }
     }
 
+    /* Everything from here on counts against auth_timeout. */
+    pamk5_deadline_start(args);
+
     /*
      * If PKINIT is available and we were configured to attempt it, try
      * authenticating with PKINIT first.  Otherwise, fail all authentication
@@ -768,7 +1157,10 @@ pamk5_password_auth(struct pam_args *args, const char *service,
      */
 #if HAVE_KRB5_HEIMDAL && HAVE_KRB5_GET_INIT_CREDS_OPT_SET_PKINIT
     if (args->config->use_pkinit || args->config->try_pkinit) {
+        pamk5_metrics_event(args, METRICS_PKINIT);
+        pamk5_timing_start(args, PHASE_PKINIT);
         retval = pkinit_auth(args, service, creds);
+        pamk5_timing_stop(args, PHASE_PKINIT);
         if (retval == 0)
             goto verify;
         putil_debug_krb5(args, retval, "PKINIT failed");
@@ -787,6 +1179,15 @@ pamk5_password_auth(struct pam_args *args, const char *service,
     }
 #endif
 
+    /*
+     * If the KDCs for the realm have been unreachable, fail at once rather
+     * than waiting for them again.  A resumed exchange was already checked.
+     */
+    if (ctx->resume == NULL && !pamk5_breaker_check(args)) {
+        retval = KRB5_KDC_UNREACH;
+        goto done;
+    }
+
     /* Allocate cred structure and set credential options. */
     *creds = calloc(1, sizeof(krb5_creds));
     if (*creds == NULL) {
@@ -794,22 +1195,35 @@ pamk5_password_auth(struct pam_args *args, const char *service,
         status = PAM_SERVICE_ERR;
         goto done;
     }
-    retval = krb5_get_init_creds_opt_alloc(ctx->context, &opts);
-    if (retval != 0) {
-        putil_crit_krb5(args, retval, "cannot allocate credential options");
-        goto done;
+    if (ctx->resume != NULL) {
+        opts = ctx->resume->opts;
+        ctx->resume->opts = NULL;
+    } else {
+        retval = krb5_get_init_creds_opt_alloc(ctx->context, &opts);
+        if (retval != 0) {
+            putil_crit_krb5(args, retval, "cannot allocate credential"
+                            " options");
+            goto done;
+        }
+        set_credential_options(args, opts, service != NULL);
     }
-    set_credential_options(args, opts, service != NULL);
 
     /*
      * Obtain the saved password, if appropriate and available, and determine
      * our retry strategy.  If try_first_pass is set, we will prompt for a
      * password and retry the authentication if the stored password didn't
-     * work.
+     * work.  If an earlier call left an exchange running, carry on with the
+     * password and strategy it had instead.
      */
-    status = maybe_retrieve_password(args, authtok, &pass);
-    if (status != PAM_SUCCESS)
-        goto done;
+    if (ctx->resume != NULL) {
+        pass = ctx->resume->pass;
+        retry = ctx->resume->retry;
+    } else {
+        status = maybe_retrieve_password(args, authtok, &pass);
+        if (status != PAM_SUCCESS)
+            goto done;
+        retry = args->config->try_first_pass;
+    }
 
     /*
      * Main authentication loop.
@@ -830,7 +1244,6 @@ pamk5_password_auth(struct pam_args *args, const char *service,
      *
      * We've already handled empty passwords in our other functions.
      */
-    retry = args->config->try_first_pass;
     prompt = !(args->config->try_pkinit || args->config->no_prompt);
     do {
         if (pass == NULL)
@@ -846,11 +1259,21 @@ pamk5_password_auth(struct pam_args *args, const char *service,
          * clear the password and then see if we should try again after
          * prompting for a password.
          */
+        pamk5_timing_start(args, PHASE_AS);
         retval = password_auth_attempt(args, service, opts, pass, *creds);
+        pamk5_timing_stop(args, PHASE_AS);
         if (retval == 0) {
             creds_valid = true;
             break;
         }
+        if (retval == EAGAIN && ctx->resume != NULL
+            && ctx->resume->ex != NULL) {
+            ctx->resume->opts = opts;
+            ctx->resume->retry = retry;
+            opts = NULL;
+            status = PAM_INCOMPLETE;
+            goto done;
+        }
         pass = NULL;
     } while (retry
              && (retval == KRB5KRB_AP_ERR_BAD_INTEGRITY
@@ -867,8 +1290,13 @@ verify: UNUSED
      * getting a TGT).  We can't get a service ticket from a kadmin/changepw
      * ticket.
      */
-    if (retval == 0 && service == NULL)
+    if (retval == 0 && service == NULL) {
+        pamk5_timing_start(args, PHASE_VERIFY);
+        PROBE_VERIFY_START(args, (*creds)->client);
         retval = verify_creds(args, *creds);
+        PROBE_VERIFY_DONE(args, (*creds)->client, retval);
+        pamk5_timing_stop(args, PHASE_VERIFY);
+    }
 
 done:
     /*
@@ -879,6 +1307,11 @@ done:
      * Kerberos status code in retval to a PAM error code.
      */
     if (status == PAM_SUCCESS) {
+        if (retval != 0 && pamk5_deadline_passed(args)) {
+            putil_err(args, "authentication timed out");
+            retval = KRB5_KDC_UNREACH;
+        }
+        pamk5_breaker_record(args, retval);
         switch (retval) {
         case 0:
             status = PAM_SUCCESS;
@@ -902,6 +1335,8 @@ done:
             break;
         }
     }
+    if (service == NULL && status != PAM_INCOMPLETE)
+        pamk5_metrics_record(args, METRICS_AUTH, status, retval, start);
     if (status != PAM_SUCCESS && *creds != NULL) {
         if (creds_valid)
             krb5_free_cred_contents(ctx->context, *creds);
@@ -911,11 +1346,21 @@ done:
     if (opts != NULL)
         krb5_get_init_creds_opt_free(ctx->context, opts);
 
-    /* Whatever the results, destroy the anonymous FAST cache. */
+    /*
+     * Unless an exchange is still running, whatever the results, stop the
+     * clock, let go of the KDC breaker, and destroy the anonymous FAST cache
+     * and the state kept for resuming.
+     */
+    if (status == PAM_INCOMPLETE)
+        return status;
+    pamk5_deadline_stop(args);
+    pamk5_breaker_release(args);
     if (ctx->fast_cache != NULL) {
         krb5_cc_destroy(ctx->context, ctx->fast_cache);
         ctx->fast_cache = NULL;
     }
+    pamk5_resume_free(ctx->context, ctx->resume);
+    ctx->resume = NULL;
     return status;
 }
 
@@ -949,10 +1394,15 @@ pamk5_authenticate(struct pam_args *args)
         args->config->force_first_pass = true;
     }
 
-    /* Create a context and obtain the user. */
-    pamret = pamk5_context_new(args);
-    if (pamret != PAM_SUCCESS)
-        goto done;
+    /*
+     * Create a context and obtain the user, unless an earlier call with
+     * nonblocking_auth left one with an exchange still running.
+     */
+    if (args->config->ctx == NULL || args->config->ctx->resume == NULL) {
+        pamret = pamk5_context_new(args);
+        if (pamret != PAM_SUCCESS)
+            goto done;
+    }
     ctx = args->config->ctx;
 
     /* Check whether we should ignore this user. */
@@ -996,8 +1446,23 @@ pamk5_authenticate(struct pam_args *args)
      * PAM_AUTHTOK to PAM_OLDAUTHTOK to be in the place where password
      * changing expects, and have to unset PAM_AUTHTOK or we'll just change
      * the password to the same thing it was.
+     *
+     * With nonblocking_auth, the exchange with the KDC may not be over yet.
+     * In that case, keep the context for the next call and return
+     * PAM_INCOMPLETE, and otherwise drop any context kept that way.
      */
     pamret = pamk5_password_auth(args, NULL, &creds);
+    if (pamret == PAM_INCOMPLETE) {
+        putil_debug(args, "waiting for KDC, returning PAM_INCOMPLETE");
+        pamret = pamk5_context_park(args);
+        if (pamret != PAM_SUCCESS) {
+            putil_err_pam(args, pamret, "cannot set context data");
+            pamret = PAM_SERVICE_ERR;
+        } else
+            pamret = PAM_INCOMPLETE;
+        goto done;
+    }
+    pamk5_context_unpark(args);
     if (pamret == PAM_NEW_AUTHTOK_REQD) {
         if (args->config->fail_pwchange)
             pamret = PAM_AUTH_ERR;
@@ -1053,7 +1518,7 @@ pamk5_authenticate(struct pam_args *args)
     }
 
     /* Now that we know we're successful, we can store the context. */
-    pamret = pam_set_data(args->pamh, "pam_krb5", ctx, pamk5_context_destroy);
+    pamret = pamk5_context_store(args);
     if (pamret != PAM_SUCCESS) {
         putil_err_pam(args, pamret, "cannot set context data");
         pamk5_context_free(args);
@@ -1076,13 +1541,6 @@ done:
         free(creds);
     }
 
-    /*
-     * Don't free our Kerberos context if we set a context, since the context
-     * will take care of that.
-     */
-    if (set_context)
-        args->ctx = NULL;
-
     /*
      * Clear the context on failure so that the account management module
      * knows that we didn't authenticate with Kerberos.  Only clear the
@@ -0,0 +1,267 @@
+/*
+ * Per-realm KDC circuit breaker.
+ *
+ * When no KDC for a realm can be reached, every authentication waits out the
+ * library's timeouts before failing, and a host with many logins in progress
+ * ties up a process for each of them.  If the kdc_breaker option names a
+ * file, each process maps it shared, as described in shared.c, and records
+ * there for each realm how many authentications in a row failed because no
+ * KDC could be reached.  Once kdc_breaker_threshold of them have, the breaker
+ * for that realm opens and authentications fail at once for
+ * kdc_breaker_cooldown seconds.  After that, one authentication is let
+ * through to probe the KDCs.  If it reaches one, the breaker closes;
+ * otherwise it opens for another cooldown.  A probe that never reports back
+ * is given up on after a cooldown and another is let through.
+ *
+ * Changes to a realm's record are made under a lock on the file, so only one
+ * process can take the probe.  The times are wall-clock times since the file
+ * outlives the processes using it.  The file is created if it doesn't exist
+ * and has the same ownership requirements as the metrics file.  Any problem
+ * with the file just means the breaker isn't used.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#include <sys/file.h>
+#include <time.h>
+
+#include <breaker.h>
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* The layout of the breaker file, which is locked around changes. */
+static const struct pamk5_shared_type breaker_type = {
+    "KDC breaker", BREAKER_MAGIC, BREAKER_VERSION, sizeof(struct breaker_file),
+    true
+};
+
+/* The threads of one process share the file lock, so also need a mutex. */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+# define threads_acquire() pthread_mutex_lock(&threads_lock)
+# define threads_release() pthread_mutex_unlock(&threads_lock)
+#else
+# define threads_acquire() /* empty */
+# define threads_release() /* empty */
+#endif
+
+
+/*
+ * Lock the configured breaker file, mapping it on first use, and return its
+ * mapping, or NULL if it can't be used.  If this returns non-NULL,
+ * breaker_unlock must be called with the descriptor stored in fd.
+ */
+static struct breaker_file *
+breaker_lock(struct pam_args *args, int *fd)
+{
+    const char *path = args->config->kdc_breaker;
+    struct breaker_file *file;
+
+    file = pamk5_shared_map(args, &breaker_type, path, fd);
+    if (file == NULL)
+        return NULL;
+    threads_acquire();
+    if (flock(*fd, LOCK_EX) < 0) {
+        putil_debug(args, "cannot lock KDC breaker file %s: %s", path,
+                    strerror(errno));
+        threads_release();
+        return NULL;
+    }
+    return file;
+}
+
+
+/*
+ * Unlock the breaker file.
+ */
+static void
+breaker_unlock(int fd)
+{
+    flock(fd, LOCK_UN);
+    threads_release();
+}
+
+
+/*
+ * Return the record for a realm, taking an unused one if it has none yet, or
+ * NULL if the realm name is too long or every record is in use.  Must be
+ * called with the file locked.
+ */
+static struct breaker_realm *
+breaker_find(struct breaker_file *file, const char *realm)
+{
+    struct breaker_realm *record;
+    size_t i;
+
+    if (strlen(realm) >= sizeof(file->realms[0].realm))
+        return NULL;
+    for (i = 0; i < BREAKER_REALMS; i++) {
+        record = &file->realms[i];
+        if (record->realm[0] == '\0') {
+            strlcpy(record->realm, realm, sizeof(record->realm));
+            return record;
+        }
+        if (strncmp(record->realm, realm, sizeof(record->realm)) == 0)
+            return record;
+    }
+    return NULL;
+}
+
+
+/*
+ * Return the number of failures in a row that opens the breaker.
+ */
+static unsigned long
+breaker_threshold(struct pam_args *args)
+{
+    if (args->config->kdc_breaker_threshold < 1)
+        return 1;
+    return (unsigned long) args->config->kdc_breaker_threshold;
+}
+
+
+/*
+ * Return whether a time in the file is within a cooldown of now.  A time in
+ * the future means the clock was set back and is treated as long past.
+ */
+static bool
+cooling(struct pam_args *args, int64_t when, int64_t now)
+{
+    return when != 0 && now >= when
+           && now - when < (int64_t) args->config->kdc_breaker_cooldown;
+}
+
+
+/*
+ * Check the breaker for the realm of the principal being authenticated
+ * before talking to its KDCs.  Returns false if the breaker is open and the
+ * authentication should fail at once.  Otherwise, remembers the realm in the
+ * context so that pamk5_breaker_record can report how it went, and returns
+ * true.  Always returns true unless the kdc_breaker option is set.
+ */
+bool
+pamk5_breaker_check(struct pam_args *args)
+{
+    struct context *ctx = args->config->ctx;
+    struct breaker_file *file;
+    struct breaker_realm *record;
+    const char *realm;
+    unsigned long threshold;
+    int64_t now;
+    int fd;
+    bool allow = true;
+
+    if (args->config->kdc_breaker == NULL || ctx->princ == NULL)
+        return true;
+    realm = krb5_principal_get_realm(ctx->context, ctx->princ);
+    if (realm == NULL)
+        return true;
+    file = breaker_lock(args, &fd);
+    if (file == NULL)
+        return true;
+    record = breaker_find(file, realm);
+    if (record == NULL) {
+        putil_debug(args, "no room for %s in KDC breaker file", realm);
+        goto done;
+    }
+    threshold = breaker_threshold(args);
+    now = time(NULL);
+    if (record->failures < threshold)
+        ctx->breaker = record;
+    else if (cooling(args, record->opened, now)) {
+        putil_debug(args, "KDC circuit breaker for %s open, failing fast",
+                    realm);
+        allow = false;
+    } else if (cooling(args, record->probe, now)) {
+        putil_debug(args, "KDC circuit breaker for %s waiting for probe,"
+                    " failing fast", realm);
+        allow = false;
+    } else {
+        putil_debug(args, "KDC circuit breaker for %s half-open, probing",
+                    realm);
+        record->probe = now;
+        ctx->breaker = record;
+        ctx->breaker_probe = true;
+    }
+
+done:
+    breaker_unlock(fd);
+    return allow;
+}
+
+
+/*
+ * Record how an authentication checked with pamk5_breaker_check went, given
+ * its Kerberos status.  Failures to reach any KDC count towards opening the
+ * breaker, and any other result shows that a KDC answered and closes it.
+ */
+void
+pamk5_breaker_record(struct pam_args *args, krb5_error_code code)
+{
+    struct context *ctx = args->config->ctx;
+    struct breaker_realm *record = ctx->breaker;
+    unsigned long threshold;
+    int fd;
+
+    if (record == NULL)
+        return;
+    if (breaker_lock(args, &fd) == NULL)
+        goto done;
+    threshold = breaker_threshold(args);
+    if (code == KRB5_KDC_UNREACH || code == KRB5_REALM_CANT_RESOLVE) {
+        if (record->failures < UINT32_MAX)
+            record->failures++;
+        if (ctx->breaker_probe) {
+            putil_debug(args, "KDC circuit breaker for %s probe failed,"
+                        " open again", record->realm);
+            record->opened = time(NULL);
+        } else if (record->failures == threshold) {
+            putil_debug(args, "KDC circuit breaker for %s tripped after %lu"
+                        " failures", record->realm, threshold);
+            record->opened = time(NULL);
+        }
+    } else if (record->failures > 0) {
+        if (record->failures >= threshold)
+            putil_debug(args, "KDC circuit breaker for %s closed",
+                        record->realm);
+        record->failures = 0;
+        record->opened = 0;
+    }
+    if (ctx->breaker_probe)
+        record->probe = 0;
+    breaker_unlock(fd);
+
+done:
+    ctx->breaker = NULL;
+    ctx->breaker_probe = false;
+}
+
+
+/*
+ * Forget an authentication checked with pamk5_breaker_check that ended
+ * without a result from the KDCs, such as one that failed while prompting,
+ * letting another probe through at once if it held the probe.
+ */
+void
+pamk5_breaker_release(struct pam_args *args)
+{
+    struct context *ctx = args->config->ctx;
+    int fd;
+
+    if (ctx->breaker != NULL && ctx->breaker_probe)
+        if (breaker_lock(args, &fd) != NULL) {
+            ctx->breaker->probe = 0;
+            breaker_unlock(fd);
+        }
+    ctx->breaker = NULL;
+    ctx->breaker_probe = false;
+}
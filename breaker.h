@@ -0,0 +1,45 @@
+/*
+ * Layout of the shared KDC circuit breaker file.
+ *
+ * If the kdc_breaker option is set, each process using the module maps the
+ * named file shared and keeps there, for each realm, how many authentications
+ * in a row could not reach a KDC and when the breaker last opened.  This
+ * header is shared between the module and its tests.
+ *
+ * The layout uses the native byte order and is only meant to be read on the
+ * host that wrote it.  Change BREAKER_VERSION with any change to the layout.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef BREAKER_H
+#define BREAKER_H 1
+
+#include <config.h>
+#include <portable/system.h>
+
+/* Identifies the file format. */
+#define BREAKER_MAGIC   "pamk5cb"
+#define BREAKER_VERSION 1
+
+/* The most realms kept in the file. */
+#define BREAKER_REALMS 64
+
+/* The record for one realm. */
+struct breaker_realm {
+    char realm[256];            /* Realm name, empty if the slot is unused. */
+    uint32_t failures;          /* Consecutive unreachable failures. */
+    uint32_t unused;
+    int64_t opened;             /* When the breaker last opened. */
+    int64_t probe;              /* When a probe was let through, or 0. */
+};
+
+/* The file. */
+struct breaker_file {
+    char magic[8];              /* BREAKER_MAGIC with its nul. */
+    uint32_t version;           /* BREAKER_VERSION. */
+    uint32_t size;              /* sizeof(struct breaker_file). */
+    struct breaker_realm realms[BREAKER_REALMS];
+};
+
+#endif /* !BREAKER_H */
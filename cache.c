@@ -21,8 +21,10 @@
 #include <errno.h>
 
 #include <internal.h>
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
+#include <usdt.h>
 
 
 /*
@@ -59,25 +61,7 @@ pamk5_get_krb5ccname(struct pam_args *args, const char *key)
 int
 pamk5_set_krb5ccname(struct pam_args *args, const char *name, const char *key)
 {
-    char *env_name = NULL;
-    int pamret;
-
-    if (asprintf(&env_name, "%s=%s", key, name) < 0) {
-        putil_crit(args, "asprintf failed: %s", strerror(errno));
-        pamret = PAM_BUF_ERR;
-        goto done;
-    }
-    pamret = pam_putenv(args->pamh, env_name);
-    if (pamret != PAM_SUCCESS) {
-        putil_err_pam(args, pamret, "pam_putenv failed");
-        pamret = PAM_SERVICE_ERR;
-        goto done;
-    }
-    pamret = PAM_SUCCESS;
-
-done:
-    free(env_name);
-    return pamret;
+    return pamk5_setenv(args, key, name);
 }
 
 
@@ -119,20 +103,26 @@ pamk5_cache_init(struct pam_args *args, const char *ccname, krb5_creds *creds,
         || args->config->ctx->context == NULL)
         return PAM_SERVICE_ERR;
     ctx = args->config->ctx;
+    PROBE_CC_RESOLVE_START(args, ccname);
     retval = krb5_cc_resolve(ctx->context, ccname, cache);
+    PROBE_CC_RESOLVE_DONE(args, ccname, retval);
     if (retval != 0) {
         putil_err_krb5(args, retval, "cannot resolve ticket cache %s", ccname);
         retval = PAM_SERVICE_ERR;
         goto done;
     }
+    PROBE_CC_INITIALIZE_START(args, ctx->princ);
     retval = krb5_cc_initialize(ctx->context, *cache, ctx->princ);
+    PROBE_CC_INITIALIZE_DONE(args, ctx->princ, retval);
     if (retval != 0) {
         putil_err_krb5(args, retval, "cannot initialize ticket cache %s",
                        ccname);
         retval = PAM_SERVICE_ERR;
         goto done;
     }
+    PROBE_CC_STORE_START(args, creds->client);
     retval = krb5_cc_store_cred(ctx->context, *cache, creds);
+    PROBE_CC_STORE_DONE(args, creds->client, retval);
     if (retval != 0) {
         putil_err_krb5(args, retval, "cannot store credentials in %s", ccname);
         retval = PAM_SERVICE_ERR;
@@ -157,7 +147,7 @@ done:
 int
 pamk5_cache_init_random(struct pam_args *args, krb5_creds *creds)
 {
-    char *cache_name = NULL;
+    char *cache_name;
     const char *dir;
     int pamret;
 
@@ -165,21 +155,19 @@ pamk5_cache_init_random(struct pam_args *args, krb5_creds *creds)
     dir = args->config->ccache_dir;
     if (strncmp("FILE:", args->config->ccache_dir, strlen("FILE:")) == 0)
         dir += strlen("FILE:");
-    if (asprintf(&cache_name, "%s/krb5cc_pam_XXXXXX", dir) < 0) {
+    cache_name = putil_arena_sprintf(args, "%s/krb5cc_pam_XXXXXX", dir);
+    if (cache_name == NULL) {
         putil_crit(args, "malloc failure: %s", strerror(errno));
         return PAM_SERVICE_ERR;
     }
+    pamk5_timing_start(args, PHASE_CACHE);
     pamret = pamk5_cache_mkstemp(args, cache_name);
+    if (pamret == PAM_SUCCESS)
+        pamret = pamk5_cache_init(args, cache_name, creds,
+                                  &args->config->ctx->cache);
+    pamk5_timing_stop(args, PHASE_CACHE);
     if (pamret != PAM_SUCCESS)
-        goto done;
-    pamret = pamk5_cache_init(args, cache_name, creds,
-                              &args->config->ctx->cache);
-    if (pamret != PAM_SUCCESS)
-        goto done;
+        return pamret;
     putil_debug(args, "temporarily storing credentials in %s", cache_name);
-    pamret = pamk5_set_krb5ccname(args, cache_name, "PAM_KRB5CCNAME");
-
-done:
-    free(cache_name);
-    return pamret;
+    return pamk5_set_krb5ccname(args, cache_name, "PAM_KRB5CCNAME");
 }
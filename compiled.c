@@ -0,0 +1,688 @@
+/*
+ * Support for compiled configuration files.
+ *
+ * Applications such as sshd fork a new process for each connection, so the
+ * process-wide configuration cache never gets a chance to help them.  For
+ * those, pam_krb5_compile can save the resolved configuration for each
+ * combination of realm and module arguments in a binary file, which the
+ * module maps read-only and uses instead of looking up every option in
+ * krb5.conf.  The file records the identity of the Kerberos configuration
+ * files it was built from and is ignored if any of them have changed since.
+ *
+ * The format is private to this version of the module and uses the native
+ * byte order.  A header identifies the format version and the option table
+ * used to build it.  It is followed by the file stamps, the entries sorted by
+ * key, the values for each entry (one 64-bit slot per option in table order),
+ * and then the lists and strings.  Strings and lists are stored as offsets
+ * from the start of the file, with zero meaning NULL, and a list is a count
+ * followed by that many string offsets.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <pam-util/options.h>
+#include <pam-util/vector.h>
+
+/* Identifies the file format.  Change the version with any layout change. */
+#define COMPILED_MAGIC   "pamk5cf"
+#define COMPILED_VERSION 1
+#define COMPILED_ENDIAN  0x01020304U
+
+/* The file header. */
+struct header {
+    char magic[8];              /* COMPILED_MAGIC with its nul. */
+    uint32_t version;           /* COMPILED_VERSION. */
+    uint32_t endian;            /* COMPILED_ENDIAN in native byte order. */
+    uint32_t options;           /* Number of options in the table. */
+    uint32_t table;             /* Hash of the option names and types. */
+    uint64_t size;              /* Total size of the file. */
+    uint64_t nstamps;           /* Number of configuration file stamps. */
+    uint64_t stamps;            /* Offset of the stamp records. */
+    uint64_t nentries;          /* Number of configurations. */
+    uint64_t entries;           /* Offset of the entry records. */
+};
+
+/* The identity of a Kerberos configuration file (see struct config_stamp). */
+struct stamp_record {
+    uint64_t path;
+    uint64_t exists;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+};
+
+/* A configuration and the key (from pamk5_config_key) it is stored under. */
+struct entry_record {
+    uint64_t key;
+    uint64_t keylen;
+    uint64_t values;
+};
+
+/* A configuration to write, used for sorting. */
+struct pending {
+    const char *key;
+    size_t keylen;
+    const struct pam_config *config;
+};
+
+/* A growing buffer holding the file being written. */
+struct buffer {
+    char *data;
+    size_t size;
+};
+
+/* Resolve an offset into the configuration struct, as in pam-util. */
+#define CONF(c, o) (void *)((char *) (c) + (o))
+
+
+/*
+ * Hash the names and types of the options in the table, so that a file built
+ * by a different version of the module is not misread.  This is FNV-1a.
+ */
+static uint32_t
+table_hash(const struct option options[], size_t optlen)
+{
+    uint32_t hash = 2166136261U;
+    const char *p;
+    size_t opt;
+
+    for (opt = 0; opt < optlen; opt++) {
+        for (p = options[opt].name; *p != '\0'; p++) {
+            hash ^= (unsigned char) *p;
+            hash *= 16777619U;
+        }
+        hash ^= (uint32_t) options[opt].type;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+/*
+ * Compare two keys, which may contain nul bytes.  Used both to sort the
+ * entries when writing and to search them when reading.
+ */
+static int
+key_compare(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int status;
+
+    status = memcmp(a, b, (alen < blen) ? alen : blen);
+    if (status != 0)
+        return status;
+    if (alen == blen)
+        return 0;
+    return (alen < blen) ? -1 : 1;
+}
+
+
+/*
+ * qsort comparison function for pending entries.
+ */
+static int
+pending_compare(const void *a, const void *b)
+{
+    const struct pending *first = a;
+    const struct pending *second = b;
+
+    return key_compare(first->key, first->keylen, second->key,
+                       second->keylen);
+}
+
+
+/*
+ * Append data to the buffer, first padding with nul bytes to the given
+ * alignment.  Returns the offset of the data or 0 on memory allocation
+ * failure.  Offsets are never 0 since the header comes first.
+ */
+static uint64_t
+buffer_append(struct buffer *buffer, const void *data, size_t length,
+              size_t align)
+{
+    size_t offset, needed;
+    char *data_new;
+
+    offset = buffer->size;
+    if (offset % align != 0)
+        offset += align - offset % align;
+    needed = offset + length;
+    data_new = realloc(buffer->data, needed);
+    if (data_new == NULL)
+        return 0;
+    buffer->data = data_new;
+    memset(buffer->data + buffer->size, 0, offset - buffer->size);
+    memcpy(buffer->data + offset, data, length);
+    buffer->size = needed;
+    return offset;
+}
+
+
+/*
+ * Append a string to the buffer and return its offset, returning 0 for a
+ * NULL string.  Sets *okay to false on memory allocation failure.
+ */
+static uint64_t
+buffer_string(struct buffer *buffer, const char *string, bool *okay)
+{
+    uint64_t offset;
+
+    if (string == NULL)
+        return 0;
+    offset = buffer_append(buffer, string, strlen(string) + 1, 1);
+    if (offset == 0)
+        *okay = false;
+    return offset;
+}
+
+
+/*
+ * Append a list to the buffer and return its offset, returning 0 for a NULL
+ * list.  Sets *okay to false on memory allocation failure.
+ */
+static uint64_t
+buffer_list(struct buffer *buffer, const struct vector *list, bool *okay)
+{
+    uint64_t *record;
+    uint64_t offset;
+    size_t i;
+
+    if (list == NULL)
+        return 0;
+    record = calloc(list->count + 1, sizeof(uint64_t));
+    if (record == NULL) {
+        *okay = false;
+        return 0;
+    }
+    record[0] = list->count;
+    for (i = 0; i < list->count; i++)
+        record[i + 1] = buffer_string(buffer, list->strings[i], okay);
+    offset = buffer_append(buffer, record,
+                           (list->count + 1) * sizeof(uint64_t), 8);
+    if (offset == 0)
+        *okay = false;
+    free(record);
+    return offset;
+}
+
+
+/*
+ * Write a new compiled configuration file containing count configurations,
+ * each stored under the corresponding key, along with the stamps of the
+ * Kerberos configuration files taken before the configurations were loaded.
+ * The file is written to a temporary file and renamed into place so that
+ * readers always see a complete file.  Returns true on success and false on
+ * failure, which will already have been reported.
+ */
+bool
+pamk5_compiled_write(struct pam_args *args, const char *path,
+                     const struct config_stamp *stamps, size_t nstamps,
+                     char **keys, const size_t *keylens,
+                     struct pam_config **configs, size_t count)
+{
+    const struct option *options;
+    size_t optlen, i, n, opt;
+    struct pending *pending = NULL;
+    struct buffer buffer = { NULL, 0 };
+    struct header header;
+    struct stamp_record stamp;
+    struct entry_record entry;
+    uint64_t slot, stamps_offset, entries_offset, values_offset, offset;
+    char *tmp = NULL;
+    int fd = -1;
+    bool okay = true;
+    ssize_t status;
+
+    options = pamk5_config_options(&optlen);
+
+    /* Sort the configurations by key and drop any duplicates. */
+    pending = calloc(count == 0 ? 1 : count, sizeof(struct pending));
+    if (pending == NULL)
+        goto nomem;
+    for (i = 0; i < count; i++) {
+        pending[i].key = keys[i];
+        pending[i].keylen = keylens[i];
+        pending[i].config = configs[i];
+    }
+    qsort(pending, count, sizeof(struct pending), pending_compare);
+    for (i = 0, n = 0; i < count; i++) {
+        if (n > 0 && pending_compare(&pending[n - 1], &pending[i]) == 0)
+            continue;
+        pending[n++] = pending[i];
+    }
+    count = n;
+
+    /* Lay out the fixed-size parts, filling them in as we go. */
+    memset(&header, 0, sizeof(header));
+    buffer.data = calloc(1, sizeof(header));
+    if (buffer.data == NULL)
+        goto nomem;
+    buffer.size = sizeof(header);
+    stamps_offset = buffer.size;
+    memset(&stamp, 0, sizeof(stamp));
+    for (i = 0; i < nstamps; i++)
+        if (buffer_append(&buffer, &stamp, sizeof(stamp), 8) == 0)
+            goto nomem;
+    entries_offset = buffer.size;
+    memset(&entry, 0, sizeof(entry));
+    for (i = 0; i < count; i++)
+        if (buffer_append(&buffer, &entry, sizeof(entry), 8) == 0)
+            goto nomem;
+    values_offset = buffer.size;
+    slot = 0;
+    for (i = 0; i < count * optlen; i++)
+        if (buffer_append(&buffer, &slot, sizeof(slot), 8) == 0)
+            goto nomem;
+
+    /* Now the variable-length data, storing offsets in the fixed parts. */
+    for (i = 0; i < nstamps; i++) {
+        memset(&stamp, 0, sizeof(stamp));
+        stamp.path = buffer_string(&buffer, stamps[i].path, &okay);
+        stamp.exists = stamps[i].exists;
+        stamp.dev = (uint64_t) stamps[i].dev;
+        stamp.ino = (uint64_t) stamps[i].ino;
+        stamp.size = (int64_t) stamps[i].size;
+        stamp.mtime = (int64_t) stamps[i].mtime;
+        stamp.ctime = (int64_t) stamps[i].ctime;
+        memcpy(buffer.data + stamps_offset + i * sizeof(stamp), &stamp,
+               sizeof(stamp));
+    }
+    for (i = 0; i < count; i++) {
+        const struct pam_config *config = pending[i].config;
+
+        entry.key = buffer_append(&buffer, pending[i].key, pending[i].keylen,
+                                  1);
+        if (entry.key == 0)
+            goto nomem;
+        entry.keylen = pending[i].keylen;
+        entry.values = values_offset + i * optlen * sizeof(uint64_t);
+        memcpy(buffer.data + entries_offset + i * sizeof(entry), &entry,
+               sizeof(entry));
+        for (opt = 0; opt < optlen; opt++) {
+            const void *value = CONF(config, options[opt].location);
+
+            switch (options[opt].type) {
+            case TYPE_BOOLEAN:
+                slot = *(const bool *) value ? 1 : 0;
+                break;
+            case TYPE_NUMBER:
+                slot = (uint64_t) (int64_t) *(const long *) value;
+                break;
+            case TYPE_TIME:
+                slot = (uint64_t) (int64_t) *(const krb5_deltat *) value;
+                break;
+            case TYPE_STRING:
+                slot = buffer_string(&buffer, *(char *const *) value, &okay);
+                break;
+            case TYPE_LIST:
+            case TYPE_STRLIST:
+                slot = buffer_list(&buffer,
+                                   *(struct vector *const *) value, &okay);
+                break;
+            }
+            offset = entry.values + opt * sizeof(uint64_t);
+            memcpy(buffer.data + offset, &slot, sizeof(slot));
+        }
+    }
+    if (!okay)
+        goto nomem;
+
+    /* Finally, the header. */
+    memcpy(header.magic, COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+    header.version = COMPILED_VERSION;
+    header.endian = COMPILED_ENDIAN;
+    header.options = (uint32_t) optlen;
+    header.table = table_hash(options, optlen);
+    header.size = buffer.size;
+    header.nstamps = nstamps;
+    header.stamps = stamps_offset;
+    header.nentries = count;
+    header.entries = entries_offset;
+    memcpy(buffer.data, &header, sizeof(header));
+
+    /* Write the file and move it into place. */
+    if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+        goto nomem;
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        putil_err(args, "cannot create temporary file %s: %s", tmp,
+                  strerror(errno));
+        goto fail;
+    }
+    if (fchmod(fd, 0644) < 0) {
+        putil_err(args, "cannot chmod %s: %s", tmp, strerror(errno));
+        goto fail;
+    }
+    for (offset = 0; offset < buffer.size; offset += (uint64_t) status) {
+        status = write(fd, buffer.data + offset, buffer.size - offset);
+        if (status < 0 && errno == EINTR)
+            status = 0;
+        else if (status < 0) {
+            putil_err(args, "cannot write to %s: %s", tmp, strerror(errno));
+            goto fail;
+        }
+    }
+    if (fsync(fd) < 0 || close(fd) < 0) {
+        fd = -1;
+        putil_err(args, "cannot flush %s: %s", tmp, strerror(errno));
+        goto fail;
+    }
+    fd = -1;
+    if (rename(tmp, path) < 0) {
+        putil_err(args, "cannot rename %s to %s: %s", tmp, path,
+                  strerror(errno));
+        goto fail;
+    }
+    free(tmp);
+    free(buffer.data);
+    free(pending);
+    return true;
+
+nomem:
+    putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+fail:
+    if (fd >= 0)
+        close(fd);
+    if (tmp != NULL)
+        unlink(tmp);
+    free(tmp);
+    free(buffer.data);
+    free(pending);
+    return false;
+}
+
+
+/*
+ * Return a pointer to the string at the given offset in the mapped file, or
+ * NULL if the offset is out of range or the string isn't nul-terminated
+ * within the file.
+ */
+static const char *
+map_string(const char *map, size_t size, uint64_t offset)
+{
+    if (offset == 0 || offset >= size)
+        return NULL;
+    if (memchr(map + offset, '\0', size - offset) == NULL)
+        return NULL;
+    return map + offset;
+}
+
+
+/*
+ * Return a pointer to an array of count records of the given size at the
+ * given offset in the mapped file, or NULL if they don't fit or the offset is
+ * misaligned.
+ */
+static const void *
+map_array(const char *map, size_t size, uint64_t offset, uint64_t count,
+          size_t length)
+{
+    if (offset == 0 || offset % 8 != 0 || offset > size)
+        return NULL;
+    if (count > (size - offset) / length)
+        return NULL;
+    return map + offset;
+}
+
+
+/*
+ * Check the stamps in the mapped file against the current configuration
+ * files.  Returns true if they match and false if the file is stale or
+ * invalid.
+ */
+static bool
+map_current(struct pam_args *args, const char *map, size_t size,
+            const struct header *header)
+{
+    const struct stamp_record *records;
+    struct config_stamp *saved = NULL;
+    struct config_stamp *current = NULL;
+    size_t ncurrent, i;
+    bool okay = false;
+
+    records = map_array(map, size, header->stamps, header->nstamps,
+                        sizeof(struct stamp_record));
+    if (records == NULL || header->nstamps == 0)
+        return false;
+    if (!pamk5_config_stamps(args, &current, &ncurrent))
+        return false;
+    if (ncurrent != header->nstamps)
+        goto done;
+    saved = calloc(ncurrent, sizeof(struct config_stamp));
+    if (saved == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        goto done;
+    }
+    for (i = 0; i < ncurrent; i++) {
+        saved[i].path = (char *) map_string(map, size, records[i].path);
+        if (saved[i].path == NULL)
+            goto done;
+        saved[i].exists = (records[i].exists != 0);
+        saved[i].dev = (dev_t) records[i].dev;
+        saved[i].ino = (ino_t) records[i].ino;
+        saved[i].size = (off_t) records[i].size;
+        saved[i].mtime = (time_t) records[i].mtime;
+        saved[i].ctime = (time_t) records[i].ctime;
+    }
+    okay = pamk5_config_stamps_equal(saved, ncurrent, current, ncurrent);
+
+done:
+    free(saved);
+    pamk5_config_stamps_free(current, ncurrent);
+    return okay;
+}
+
+
+/*
+ * Build a new configuration struct from the value slots of an entry in the
+ * mapped file at path.  Returns NULL if any value is invalid or on memory
+ * allocation failure, either of which is reported.
+ */
+static struct pam_config *
+map_config(struct pam_args *args, const char *path, const char *map,
+           size_t size, const uint64_t *slots)
+{
+    const struct option *options;
+    struct pam_config *config;
+    const uint64_t *list;
+    const char *string;
+    struct vector *vector;
+    size_t optlen, opt, i;
+    void *value;
+
+    options = pamk5_config_options(&optlen);
+    config = calloc(1, sizeof(struct pam_config));
+    if (config == NULL)
+        goto nomem;
+    for (opt = 0; opt < optlen; opt++) {
+        value = CONF(config, options[opt].location);
+        switch (options[opt].type) {
+        case TYPE_BOOLEAN:
+            *(bool *) value = (slots[opt] != 0);
+            break;
+        case TYPE_NUMBER:
+            *(long *) value = (long) (int64_t) slots[opt];
+            break;
+        case TYPE_TIME:
+            *(krb5_deltat *) value = (krb5_deltat) (int64_t) slots[opt];
+            break;
+        case TYPE_STRING:
+            if (slots[opt] == 0)
+                break;
+            string = map_string(map, size, slots[opt]);
+            if (string == NULL)
+                goto invalid;
+            *(char **) value = strdup(string);
+            if (*(char **) value == NULL)
+                goto nomem;
+            break;
+        case TYPE_LIST:
+        case TYPE_STRLIST:
+            if (slots[opt] == 0)
+                break;
+            list = map_array(map, size, slots[opt], 1, sizeof(uint64_t));
+            if (list == NULL)
+                goto invalid;
+            list = map_array(map, size, slots[opt], list[0] + 1,
+                             sizeof(uint64_t));
+            if (list == NULL)
+                goto invalid;
+            vector = vector_new();
+            if (vector == NULL)
+                goto nomem;
+            *(struct vector **) value = vector;
+            if (!vector_resize(vector, list[0]))
+                goto nomem;
+            for (i = 0; i < list[0]; i++) {
+                string = map_string(map, size, list[i + 1]);
+                if (string == NULL)
+                    goto invalid;
+                if (!vector_add(vector, string))
+                    goto nomem;
+            }
+            break;
+        }
+    }
+    return config;
+
+nomem:
+    putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+    pamk5_config_free(config);
+    return NULL;
+
+invalid:
+    putil_err(args, "invalid compiled configuration %s", path);
+    pamk5_config_free(config);
+    return NULL;
+}
+
+
+/*
+ * Look up the configuration for the realm and PAM arguments in the compiled
+ * configuration file at path.  Returns a newly allocated configuration struct
+ * on success and NULL if the file doesn't exist, isn't current, or doesn't
+ * contain this combination.  Problems with the file itself, such as unsafe
+ * permissions or corruption, are reported.
+ */
+struct pam_config *
+pamk5_compiled_fetch(struct pam_args *args, const char *path, int argc,
+                     const char **argv)
+{
+    const struct option *options;
+    size_t optlen, keylen, low, high, middle;
+    size_t size = 0;
+    struct stat st;
+    void *map = MAP_FAILED;
+    const char *data;
+    const struct header *header;
+    const struct entry_record *entries;
+    const uint64_t *slots;
+    struct pam_config *config = NULL;
+    char *key = NULL;
+    int fd, status;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            putil_err(args, "cannot open compiled configuration %s: %s",
+                      path, strerror(errno));
+        return NULL;
+    }
+
+    /*
+     * The file determines security-relevant behavior, so it must be owned by
+     * root (or by us) and not writable by anyone else.
+     */
+    if (fstat(fd, &st) < 0) {
+        putil_err(args, "cannot stat compiled configuration %s: %s", path,
+                  strerror(errno));
+        goto done;
+    }
+    if (!S_ISREG(st.st_mode)
+        || (st.st_uid != 0 && st.st_uid != geteuid())
+        || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        putil_err(args, "ignoring insecure compiled configuration %s", path);
+        goto done;
+    }
+    if (st.st_size < (off_t) sizeof(struct header)
+        || (uintmax_t) st.st_size > SIZE_MAX)
+        goto invalid;
+    size = (size_t) st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        putil_err(args, "cannot map compiled configuration %s: %s", path,
+                  strerror(errno));
+        goto done;
+    }
+    data = map;
+
+    /* Check the header and whether the file is still current. */
+    options = pamk5_config_options(&optlen);
+    header = map;
+    if (memcmp(header->magic, COMPILED_MAGIC, sizeof(COMPILED_MAGIC)) != 0)
+        goto invalid;
+    if (header->version != COMPILED_VERSION
+        || header->endian != COMPILED_ENDIAN
+        || header->options != optlen
+        || header->table != table_hash(options, optlen)
+        || header->size != size)
+        goto invalid;
+    if (!map_current(args, data, size, header))
+        goto done;
+
+    /* Binary search for our entry. */
+    entries = map_array(data, size, header->entries, header->nentries,
+                        sizeof(struct entry_record));
+    if (entries == NULL)
+        goto invalid;
+    key = pamk5_config_key(args, argc, argv, &keylen);
+    if (key == NULL)
+        goto done;
+    low = 0;
+    high = header->nentries;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (entries[middle].key == 0 || entries[middle].key > size
+            || entries[middle].keylen > size - entries[middle].key)
+            goto invalid;
+        status = key_compare(key, keylen, data + entries[middle].key,
+                             entries[middle].keylen);
+        if (status == 0)
+            break;
+        else if (status < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    if (low >= high)
+        goto done;
+    slots = map_array(data, size, entries[middle].values, optlen,
+                      sizeof(uint64_t));
+    if (slots == NULL)
+        goto invalid;
+    config = map_config(args, path, data, size, slots);
+    goto done;
+
+invalid:
+    putil_err(args, "invalid compiled configuration %s", path);
+
+done:
+    if (map != MAP_FAILED)
+        munmap(map, size);
+    close(fd);
+    free(key);
+    return config;
+}
@@ -0,0 +1,521 @@
+/*
+ * Process-wide cache of the parsed module configuration.
+ *
+ * Every call into the module normally creates a new Kerberos context, which
+ * reads and parses krb5.conf, and then looks up each of our options in the
+ * [appdefaults] section.  Long-running PAM applications pay that cost for
+ * every transaction even though the answer almost never changes.  If the
+ * config_cache option is set, the parsed configuration and a template
+ * Kerberos context are kept here, keyed by the realm and the PAM arguments,
+ * and later calls get copies of them instead.
+ *
+ * The cache records the device, inode, size, and modification and change
+ * times of every configuration file the Kerberos library reads and throws
+ * away all entries as soon as any of those change.  It is never used when
+ * running setuid or setgid.  The key and file stamp helpers are also used by
+ * the compiled configuration support.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#ifdef HAVE_DLFCN_H
+# include <dlfcn.h>
+#endif
+#include <errno.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#include <sys/stat.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+
+/*
+ * Build the cache key from the realm and the PAM arguments, separating each
+ * with a nul byte so that different splits of the same characters can't
+ * collide.  Returns the key in newly allocated memory and stores its length
+ * in keylen, or returns NULL on memory allocation failure, which is reported.
+ */
+char *
+pamk5_config_key(struct pam_args *args, int argc, const char **argv,
+                 size_t *keylen)
+{
+    const char *realm;
+    char *key;
+    size_t length, offset;
+    int i;
+
+    realm = (args->realm == NULL) ? "" : args->realm;
+    length = strlen(realm) + 1;
+    for (i = 0; i < argc; i++)
+        length += strlen(argv[i]) + 1;
+    key = malloc(length);
+    if (key == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return NULL;
+    }
+    memcpy(key, realm, strlen(realm) + 1);
+    offset = strlen(realm) + 1;
+    for (i = 0; i < argc; i++) {
+        memcpy(key + offset, argv[i], strlen(argv[i]) + 1);
+        offset += strlen(argv[i]) + 1;
+    }
+    *keylen = length;
+    return key;
+}
+
+
+/*
+ * Free an array of file stamps.
+ */
+void
+pamk5_config_stamps_free(struct config_stamp *stamps, size_t nstamps)
+{
+    size_t i;
+
+    if (stamps == NULL)
+        return;
+    for (i = 0; i < nstamps; i++)
+        free(stamps[i].path);
+    free(stamps);
+}
+
+
+/*
+ * Compare two sets of file stamps, returning true if they're identical.
+ */
+bool
+pamk5_config_stamps_equal(const struct config_stamp *a, size_t na,
+                          const struct config_stamp *b, size_t nb)
+{
+    size_t i;
+
+    if (na != nb)
+        return false;
+    for (i = 0; i < na; i++) {
+        if (strcmp(a[i].path, b[i].path) != 0)
+            return false;
+        if (a[i].exists != b[i].exists)
+            return false;
+        if (!a[i].exists)
+            continue;
+        if (a[i].dev != b[i].dev || a[i].ino != b[i].ino)
+            return false;
+        if (a[i].size != b[i].size)
+            return false;
+        if (a[i].mtime != b[i].mtime || a[i].ctime != b[i].ctime)
+            return false;
+    }
+    return true;
+}
+
+
+#ifdef HAVE_KRB5_GET_DEFAULT_CONFIG_FILES
+
+/*
+ * Ask the Kerberos library which configuration files it would read and
+ * record the identity of each.  Files that don't exist are recorded as such,
+ * since creating one is also a change.  Returns true on success and false on
+ * failure, in which case no saved configuration should be trusted.
+ */
+bool
+pamk5_config_stamps(struct pam_args *args, struct config_stamp **stamps,
+                    size_t *nstamps)
+{
+    char **files = NULL;
+    struct stat st;
+    size_t count, i;
+    krb5_error_code retval;
+
+    *stamps = NULL;
+    *nstamps = 0;
+    retval = krb5_get_default_config_files(&files);
+    if (retval != 0) {
+        putil_err_krb5(args, retval, "cannot get Kerberos configuration"
+                       " files");
+        return false;
+    }
+    for (count = 0; files[count] != NULL; count++)
+        ;
+    if (count == 0) {
+        krb5_free_config_files(files);
+        return false;
+    }
+    *stamps = calloc(count, sizeof(struct config_stamp));
+    if (*stamps == NULL)
+        goto nomem;
+    *nstamps = count;
+    for (i = 0; i < count; i++) {
+        (*stamps)[i].path = strdup(files[i]);
+        if ((*stamps)[i].path == NULL)
+            goto nomem;
+        if (stat(files[i], &st) < 0)
+            continue;
+        (*stamps)[i].exists = true;
+        (*stamps)[i].dev    = st.st_dev;
+        (*stamps)[i].ino    = st.st_ino;
+        (*stamps)[i].size   = st.st_size;
+        (*stamps)[i].mtime  = st.st_mtime;
+        (*stamps)[i].ctime  = st.st_ctime;
+    }
+    krb5_free_config_files(files);
+    return true;
+
+nomem:
+    putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+    krb5_free_config_files(files);
+    pamk5_config_stamps_free(*stamps, *nstamps);
+    *stamps = NULL;
+    *nstamps = 0;
+    return false;
+}
+
+
+#else /* !HAVE_KRB5_GET_DEFAULT_CONFIG_FILES */
+
+bool
+pamk5_config_stamps(struct pam_args *args UNUSED,
+                    struct config_stamp **stamps, size_t *nstamps)
+{
+    *stamps = NULL;
+    *nstamps = 0;
+    return false;
+}
+#endif /* !HAVE_KRB5_GET_DEFAULT_CONFIG_FILES */
+
+
+/*
+ * We need threads for locking and a way of asking the Kerberos library which
+ * files it reads.  Without either, the cache is never used.
+ */
+#if !defined(HAVE_PTHREAD_H) || !defined(HAVE_KRB5_GET_DEFAULT_CONFIG_FILES)
+
+struct pam_config *
+pamk5_config_cache_fetch(struct pam_args *args UNUSED, int argc UNUSED,
+                         const char **argv UNUSED, unsigned long *generation)
+{
+    *generation = 0;
+    return NULL;
+}
+
+bool
+pamk5_config_cache_context(struct pam_args *args, int argc UNUSED,
+                           const char **argv UNUSED)
+{
+    return putil_args_krb5_context(args);
+}
+
+void
+pamk5_config_cache_store(struct pam_args *args UNUSED, int argc UNUSED,
+                         const char **argv UNUSED,
+                         unsigned long generation UNUSED)
+{
+}
+
+#else /* HAVE_PTHREAD_H && HAVE_KRB5_GET_DEFAULT_CONFIG_FILES */
+
+/* The maximum number of distinct configurations kept in the cache. */
+#define CACHE_MAX 16
+
+/* A cached configuration, kept in most-recently-used order. */
+struct entry {
+    char *key;                  /* Realm and arguments, nul-separated. */
+    size_t keylen;              /* Length of key. */
+    struct pam_config *config;  /* Settings before sanity checks. */
+    krb5_context context;       /* Template context, if it can be copied. */
+    struct entry *next;
+};
+
+/*
+ * The cache itself.  The generation is incremented whenever the entries are
+ * discarded because the configuration files changed, so that a caller that
+ * parsed the old configuration can't store it afterwards.
+ */
+static struct {
+    struct config_stamp *stamps;
+    size_t nstamps;
+    unsigned long generation;
+    struct entry *entries;
+    size_t count;
+    bool pin_attempted;
+} cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Free everything at unload so that the cache doesn't leak. */
+static void cache_free(void) __attribute__((__destructor__));
+
+
+/*
+ * Free a cache entry.
+ */
+static void
+entry_free(struct entry *entry)
+{
+    if (entry == NULL)
+        return;
+    free(entry->key);
+    pamk5_config_free(entry->config);
+    if (entry->context != NULL)
+        krb5_free_context(entry->context);
+    free(entry);
+}
+
+
+/*
+ * Discard all cache entries.  Must be called with the lock held.
+ */
+static void
+cache_flush(void)
+{
+    struct entry *entry, *next;
+
+    for (entry = cache.entries; entry != NULL; entry = next) {
+        next = entry->next;
+        entry_free(entry);
+    }
+    cache.entries = NULL;
+    cache.count = 0;
+}
+
+
+/*
+ * Free the whole cache when the module is unloaded.
+ */
+static void
+cache_free(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_flush();
+    pamk5_config_stamps_free(cache.stamps, cache.nstamps);
+    cache.stamps = NULL;
+    cache.nstamps = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+/*
+ * PAM applications normally unload the module at pam_end, which would throw
+ * away the cache after every transaction.  Once something is cached, try to
+ * take an additional reference to the module that can never be dropped so
+ * that the cache survives.  This is only possible where RTLD_NODELETE is
+ * supported, and is harmless if the module is linked into the application.
+ * Must be called with the lock held.
+ */
+static void
+pin_module(void)
+{
+#if defined(HAVE_DLADDR) && defined(RTLD_NODELETE)
+    Dl_info info;
+
+    if (cache.pin_attempted)
+        return;
+    cache.pin_attempted = true;
+    if (dladdr((void *) pamk5_config_cache_store, &info) == 0)
+        return;
+    if (info.dli_fname != NULL)
+        dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE);
+#endif
+}
+
+
+/*
+ * Find the entry for a key and move it to the front of the list.  Returns
+ * NULL if there is no such entry.  Must be called with the lock held.
+ */
+static struct entry *
+cache_find(const char *key, size_t keylen)
+{
+    struct entry *entry, *prev;
+
+    prev = NULL;
+    for (entry = cache.entries; entry != NULL; entry = entry->next) {
+        if (entry->keylen == keylen && memcmp(entry->key, key, keylen) == 0)
+            break;
+        prev = entry;
+    }
+    if (entry != NULL && prev != NULL) {
+        prev->next = entry->next;
+        entry->next = cache.entries;
+        cache.entries = entry;
+    }
+    return entry;
+}
+
+
+/*
+ * Look up the configuration for the realm and arguments in the cache.  If
+ * found, return a copy of it.  Otherwise, return NULL.  Either way, store in
+ * generation the number that should be passed to pamk5_config_cache_store,
+ * or 0 if the cache can't be used.  The Kerberos context is not touched;
+ * call pamk5_config_cache_context once it's needed.
+ */
+struct pam_config *
+pamk5_config_cache_fetch(struct pam_args *args, int argc, const char **argv,
+                         unsigned long *generation)
+{
+    struct config_stamp *stamps = NULL;
+    size_t nstamps = 0;
+    char *key = NULL;
+    size_t keylen;
+    struct entry *entry;
+    struct pam_config *config = NULL;
+
+    *generation = 0;
+    if (issetugid())
+        return NULL;
+    if (!pamk5_config_stamps(args, &stamps, &nstamps))
+        return NULL;
+    key = pamk5_config_key(args, argc, argv, &keylen);
+    if (key == NULL) {
+        pamk5_config_stamps_free(stamps, nstamps);
+        return NULL;
+    }
+
+    /* Discard everything if the configuration files have changed. */
+    pthread_mutex_lock(&cache_lock);
+    if (cache.generation == 0
+        || !pamk5_config_stamps_equal(stamps, nstamps, cache.stamps, cache.nstamps)) {
+        cache_flush();
+        pamk5_config_stamps_free(cache.stamps, cache.nstamps);
+        cache.stamps = stamps;
+        cache.nstamps = nstamps;
+        cache.generation++;
+        stamps = NULL;
+    }
+    *generation = cache.generation;
+
+    /* Copy the configuration while holding the lock. */
+    entry = cache_find(key, keylen);
+    if (entry != NULL)
+        config = pamk5_config_copy(args, entry->config);
+    pthread_mutex_unlock(&cache_lock);
+    pamk5_config_stamps_free(stamps, nstamps);
+    free(key);
+    return config;
+}
+
+
+/*
+ * Set the Kerberos context in args for a configuration that came from the
+ * cache, using a copy of the cached template context if there still is one
+ * and creating a new context otherwise.  The configuration files are not
+ * checked again, since pamk5_config_cache_fetch did that at the start of
+ * this call.  Returns true on success and false on failure, which will have
+ * been reported.
+ */
+bool
+pamk5_config_cache_context(struct pam_args *args, int argc, const char **argv)
+{
+    char *key;
+    size_t keylen;
+    struct entry *entry;
+    krb5_context context = NULL;
+#ifdef HAVE_KRB5_COPY_CONTEXT
+    krb5_error_code retval = 0;
+#endif
+
+    key = pamk5_config_key(args, argc, argv, &keylen);
+    if (key == NULL)
+        return false;
+    pthread_mutex_lock(&cache_lock);
+    entry = cache_find(key, keylen);
+#ifdef HAVE_KRB5_COPY_CONTEXT
+    if (entry != NULL && entry->context != NULL)
+        retval = krb5_copy_context(entry->context, &context);
+#endif
+    pthread_mutex_unlock(&cache_lock);
+    free(key);
+#ifdef HAVE_KRB5_COPY_CONTEXT
+    if (retval != 0) {
+        putil_err_krb5(args, retval, "cannot copy Kerberos context");
+        return false;
+    }
+#endif
+    if (context != NULL) {
+        args->ctx = context;
+        return true;
+    }
+    return putil_args_krb5_context(args);
+}
+
+
+/*
+ * Store the configuration and Kerberos context in args in the cache for the
+ * realm and arguments, provided that the configuration files haven't changed
+ * since generation was returned by pamk5_config_cache_fetch.  Failures are
+ * not fatal; the configuration is just not cached.
+ */
+void
+pamk5_config_cache_store(struct pam_args *args, int argc, const char **argv,
+                         unsigned long generation)
+{
+    struct entry *entry, *current, *prev;
+#ifdef HAVE_KRB5_COPY_CONTEXT
+    krb5_error_code retval;
+#endif
+
+    if (generation == 0)
+        return;
+    entry = calloc(1, sizeof(struct entry));
+    if (entry == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return;
+    }
+    entry->key = pamk5_config_key(args, argc, argv, &entry->keylen);
+    if (entry->key == NULL)
+        goto fail;
+    entry->config = pamk5_config_copy(args, args->config);
+    if (entry->config == NULL)
+        goto fail;
+#ifdef HAVE_KRB5_COPY_CONTEXT
+    retval = krb5_copy_context(args->ctx, &entry->context);
+    if (retval != 0) {
+        putil_err_krb5(args, retval, "cannot copy Kerberos context");
+        entry->context = NULL;
+        goto fail;
+    }
+#endif
+
+    /*
+     * Give up if the configuration changed under us or if another thread got
+     * there first.  Otherwise, add the new entry to the front and drop the
+     * least recently used entry if the cache is full.
+     */
+    pthread_mutex_lock(&cache_lock);
+    if (generation != cache.generation) {
+        pthread_mutex_unlock(&cache_lock);
+        goto fail;
+    }
+    for (current = cache.entries; current != NULL; current = current->next)
+        if (current->keylen == entry->keylen
+            && memcmp(current->key, entry->key, entry->keylen) == 0) {
+            pthread_mutex_unlock(&cache_lock);
+            goto fail;
+        }
+    entry->next = cache.entries;
+    cache.entries = entry;
+    cache.count++;
+    if (cache.count > CACHE_MAX) {
+        prev = NULL;
+        for (current = cache.entries; current->next != NULL;
+             current = current->next)
+            prev = current;
+        prev->next = NULL;
+        entry_free(current);
+        cache.count--;
+    }
+    pin_module();
+    pthread_mutex_unlock(&cache_lock);
+    return;
+
+fail:
+    entry_free(entry);
+}
+
+#endif /* HAVE_PTHREAD_H && HAVE_KRB5_GET_DEFAULT_CONFIG_FILES */
@@ -0,0 +1,171 @@
+/*
+ * Cache of the parsed module configuration for one PAM handle.
+ *
+ * Services often stack this module several times, for instance once per
+ * realm followed by a use_first_pass fallback, and every stacked instance
+ * and every later call in the transaction would otherwise load the same
+ * settings from krb5.conf again.  The resolved configuration for each set of
+ * arguments is kept in the PAM data for the handle, keyed by the realm and
+ * the arguments, so a later call with identical arguments just takes a copy.
+ * The settings from the defaults and krb5.conf before any arguments were
+ * applied are also kept for each realm, so an instance with different
+ * arguments only has to apply its own.
+ *
+ * Unlike the process-wide configuration cache, this needs no locking and no
+ * checks that the configuration files have changed, since it lives only as
+ * long as the PAM transaction.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* The PAM data key under which the cache is stored. */
+#define HANDLE_DATA "pam_krb5_config"
+
+/* The maximum number of configurations kept for one handle. */
+#define HANDLE_MAX 16
+
+/* A saved configuration. */
+struct entry {
+    char *key;                  /* Realm and arguments, nul-separated. */
+    size_t keylen;              /* Length of key. */
+    struct pam_config *config;  /* Settings before sanity checks. */
+    struct entry *next;
+};
+
+/* The cache stored in the PAM data. */
+struct handle_cache {
+    struct entry *entries;
+    size_t count;
+};
+
+
+/*
+ * The PAM callback to free the cache when the handle is destroyed.
+ */
+static void
+handle_cache_free(pam_handle_t *pamh UNUSED, void *data,
+                  int pam_end_status UNUSED)
+{
+    struct handle_cache *cache = data;
+    struct entry *entry, *next;
+
+    if (cache == NULL)
+        return;
+    for (entry = cache->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        free(entry->key);
+        pamk5_config_free(entry->config);
+        free(entry);
+    }
+    free(cache);
+}
+
+
+/*
+ * Return the cache for the PAM handle, or NULL if there isn't one yet.
+ */
+static struct handle_cache *
+handle_cache_get(struct pam_args *args)
+{
+    struct handle_cache *cache = NULL;
+
+    if (args->pamh == NULL)
+        return NULL;
+    if (pam_get_data(args->pamh, HANDLE_DATA, (void *) &cache) != PAM_SUCCESS)
+        return NULL;
+    return cache;
+}
+
+
+/*
+ * Look up the configuration saved for a key in the cache for the PAM handle.
+ * Returns a copy of it, or NULL if there isn't one or on memory allocation
+ * failure, which is reported.
+ */
+struct pam_config *
+pamk5_config_handle_fetch(struct pam_args *args, const char *key,
+                          size_t keylen)
+{
+    struct handle_cache *cache;
+    struct entry *entry;
+
+    cache = handle_cache_get(args);
+    if (cache == NULL)
+        return NULL;
+    for (entry = cache->entries; entry != NULL; entry = entry->next)
+        if (entry->keylen == keylen && memcmp(entry->key, key, keylen) == 0)
+            return pamk5_config_copy(args, entry->config);
+    return NULL;
+}
+
+
+/*
+ * Save a copy of a configuration under a key in the cache for the PAM
+ * handle, creating the cache if needed.  Failures are not fatal; the
+ * configuration is just not saved.
+ */
+void
+pamk5_config_handle_store(struct pam_args *args, const char *key,
+                          size_t keylen, const struct pam_config *config)
+{
+    struct handle_cache *cache;
+    struct entry *entry;
+    int pamret;
+
+    if (args->pamh == NULL)
+        return;
+    cache = handle_cache_get(args);
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(struct handle_cache));
+        if (cache == NULL) {
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+            return;
+        }
+        pamret = pam_set_data(args->pamh, HANDLE_DATA, cache,
+                              handle_cache_free);
+        if (pamret != PAM_SUCCESS) {
+            putil_err_pam(args, pamret, "cannot set configuration data");
+            free(cache);
+            return;
+        }
+    }
+    if (cache->count >= HANDLE_MAX)
+        return;
+    for (entry = cache->entries; entry != NULL; entry = entry->next)
+        if (entry->keylen == keylen && memcmp(entry->key, key, keylen) == 0)
+            return;
+
+    /* Build the new entry and add it to the front of the list. */
+    entry = calloc(1, sizeof(struct entry));
+    if (entry == NULL)
+        goto nomem;
+    entry->key = malloc(keylen);
+    if (entry->key == NULL)
+        goto nomem;
+    memcpy(entry->key, key, keylen);
+    entry->keylen = keylen;
+    entry->config = pamk5_config_copy(args, config);
+    if (entry->config == NULL)
+        goto fail;
+    entry->next = cache->entries;
+    cache->entries = entry;
+    cache->count++;
+    return;
+
+nomem:
+    putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+fail:
+    if (entry != NULL)
+        free(entry->key);
+    free(entry);
+}
@@ -2,7 +2,11 @@
  * Manage context structure.
  *
  * The context structure is the internal state maintained by the pam-krb5
- * module between calls to the various public interfaces.
+ * module between calls to the various public interfaces.  It is reference
+ * counted: the PAM data holds one reference once it has been stored there,
+ * and each call holds one through args->config->ctx.  The context owns its
+ * Kerberos context, which later calls borrow as args->ctx instead of creating
+ * their own.
  *
  * Copyright 2011
  *     The Board of Trustees of the Leland Stanford Junior University
@@ -18,15 +22,79 @@
 #include <portable/system.h>
 
 #include <errno.h>
+#include <time.h>
 
 #include <internal.h>
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
 
 
+/*
+ * Return a new transaction ID for structured logs: 16 hex digits mixed from
+ * the time, the process, a counter, and the address of the context, which is
+ * unique enough to tell apart the logins on a system without needing a
+ * source of randomness.
+ */
+static char *
+new_tid(const struct context *ctx)
+{
+    static unsigned long counter = 0;
+    struct timespec ts;
+    unsigned long long x;
+    char tid[17];
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    x = (unsigned long long) ts.tv_sec * 1000000000ULL
+        + (unsigned long long) ts.tv_nsec;
+    x ^= (unsigned long long) getpid() << 40;
+    x ^= (unsigned long long) ++counter << 20;
+    x ^= (unsigned long long) (uintptr_t) ctx;
+
+    /* The splitmix64 finalizer, so that similar inputs look unrelated. */
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    snprintf(tid, sizeof(tid), "%016llx", x);
+    return strdup(tid);
+}
+
+
+/*
+ * Give the context a transaction ID if structured logs are wanted, reusing
+ * the one from an earlier call for this PAM handle or else creating one and
+ * putting it in the PAM environment as PAM_KRB5_TID, where later calls and
+ * other modules can find it.  Returns a PAM status code.
+ */
+static int
+context_tid(struct pam_args *args, struct context *ctx)
+{
+    int retval;
+
+    if (args->log_format == PUTIL_LOG_TEXT)
+        return PAM_SUCCESS;
+    if (args->tid != NULL) {
+        ctx->tid = strdup(args->tid);
+        if (ctx->tid == NULL)
+            return PAM_BUF_ERR;
+    } else {
+        ctx->tid = new_tid(ctx);
+        if (ctx->tid == NULL)
+            return PAM_BUF_ERR;
+        retval = pamk5_setenv(args, "PAM_KRB5_TID", ctx->tid);
+        if (retval != PAM_SUCCESS)
+            return retval;
+    }
+    args->tid = ctx->tid;
+    return PAM_SUCCESS;
+}
+
+
 /*
  * Create a new context and populate it with the user from PAM and the current
- * Kerberos context.  Set the default realm if one was configured.
+ * Kerberos context, which the new context then owns.  Set the default realm
+ * if one was configured.
  */
 int
 pamk5_context_new(struct pam_args *args)
@@ -40,6 +108,7 @@ pamk5_context_new(struct pam_args *args)
         retval = PAM_BUF_ERR;
         goto done;
     }
+    ctx->refs = 1;
     ctx->cache = NULL;
     ctx->princ = NULL;
     ctx->creds = NULL;
@@ -61,6 +130,9 @@ pamk5_context_new(struct pam_args *args)
     }
     ctx->name = strdup(name);
     args->user = ctx->name;
+    retval = context_tid(args, ctx);
+    if (retval != PAM_SUCCESS)
+        goto done;
 
     /* Set a default realm if one was configured. */
     if (args->realm != NULL) {
@@ -82,31 +154,146 @@ done:
 /*
  * Retrieve a context from the PAM data structures, returning failure if no
  * context was present.  Note that OpenSSH loses contexts between authenticate
- * and setcred, so failure shouldn't always be fatal.
+ * and setcred, so failure shouldn't always be fatal.  Takes a reference to
+ * the context for args, and may be called more than once.
  */
 int
 pamk5_context_fetch(struct pam_args *args)
 {
+    struct context *ctx = NULL;
     int pamret;
 
-    pamret = pam_get_data(args->pamh, "pam_krb5", (void *) &args->config->ctx);
+    pamret = pam_get_data(args->pamh, "pam_krb5", (void *) &ctx);
     if (pamret != PAM_SUCCESS)
-        args->config->ctx = NULL;
-    if (pamret == 0 && args->config->ctx == NULL)
+        ctx = NULL;
+    if (ctx != args->config->ctx) {
+        pamk5_context_free(args);
+        if (ctx != NULL) {
+            ctx->refs++;
+            args->config->ctx = ctx;
+        }
+    }
+    if (pamret == 0 && ctx == NULL)
         return PAM_SERVICE_ERR;
-    if (args->config->ctx != NULL)
-        args->user = args->config->ctx->name;
+    if (ctx != NULL) {
+        args->user = ctx->name;
+        if (ctx->tid != NULL)
+            args->tid = ctx->tid;
+        pamk5_context_principal(args);
+    }
+    return pamret;
+}
+
+
+/*
+ * Note the principal of the current context in args for structured logs.
+ * Only done if a structured log format is in use, since it costs an unparse
+ * each time the principal changes.  Failure just leaves it out of the logs.
+ */
+void
+pamk5_context_principal(struct pam_args *args)
+{
+    struct context *ctx = args->config->ctx;
+    char *principal;
+
+    if (args->log_format == PUTIL_LOG_TEXT)
+        return;
+    args->principal = NULL;
+    if (ctx == NULL || ctx->princ == NULL)
+        return;
+    if (krb5_unparse_name(ctx->context, ctx->princ, &principal) != 0)
+        return;
+    args->principal = putil_arena_strdup(args, principal);
+    krb5_free_unparsed_name(ctx->context, principal);
+}
+
+
+/*
+ * Store the current context in the PAM data structures for later calls,
+ * giving the PAM data its own reference.  Returns a PAM status code.
+ */
+int
+pamk5_context_store(struct pam_args *args)
+{
+    struct context *ctx = args->config->ctx;
+    int pamret;
+
+    ctx->refs++;
+    pamret = pam_set_data(args->pamh, "pam_krb5", ctx, pamk5_context_destroy);
+    if (pamret != PAM_SUCCESS)
+        ctx->refs--;
     return pamret;
 }
 
 
+/*
+ * Keep the context of an authentication left incomplete by nonblocking_auth
+ * in the PAM data for the next call, giving the PAM data its own reference.
+ * This is kept apart from the context of a finished authentication so that
+ * the other PAM interfaces never see it.  Returns a PAM status code.
+ */
+int
+pamk5_context_park(struct pam_args *args)
+{
+    struct context *ctx = args->config->ctx;
+    int pamret;
+
+    ctx->refs++;
+    pamret = pam_set_data(args->pamh, "pam_krb5_resume", ctx,
+                          pamk5_context_destroy);
+    if (pamret != PAM_SUCCESS)
+        ctx->refs--;
+    return pamret;
+}
+
+
+/*
+ * Retrieve the context of an authentication left incomplete by an earlier
+ * call, if there is one, taking a reference to it for args.  Returns true if
+ * there was one.
+ */
+bool
+pamk5_context_resume(struct pam_args *args)
+{
+    struct context *ctx = NULL;
+    int pamret;
+
+    pamret = pam_get_data(args->pamh, "pam_krb5_resume", (void *) &ctx);
+    if (pamret != PAM_SUCCESS || ctx == NULL)
+        return false;
+    if (ctx != args->config->ctx) {
+        pamk5_context_free(args);
+        ctx->refs++;
+        args->config->ctx = ctx;
+    }
+    args->user = ctx->name;
+    if (ctx->tid != NULL)
+        args->tid = ctx->tid;
+    pamk5_context_principal(args);
+    return true;
+}
+
+
+/*
+ * Drop the reference to a parked context held by the PAM data, once the
+ * authentication it was kept for is over.
+ */
+void
+pamk5_context_unpark(struct pam_args *args)
+{
+    PAM_CONST void *data;
+
+    if (pam_get_data(args->pamh, "pam_krb5_resume", &data) == PAM_SUCCESS
+        && data != NULL)
+        pam_set_data(args->pamh, "pam_krb5_resume", NULL, NULL);
+}
+
+
 /*
  * Free a context and all of the data that's stored in it.  Normally this also
  * includes destroying the ticket cache, but don't do this (just close it) if
- * a flag was set to preserve it.
- *
- * This function is common code between pamk5_context_free (called internally
- * by our code) and pamk5_context_destroy (called by PAM as a data callback).
+ * a flag was set to preserve it.  The Kerberos context is freed only if
+ * free_context is true.
  */
 static void
 context_free(struct context *ctx, bool free_context)
@@ -114,6 +301,7 @@ context_free(struct context *ctx, bool free_context)
     if (ctx == NULL)
         return;
     free(ctx->name);
+    free(ctx->tid);
     if (ctx->context != NULL) {
         if (ctx->princ != NULL)
             krb5_free_principal(ctx->context, ctx->princ);
@@ -127,43 +315,67 @@ context_free(struct context *ctx, bool free_context)
             krb5_free_cred_contents(ctx->context, ctx->creds);
             free(ctx->creds);
         }
+        if (ctx->fast_cache != NULL)
+            krb5_cc_destroy(ctx->context, ctx->fast_cache);
+        pamk5_resume_free(ctx->context, ctx->resume);
         if (free_context)
             krb5_free_context(ctx->context);
     }
-    if (ctx->fast_cache != NULL)
-        krb5_cc_destroy(ctx->context, ctx->fast_cache);
     free(ctx);
 }
 
 
 /*
- * Free the current context, used internally by pam-krb5 code.  This is a
- * wrapper around context_free that makes sure we don't destroy the Kerberos
- * context if it's the same as the top-level context and handles other
- * bookkeeping in the top-level pam_args struct.
+ * Drop a reference to a context, freeing it along with its Kerberos context
+ * when the last reference goes away.
+ */
+static void
+context_release(struct context *ctx)
+{
+    if (ctx == NULL)
+        return;
+    if (--ctx->refs == 0)
+        context_free(ctx, true);
+}
+
+
+/*
+ * Drop the reference to the current context held by args, used internally by
+ * pam-krb5 code and when a call finishes.  If args borrowed the Kerberos
+ * context from the context, it gives it up, unless this was the last
+ * reference, in which case args takes the Kerberos context back.  Also
+ * handles other bookkeeping in the top-level pam_args struct.
  */
 void
 pamk5_context_free(struct pam_args *args)
 {
-    if (args->config->ctx == NULL)
+    struct context *ctx = args->config->ctx;
+
+    if (ctx == NULL)
         return;
-    if (args->user == args->config->ctx->name)
+    if (args->user == ctx->name)
         args->user = NULL;
-    context_free(args->config->ctx, args->ctx != args->config->ctx->context);
+    if (args->tid == ctx->tid)
+        args->tid = NULL;
+    args->principal = NULL;
     args->config->ctx = NULL;
+    if (args->ctx == ctx->context) {
+        if (ctx->refs == 1) {
+            context_free(ctx, false);
+            return;
+        }
+        args->ctx = NULL;
+    }
+    context_release(ctx);
 }
 
 
 /*
- * The PAM callback to destroy the context stored in the PAM data structures.
- * Just does the necessary conversion of arguments and calls context_free.
+ * The PAM callback to drop the reference held by the PAM data structures.
  */
 void
 pamk5_context_destroy(pam_handle_t *pamh UNUSED, void *data,
                       int pam_end_status UNUSED)
 {
-    struct context *ctx = (struct context *) data;
-
-    if (ctx != NULL)
-        context_free(ctx, true);
+    context_release((struct context *) data);
 }
@@ -0,0 +1,1282 @@
+/*
+ * Initial credentials exchanges driven by the module.
+ *
+ * krb5_get_init_creds_password does its own network I/O and blocks until the
+ * exchange is over, waiting out the library's timeouts and failover between
+ * KDCs.  When nonblocking_kdc is set and the Kerberos library has the step
+ * interface, the module instead runs the exchange with krb5_init_creds_step,
+ * sends each request itself, and waits for the replies with poll.  Several
+ * exchanges can then share one thread, the module decides how long to wait
+ * for each KDC, and an exchange whose result is no longer needed can be
+ * abandoned rather than left to finish.  With nonblocking_auth, an exchange
+ * can also be taken as far as it goes without waiting and then left for a
+ * later call to the module to pick up.  auth_timeout also has the module
+ * drive the exchanges, since that's the only way to stop one at a deadline.
+ *
+ * The KDCs for a realm are taken from the kdc settings in the [realms]
+ * section of krb5.conf.  An exchange with a realm that isn't listed there,
+ * such as one found only in DNS or only reachable through an HTTPS proxy, is
+ * started over with krb5_get_init_creds_password.  So is every exchange if
+ * the library doesn't have the MIT Kerberos step interface; Heimdal's takes
+ * different arguments and older versions have none.
+ *
+ * Each request is sent over UDP to each KDC in turn, and then over TCP,
+ * waiting KDC_WAIT for a reply before moving on but still listening to the
+ * KDCs already tried.  The UDP requests are then sent again with longer
+ * waits, up to KDC_PASSES times in all.  A reply too big for UDP restarts
+ * the request over TCP only.  The host names of the KDCs are still looked up
+ * with getaddrinfo, which may block and isn't bounded by auth_timeout, so
+ * nonblocking_auth and auth_timeout only hold for KDCs listed by address.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+#if defined(HAVE_KRB5_MIT) && defined(HAVE_KRB5_INIT_CREDS_STEP)       \
+    && defined(HAVE_KRB5_GET_PROFILE)                                   \
+    && (defined(HAVE_K5PROFILE_H) || defined(HAVE_PROFILE_H))
+# define HAVE_EXCHANGE 1
+#endif
+
+#ifdef HAVE_EXCHANGE
+# include <fcntl.h>
+# include <limits.h>
+# ifdef HAVE_K5PROFILE_H
+#  include <k5profile.h>
+# else
+#  include <profile.h>
+# endif
+# include <netdb.h>
+# include <poll.h>
+# include <sys/socket.h>
+
+# ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+# endif
+
+/* Milliseconds to wait for a KDC before also trying the next. */
+# define KDC_WAIT 1000
+
+/* Number of times a request is sent to each KDC over UDP. */
+# define KDC_PASSES 3
+
+/*
+ * Milliseconds after which a caller of pamk5_exchange_poll should call again
+ * while a TCP connection is being made or written to, since the descriptor
+ * it is given is only good for waiting for a reply.
+ */
+# define POLL_WRITE_WAIT 50
+
+/* The most KDC addresses used for one realm, counting UDP and TCP. */
+# define MAX_SERVERS 16
+
+/* The largest reply accepted over UDP and over TCP. */
+# define MAX_UDP_REPLY 65536
+# define MAX_TCP_REPLY (1024 * 1024)
+
+/* A KDC address and whether to talk to it over TCP. */
+struct server {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    bool tcp;
+};
+
+/* The state of a connection to a KDC. */
+enum conn_state {
+    CONN_CLOSED,                /* No socket. */
+    CONN_CONNECTING,            /* Waiting for a TCP connection. */
+    CONN_WRITING,               /* Writing the request over TCP. */
+    CONN_READING                /* Waiting for the reply. */
+};
+
+/* A connection to a KDC, for the current request. */
+struct conn {
+    int fd;                     /* The socket, or -1. */
+    enum conn_state state;      /* What the connection is waiting for. */
+    size_t pos;                 /* TCP bytes written or read so far. */
+    unsigned char header[4];    /* TCP reply length. */
+    unsigned char *reply;       /* TCP reply, once its length is known. */
+    size_t length;              /* Length of the TCP reply. */
+};
+#endif /* HAVE_EXCHANGE */
+
+/* An initial credentials exchange. */
+struct pamk5_exchange {
+    krb5_context context;       /* Kerberos context of the module. */
+    krb5_principal client;      /* Principal to authenticate. */
+    const char *pass;           /* Password, or NULL to prompt. */
+    krb5_prompter_fct prompter; /* Prompter for the Kerberos library. */
+    void *data;                 /* Data for the prompter. */
+    const char *service;        /* Service to get tickets for. */
+    krb5_get_init_creds_opt *opts; /* Initial credential options. */
+    krb5_creds creds;           /* The credentials, on success. */
+    krb5_error_code status;     /* Result of the exchange. */
+    bool done;                  /* Whether the exchange has finished. */
+#ifdef HAVE_EXCHANGE
+    bool stepping;              /* Whether the module is doing the I/O. */
+    bool started;               /* Whether the first step has been taken. */
+    krb5_init_creds_context icc; /* The exchange in the Kerberos library. */
+    krb5_data request;          /* The request to send. */
+    krb5_data realm;            /* The realm to send it to. */
+    unsigned char *framed;      /* The request with its TCP length. */
+    char *located;              /* The realm the servers are for. */
+    bool tcp_only;              /* Whether the KDC reply was too big. */
+    bool primary;               /* Whether retrying with the primary KDCs. */
+    krb5_error_code replica;    /* The error before retrying, if so. */
+    struct server servers[MAX_SERVERS]; /* The KDCs for the realm. */
+    struct conn conns[MAX_SERVERS]; /* Connections to each KDC. */
+    size_t nservers;            /* Number of KDCs. */
+    size_t round;               /* Pass over the KDCs. */
+    size_t next;                /* Next KDC to send to in this pass. */
+    unsigned long long due;     /* When to send to the next KDC. */
+#endif
+};
+
+
+/*
+ * Return the current monotonic time in milliseconds.
+ */
+static unsigned long long
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+    return (unsigned long long) ts.tv_sec * 1000ULL
+           + (unsigned long long) ts.tv_nsec / 1000000ULL;
+}
+
+
+/*
+ * Start the clock for auth_timeout, unless it isn't set or the clock is
+ * already running for an authentication that an earlier call left
+ * incomplete.
+ */
+void
+pamk5_deadline_start(struct pam_args *args)
+{
+    struct context *ctx = args->config->ctx;
+
+    if (args->config->auth_timeout <= 0 || ctx->deadline != 0)
+        return;
+    ctx->deadline = now()
+        + (unsigned long long) args->config->auth_timeout * 1000ULL;
+}
+
+
+/*
+ * Stop the clock for auth_timeout.
+ */
+void
+pamk5_deadline_stop(struct pam_args *args)
+{
+    args->config->ctx->deadline = 0;
+}
+
+
+/*
+ * Whether the time allowed by auth_timeout is up.
+ */
+bool
+pamk5_deadline_passed(struct pam_args *args)
+{
+    struct context *ctx = args->config->ctx;
+
+    return ctx != NULL && ctx->deadline != 0 && now() >= ctx->deadline;
+}
+
+
+/*
+ * Record the result of an exchange.
+ */
+static void
+finish(struct pamk5_exchange *ex, krb5_error_code status)
+{
+    ex->done = true;
+    ex->status = status;
+}
+
+
+/*
+ * Do an exchange with the blocking interface of the Kerberos library, unless
+ * the time allowed by auth_timeout is already up.  The library can't be
+ * stopped once it has started.
+ */
+static void
+exchange_blocking(struct pam_args *args, struct pamk5_exchange *ex)
+{
+    krb5_error_code retval;
+
+    if (pamk5_deadline_passed(args)) {
+        finish(ex, KRB5_KDC_UNREACH);
+        return;
+    }
+    retval = krb5_get_init_creds_password(ex->context, &ex->creds,
+                 ex->client, (char *) ex->pass, ex->prompter, ex->data, 0,
+                 (char *) ex->service, ex->opts);
+    finish(ex, retval);
+}
+
+
+#ifdef HAVE_EXCHANGE
+
+
+/*
+ * Close a connection to a KDC.
+ */
+static void
+conn_close(struct conn *conn)
+{
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+    conn->state = CONN_CLOSED;
+    conn->pos = 0;
+    free(conn->reply);
+    conn->reply = NULL;
+    conn->length = 0;
+}
+
+
+/*
+ * Close all the connections of an exchange.
+ */
+static void
+close_all(struct pamk5_exchange *ex)
+{
+    size_t i;
+
+    for (i = 0; i < ex->nservers; i++)
+        conn_close(&ex->conns[i]);
+}
+
+
+/*
+ * Return whether any connection of an exchange is still open.
+ */
+static bool
+any_open(struct pamk5_exchange *ex)
+{
+    size_t i;
+
+    for (i = 0; i < ex->nservers; i++)
+        if (ex->conns[i].fd >= 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Add an address to the servers of an exchange, if there is room.
+ */
+static void
+add_server(struct pamk5_exchange *ex, const struct addrinfo *ai, bool tcp)
+{
+    struct server *server;
+
+    if (ex->nservers >= MAX_SERVERS)
+        return;
+    server = &ex->servers[ex->nservers++];
+    memcpy(&server->addr, ai->ai_addr, ai->ai_addrlen);
+    server->addrlen = ai->ai_addrlen;
+    server->tcp = tcp;
+}
+
+
+/*
+ * Add the addresses of one kdc setting from krb5.conf to the servers of an
+ * exchange.  The setting is a host name or address with an optional port, in
+ * brackets for an IPv6 address, and optionally starts with udp/ or tcp/.
+ * Settings for an HTTPS proxy are skipped.
+ */
+static void
+add_kdc(struct pam_args *args, struct pamk5_exchange *ex, const char *kdc)
+{
+    struct addrinfo hints, *ai, *p;
+    const char *port = "88";
+    char *host, *end;
+    bool udp = true, tcp = true;
+    int status;
+
+    if (strncmp(kdc, "https:", 6) == 0 || strncmp(kdc, "http:", 5) == 0)
+        return;
+    if (strncmp(kdc, "udp/", 4) == 0) {
+        tcp = false;
+        kdc += 4;
+    } else if (strncmp(kdc, "tcp/", 4) == 0) {
+        udp = false;
+        kdc += 4;
+    }
+    if (ex->tcp_only)
+        udp = false;
+    host = strdup(kdc);
+    if (host == NULL)
+        return;
+    if (host[0] == '[') {
+        end = strchr(host, ']');
+        if (end == NULL)
+            goto done;
+        *end = '\0';
+        if (end[1] == ':')
+            port = end + 2;
+        memmove(host, host + 1, strlen(host + 1) + 1);
+    } else {
+        end = strchr(host, ':');
+        if (end != NULL && strchr(end + 1, ':') == NULL) {
+            *end = '\0';
+            port = end + 1;
+        }
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    status = getaddrinfo(host, port, &hints, &ai);
+    if (status != 0) {
+        putil_debug(args, "cannot resolve KDC %s: %s", host,
+                    gai_strerror(status));
+        goto done;
+    }
+    for (p = ai; p != NULL; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+        if (udp)
+            add_server(ex, p, false);
+        if (tcp)
+            add_server(ex, p, true);
+    }
+    freeaddrinfo(ai);
+
+done:
+    free(host);
+}
+
+
+/*
+ * Sort the servers of an exchange so that all the UDP addresses come before
+ * all the TCP addresses, keeping the order of krb5.conf otherwise.
+ */
+static void
+sort_servers(struct pamk5_exchange *ex)
+{
+    struct server sorted[MAX_SERVERS];
+    size_t i, n = 0;
+
+    for (i = 0; i < ex->nservers; i++)
+        if (!ex->servers[i].tcp)
+            sorted[n++] = ex->servers[i];
+    for (i = 0; i < ex->nservers; i++)
+        if (ex->servers[i].tcp)
+            sorted[n++] = ex->servers[i];
+    memcpy(ex->servers, sorted, n * sizeof(struct server));
+}
+
+
+/*
+ * Find the KDCs for the realm of the current request, or only its primary
+ * KDCs when retrying with them.  Keeps the previous list if the realm hasn't
+ * changed.  Returns false if krb5.conf doesn't list any usable KDC for the
+ * realm.
+ */
+static bool
+locate(struct pam_args *args, struct pamk5_exchange *ex)
+{
+    static const char *const all_keys[] = { "kdc", NULL };
+    static const char *const primary_keys[] = {
+        "primary_kdc", "master_kdc", NULL
+    };
+    const char *const *keys;
+    const char *names[4];
+    profile_t profile;
+    char **values = NULL;
+    char *realm;
+    size_t i, j;
+
+    realm = malloc(ex->realm.length + 1);
+    if (realm == NULL)
+        return false;
+    memcpy(realm, ex->realm.data, ex->realm.length);
+    realm[ex->realm.length] = '\0';
+    if (ex->located != NULL && strcmp(ex->located, realm) == 0
+        && ex->nservers > 0) {
+        free(realm);
+        return true;
+    }
+    free(ex->located);
+    ex->located = realm;
+    ex->nservers = 0;
+    if (krb5_get_profile(ex->context, &profile) != 0)
+        return false;
+    names[0] = "realms";
+    names[1] = realm;
+    names[3] = NULL;
+    keys = ex->primary ? primary_keys : all_keys;
+    for (i = 0; keys[i] != NULL && ex->nservers == 0; i++) {
+        names[2] = keys[i];
+        if (profile_get_values(profile, names, &values) != 0)
+            continue;
+        for (j = 0; values[j] != NULL; j++)
+            add_kdc(args, ex, values[j]);
+        profile_free_list(values);
+    }
+    profile_release(profile);
+    sort_servers(ex);
+    for (i = 0; i < ex->nservers; i++)
+        ex->conns[i].fd = -1;
+    return ex->nservers > 0;
+}
+
+
+/*
+ * Send the current request to one KDC, opening the connection first if
+ * needed.  A request over TCP is written once the connection is up.  On
+ * failure, the connection is left closed.
+ */
+static void
+send_request(struct pam_args *args, struct pamk5_exchange *ex, size_t i)
+{
+    struct server *server = &ex->servers[i];
+    struct conn *conn = &ex->conns[i];
+    int fd, flags;
+
+    if (conn->fd < 0) {
+        fd = socket(server->addr.ss_family,
+                    server->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+        if (fd < 0) {
+            putil_debug(args, "cannot create socket: %s", strerror(errno));
+            return;
+        }
+        flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            close(fd);
+            return;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (connect(fd, (struct sockaddr *) &server->addr, server->addrlen) < 0
+            && errno != EINPROGRESS) {
+            putil_debug(args, "cannot connect to KDC: %s", strerror(errno));
+            close(fd);
+            return;
+        }
+        conn->fd = fd;
+        conn->state = server->tcp ? CONN_CONNECTING : CONN_READING;
+    }
+    if (server->tcp)
+        return;
+    if (send(conn->fd, ex->request.data, ex->request.length, MSG_NOSIGNAL)
+        < 0) {
+        putil_debug(args, "cannot send to KDC: %s", strerror(errno));
+        conn_close(conn);
+    }
+}
+
+
+/*
+ * Start the exchange in the Kerberos library.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+exchange_init(struct pamk5_exchange *ex)
+{
+    krb5_error_code retval;
+
+    retval = krb5_init_creds_init(ex->context, ex->client, ex->prompter,
+                                  ex->data, 0, ex->opts, &ex->icc);
+    if (retval == 0 && ex->pass != NULL)
+        retval = krb5_init_creds_set_password(ex->context, ex->icc, ex->pass);
+    if (retval == 0 && ex->service != NULL)
+        retval = krb5_init_creds_set_service(ex->context, ex->icc,
+                                             ex->service);
+    return retval;
+}
+
+
+static void exchange_step(struct pam_args *, struct pamk5_exchange *,
+                          krb5_data *);
+
+/*
+ * Start an exchange with a password over with the primary KDCs of the realm
+ * after a KDC rejected it, as krb5_get_init_creds_password does, since the
+ * KDC that answered may be a replica that hasn't seen a recent password
+ * change.  The error is kept and returned in the end if the primary KDCs
+ * can't be reached or aren't listed in krb5.conf.  Unlike the library, this
+ * doesn't check whether the KDC that answered was already a primary, which
+ * only costs another request.  Returns false if the exchange shouldn't be
+ * retried.
+ */
+static bool
+retry_primary(struct pam_args *args, struct pamk5_exchange *ex,
+              krb5_error_code error)
+{
+    if (ex->primary || ex->pass == NULL || error == KRB5_KDC_UNREACH
+        || error == KRB5_REALM_CANT_RESOLVE || error == KRB5_LIBOS_PWDINTR
+        || error == KRB5_LIBOS_CANTREADPWD)
+        return false;
+    krb5_init_creds_free(ex->context, ex->icc);
+    ex->icc = NULL;
+    if (exchange_init(ex) != 0)
+        return false;
+    putil_debug_krb5(args, error, "retrying with the primary KDC");
+    ex->primary = true;
+    ex->replica = error;
+    ex->tcp_only = false;
+    ex->nservers = 0;
+    exchange_step(args, ex, NULL);
+    return true;
+}
+
+
+/*
+ * Take the next step of an exchange given the reply to the last request, or
+ * NULL to take the first step.  Either finishes the exchange or sets up the
+ * next request to send right away.  If there's no KDC to send it to, the
+ * exchange is handed to the Kerberos library instead, unless it was already
+ * retrying with the primary KDCs.
+ */
+static void
+exchange_step(struct pam_args *args, struct pamk5_exchange *ex,
+              krb5_data *reply)
+{
+    krb5_data empty;
+    unsigned int flags = 0;
+    krb5_error_code retval;
+
+    close_all(ex);
+    krb5_free_data_contents(ex->context, &ex->request);
+    krb5_free_data_contents(ex->context, &ex->realm);
+    memset(&empty, 0, sizeof(empty));
+    retval = krb5_init_creds_step(ex->context, ex->icc,
+                                  reply != NULL ? reply : &empty,
+                                  &ex->request, &ex->realm, &flags);
+    if (retval == KRB5KRB_ERR_RESPONSE_TOO_BIG && !ex->tcp_only) {
+        putil_debug(args, "KDC reply too big for UDP, retrying with TCP");
+        ex->tcp_only = true;
+        ex->nservers = 0;
+        flags = KRB5_INIT_CREDS_STEP_FLAG_CONTINUE;
+        retval = 0;
+    }
+    if (retval != 0) {
+        if (reply == NULL || !retry_primary(args, ex, retval))
+            finish(ex, retval);
+        return;
+    }
+    if (!(flags & KRB5_INIT_CREDS_STEP_FLAG_CONTINUE)) {
+        retval = krb5_init_creds_get_creds(ex->context, ex->icc, &ex->creds);
+        finish(ex, retval);
+        return;
+    }
+
+    /* Find the KDCs, or give up and let the Kerberos library do it. */
+    if (!locate(args, ex)) {
+        if (ex->primary) {
+            putil_debug(args, "no primary KDC for %.*s in krb5.conf",
+                        (int) ex->realm.length, ex->realm.data);
+            finish(ex, ex->replica);
+            return;
+        }
+        putil_debug(args, "no KDC for %.*s in krb5.conf, waiting for the"
+                    " Kerberos library", (int) ex->realm.length,
+                    ex->realm.data);
+        krb5_init_creds_free(ex->context, ex->icc);
+        ex->icc = NULL;
+        ex->stepping = false;
+        return;
+    }
+
+    /* Set up the request for TCP and send it right away. */
+    free(ex->framed);
+    ex->framed = malloc(ex->request.length + 4);
+    if (ex->framed == NULL) {
+        finish(ex, errno);
+        return;
+    }
+    ex->framed[0] = (ex->request.length >> 24) & 0xff;
+    ex->framed[1] = (ex->request.length >> 16) & 0xff;
+    ex->framed[2] = (ex->request.length >> 8) & 0xff;
+    ex->framed[3] = ex->request.length & 0xff;
+    memcpy(ex->framed + 4, ex->request.data, ex->request.length);
+    ex->round = 0;
+    ex->next = 0;
+    ex->due = 0;
+    pamk5_timing_exchange(args);
+}
+
+
+/*
+ * Hand a reply to the Kerberos library.  The reply is freed.
+ */
+static void
+exchange_reply(struct pam_args *args, struct pamk5_exchange *ex,
+               unsigned char *data, size_t length)
+{
+    krb5_data reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.data = (char *) data;
+    reply.length = length;
+    exchange_step(args, ex, &reply);
+    free(data);
+}
+
+
+/*
+ * Handle the poll events for one connection.  Returns false if the
+ * connection failed and was closed.
+ */
+static bool
+conn_io(struct pam_args *args, struct pamk5_exchange *ex, size_t i,
+        short revents)
+{
+    struct conn *conn = &ex->conns[i];
+    unsigned char *reply;
+    size_t length;
+    ssize_t status;
+    socklen_t size;
+    int error;
+
+    if (revents & POLLNVAL)
+        goto fail;
+
+    /* A UDP reply comes in a single datagram. */
+    if (!ex->servers[i].tcp) {
+        if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+            return true;
+        reply = malloc(MAX_UDP_REPLY);
+        if (reply == NULL)
+            return true;
+        status = recv(conn->fd, reply, MAX_UDP_REPLY, 0);
+        if (status <= 0) {
+            free(reply);
+            if (status < 0 && (errno == EAGAIN || errno == EINTR))
+                return true;
+            goto fail;
+        }
+        exchange_reply(args, ex, reply, (size_t) status);
+        return true;
+    }
+
+    /* A TCP exchange goes through connecting, writing, and reading. */
+    switch (conn->state) {
+    case CONN_CONNECTING:
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+            return true;
+        size = sizeof(error);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &size) < 0
+            || error != 0)
+            goto fail;
+        conn->state = CONN_WRITING;
+        conn->pos = 0;
+        /* fall through */
+    case CONN_WRITING:
+        status = send(conn->fd, ex->framed + conn->pos,
+                      ex->request.length + 4 - conn->pos, MSG_NOSIGNAL);
+        if (status < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return true;
+            goto fail;
+        }
+        conn->pos += (size_t) status;
+        if (conn->pos == ex->request.length + 4) {
+            conn->state = CONN_READING;
+            conn->pos = 0;
+        }
+        return true;
+    case CONN_READING:
+        if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+            return true;
+        if (conn->pos < 4)
+            status = recv(conn->fd, conn->header + conn->pos, 4 - conn->pos,
+                          0);
+        else
+            status = recv(conn->fd, conn->reply + conn->pos - 4,
+                          conn->length - (conn->pos - 4), 0);
+        if (status < 0 && (errno == EAGAIN || errno == EINTR))
+            return true;
+        if (status <= 0)
+            goto fail;
+        conn->pos += (size_t) status;
+        if (conn->pos == 4) {
+            conn->length = ((size_t) conn->header[0] << 24)
+                           | ((size_t) conn->header[1] << 16)
+                           | ((size_t) conn->header[2] << 8)
+                           | (size_t) conn->header[3];
+            if (conn->length == 0 || conn->length > MAX_TCP_REPLY)
+                goto fail;
+            conn->reply = malloc(conn->length);
+            if (conn->reply == NULL)
+                goto fail;
+        }
+        if (conn->pos > 4 && conn->pos - 4 == conn->length) {
+            reply = conn->reply;
+            length = conn->length;
+            conn->reply = NULL;
+            exchange_reply(args, ex, reply, length);
+        }
+        return true;
+    case CONN_CLOSED:
+        return true;
+    }
+    return true;
+
+fail:
+    conn_close(conn);
+    return false;
+}
+
+
+/*
+ * Move on to the next KDC in the schedule.  Returns false if every KDC has
+ * been tried on every pass.  TCP connections stay open after the first pass,
+ * so only UDP requests are sent again.
+ */
+static bool
+schedule_next(struct pamk5_exchange *ex)
+{
+    for (;;) {
+        if (ex->next >= ex->nservers) {
+            ex->round++;
+            ex->next = 0;
+        }
+        if (ex->round >= KDC_PASSES)
+            return false;
+        if (ex->round == 0 || !ex->servers[ex->next].tcp)
+            return true;
+        ex->next++;
+    }
+}
+
+
+/*
+ * Do whatever an exchange is waiting to do at the given time: take its first
+ * step, send its request to the next KDC, or give up on the KDCs.
+ * Exchanges that the module can't drive are done here with the blocking
+ * interface.
+ */
+static void
+exchange_timers(struct pam_args *args, struct pamk5_exchange *ex,
+                unsigned long long when)
+{
+    if (!ex->started) {
+        ex->started = true;
+        if (ex->stepping)
+            exchange_step(args, ex, NULL);
+    }
+    while (!ex->done && ex->stepping && when >= ex->due) {
+        if (ex->nservers == 0 || !schedule_next(ex)) {
+            close_all(ex);
+            finish(ex, ex->primary ? ex->replica : KRB5_KDC_UNREACH);
+            return;
+        }
+        send_request(args, ex, ex->next);
+        ex->due = when + ((unsigned long long) KDC_WAIT << ex->round);
+        ex->next++;
+        if (!any_open(ex))
+            ex->due = when;
+    }
+    if (!ex->done && !ex->stepping)
+        exchange_blocking(args, ex);
+}
+
+
+/*
+ * Return the milliseconds left at the given time before the deadline for
+ * auth_timeout, which is 0 once it has passed, or the most possible if there
+ * is no deadline.
+ */
+static unsigned long long
+deadline_left(struct pam_args *args, unsigned long long when)
+{
+    unsigned long long deadline = args->config->ctx->deadline;
+
+    if (deadline == 0)
+        return (unsigned long long) -1;
+    return (when >= deadline) ? 0 : deadline - when;
+}
+
+
+/*
+ * Give up on an exchange because the time allowed by auth_timeout is up.
+ */
+static void
+exchange_expire(struct pamk5_exchange *ex)
+{
+    close_all(ex);
+    finish(ex, KRB5_KDC_UNREACH);
+}
+
+
+/*
+ * Fill in fds with what to wait for on each open connection of an exchange,
+ * and conns with the index of each connection.  Returns the number filled
+ * in, at most MAX_SERVERS.
+ */
+static size_t
+exchange_pollfds(const struct pamk5_exchange *ex, struct pollfd *fds,
+                 size_t *conns)
+{
+    size_t i, n = 0;
+    short events;
+
+    for (i = 0; i < ex->nservers; i++) {
+        switch (ex->conns[i].state) {
+        case CONN_CONNECTING:
+        case CONN_WRITING:
+            events = POLLOUT;
+            break;
+        case CONN_READING:
+            events = POLLIN;
+            break;
+        case CONN_CLOSED:
+        default:
+            continue;
+        }
+        fds[n].fd = ex->conns[i].fd;
+        fds[n].events = events;
+        fds[n].revents = 0;
+        conns[n] = i;
+        n++;
+    }
+    return n;
+}
+
+
+/*
+ * Handle the result of poll for one connection of an exchange.  A reply
+ * closes all the connections of its exchange, so ignore the events of the
+ * others once one arrives, and move on to the next KDC at once if the last
+ * connection failed.
+ */
+static void
+exchange_event(struct pam_args *args, struct pamk5_exchange *ex, size_t conn,
+               const struct pollfd *fd)
+{
+    if (fd->revents == 0 || ex->done || !ex->stepping)
+        return;
+    if (ex->conns[conn].fd != fd->fd)
+        return;
+    if (!conn_io(args, ex, conn, fd->revents) && !any_open(ex))
+        ex->due = 0;
+}
+
+#endif /* HAVE_EXCHANGE */
+
+
+/*
+ * Decide whether a set of exchanges has a result yet, setting winner if so.
+ * If ordered is false, the first exchange to succeed wins, and if all fail,
+ * the last one's error is used.  If ordered is true, a success only wins
+ * once all the exchanges before it have failed, and if all fail, the error
+ * of the first one whose principal the KDC knew is used.
+ */
+static bool
+decided(struct pamk5_exchange **exchanges, size_t count, bool ordered,
+        size_t *winner)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!exchanges[i]->done) {
+            if (ordered)
+                return false;
+            continue;
+        }
+        if (exchanges[i]->status == 0) {
+            *winner = i;
+            return true;
+        }
+    }
+    for (i = 0; i < count; i++)
+        if (!exchanges[i]->done)
+            return false;
+    if (!ordered) {
+        *winner = count - 1;
+        return true;
+    }
+    *winner = 0;
+    for (i = 0; i < count; i++)
+        if (exchanges[i]->status != KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN) {
+            *winner = i;
+            break;
+        }
+    return true;
+}
+
+
+/*
+ * Whether the module drives exchanges itself, which is also how auth_timeout
+ * cuts exchanges short.
+ */
+bool
+pamk5_exchange_enabled(struct pam_args *args UNUSED)
+{
+#ifdef HAVE_EXCHANGE
+    return args->config->nonblocking_kdc || args->config->nonblocking_auth
+           || args->config->auth_timeout > 0;
+#else
+    return false;
+#endif
+}
+
+
+/*
+ * Create an exchange, taking the same arguments as
+ * krb5_get_init_creds_password.  Nothing is sent until the exchange is run.
+ * The principal, password, service, and options must last as long as the
+ * exchange.  Returns a Kerberos error code.
+ */
+krb5_error_code
+pamk5_exchange_new(struct pam_args *args, krb5_principal client,
+                   const char *pass, krb5_prompter_fct prompter, void *data,
+                   const char *service, krb5_get_init_creds_opt *opts,
+                   struct pamk5_exchange **result)
+{
+    struct pamk5_exchange *ex;
+#ifdef HAVE_EXCHANGE
+    krb5_error_code retval;
+#endif
+
+    *result = NULL;
+    ex = calloc(1, sizeof(struct pamk5_exchange));
+    if (ex == NULL)
+        return errno;
+    ex->context = args->config->ctx->context;
+    ex->client = client;
+    ex->pass = pass;
+    ex->prompter = prompter;
+    ex->data = data;
+    ex->service = service;
+    ex->opts = opts;
+#ifdef HAVE_EXCHANGE
+    if (pamk5_exchange_enabled(args)) {
+        retval = exchange_init(ex);
+        if (retval != 0) {
+            pamk5_exchange_free(ex);
+            return retval;
+        }
+        ex->stepping = true;
+    }
+#else
+    if (args->config->nonblocking_kdc || args->config->nonblocking_auth
+        || args->config->auth_timeout > 0)
+        putil_debug(args, "nonblocking_kdc not supported by this Kerberos"
+                    " library");
+#endif
+    *result = ex;
+    return 0;
+}
+
+
+/*
+ * Run a set of exchanges until there is a result, deciding the winner as
+ * described for decided, and abandon the exchanges still running.  At most
+ * limit exchanges are running at once, and the rest are started in order as
+ * those finish.  Returns the status of the winner.
+ */
+krb5_error_code
+pamk5_exchange_run(struct pam_args *args,
+                   struct pamk5_exchange **exchanges, size_t count,
+                   size_t limit UNUSED, bool ordered, size_t *winner)
+{
+    size_t i;
+#ifdef HAVE_EXCHANGE
+    struct pamk5_exchange *ex;
+    struct pollfd *fds = NULL;
+    size_t *owners = NULL;
+    size_t *conns = NULL;
+    unsigned long long when, wait;
+    size_t j, n, nfds, running, abandoned = 0;
+    int status, timeout;
+#endif
+
+    if (count == 0)
+        return KRB5KRB_AP_ERR_BAD_INTEGRITY;
+
+#ifndef HAVE_EXCHANGE
+    while (!decided(exchanges, count, ordered, winner))
+        for (i = 0; i < count; i++)
+            if (!exchanges[i]->done) {
+                exchange_blocking(args, exchanges[i]);
+                break;
+            }
+#else
+    fds = calloc(count * MAX_SERVERS, sizeof(struct pollfd));
+    owners = calloc(count * MAX_SERVERS, sizeof(size_t));
+    conns = calloc(count * MAX_SERVERS, sizeof(size_t));
+    if (fds == NULL || owners == NULL || conns == NULL) {
+        status = errno;
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        for (i = 0; i < count; i++)
+            if (!exchanges[i]->done)
+                finish(exchanges[i], status);
+    }
+    while (!decided(exchanges, count, ordered, winner)) {
+        when = now();
+        if (deadline_left(args, when) == 0) {
+            for (i = 0; i < count; i++)
+                if (!exchanges[i]->done)
+                    exchange_expire(exchanges[i]);
+            continue;
+        }
+        running = 0;
+        for (i = 0; i < count; i++)
+            if (exchanges[i]->started && !exchanges[i]->done)
+                running++;
+        for (i = 0; i < count; i++) {
+            ex = exchanges[i];
+            if (ex->done)
+                continue;
+            if (!ex->started) {
+                if (running >= limit)
+                    continue;
+                running++;
+            }
+            exchange_timers(args, ex, when);
+        }
+        if (decided(exchanges, count, ordered, winner))
+            break;
+
+        /*
+         * Wait for a reply or until the next KDC is due.  The timers above
+         * leave every exchange still running due some time after now.
+         */
+        nfds = 0;
+        wait = (unsigned long long) -1;
+        for (i = 0; i < count; i++) {
+            ex = exchanges[i];
+            if (ex->done || !ex->stepping || !ex->started)
+                continue;
+            if (ex->due - when < wait)
+                wait = ex->due - when;
+            n = exchange_pollfds(ex, fds + nfds, conns + nfds);
+            for (j = nfds; j < nfds + n; j++)
+                owners[j] = i;
+            nfds += n;
+        }
+        if (deadline_left(args, when) < wait)
+            wait = deadline_left(args, when);
+        timeout = (wait > INT_MAX) ? INT_MAX : (int) wait;
+        status = poll(fds, nfds, timeout);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            status = errno;
+            putil_err(args, "cannot wait for KDC: %s", strerror(errno));
+            for (i = 0; i < count; i++)
+                if (!exchanges[i]->done) {
+                    close_all(exchanges[i]);
+                    finish(exchanges[i], status);
+                }
+            continue;
+        }
+
+        /* Handle the events. */
+        for (j = 0; j < nfds; j++)
+            exchange_event(args, exchanges[owners[j]], conns[j], &fds[j]);
+    }
+
+    /* Abandon the exchanges whose results aren't needed. */
+    for (i = 0; i < count; i++)
+        if (!exchanges[i]->done && exchanges[i]->started) {
+            close_all(exchanges[i]);
+            abandoned++;
+        }
+    if (abandoned > 0)
+        putil_debug(args, "abandoned %lu initial credentials exchanges",
+                    (unsigned long) abandoned);
+    free(fds);
+    free(owners);
+    free(conns);
+#endif /* HAVE_EXCHANGE */
+
+    return exchanges[*winner]->status;
+}
+
+
+/*
+ * Take an exchange as far as it can go without waiting, for nonblocking_auth.
+ * Returns 0 once the exchange has finished, whatever its result, or EAGAIN if
+ * it is waiting on a KDC.  In that case, fd is set to the connection that a
+ * reply is most likely to come on, or -1 if there is none, and timeout to
+ * the milliseconds after which the exchange has to be taken further even
+ * without a reply.  A reply on another connection is noticed on the next
+ * call.  Without library support, the exchange is done here with
+ * krb5_get_init_creds_password.
+ */
+krb5_error_code
+pamk5_exchange_poll(struct pam_args *args, struct pamk5_exchange *ex,
+                    int *fd, int *timeout)
+{
+#ifdef HAVE_EXCHANGE
+    struct pollfd fds[MAX_SERVERS];
+    size_t conns[MAX_SERVERS];
+    unsigned long long when, wait;
+    size_t i, nfds;
+    bool writing = false;
+    int status;
+#endif
+
+    *fd = -1;
+    *timeout = 0;
+#ifndef HAVE_EXCHANGE
+    if (!ex->done)
+        exchange_blocking(args, ex);
+    return 0;
+#else
+    for (;;) {
+        when = now();
+        if (!ex->done && deadline_left(args, when) == 0)
+            exchange_expire(ex);
+        if (!ex->done)
+            exchange_timers(args, ex, when);
+        if (ex->done)
+            return 0;
+        nfds = exchange_pollfds(ex, fds, conns);
+        status = poll(fds, nfds, 0);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0) {
+            status = errno;
+            putil_err(args, "cannot check for KDC reply: %s",
+                      strerror(errno));
+            close_all(ex);
+            finish(ex, status);
+            return 0;
+        }
+        if (status == 0)
+            break;
+        for (i = 0; i < nfds; i++)
+            exchange_event(args, ex, conns[i], &fds[i]);
+    }
+
+    /*
+     * Nothing more can be done now.  The request was last sent to the KDC
+     * before next, so its reply is the one most likely to come first.
+     */
+    for (i = 0; i < ex->nservers; i++)
+        if (ex->conns[i].state == CONN_CONNECTING
+            || ex->conns[i].state == CONN_WRITING)
+            writing = true;
+    if (ex->next > 0 && ex->conns[ex->next - 1].state == CONN_READING)
+        *fd = ex->conns[ex->next - 1].fd;
+    else
+        for (i = 0; i < ex->nservers; i++)
+            if (ex->conns[i].state == CONN_READING)
+                *fd = ex->conns[i].fd;
+    wait = ex->due - when;
+    if (writing && wait > POLL_WRITE_WAIT)
+        wait = POLL_WRITE_WAIT;
+    if (deadline_left(args, when) < wait)
+        wait = deadline_left(args, when);
+    *timeout = (wait > INT_MAX) ? INT_MAX : (int) wait;
+    return EAGAIN;
+#endif /* HAVE_EXCHANGE */
+}
+
+
+/*
+ * Return the status of an exchange, setting finished to whether it ran to
+ * completion rather than being abandoned.
+ */
+krb5_error_code
+pamk5_exchange_status(const struct pamk5_exchange *ex, bool *finished)
+{
+    *finished = ex->done;
+    return ex->done ? ex->status : 0;
+}
+
+
+/*
+ * Move the credentials from a successful exchange into creds.
+ */
+void
+pamk5_exchange_creds(struct pamk5_exchange *ex, krb5_creds *creds)
+{
+    *creds = ex->creds;
+    memset(&ex->creds, 0, sizeof(ex->creds));
+}
+
+
+/*
+ * Free an exchange, abandoning it if it is still running.
+ */
+void
+pamk5_exchange_free(struct pamk5_exchange *ex)
+{
+    if (ex == NULL)
+        return;
+#ifdef HAVE_EXCHANGE
+    close_all(ex);
+    free(ex->framed);
+    free(ex->located);
+    krb5_free_data_contents(ex->context, &ex->request);
+    krb5_free_data_contents(ex->context, &ex->realm);
+    if (ex->icc != NULL)
+        krb5_init_creds_free(ex->context, ex->icc);
+#endif
+    krb5_free_cred_contents(ex->context, &ex->creds);
+    free(ex);
+}
+
+
+/*
+ * Replacement for krb5_get_init_creds_password with the given Kerberos
+ * context, which fails at once if the time allowed by auth_timeout is up.
+ * With the context of the module, uses an exchange driven by the module
+ * whenever pamk5_exchange_enabled returns true, which it does if any of
+ * nonblocking_kdc, nonblocking_auth, or auth_timeout is set.  With any other
+ * context, the exchange is left to the library and args is only read, so
+ * threads each with their own context may call this at once.  Returns a
+ * Kerberos error code.
+ */
+krb5_error_code
+pamk5_init_creds_context(struct pam_args *args, krb5_context context,
+                         krb5_creds *creds, krb5_principal client,
+                         const char *pass, krb5_prompter_fct prompter,
+                         void *data, const char *service,
+                         krb5_get_init_creds_opt *opts)
+{
+    struct pamk5_exchange *ex;
+    krb5_error_code retval;
+    size_t winner;
+
+    if (pamk5_deadline_passed(args))
+        return KRB5_KDC_UNREACH;
+    if (context != args->config->ctx->context || !pamk5_exchange_enabled(args))
+        return krb5_get_init_creds_password(context, creds, client,
+                   (char *) pass, prompter, data, 0, (char *) service, opts);
+    retval = pamk5_exchange_new(args, client, pass, prompter, data, service,
+                                opts, &ex);
+    if (retval != 0)
+        return retval;
+    retval = pamk5_exchange_run(args, &ex, 1, 1, false, &winner);
+    if (retval == 0)
+        pamk5_exchange_creds(ex, creds);
+    pamk5_exchange_free(ex);
+    return retval;
+}
+
+
+/*
+ * The same as pamk5_init_creds_context with the Kerberos context of the
+ * module.  Returns a Kerberos error code.
+ */
+krb5_error_code
+pamk5_init_creds(struct pam_args *args, krb5_creds *creds,
+                 krb5_principal client, const char *pass,
+                 krb5_prompter_fct prompter, void *data, const char *service,
+                 krb5_get_init_creds_opt *opts)
+{
+    return pamk5_init_creds_context(args, args->config->ctx->context, creds,
+                                    client, pass, prompter, data, service,
+                                    opts);
+}
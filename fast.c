@@ -21,8 +21,10 @@
 #include <errno.h>
 
 #include <internal.h>
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
+#include <usdt.h>
 
 
 /*
@@ -77,7 +79,8 @@ cache_init_anonymous(struct pam_args *args, krb5_ccache *ccache)
      * memory cache whose name is based on the pointer value of our Kerberos
      * context, since that should be unique among threads.
      */
-    if (asprintf(&name, "MEMORY:%p", c) < 0) {
+    name = putil_arena_sprintf(args, "MEMORY:%p", (void *) c);
+    if (name == NULL) {
         putil_crit(args, "malloc failure: %s", strerror(errno));
         retval = errno;
         goto done;
@@ -100,8 +103,10 @@ cache_init_anonymous(struct pam_args *args, krb5_ccache *ccache)
 # ifdef HAVE_KRB5_GET_INIT_CREDS_OPT_SET_OUT_CCACHE
     krb5_get_init_creds_opt_set_out_ccache(c, opts, *ccache);
 # endif
-    retval = krb5_get_init_creds_password(c, &creds, princ, NULL, NULL, NULL,
-                                          0, NULL, opts);
+    PROBE_AS_START(args, princ, NULL);
+    retval = pamk5_init_creds(args, &creds, princ, NULL, NULL, NULL, NULL,
+                              opts);
+    PROBE_AS_DONE(args, princ, NULL, retval);
     if (retval != 0) {
         putil_debug_krb5(args, retval, "cannot obtain anonymous credentials"
                          " for FAST");
@@ -135,7 +140,6 @@ cache_init_anonymous(struct pam_args *args, krb5_ccache *ccache)
     }
     if (princ != NULL)
         krb5_free_principal(c, princ);
-    free(name);
     if (opts != NULL)
         krb5_get_init_creds_opt_free(c, opts);
     if (creds_valid)
@@ -149,7 +153,7 @@ cache_init_anonymous(struct pam_args *args, krb5_ccache *ccache)
  * Attempt to use an existing ticket cache for FAST.  Checks whether
  * fast_ccache is set in the options and, if so, opens that cache and does
  * some sanity checks, returning the cache name to use if everything checks
- * out in newly allocated memory.  Caller is responsible for freeing.  If not,
+ * out in memory allocated from the arena for the PAM arguments.  If not,
  * returns NULL.
  */
 UNUSED static char *
@@ -178,7 +182,7 @@ fast_setup_cache(struct pam_args *args)
     } else {
         krb5_free_principal(c, princ);
         krb5_cc_close(c, ccache);
-        result = strdup(cache);
+        result = putil_arena_strdup(args, cache);
         if (result == NULL)
             putil_crit(args, "strdup failure: %s", strerror(errno));
         return result;
@@ -190,8 +194,8 @@ fast_setup_cache(struct pam_args *args)
  * Attempt to use an anonymous ticket cache for FAST.  Checks whether
  * anon_fast is set in the options and, if so, opens that cache and does some
  * sanity checks, returning the cache name to use if everything checks out in
- * newly allocated memory.  Caller is responsible for freeing.  If not,
- * returns NULL.
+ * memory allocated from the arena for the PAM arguments.  If not, returns
+ * NULL.
  *
  * If successful, store the anonymous FAST cache in the context where it will
  * be freed following authentication.
@@ -206,7 +210,9 @@ fast_setup_anon(struct pam_args *args)
 
     if (!args->config->anon_fast)
         return NULL;
+    pamk5_timing_start(args, PHASE_FAST);
     retval = cache_init_anonymous(args, &ccache);
+    pamk5_timing_stop(args, PHASE_FAST);
     if (retval != 0) {
         putil_debug_krb5(args, retval, "skipping anonymous FAST");
         return NULL;
@@ -218,7 +224,7 @@ fast_setup_anon(struct pam_args *args)
         krb5_cc_destroy(c, ccache);
         return NULL;
     }
-    result = strdup(cache);
+    result = putil_arena_strdup(args, cache);
     if (result == NULL) {
         putil_crit(args, "strdup failure: %s", strerror(errno));
         krb5_cc_destroy(c, ccache);
@@ -274,9 +280,10 @@ pamk5_fast_setup(struct pam_args *args, krb5_get_init_creds_opt *opts)
     retval = krb5_get_init_creds_opt_set_fast_ccache_name(c, opts, cache);
     if (retval != 0)
         putil_err_krb5(args, retval, "failed to set FAST ccache");
-    else
+    else {
         putil_debug(args, "setting FAST credential cache to %s", cache);
-    free(cache);
+        pamk5_metrics_event(args, METRICS_FAST);
+    }
 }
 
 #endif /* HAVE_KRB5_GET_INIT_CREDS_OPT_SET_FAST_CCACHE_NAME */
@@ -19,11 +19,21 @@
 #include <portable/pam.h>
 
 #include <stdarg.h>
+#include <sys/types.h>
 #include <syslog.h>
+#include <time.h>
+
+#include <metrics.h>
 
 /* Forward declarations to avoid unnecessary includes. */
+struct breaker_realm;
+struct option;
 struct pam_args;
+struct pamk5_exchange;
+struct pamk5_resume;
 struct passwd;
+struct pamk5_timing;
+struct stat;
 struct vector;
 
 /* Used for unused parameters to silence gcc warnings. */
@@ -45,6 +55,45 @@ struct context {
     int initialized;            /* If set, ticket cache initialized. */
     krb5_creds *creds;          /* Credentials for password changing. */
     krb5_ccache fast_cache;     /* Temporary credential cache for FAST. */
+    char *tid;                  /* Transaction ID for structured logs. */
+    struct pamk5_resume *resume; /* Exchange left for the next call. */
+    unsigned long long deadline; /* End of auth_timeout in ms, or 0. */
+    struct breaker_realm *breaker; /* KDC breaker record being used. */
+    bool breaker_probe;         /* Whether this is the breaker's probe. */
+    unsigned long refs;         /* References from PAM data and calls. */
+};
+
+/*
+ * The phases of a call timed by the timing option.  Time spent in a phase
+ * started while another is running, such as prompting inside the initial
+ * credentials exchange, is counted only for the inner phase.
+ */
+enum pamk5_phase {
+    PHASE_NAME,                 /* Parsing the principal name. */
+    PHASE_PKINIT,               /* PKINIT authentication. */
+    PHASE_FAST,                 /* Anonymous FAST armor. */
+    PHASE_AS,                   /* Initial credentials exchange. */
+    PHASE_VERIFY,               /* Credential verification. */
+    PHASE_CACHE,                /* Writing the temporary ticket cache. */
+    PHASE_COPY,                 /* Copying to the user's ticket cache. */
+    PHASE_CHPW,                 /* Password change. */
+    PHASE_PROMPT,               /* Waiting on the conversation function. */
+    PHASE_MAX
+};
+
+/*
+ * The identity of one Kerberos configuration file at the time a saved
+ * configuration was built from it, used to tell whether that configuration
+ * is still current.
+ */
+struct config_stamp {
+    char *path;                 /* Path to the configuration file. */
+    bool exists;                /* Whether the file existed. */
+    dev_t dev;                  /* Device and inode of the file. */
+    ino_t ino;
+    off_t size;                 /* Size of the file. */
+    time_t mtime;               /* Modification and change times. */
+    time_t ctime;
 };
 
 /*
@@ -62,25 +111,43 @@ struct pam_config {
     long minimum_uid;            /* Ignore users below this UID. */
     bool only_alt_auth;          /* Alt principal must be used. */
     bool search_k5login;         /* Try password with each line of .k5login. */
+    char *search_k5login_hints; /* Directory of last .k5login principals. */
+    long search_k5login_parallel; /* Try this many .k5login lines at once. */
 
     /* Kerberos behavior. */
     char *fast_ccache;          /* Cache containing armor ticket. */
     bool anon_fast;             /* sets up an anonymous fast armor cache */
+    krb5_deltat auth_timeout;   /* Time allowed for all KDC exchanges. */
     bool forwardable;           /* Obtain forwardable tickets. */
+    char *kdc_breaker;          /* File for shared KDC breaker state. */
+    krb5_deltat kdc_breaker_cooldown; /* Time to fail fast once open. */
+    long kdc_breaker_threshold; /* Failures in a row that open it. */
     char *keytab;               /* Keytab for credential validation. */
+    bool nonblocking_auth;      /* Return PAM_INCOMPLETE, not wait. */
+    bool nonblocking_kdc;       /* Talk to the KDC from the module. */
     char *realm;                /* Default realm for Kerberos. */
+    struct vector *realms;      /* Realms to try at once, in priority order. */
     krb5_deltat renew_lifetime; /* Renewable lifetime of credentials. */
     krb5_deltat ticket_lifetime; /* Lifetime of credentials. */
     char *user_realm;           /* Default realm for user principals. */
 
     /* PAM behavior. */
     bool clear_on_fail;         /* Delete saved password on change failure. */
+    char *compiled_config;      /* Precompiled configuration file. */
+    bool config_cache;          /* Cache parsed configuration in-process. */
     bool debug;                 /* Log debugging information. */
     bool defer_pwchange;        /* Defer expired account fail to account. */
     bool fail_pwchange;         /* Treat expired password as auth failure. */
     bool force_pwchange;        /* Change expired passwords in auth. */
+    char *log_format;           /* Format of log messages: text, kv, json. */
+    char *metrics;              /* File for shared authentication metrics. */
     bool no_update_user;        /* Don't update PAM_USER with local name. */
+    bool nonblocking_log;       /* Never wait for syslog. */
+    bool recorder;              /* Log suppressed debug output on failure. */
+    char *recorder_file;        /* Append recorded output here, not syslog. */
+    long recorder_threshold;    /* Also log it for calls slower than this. */
     bool silent;                /* Suppress text and errors (PAM_SILENT). */
+    bool timing;                /* Log the time spent in each phase. */
     char *trace;                /* File name for trace logging. */
 
     /* PKINIT. */
@@ -110,17 +177,128 @@ struct pam_config {
 
     /* The authentication context, which bundles together Kerberos data. */
     struct context *ctx;
+
+    /* State of the lazy load, not copied or saved with the settings. */
+    bool loaded;                /* Settings from krb5.conf are present. */
+    bool cached;                /* Settings came from the config cache. */
+    bool checked;               /* Kerberos context and sanity checks done. */
+    unsigned long generation;   /* Config cache generation for storing. */
+    struct pamk5_timing *phases; /* Phase times if timing is set. */
+    struct pamk5_recorder *flight; /* Recorder state if recorder is set. */
+    struct metrics_file *metrics_file; /* Mapped metrics file, once found. */
+    enum pamk5_phase running[PHASE_MAX]; /* Phases for structured logs. */
+    size_t running_depth;       /* Number of running phases. */
+};
+
+/*
+ * A kind of file mapped shared by every process using the module, as
+ * described by metrics.h and breaker.h.  Each starts with the magic string,
+ * the version, and the size.
+ */
+struct pamk5_shared_type {
+    const char *what;           /* Name of the file for log messages. */
+    const char *magic;          /* Magic string identifying the format. */
+    uint32_t version;           /* Version of the layout. */
+    size_t size;                /* Size of the whole file. */
+    bool locked;                /* Keep a descriptor open for flock. */
 };
 
 /* Default to a hidden visibility for all internal functions. */
 #pragma GCC visibility push(hidden)
 
-/* Parse the PAM flags, arguments, and krb5.conf and fill out pam_args. */
+/*
+ * Parse the PAM flags and arguments and fill out pam_args.  The settings from
+ * krb5.conf are only present if they came from the configuration cache or a
+ * compiled configuration, and the Kerberos context is not created.
+ * pamk5_load finishes the job and must be called before anything that needs
+ * either.  It returns false on failure, which will have been reported.
+ */
 struct pam_args *pamk5_init(pam_handle_t *, int flags, int, const char **);
+bool pamk5_load(struct pam_args *, int, const char **);
 
 /* Free the pam_args struct when we're done. */
 void pamk5_free(struct pam_args *);
 
+/*
+ * Pieces of pamk5_init that are also used by the configuration compiler.
+ * pamk5_config_realm sets the realm in the pam_args struct from the
+ * arguments, pamk5_config_load creates the Kerberos context if needed and
+ * loads the configuration from krb5.conf and the arguments without any sanity
+ * checks, and pamk5_config_options returns the option table and its length.
+ */
+bool pamk5_config_realm(struct pam_args *, int, const char **);
+bool pamk5_config_load(struct pam_args *, int, const char **);
+const struct option *pamk5_config_options(size_t *);
+
+/*
+ * Copy or free a configuration struct.  Copying makes deep copies of all
+ * settings but does not copy the authentication context.
+ */
+struct pam_config *pamk5_config_copy(struct pam_args *,
+                                     const struct pam_config *);
+void pamk5_config_free(struct pam_config *);
+
+/*
+ * Build the key for a saved configuration from the realm and the PAM
+ * arguments.  The key may contain nul bytes, so its length is returned in the
+ * final argument.
+ */
+char *pamk5_config_key(struct pam_args *, int, const char **, size_t *);
+
+/*
+ * Record the identity of each Kerberos configuration file, compare two such
+ * records, and free them.  pamk5_config_stamps returns false if the files
+ * can't be determined, in which case no saved configuration should be used.
+ */
+bool pamk5_config_stamps(struct pam_args *, struct config_stamp **,
+                         size_t *);
+bool pamk5_config_stamps_equal(const struct config_stamp *, size_t,
+                               const struct config_stamp *, size_t);
+void pamk5_config_stamps_free(struct config_stamp *, size_t);
+
+/*
+ * Compiled configuration files.  pamk5_compiled_fetch returns the
+ * configuration for the realm and arguments from the named file if it is
+ * present, valid, and current, and otherwise NULL.  pamk5_compiled_write
+ * writes a new file containing the given number of configurations, each
+ * paired with the key from pamk5_config_key, and the configuration file
+ * stamps taken before they were loaded.
+ */
+struct pam_config *pamk5_compiled_fetch(struct pam_args *, const char *path,
+                                        int, const char **);
+bool pamk5_compiled_write(struct pam_args *, const char *path,
+                          const struct config_stamp *, size_t nstamps,
+                          char **keys, const size_t *keylens,
+                          struct pam_config **, size_t count);
+
+/*
+ * The process-wide configuration cache.  pamk5_config_cache_fetch returns a
+ * copy of the cached configuration for the realm and arguments, or NULL if
+ * there is no valid cache entry.  Either way, it stores a generation number
+ * that must be passed to pamk5_config_cache_store along with the
+ * configuration built in its absence.  pamk5_config_cache_context sets the
+ * Kerberos context in the pam_args struct to a copy of the cached one, or to
+ * a new context if none is cached.
+ */
+struct pam_config *pamk5_config_cache_fetch(struct pam_args *, int,
+                                            const char **,
+                                            unsigned long *generation);
+bool pamk5_config_cache_context(struct pam_args *, int, const char **);
+void pamk5_config_cache_store(struct pam_args *, int, const char **,
+                              unsigned long generation);
+
+/*
+ * The configuration cache for a PAM handle, used by stacked instances of the
+ * module and later calls in the same transaction.  pamk5_config_handle_fetch
+ * returns a copy of the configuration saved under a key from
+ * pamk5_config_key, or NULL if there is none, and pamk5_config_handle_store
+ * saves a copy of one.
+ */
+struct pam_config *pamk5_config_handle_fetch(struct pam_args *, const char *,
+                                             size_t);
+void pamk5_config_handle_store(struct pam_args *, const char *, size_t,
+                               const struct pam_config *);
+
 /*
  * The underlying functions between several of the major PAM interfaces.
  */
@@ -140,20 +318,29 @@ int pamk5_password(struct pam_args *, bool only_auth);
  */
 int pamk5_setcred(struct pam_args *, bool refresh);
 
+/*
+ * Returns true if pamk5_setcred would do nothing, which can be determined
+ * without the settings from krb5.conf or a Kerberos context.
+ */
+bool pamk5_setcred_noop(struct pam_args *);
+
 /*
  * Authenticate the user.  Prompts for the password as needed and obtains
  * tickets for in_tkt_service, krbtgt/<realm> by default.  Stores the initial
  * credentials in the final argument, allocating a new krb5_creds structure.
  * If possible, the initial credentials are verified by checking them against
- * the local system key.
+ * the local system key.  With nonblocking_auth, may return PAM_INCOMPLETE
+ * instead of waiting for the KDC, leaving state in the context for the next
+ * call to pick up; pamk5_resume_free frees that state.
  */
 int pamk5_password_auth(struct pam_args *, const char *service,
                         krb5_creds **);
+void pamk5_resume_free(krb5_context, struct pamk5_resume *);
 
 /*
  * Prompt the user for a new password, twice so that they can confirm.  Sets
- * PAM_AUTHTOK and puts the new password in newly allocated memory in pass if
- * it's not NULL.
+ * PAM_AUTHTOK and puts the new password in pass if it's not NULL.  The
+ * password is in secret arena memory and is freed with the PAM arguments.
  */
 int pamk5_password_prompt(struct pam_args *, char **pass);
 
@@ -174,7 +361,8 @@ int pamk5_conv(struct pam_args *, const char *, int, char **);
 /*
  * Function specifically for getting a password.  Takes a prefix (if non-NULL,
  * args->banner will also be prepended) and a pointer into which to store the
- * password.  The password must be freed by the caller.
+ * password.  The password is in secret arena memory and is overwritten and
+ * freed with the PAM arguments.
  */
 int pamk5_get_password(struct pam_args *, const char *, char **);
 
@@ -189,6 +377,15 @@ int pamk5_authorized(struct pam_args *);
 /* Returns true if we should ignore this user (root or low UID). */
 int pamk5_should_ignore(struct pam_args *, PAM_CONST char *);
 
+/*
+ * Returns true, storing the user, if the PAM arguments alone say to ignore
+ * the user already set in PAM.  Never prompts and logs nothing.
+ */
+bool pamk5_ignore_early(struct pam_args *, PAM_CONST char **user);
+
+/* Set a variable in the PAM environment.  Returns a PAM status code. */
+int pamk5_setenv(struct pam_args *, const char *key, const char *value);
+
 /*
  * alt_auth_map support.
  *
@@ -205,12 +402,121 @@ krb5_error_code pamk5_alt_auth(struct pam_args *, const char *service,
                                krb5_creds *);
 int pamk5_alt_auth_verify(struct pam_args *);
 
+/*
+ * search_k5login_hints support.  pamk5_k5login_hint returns the principal
+ * that last worked for the user if .k5login, described by the stat struct,
+ * hasn't changed since, and sets name to its unparsed form.  It returns NULL
+ * if there is no usable hint.  pamk5_k5login_hint_save records the principal
+ * that worked.  Both do nothing if search_k5login_hints isn't set.
+ */
+krb5_principal pamk5_k5login_hint(struct pam_args *, const struct stat *,
+                                  const char **name);
+void pamk5_k5login_hint_save(struct pam_args *, const struct stat *,
+                             krb5_const_principal);
+
+/*
+ * Concurrent initial credentials exchanges for search_k5login_parallel and
+ * realms.  Tries the password with each of the candidate principals at once
+ * in up to the given number of threads and returns a Kerberos error code.
+ * If ordered is set, earlier candidates win over later ones that succeed
+ * too; otherwise the first to succeed wins.  On success, the credentials
+ * are stored in krb5_creds.  winner is set to the index of the principal
+ * that worked, or, on failure, of the one whose error was returned, or to
+ * count if no principal decided the result.
+ */
+krb5_error_code pamk5_parallel_auth(struct pam_args *,
+                                    krb5_principal *candidates, size_t count,
+                                    size_t threads, bool ordered,
+                                    krb5_get_init_creds_opt *,
+                                    const char *service, const char *pass,
+                                    krb5_creds *, size_t *winner);
+
+/*
+ * Initial credentials exchanges driven by the module for nonblocking_kdc,
+ * nonblocking_auth, and auth_timeout.
+ * pamk5_init_creds takes the same arguments as krb5_get_init_creds_password,
+ * without the Kerberos context and start time, and uses an exchange driven by
+ * the module if pamk5_exchange_enabled returns true, and otherwise just calls
+ * krb5_get_init_creds_password.  pamk5_init_creds_context does the same
+ * with another Kerberos context, with which the exchange is always left to
+ * the library and args is only read, so that threads can use it.
+ *
+ * To run several exchanges at once in one thread, create each with
+ * pamk5_exchange_new and pass them all to pamk5_exchange_run, which runs up
+ * to limit of them at a time and returns once the result is known,
+ * abandoning the exchanges still running.  The winner is chosen as for
+ * pamk5_parallel_auth, and pamk5_exchange_run returns its status.
+ * pamk5_exchange_status returns the status of any exchange and whether it
+ * finished, and pamk5_exchange_creds takes the credentials from a successful
+ * one.  Without library support, the exchanges are done one at a time with
+ * krb5_get_init_creds_password.
+ *
+ * For nonblocking_auth, pamk5_exchange_poll instead takes a single exchange
+ * as far as it can go without waiting.  It returns EAGAIN if the exchange is
+ * still waiting on a KDC, along with a descriptor and a timeout for the
+ * caller to wait on before calling it again.
+ */
+bool pamk5_exchange_enabled(struct pam_args *);
+krb5_error_code pamk5_init_creds(struct pam_args *, krb5_creds *,
+                                 krb5_principal, const char *pass,
+                                 krb5_prompter_fct, void *data,
+                                 const char *service,
+                                 krb5_get_init_creds_opt *);
+krb5_error_code pamk5_init_creds_context(struct pam_args *, krb5_context,
+                                         krb5_creds *, krb5_principal,
+                                         const char *pass, krb5_prompter_fct,
+                                         void *data, const char *service,
+                                         krb5_get_init_creds_opt *);
+krb5_error_code pamk5_exchange_new(struct pam_args *, krb5_principal,
+                                   const char *pass, krb5_prompter_fct,
+                                   void *data, const char *service,
+                                   krb5_get_init_creds_opt *,
+                                   struct pamk5_exchange **);
+krb5_error_code pamk5_exchange_run(struct pam_args *,
+                                   struct pamk5_exchange **, size_t count,
+                                   size_t limit, bool ordered,
+                                   size_t *winner);
+krb5_error_code pamk5_exchange_status(const struct pamk5_exchange *,
+                                      bool *finished);
+krb5_error_code pamk5_exchange_poll(struct pam_args *,
+                                    struct pamk5_exchange *, int *fd,
+                                    int *timeout);
+void pamk5_exchange_creds(struct pamk5_exchange *, krb5_creds *);
+void pamk5_exchange_free(struct pamk5_exchange *);
+
+/*
+ * The deadline for auth_timeout, which covers every exchange with the KDC in
+ * an authentication.  pamk5_deadline_start starts the clock if auth_timeout
+ * is set and the clock isn't already running, and pamk5_deadline_stop stops
+ * it.  pamk5_deadline_passed returns true once the time is up, after which
+ * exchanges fail at once with KRB5_KDC_UNREACH.  Exchanges driven by the
+ * module are also cut short at the deadline; those left to the Kerberos
+ * library can only be refused before they start.
+ */
+void pamk5_deadline_start(struct pam_args *);
+void pamk5_deadline_stop(struct pam_args *);
+bool pamk5_deadline_passed(struct pam_args *);
+
 /* FAST support.  Set up FAST protection of authentication. */
 void pamk5_fast_setup(struct pam_args *, krb5_get_init_creds_opt *);
 
-/* Context management. */
+/*
+ * Context management.  pamk5_context_fetch and pamk5_context_new give args a
+ * reference to the context, pamk5_context_store gives the PAM data one, and
+ * pamk5_context_free drops the one held by args.  pamk5_context_principal
+ * notes the principal of the context in args for structured logs and should
+ * be called whenever it changes.  pamk5_context_park keeps the context of an
+ * authentication left incomplete by nonblocking_auth in the PAM data under a
+ * separate name, pamk5_context_resume gives args a reference to it if there
+ * is one, and pamk5_context_unpark drops it once the authentication is over.
+ */
 int pamk5_context_new(struct pam_args *);
 int pamk5_context_fetch(struct pam_args *);
+int pamk5_context_store(struct pam_args *);
+int pamk5_context_park(struct pam_args *);
+bool pamk5_context_resume(struct pam_args *);
+void pamk5_context_unpark(struct pam_args *);
+void pamk5_context_principal(struct pam_args *);
 void pamk5_context_free(struct pam_args *);
 void pamk5_context_destroy(pam_handle_t *, void *data, int pam_end_status);
 
@@ -237,6 +543,61 @@ int pamk5_cache_init(struct pam_args *, const char *ccname, krb5_creds *,
  */
 int pamk5_cache_init_random(struct pam_args *, krb5_creds *);
 
+/*
+ * The timing option.  pamk5_timing_start and pamk5_timing_stop bracket a
+ * phase and do nothing unless timing is set.  pamk5_timing_report logs the
+ * phase times and KDC exchanges for the call, if any phase ran, and is
+ * called by pamk5_free.  pamk5_timing_exchange counts a message sent to a KDC
+ * by the module rather than the Kerberos library.
+ */
+void pamk5_timing_start(struct pam_args *, enum pamk5_phase);
+void pamk5_timing_stop(struct pam_args *, enum pamk5_phase);
+void pamk5_timing_exchange(struct pam_args *);
+void pamk5_timing_report(struct pam_args *);
+
+/*
+ * The flight recorder.  pamk5_recorder_start begins keeping suppressed debug
+ * output and Kerberos trace output in memory if the recorder option is set,
+ * and may be called again once more settings are known.
+ * pamk5_recorder_finish logs what was kept if the PAM status is a failure or
+ * the call was slow, and otherwise discards it.
+ */
+void pamk5_recorder_start(struct pam_args *);
+void pamk5_recorder_finish(struct pam_args *, int pamret);
+
+/*
+ * Files shared between processes.  pamk5_shared_map maps the file of the
+ * given type at path the first time it's asked for, creating and stamping it
+ * if needed, and returns the mapping, or NULL if the file can't be used.  For
+ * a locked type, fd is set to a descriptor to lock the file with.
+ */
+void *pamk5_shared_map(struct pam_args *, const struct pamk5_shared_type *,
+                       const char *path, int *fd);
+
+/*
+ * Shared metrics.  pamk5_metrics_start returns the start time of an
+ * operation to pass to pamk5_metrics_record, which counts its outcome from
+ * the PAM status and Kerberos error code and records its latency.
+ * pamk5_metrics_event counts other events.  All do nothing unless the
+ * metrics option is set.
+ */
+unsigned long long pamk5_metrics_start(struct pam_args *);
+void pamk5_metrics_record(struct pam_args *, enum metrics_op, int pamret,
+                          krb5_error_code, unsigned long long start);
+void pamk5_metrics_event(struct pam_args *, enum metrics_event);
+
+/*
+ * The KDC circuit breaker.  pamk5_breaker_check returns false if the KDCs for
+ * the realm of the principal being authenticated are known to be unreachable
+ * and authentication should fail without trying them.  Otherwise, the result
+ * of the authentication is passed to pamk5_breaker_record, or, if the KDCs
+ * never gave one, pamk5_breaker_release is called.  All do nothing unless
+ * the kdc_breaker option is set.
+ */
+bool pamk5_breaker_check(struct pam_args *);
+void pamk5_breaker_record(struct pam_args *, krb5_error_code);
+void pamk5_breaker_release(struct pam_args *);
+
 /*
  * Compatibility functions.  Depending on whether pam_krb5 is built with MIT
  * Kerberos or Heimdal, appropriate implementations for the Kerberos
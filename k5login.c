@@ -0,0 +1,191 @@
+/*
+ * Hints for the principals in .k5login.
+ *
+ * With search_k5login, the module tries the password with each principal in
+ * the user's .k5login in turn, so a user whose principal is far down the file
+ * waits for a failed exchange with the KDC for every line before it.  If
+ * search_k5login_hints names a directory, the principal that last worked for
+ * each user is saved there in a file named after the user, together with the
+ * device, inode, size, and modification and change times of their .k5login.
+ * The change time catches a file rewritten and given back its old
+ * modification time, which its owner can do.  Next time, if .k5login hasn't
+ * changed, that principal is tried before the rest.  The hints are only saved
+ * by a module running as root and only trusted if owned by root, so a user
+ * can't point the module at a principal they don't list.  Any problem with a
+ * hint is logged at debug level and just means the whole file is searched.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <internal.h>
+#include <pam-util/arena.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+
+/*
+ * Return the path of the hint file for the user, or NULL if no hint
+ * directory is set or the user name can't safely be used as a file name.
+ */
+static char *
+hint_path(struct pam_args *args)
+{
+    const char *dir = args->config->search_k5login_hints;
+    const char *name = args->config->ctx->name;
+
+    if (dir == NULL || name == NULL)
+        return NULL;
+    if (name[0] == '\0' || name[0] == '.' || strchr(name, '/') != NULL)
+        return NULL;
+    return putil_arena_sprintf(args, "%s/%s", dir, name);
+}
+
+
+/*
+ * Return the string identifying a version of .k5login from its stat
+ * information, allocated from the arena.
+ */
+static char *
+hint_stamp(struct pam_args *args, const struct stat *st)
+{
+    return putil_arena_sprintf(args, "%llu %llu %llu %lld %lld",
+                               (unsigned long long) st->st_dev,
+                               (unsigned long long) st->st_ino,
+                               (unsigned long long) st->st_size,
+                               (long long) st->st_mtime,
+                               (long long) st->st_ctime);
+}
+
+
+/*
+ * Return the hinted principal for the user if there is a trustworthy hint
+ * for the version of .k5login described by st, setting name to its unparsed
+ * form in the arena.  Returns NULL if there is no usable hint.
+ */
+krb5_principal
+pamk5_k5login_hint(struct pam_args *args, const struct stat *st,
+                   const char **name)
+{
+    struct context *ctx = args->config->ctx;
+    struct stat hint_st;
+    krb5_principal princ = NULL;
+    char line[BUFSIZ];
+    char *path, *stamp;
+    size_t length;
+    FILE *hint;
+    int fd;
+
+    path = hint_path(args);
+    if (path == NULL)
+        return NULL;
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            putil_debug(args, "cannot open .k5login hint %s: %s", path,
+                        strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &hint_st) < 0 || !S_ISREG(hint_st.st_mode)
+        || hint_st.st_uid != 0
+        || (hint_st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        putil_debug(args, "ignoring insecure .k5login hint %s", path);
+        close(fd);
+        return NULL;
+    }
+    hint = fdopen(fd, "r");
+    if (hint == NULL) {
+        close(fd);
+        return NULL;
+    }
+    if (fgets(line, sizeof(line), hint) == NULL)
+        goto done;
+    length = strlen(line);
+    if (length == 0 || line[length - 1] != '\n')
+        goto done;
+    line[length - 1] = '\0';
+    stamp = hint_stamp(args, st);
+    if (stamp == NULL)
+        goto done;
+    length = strlen(stamp);
+    if (strncmp(line, stamp, length) != 0 || line[length] != ' ') {
+        putil_debug(args, ".k5login changed since the hint was saved");
+        goto done;
+    }
+    *name = putil_arena_strdup(args, line + length + 1);
+    if (*name == NULL)
+        goto done;
+    if (krb5_parse_name(ctx->context, *name, &princ) != 0)
+        princ = NULL;
+
+done:
+    fclose(hint);
+    return princ;
+}
+
+
+/*
+ * Save the principal that worked as the hint for the version of .k5login
+ * described by st.  The new hint is written to a temporary file and renamed
+ * into place so that readers never see a partial one.
+ */
+void
+pamk5_k5login_hint_save(struct pam_args *args, const struct stat *st,
+                        krb5_const_principal princ)
+{
+    struct context *ctx = args->config->ctx;
+    char *path, *stamp, *tmpname;
+    char *principal = NULL;
+    FILE *hint;
+    int fd, oerrno;
+
+    if (geteuid() != 0)
+        return;
+    path = hint_path(args);
+    if (path == NULL)
+        return;
+    stamp = hint_stamp(args, st);
+    tmpname = putil_arena_sprintf(args, "%s/.%s.XXXXXX",
+                                  args->config->search_k5login_hints,
+                                  ctx->name);
+    if (stamp == NULL || tmpname == NULL)
+        return;
+    if (krb5_unparse_name(ctx->context, princ, &principal) != 0)
+        return;
+    fd = mkstemp(tmpname);
+    if (fd < 0) {
+        putil_debug(args, "cannot create .k5login hint %s: %s", tmpname,
+                    strerror(errno));
+        goto done;
+    }
+    hint = fdopen(fd, "w");
+    if (hint == NULL) {
+        oerrno = errno;
+        close(fd);
+        errno = oerrno;
+        goto fail;
+    }
+    fprintf(hint, "%s %s\n", stamp, principal);
+    if (fclose(hint) != 0)
+        goto fail;
+    if (rename(tmpname, path) < 0)
+        goto fail;
+    putil_debug(args, "saved .k5login hint %s", principal);
+    goto done;
+
+fail:
+    putil_debug(args, "cannot save .k5login hint %s: %s", path,
+                strerror(errno));
+    unlink(tmpname);
+
+done:
+    krb5_free_unparsed_name(ctx->context, principal);
+}
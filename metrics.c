@@ -0,0 +1,156 @@
+/*
+ * Shared authentication metrics.
+ *
+ * If the metrics option names a file, each process maps it shared the first
+ * time it needs it, as described in shared.c.  Authentication, ticket cache
+ * creation, and password changes add their outcome and latency to the
+ * counters in the file with atomic increments, and the use of FAST and
+ * PKINIT is counted, so every process on the host contributes to the same
+ * totals without locking.  See metrics.h for the layout.
+ *
+ * The file is created if it doesn't exist.  It must be owned by root or by
+ * the user running the module and not writable by group or other; since
+ * only its owner can then update it, it should normally be created by a
+ * service running as root.  Any problem with the file just means nothing is
+ * counted.  Collection never fails, never waits on a lock, and, once the
+ * file is mapped, does nothing but the atomic increments.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <internal.h>
+#include <metrics.h>
+#include <pam-util/args.h>
+
+
+/*
+ * Return the current monotonic time in microseconds.
+ */
+static unsigned long long
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+    return (unsigned long long) ts.tv_sec * 1000000ULL
+           + (unsigned long long) ts.tv_nsec / 1000ULL;
+}
+
+
+/* The layout of the metrics file. */
+static const struct pamk5_shared_type metrics_type = {
+    "metrics", METRICS_MAGIC, METRICS_VERSION, sizeof(struct metrics_file),
+    false
+};
+
+
+/*
+ * Return the mapping of the configured metrics file, or NULL if it can't be
+ * used.  Once found, the mapping is kept in the configuration, so after the
+ * first call only the atomic increments touch anything shared.
+ */
+static struct metrics_file *
+metrics_find(struct pam_args *args)
+{
+    struct pam_config *config = args->config;
+
+    if (config->metrics_file == NULL)
+        config->metrics_file = pamk5_shared_map(args, &metrics_type,
+                                                config->metrics, NULL);
+    return config->metrics_file;
+}
+
+
+/*
+ * Classify the outcome of an operation from its PAM status and, for
+ * failures, its Kerberos status.
+ */
+static enum metrics_result
+classify(int pamret, krb5_error_code code)
+{
+    if (pamret == PAM_SUCCESS)
+        return METRICS_SUCCESS;
+    switch (code) {
+    case KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN:
+        return METRICS_PRINCIPAL_UNKNOWN;
+    case KRB5KDC_ERR_PREAUTH_FAILED:
+    case KRB5KRB_AP_ERR_BAD_INTEGRITY:
+    case KRB5KRB_AP_ERR_MODIFIED:
+    case KRB5_GET_IN_TKT_LOOP:
+    case KRB5_BAD_ENCTYPE:
+        return METRICS_PREAUTH_FAILED;
+    case KRB5_KDC_UNREACH:
+    case KRB5_REALM_CANT_RESOLVE:
+        return METRICS_KDC_UNREACH;
+    case KRB5KDC_ERR_KEY_EXP:
+        return METRICS_KEY_EXP;
+    default:
+        return METRICS_OTHER;
+    }
+}
+
+
+/*
+ * Return the start time to pass to pamk5_metrics_record, or 0 if metrics
+ * aren't being collected.
+ */
+unsigned long long
+pamk5_metrics_start(struct pam_args *args)
+{
+    if (args->config->metrics == NULL)
+        return 0;
+    return now();
+}
+
+
+/*
+ * Count the outcome of an operation and add its latency to the histogram.
+ */
+void
+pamk5_metrics_record(struct pam_args *args, enum metrics_op op, int pamret,
+                     krb5_error_code code, unsigned long long start)
+{
+    struct metrics_file *file;
+    struct metrics_counters *counters;
+    unsigned long long usec, end;
+    size_t bucket;
+
+    if (args->config->metrics == NULL)
+        return;
+    file = metrics_find(args);
+    if (file == NULL)
+        return;
+    end = now();
+    usec = (end > start) ? end - start : 0;
+    for (bucket = 0; bucket < METRICS_BUCKETS - 1; bucket++)
+        if (usec < (1ULL << bucket))
+            break;
+    counters = &file->ops[op];
+    __sync_fetch_and_add(&counters->results[classify(pamret, code)], 1);
+    __sync_fetch_and_add(&counters->buckets[bucket], 1);
+    __sync_fetch_and_add(&counters->usec, usec);
+}
+
+
+/*
+ * Count an event.
+ */
+void
+pamk5_metrics_event(struct pam_args *args, enum metrics_event event)
+{
+    struct metrics_file *file;
+
+    if (args->config->metrics == NULL)
+        return;
+    file = metrics_find(args);
+    if (file == NULL)
+        return;
+    __sync_fetch_and_add(&file->events[event], 1);
+}
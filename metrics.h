@@ -0,0 +1,75 @@
+/*
+ * Layout of the shared authentication metrics file.
+ *
+ * If the metrics option is set, the module maps the named file shared and
+ * adds to the counters in it with atomic increments, so every process using
+ * the module on a host contributes to the same totals without any locking.
+ * pam_krb5_stats reads the file and prints the counters for Prometheus.  This
+ * header is shared between the two.
+ *
+ * The layout uses the native byte order and is only meant to be read on the
+ * host that wrote it.  Change METRICS_VERSION with any change to the layout.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H 1
+
+#include <config.h>
+#include <portable/system.h>
+
+/* Identifies the file format. */
+#define METRICS_MAGIC   "pamk5mt"
+#define METRICS_VERSION 1
+
+/*
+ * The number of latency histogram buckets.  Bucket i counts operations that
+ * took less than 2^i microseconds but not less than 2^(i-1), and the last
+ * bucket counts everything slower than the one before it.
+ */
+#define METRICS_BUCKETS 26
+
+/* The operations that are counted and timed. */
+enum metrics_op {
+    METRICS_AUTH,               /* Authentication (pam_authenticate). */
+    METRICS_SETCRED,            /* Creating or refreshing a ticket cache. */
+    METRICS_CHPW,               /* Changing a password. */
+    METRICS_OP_MAX
+};
+
+/* The outcomes of an operation. */
+enum metrics_result {
+    METRICS_SUCCESS,
+    METRICS_PRINCIPAL_UNKNOWN,  /* KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN. */
+    METRICS_PREAUTH_FAILED,     /* Wrong password. */
+    METRICS_KDC_UNREACH,        /* No KDC could be reached. */
+    METRICS_KEY_EXP,            /* Expired password. */
+    METRICS_OTHER,              /* Any other failure. */
+    METRICS_RESULT_MAX
+};
+
+/* Other events that are counted. */
+enum metrics_event {
+    METRICS_FAST,               /* Authentication protected by FAST. */
+    METRICS_PKINIT,             /* Authentication attempted with PKINIT. */
+    METRICS_EVENT_MAX
+};
+
+/* The counters for one operation. */
+struct metrics_counters {
+    uint64_t results[METRICS_RESULT_MAX]; /* Count of each outcome. */
+    uint64_t buckets[METRICS_BUCKETS];    /* Latency histogram. */
+    uint64_t usec;                        /* Total latency. */
+};
+
+/* The file. */
+struct metrics_file {
+    char magic[8];              /* METRICS_MAGIC with its nul. */
+    uint32_t version;           /* METRICS_VERSION. */
+    uint32_t size;              /* sizeof(struct metrics_file). */
+    struct metrics_counters ops[METRICS_OP_MAX];
+    uint64_t events[METRICS_EVENT_MAX];
+};
+
+#endif /* !METRICS_H */
@@ -30,71 +30,231 @@
 /* Our option definition.  Must be sorted. */
 #define K(name) (#name), offsetof(struct pam_config, name)
 static const struct option options[] = {
-    { K(alt_auth_map),       true,  STRING (NULL)  },
-    { K(anon_fast),          true,  BOOL   (false) },
-    { K(banner),             true,  STRING ("Kerberos") },
-    { K(ccache),             true,  STRING (NULL)  },
-    { K(ccache_dir),         true,  STRING ("FILE:/tmp") },
-    { K(clear_on_fail),      true,  BOOL   (false) },
-    { K(debug),              true,  BOOL   (false) },
-    { K(defer_pwchange),     true,  BOOL   (false) },
-    { K(expose_account),     true,  BOOL   (false) },
-    { K(fail_pwchange),      true,  BOOL   (false) },
-    { K(fast_ccache),        true,  STRING (NULL)  },
-    { K(first_pass_is_pin),  false, BOOL   (false) },
-    { K(force_alt_auth),     true,  BOOL   (false) },
-    { K(force_first_pass),   false, BOOL   (false) },
-    { K(force_pwchange),     true,  BOOL   (false) },
-    { K(forwardable),        true,  BOOL   (false) },
-    { K(ignore_k5login),     true,  BOOL   (false) },
-    { K(ignore_root),        true,  BOOL   (false) },
-    { K(keytab),             true,  STRING (NULL)  },
-    { K(minimum_uid),        true,  NUMBER (0)     },
-    { K(no_ccache),          false, BOOL   (false) },
-    { K(no_prompt),          true,  BOOL   (false) },
-    { K(no_update_user),     true,  BOOL   (false) },
-    { K(only_alt_auth),      true,  BOOL   (false) },
-    { K(pkinit_anchors),     true,  STRING (NULL)  },
-    { K(pkinit_prompt),      true,  BOOL   (false) },
-    { K(pkinit_user),        true,  STRING (NULL)  },
-    { K(preauth_opt),        true,  LIST   (NULL)  },
-    { K(prompt_principal),   true,  BOOL   (false) },
-    { K(realm),              false, STRING (NULL)  },
-    { K(renew_lifetime),     true,  TIME   (0)     },
-    { K(retain_after_close), true,  BOOL   (false) },
-    { K(search_k5login),     true,  BOOL   (false) },
-    { K(silent),             false, BOOL   (false) },
-    { K(ticket_lifetime),    true,  TIME   (0)     },
-    { K(trace),              false, STRING (NULL)  },
-    { K(try_first_pass),     false, BOOL   (false) },
-    { K(try_pkinit),         true,  BOOL   (false) },
-    { K(use_authtok),        false, BOOL   (false) },
-    { K(use_first_pass),     false, BOOL   (false) },
-    { K(use_pkinit),         true,  BOOL   (false) },
-    { K(user_realm),         true,  STRING (NULL)  },
+    { K(alt_auth_map),            true,  STRING (NULL)  },
+    { K(anon_fast),               true,  BOOL   (false) },
+    { K(auth_timeout),            true,  TIME   (0)     },
+    { K(banner),                  true,  STRING ("Kerberos") },
+    { K(ccache),                  true,  STRING (NULL)  },
+    { K(ccache_dir),              true,  STRING ("FILE:/tmp") },
+    { K(clear_on_fail),           true,  BOOL   (false) },
+    { K(compiled_config),         false, STRING (NULL)  },
+    { K(config_cache),            false, BOOL   (false) },
+    { K(debug),                   true,  BOOL   (false) },
+    { K(defer_pwchange),          true,  BOOL   (false) },
+    { K(expose_account),          true,  BOOL   (false) },
+    { K(fail_pwchange),           true,  BOOL   (false) },
+    { K(fast_ccache),             true,  STRING (NULL)  },
+    { K(first_pass_is_pin),       false, BOOL   (false) },
+    { K(force_alt_auth),          true,  BOOL   (false) },
+    { K(force_first_pass),        false, BOOL   (false) },
+    { K(force_pwchange),          true,  BOOL   (false) },
+    { K(forwardable),             true,  BOOL   (false) },
+    { K(ignore_k5login),          true,  BOOL   (false) },
+    { K(ignore_root),             true,  BOOL   (false) },
+    { K(kdc_breaker),             true,  STRING (NULL)  },
+    { K(kdc_breaker_cooldown),    true,  TIME   (30)    },
+    { K(kdc_breaker_threshold),   true,  NUMBER (5)     },
+    { K(keytab),                  true,  STRING (NULL)  },
+    { K(log_format),              true,  STRING (NULL)  },
+    { K(metrics),                 true,  STRING (NULL)  },
+    { K(minimum_uid),             true,  NUMBER (0)     },
+    { K(no_ccache),               false, BOOL   (false) },
+    { K(no_prompt),               true,  BOOL   (false) },
+    { K(no_update_user),          true,  BOOL   (false) },
+    { K(nonblocking_auth),        true,  BOOL   (false) },
+    { K(nonblocking_kdc),         true,  BOOL   (false) },
+    { K(nonblocking_log),         true,  BOOL   (false) },
+    { K(only_alt_auth),           true,  BOOL   (false) },
+    { K(pkinit_anchors),          true,  STRING (NULL)  },
+    { K(pkinit_prompt),           true,  BOOL   (false) },
+    { K(pkinit_user),             true,  STRING (NULL)  },
+    { K(preauth_opt),             true,  LIST   (NULL)  },
+    { K(prompt_principal),        true,  BOOL   (false) },
+    { K(realm),                   false, STRING (NULL)  },
+    { K(realms),                  true,  LIST   (NULL)  },
+    { K(recorder),                true,  BOOL   (false) },
+    { K(recorder_file),           false, STRING (NULL)  },
+    { K(recorder_threshold),      true,  NUMBER (0)     },
+    { K(renew_lifetime),          true,  TIME   (0)     },
+    { K(retain_after_close),      true,  BOOL   (false) },
+    { K(search_k5login),          true,  BOOL   (false) },
+    { K(search_k5login_hints),    true,  STRING (NULL)  },
+    { K(search_k5login_parallel), true,  NUMBER (0)     },
+    { K(silent),                  false, BOOL   (false) },
+    { K(ticket_lifetime),         true,  TIME   (0)     },
+    { K(timing),                  true,  BOOL   (false) },
+    { K(trace),                   false, STRING (NULL)  },
+    { K(try_first_pass),          false, BOOL   (false) },
+    { K(try_pkinit),              true,  BOOL   (false) },
+    { K(use_authtok),             false, BOOL   (false) },
+    { K(use_first_pass),          false, BOOL   (false) },
+    { K(use_pkinit),              true,  BOOL   (false) },
+    { K(user_realm),              true,  STRING (NULL)  },
 };
 static const size_t optlen = sizeof(options) / sizeof(options[0]);
 
 
+/*
+ * Scan the PAM arguments for the config_cache option.  This has to be known
+ * before we do any of the work that the cache would save, so it can't come
+ * from krb5.conf.  Accept the same values as the normal boolean parser, with
+ * later settings overriding earlier ones.
+ */
+static bool
+config_cache_requested(int argc, const char **argv)
+{
+    int i;
+    bool requested = false;
+    const char *value;
+
+    for (i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "config_cache", strlen("config_cache")) != 0)
+            continue;
+        value = argv[i] + strlen("config_cache");
+        if (*value == '\0')
+            requested = true;
+        else if (*value != '=')
+            continue;
+        else if (   strcasecmp(value + 1, "true") == 0
+                 || strcasecmp(value + 1, "yes")  == 0
+                 || strcasecmp(value + 1, "on")   == 0
+                 || strcmp    (value + 1, "1")    == 0)
+            requested = true;
+        else
+            requested = false;
+    }
+    return requested;
+}
+
+
+/*
+ * Return the value of the last instance of a string option in the PAM
+ * arguments, or NULL if it isn't present.  Used for options that have to be
+ * known before anything else is loaded.
+ */
+static const char *
+early_string(int argc, const char **argv, const char *name)
+{
+    size_t length = strlen(name);
+    const char *value = NULL;
+    int i;
+
+    for (i = 0; i < argc; i++)
+        if (strncmp(argv[i], name, length) == 0 && argv[i][length] == '=')
+            value = argv[i] + length + 1;
+    return value;
+}
+
+
+/*
+ * Apply the log_format option to args, complaining about unknown formats.
+ * The transaction ID set by an earlier call for this PAM handle, if any, is
+ * picked up here so that messages logged before the context is found
+ * already carry it.
+ */
+static void
+set_log_format(struct pam_args *args)
+{
+    const char *tid;
+
+    if (args->config->log_format == NULL)
+        return;
+    if (!putil_log_format(args, args->config->log_format)) {
+        putil_err(args, "unknown log_format %s", args->config->log_format);
+        return;
+    }
+    if (args->log_format == PUTIL_LOG_TEXT)
+        return;
+    tid = pam_getenv(args->pamh, "PAM_KRB5_TID");
+    if (tid != NULL && tid[0] != '\0')
+        args->tid = tid;
+}
+
+
+/*
+ * Set args->realm from the realm option in the PAM arguments, if present.
+ * Returns false on memory allocation failure, which is reported.
+ */
+bool
+pamk5_config_realm(struct pam_args *args, int argc, const char **argv)
+{
+    const char *realm;
+
+    realm = early_string(argc, argv, "realm");
+    if (realm == NULL)
+        return true;
+    free(args->realm);
+    args->realm = strdup(realm);
+    if (args->realm == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Load the configuration from krb5.conf and the PAM arguments into a newly
+ * allocated config struct in args, creating the Kerberos context first if
+ * needed.  args->realm should already be set.  None of the sanity checks in
+ * pamk5_init are applied.  Returns false on failure, which will already have
+ * been reported, and in which case the config struct may be partially filled
+ * in.
+ */
+bool
+pamk5_config_load(struct pam_args *args, int argc, const char **argv)
+{
+    args->config = calloc(1, sizeof(struct pam_config));
+    if (args->config == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    if (!putil_args_krb5_context(args))
+        return false;
+    if (!putil_args_defaults(args, options, optlen))
+        return false;
+    if (!putil_args_krb5(args, "pam", options, optlen))
+        return false;
+    return putil_args_parse(args, argc, argv, options, optlen);
+}
+
+
+/*
+ * Return the option table, used to save and restore compiled configurations.
+ */
+const struct option *
+pamk5_config_options(size_t *length)
+{
+    *length = optlen;
+    return options;
+}
+
+
 /*
  * Allocate a new struct pam_args and initialize its data members, including
- * parsing the arguments and getting settings from krb5.conf.  Check the
- * resulting options for consistency.
+ * parsing the arguments.  Reading krb5.conf and creating the Kerberos context
+ * are left to pamk5_load, since many calls (ignored users, repeated setcred
+ * calls, closing sessions) never need either.
+ *
+ * If config_cache is set, first try to get the parsed settings from the
+ * process-wide configuration cache.  If compiled_config is set, try the
+ * compiled configuration file next.  Either way, the settings from krb5.conf
+ * are then already present and pamk5_load only has to create the context.
  */
 struct pam_args *
 pamk5_init(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
-    int i;
     struct pam_args *args;
-    struct pam_config *config = NULL;
+    struct pam_config *config;
+    const char *compiled;
+    bool use_cache;
+    bool cached = false;
+    bool precompiled = false;
+    unsigned long generation = 0;
 
     args = putil_args_new(pamh, flags);
     if (args == NULL)
         return NULL;
-    config = calloc(1, sizeof(struct pam_config));
-    if (config == NULL)
-        goto nomem;
-    args->config = config;
 
     /*
      * Do an initial scan to see if the realm is already set in our options.
@@ -105,28 +265,188 @@ pamk5_init(pam_handle_t *pamh, int flags, int argc, const char **argv)
      * in favor of using args->realm extracted here.  However, the latter must
      * exist to avoid throwing unknown option errors.
      */
-    for (i = 0; i < argc; i++) {
-        if (strncmp(argv[i], "realm=", 6) != 0)
-            continue;
-        free(args->realm);
-        args->realm = strdup(&argv[i][strlen("realm=")]);
-        if (args->realm == NULL)
-            goto nomem;
+    if (!pamk5_config_realm(args, argc, argv))
+        goto fail;
+
+    /*
+     * Get the configuration from the cache or the compiled configuration
+     * file if possible, and otherwise parse only our arguments.  The saved
+     * configurations hold the settings before the sanity checks in
+     * pamk5_load so that those checks and their diagnostics happen on every
+     * call that uses them.
+     */
+    use_cache = config_cache_requested(argc, argv);
+    compiled = early_string(argc, argv, "compiled_config");
+    if (use_cache) {
+        args->config = pamk5_config_cache_fetch(args, argc, argv, &generation);
+        cached = (args->config != NULL);
+    }
+    if (args->config == NULL && compiled != NULL) {
+        args->config = pamk5_compiled_fetch(args, compiled, argc, argv);
+        precompiled = (args->config != NULL);
     }
+    if (args->config != NULL)
+        args->config->loaded = true;
+    else {
+        args->config = calloc(1, sizeof(struct pam_config));
+        if (args->config == NULL) {
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+            goto fail;
+        }
+        if (!putil_args_defaults(args, options, optlen))
+            goto fail;
+        if (!putil_args_parse(args, argc, argv, options, optlen))
+            goto fail;
+    }
+    config = args->config;
+    config->cached = cached;
+    config->generation = generation;
+    if (config->debug)
+        args->debug = true;
+    if (config->silent)
+        args->silent = true;
+    if (config->nonblocking_log)
+        args->nonblocking_log = true;
+    set_log_format(args);
+    pamk5_recorder_start(args);
+    if (cached)
+        putil_debug(args, "using cached configuration");
+    else if (use_cache && generation == 0)
+        putil_debug(args, "configuration cache not available");
+    else if (use_cache)
+        putil_debug(args, "configuration not cached");
+    if (precompiled)
+        putil_debug(args, "using compiled configuration from %s", compiled);
+    else if (compiled != NULL && !cached)
+        putil_debug(args, "no current compiled configuration in %s",
+                    compiled);
 
-    if (!putil_args_defaults(args, options, optlen)) {
-        free(config);
-        putil_args_free(args);
+    /*
+     * Tracing has to be set up on the context before anything else happens,
+     * and anyone asking for it wants to see every call, so don't defer.
+     */
+    if (config->trace != NULL && !pamk5_load(args, argc, argv))
+        goto fail;
+    return args;
+
+fail:
+    pamk5_recorder_finish(args, PAM_SERVICE_ERR);
+    pamk5_free(args);
+    return NULL;
+}
+
+
+/*
+ * Return the settings from the defaults and krb5.conf for the realm, before
+ * any arguments are applied, in a newly allocated struct.  Stacked instances
+ * of the module share these through the cache for the PAM handle.  Returns
+ * NULL on failure, which will already have been reported.
+ */
+static struct pam_config *
+load_base(struct pam_args *args)
+{
+    struct pam_config *parsed = args->config;
+    struct pam_config *base;
+    char *key;
+    size_t keylen;
+
+    key = pamk5_config_key(args, 0, NULL, &keylen);
+    if (key == NULL)
         return NULL;
+    base = pamk5_config_handle_fetch(args, key, keylen);
+    if (base == NULL) {
+        base = calloc(1, sizeof(struct pam_config));
+        if (base == NULL) {
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+            free(key);
+            return NULL;
+        }
+        args->config = base;
+        if (putil_args_defaults(args, options, optlen)
+            && putil_args_krb5(args, "pam", options, optlen))
+            pamk5_config_handle_store(args, key, keylen, base);
+        else {
+            pamk5_config_free(base);
+            base = NULL;
+        }
+        args->config = parsed;
     }
-    if (!putil_args_krb5(args, "pam", options, optlen))
-        goto fail;
-    if (!putil_args_parse(args, argc, argv, options, optlen))
-        goto fail;
+    free(key);
+    return base;
+}
+
+
+/*
+ * Finish setting up args after pamk5_init: read krb5.conf unless the
+ * settings came from a saved configuration, create the Kerberos context, and
+ * check the resulting options for consistency.  Does nothing if called a
+ * second time.  Returns false on failure, which will already have been
+ * reported.
+ */
+bool
+pamk5_load(struct pam_args *args, int argc, const char **argv)
+{
+    struct pam_config *config, *parsed;
+    char *key;
+    size_t keylen;
+
+    if (args->config->checked)
+        return true;
+    parsed = args->config;
+
+    /*
+     * If an earlier call in this PAM transaction left a context, borrow its
+     * Kerberos context.  Otherwise, create one, getting it from the cache if
+     * the settings came from there.
+     */
+    if (parsed->ctx != NULL && args->ctx == NULL)
+        args->ctx = parsed->ctx->context;
+    if (parsed->cached && args->ctx == NULL) {
+        if (!pamk5_config_cache_context(args, argc, argv))
+            return false;
+    } else {
+        if (!putil_args_krb5_context(args))
+            return false;
+    }
+
+    /*
+     * If only the arguments have been parsed, get the settings for the same
+     * arguments from an earlier call on this PAM handle, or failing that,
+     * the settings from the defaults and krb5.conf and then move the
+     * settings from the arguments over, since those override krb5.conf.
+     */
+    if (!parsed->loaded) {
+        key = pamk5_config_key(args, argc, argv, &keylen);
+        if (key == NULL)
+            return false;
+        config = pamk5_config_handle_fetch(args, key, keylen);
+        if (config == NULL) {
+            config = load_base(args);
+            if (config == NULL) {
+                free(key);
+                return false;
+            }
+            putil_args_swap(config, parsed, argc, argv, options, optlen);
+            pamk5_config_handle_store(args, key, keylen, config);
+        }
+        free(key);
+        config->ctx = parsed->ctx;
+        config->flight = parsed->flight;
+        config->loaded = true;
+        args->config = config;
+        if (parsed->generation != 0)
+            pamk5_config_cache_store(args, argc, argv, parsed->generation);
+        pamk5_config_free(parsed);
+    }
+    config = args->config;
+    config->checked = true;
     if (config->debug)
         args->debug = true;
     if (config->silent)
         args->silent = true;
+    if (config->nonblocking_log)
+        args->nonblocking_log = true;
+    set_log_format(args);
 
     /* An empty banner should be treated the same as not having one. */
     if (config->banner != NULL && config->banner[0] == '\0') {
@@ -199,46 +519,64 @@ pamk5_init(pam_handle_t *pamh, int flags, int argc, const char **argv)
         putil_err(args, "trace logging requested but not supported");
 #endif
 
-    return args;
+    /* Start the recorder if only krb5.conf set it, and capture tracing. */
+    pamk5_recorder_start(args);
+    return true;
+}
 
-nomem:
-    putil_crit(args, "cannot allocate memory: %s", strerror(errno));
-    free(config);
-    putil_args_free(args);
-    return NULL;
 
-fail:
-    pamk5_free(args);
-    return NULL;
+/*
+ * Copy the settings in one configuration struct to a newly allocated one,
+ * used by the configuration cache.  The ctx member is not copied.  Returns
+ * the new struct or NULL on memory allocation failure, which is reported.
+ */
+struct pam_config *
+pamk5_config_copy(struct pam_args *args, const struct pam_config *src)
+{
+    struct pam_config *config;
+
+    config = calloc(1, sizeof(struct pam_config));
+    if (config == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return NULL;
+    }
+    if (!putil_args_copy(args, config, src, options, optlen)) {
+        free(config);
+        return NULL;
+    }
+    return config;
 }
 
 
 /*
- * Free the allocated args struct and any memory it points to.
+ * Free a configuration struct and all of the settings it holds.  Does not
+ * touch the authentication context.
  */
 void
-pamk5_free(struct pam_args *args)
+pamk5_config_free(struct pam_config *config)
 {
-    struct pam_config *config;
+    if (config == NULL)
+        return;
+    putil_args_free_settings(config, options, optlen);
+    free(config);
+}
 
+
+/*
+ * Free the allocated args struct and any memory it points to.  Anything the
+ * recorder holds that the caller didn't already flush is discarded.
+ */
+void
+pamk5_free(struct pam_args *args)
+{
     if (args == NULL)
         return;
-    config = args->config;
-    if (config != NULL) {
-        free(config->alt_auth_map);
-        free(config->banner);
-        free(config->ccache);
-        free(config->ccache_dir);
-        free(config->fast_ccache);
-        free(config->keytab);
-        free(config->pkinit_anchors);
-        free(config->pkinit_user);
-        vector_free(config->preauth_opt);
-        free(config->realm);
-        free(config->trace);
-        free(config->user_realm);
-        free(args->config);
-        args->config = NULL;
+    if (args->config != NULL) {
+        pamk5_timing_report(args);
+        pamk5_recorder_finish(args, PAM_SUCCESS);
+        pamk5_context_free(args);
     }
+    pamk5_config_free(args->config);
+    args->config = NULL;
     putil_args_free(args);
 }
@@ -0,0 +1,436 @@
+/*
+ * Per-call memory allocation for PAM modules.
+ *
+ * The arena is a list of blocks, each of which is filled from the front.  An
+ * allocation that doesn't fit in the current block starts a new one, except
+ * that large allocations get a block of their own so that they don't waste
+ * the rest of the current block.  Secret allocations come from a separate
+ * list of blocks so that only the memory that held secrets has to be
+ * overwritten when the arena is released.
+ *
+ * Where possible, secret blocks are fixed-size slots in a process-wide pool
+ * of pages that are mapped and locked into memory once, the first time a
+ * secret is stored, so that passwords are not written to swap and no system
+ * call is needed per login.  The pool is excluded from core dumps where the
+ * system supports that.  Secrets that don't fit in a slot, or that are
+ * allocated while every slot is in use, fall back on ordinary heap blocks,
+ * which are overwritten the same way.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
+#include <pam-util/arena.h>
+#include <pam-util/args.h>
+
+/* The secret pool needs locking and locked memory. */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_MLOCK)
+# define HAVE_SECRET_POOL 1
+#endif
+
+/* BSD systems only provide the older name. */
+#if defined(HAVE_SECRET_POOL) && !defined(MAP_ANONYMOUS)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* The size of a normal arena block. */
+#define ARENA_BLOCK 2048
+
+/* Allocations larger than this get a block of their own. */
+#define ARENA_LARGE (ARENA_BLOCK / 4)
+
+/* The size of a slot in the secret pool, including its header. */
+#define SECRET_SLOT 512
+
+/* The number of slots in the secret pool. */
+#define SECRET_SLOTS 32
+
+/* Used to align all allocations suitably for any type. */
+union arena_align {
+    long double ld;
+    long long ll;
+    void *p;
+    void (*f)(void);
+};
+
+/* An arena block, followed by its data. */
+struct putil_arena {
+    struct putil_arena *next;
+    size_t size;                /* Usable bytes in data. */
+    size_t used;                /* Bytes handed out so far. */
+    bool pooled;                /* Whether this is a secret pool slot. */
+    union arena_align data[];
+};
+
+/*
+ * Called through a volatile pointer so that the compiler can't optimize away
+ * overwriting memory that is about to be freed.
+ */
+static void *(*const volatile wipe)(void *, int, size_t) = memset;
+
+
+#ifdef HAVE_SECRET_POOL
+
+/*
+ * The secret pool.  base is NULL until the pool is first used, and failed is
+ * set if it could not be mapped so that we don't keep trying.
+ */
+static struct {
+    char *base;
+    bool failed;
+    bool used[SECRET_SLOTS];
+} pool;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Unmap the pool at unload. */
+static void pool_free(void) __attribute__((__destructor__));
+
+
+/*
+ * Map and lock the pages for the secret pool.  Failure to lock the pages
+ * isn't fatal, since the slots are still overwritten when released.  Must be
+ * called with the lock held.
+ */
+static void
+pool_setup(void)
+{
+    void *base;
+
+    base = mmap(NULL, SECRET_SLOT * SECRET_SLOTS, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        pool.failed = true;
+        return;
+    }
+    mlock(base, SECRET_SLOT * SECRET_SLOTS);
+#ifdef MADV_DONTDUMP
+    madvise(base, SECRET_SLOT * SECRET_SLOTS, MADV_DONTDUMP);
+#endif
+    pool.base = base;
+}
+
+
+/*
+ * Take a free slot from the secret pool and set it up as an empty arena
+ * block.  Returns NULL if the pool can't be used or every slot is taken.
+ */
+static struct putil_arena *
+pool_get(void)
+{
+    struct putil_arena *block = NULL;
+    size_t i;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool.base == NULL && !pool.failed)
+        pool_setup();
+    if (pool.base != NULL)
+        for (i = 0; i < SECRET_SLOTS; i++)
+            if (!pool.used[i]) {
+                pool.used[i] = true;
+                block = (void *) (pool.base + i * SECRET_SLOT);
+                break;
+            }
+    pthread_mutex_unlock(&pool_lock);
+    if (block == NULL)
+        return NULL;
+    block->next = NULL;
+    block->size = SECRET_SLOT - sizeof(struct putil_arena);
+    block->used = 0;
+    block->pooled = true;
+    return block;
+}
+
+
+/*
+ * Return a slot to the secret pool.  The caller must already have overwritten
+ * its contents.
+ */
+static void
+pool_put(struct putil_arena *block)
+{
+    size_t slot;
+
+    slot = (size_t) ((char *) block - pool.base) / SECRET_SLOT;
+    pthread_mutex_lock(&pool_lock);
+    pool.used[slot] = false;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/*
+ * Return the pool slot holding a secret, or NULL if it isn't in the pool.
+ */
+static struct putil_arena *
+pool_find(const char *secret)
+{
+    size_t offset;
+
+    if (pool.base == NULL || secret < pool.base
+        || secret >= pool.base + SECRET_SLOT * SECRET_SLOTS)
+        return NULL;
+    offset = (size_t) (secret - pool.base) / SECRET_SLOT * SECRET_SLOT;
+    return (void *) (pool.base + offset);
+}
+
+
+/*
+ * Unmap the secret pool when the module is unloaded.
+ */
+static void
+pool_free(void)
+{
+    if (pool.base != NULL) {
+        wipe(pool.base, 0, SECRET_SLOT * SECRET_SLOTS);
+        munlock(pool.base, SECRET_SLOT * SECRET_SLOTS);
+        munmap(pool.base, SECRET_SLOT * SECRET_SLOTS);
+        pool.base = NULL;
+    }
+}
+
+#else /* !HAVE_SECRET_POOL */
+
+static struct putil_arena *
+pool_get(void)
+{
+    return NULL;
+}
+
+static void
+pool_put(struct putil_arena *block __attribute__((__unused__)))
+{
+}
+
+static struct putil_arena *
+pool_find(const char *secret __attribute__((__unused__)))
+{
+    return NULL;
+}
+
+#endif /* !HAVE_SECRET_POOL */
+
+
+/*
+ * Allocate memory from a list of arena blocks, adding a block if needed.  If
+ * secret is true, new blocks come from the secret pool when the allocation
+ * fits in a slot and a slot is free.  Returns NULL with errno set on failure.
+ */
+static void *
+arena_alloc(struct putil_arena **list, size_t size, bool secret)
+{
+    struct putil_arena *block = *list;
+    size_t align = sizeof(union arena_align);
+    void *result;
+
+    if (size == 0)
+        size = 1;
+    if (size > SIZE_MAX - align) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = (size + align - 1) / align * align;
+    if (block == NULL || block->size - block->used < size) {
+        size_t length = (size > ARENA_LARGE) ? size : ARENA_BLOCK;
+
+        block = NULL;
+        if (secret && size <= SECRET_SLOT - sizeof(struct putil_arena)) {
+            block = pool_get();
+            if (block != NULL)
+                length = block->size;
+        }
+        if (block == NULL) {
+            block = malloc(sizeof(struct putil_arena) + length);
+            if (block == NULL)
+                return NULL;
+            block->size = length;
+            block->used = 0;
+            block->pooled = false;
+        }
+
+        /*
+         * A large allocation doesn't become the current block, since it has
+         * no room left, unless there is no current block.
+         */
+        if (size > ARENA_LARGE && *list != NULL) {
+            block->next = (*list)->next;
+            (*list)->next = block;
+        } else {
+            block->next = *list;
+            *list = block;
+        }
+    }
+    result = (char *) block->data + block->used;
+    block->used += size;
+    memset(result, 0, size);
+    return result;
+}
+
+
+/*
+ * Free a list of arena blocks, overwriting the used part of each first if
+ * requested.
+ */
+static void
+arena_free(struct putil_arena *list, bool secret)
+{
+    struct putil_arena *block, *next;
+
+    for (block = list; block != NULL; block = next) {
+        next = block->next;
+        if (secret)
+            wipe(block->data, 0, block->used);
+        if (block->pooled)
+            pool_put(block);
+        else
+            free(block);
+    }
+}
+
+
+/*
+ * Allocate memory from the arena.
+ */
+void *
+putil_arena_alloc(struct pam_args *args, size_t size)
+{
+    return arena_alloc(&args->arena, size, false);
+}
+
+
+/*
+ * Allocate memory that will be overwritten when the arena is released.
+ */
+void *
+putil_arena_secret(struct pam_args *args, size_t size)
+{
+    return arena_alloc(&args->secrets, size, true);
+}
+
+
+/*
+ * Copy a string into the arena.
+ */
+char *
+putil_arena_strdup(struct pam_args *args, const char *string)
+{
+    size_t length = strlen(string) + 1;
+    char *copy;
+
+    copy = putil_arena_alloc(args, length);
+    if (copy != NULL)
+        memcpy(copy, string, length);
+    return copy;
+}
+
+
+/*
+ * Copy a string into secret memory in the arena.
+ */
+char *
+putil_arena_secret_strdup(struct pam_args *args, const char *string)
+{
+    size_t length = strlen(string) + 1;
+    char *copy;
+
+    copy = putil_arena_secret(args, length);
+    if (copy != NULL)
+        memcpy(copy, string, length);
+    return copy;
+}
+
+
+/*
+ * Format a string into the arena.  The length is determined with a first
+ * call to vsnprintf and the string is then formatted directly into the
+ * allocated memory.
+ */
+char *
+putil_arena_sprintf(struct pam_args *args, const char *fmt, ...)
+{
+    va_list ap;
+    int length;
+    char *result;
+
+    va_start(ap, fmt);
+    length = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (length < 0)
+        return NULL;
+    result = putil_arena_alloc(args, (size_t) length + 1);
+    if (result == NULL)
+        return NULL;
+    va_start(ap, fmt);
+    vsnprintf(result, (size_t) length + 1, fmt, ap);
+    va_end(ap);
+    return result;
+}
+
+
+/*
+ * Copy a secret string that has to outlive the arena.  The copy takes a slot
+ * in the secret pool if it fits and one is free, and otherwise comes from
+ * malloc.  Either way, it is released with putil_secret_free.
+ */
+char *
+putil_secret_strdup(const char *string)
+{
+    struct putil_arena *block = NULL;
+    size_t length = strlen(string) + 1;
+    char *copy;
+
+    if (length <= SECRET_SLOT - sizeof(struct putil_arena))
+        block = pool_get();
+    if (block != NULL) {
+        copy = (char *) block->data;
+        block->used = length;
+    } else {
+        copy = malloc(length);
+        if (copy == NULL)
+            return NULL;
+    }
+    memcpy(copy, string, length);
+    return copy;
+}
+
+
+/*
+ * Overwrite and free a secret string that didn't come from the arena, either
+ * one copied with putil_secret_strdup or one allocated with malloc by someone
+ * else, such as a response from the PAM conversation function.
+ */
+void
+putil_secret_free(char *secret)
+{
+    struct putil_arena *block;
+
+    if (secret == NULL)
+        return;
+    wipe(secret, 0, strlen(secret));
+    block = pool_find(secret);
+    if (block != NULL)
+        pool_put(block);
+    else
+        free(secret);
+}
+
+
+/*
+ * Release all memory in the arena.
+ */
+void
+putil_arena_free(struct pam_args *args)
+{
+    arena_free(args->arena, false);
+    arena_free(args->secrets, true);
+    args->arena = NULL;
+    args->secrets = NULL;
+}
@@ -0,0 +1,78 @@
+/*
+ * Prototypes for per-call memory allocation.
+ *
+ * Memory that is only needed until the end of the current PAM call can be
+ * allocated from an arena attached to the pam_args struct instead of with
+ * malloc.  The arena hands out pieces of a few large blocks and is released
+ * in one step by putil_args_free(), so none of these allocations have to be
+ * freed individually.  Memory that held a secret, such as a password, should
+ * be allocated with the secret variants, which are overwritten before the
+ * arena is released and, where the system allows, come from a pool of memory
+ * that is locked against swapping.
+ *
+ * All of the allocation functions return NULL with errno set on failure and
+ * leave reporting the error to the caller.  Allocated memory is zeroed.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef PAM_UTIL_ARENA_H
+#define PAM_UTIL_ARENA_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+
+#include <stddef.h>
+
+struct pam_args;
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all internal functions. */
+#pragma GCC visibility push(hidden)
+
+/* Allocate memory from the arena. */
+void *putil_arena_alloc(struct pam_args *, size_t)
+    __attribute__((__malloc__, __nonnull__));
+
+/* Allocate memory that will be overwritten when the arena is released. */
+void *putil_arena_secret(struct pam_args *, size_t)
+    __attribute__((__malloc__, __nonnull__));
+
+/* Copy a string into the arena, either normal or secret memory. */
+char *putil_arena_strdup(struct pam_args *, const char *)
+    __attribute__((__malloc__, __nonnull__));
+char *putil_arena_secret_strdup(struct pam_args *, const char *)
+    __attribute__((__malloc__, __nonnull__));
+
+/* Format a string into the arena. */
+char *putil_arena_sprintf(struct pam_args *, const char *, ...)
+    __attribute__((__format__(printf, 2, 3), __malloc__, __nonnull__));
+
+/*
+ * Copy a secret string that must outlive the arena, using the secret pool
+ * where possible.  Returns NULL on memory allocation failure.
+ */
+char *putil_secret_strdup(const char *)
+    __attribute__((__malloc__, __nonnull__));
+
+/*
+ * Overwrite and free a secret string that did not come from the arena, either
+ * one from putil_secret_strdup or a malloc'd one such as a PAM conversation
+ * response.  Does nothing if given NULL.
+ */
+void putil_secret_free(char *);
+
+/*
+ * Release all memory allocated from the arena, overwriting any secret memory
+ * first.  Called by putil_args_free(), but may also be called directly.
+ */
+void putil_arena_free(struct pam_args *)
+    __attribute__((__nonnull__));
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* !PAM_UTIL_ARENA_H */
@@ -46,22 +46,21 @@
 
 #include <errno.h>
 
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
 
 
 /*
  * Allocate a new pam_args struct and return it, or NULL on memory allocation
- * or Kerberos initialization failure.  If HAVE_KRB5 is defined, we also
- * allocate a Kerberos context.
+ * failure.  The Kerberos context, if any, is created separately by
+ * putil_args_krb5_context() so that callers with another source for it can
+ * avoid the cost of a full initialization.
  */
 struct pam_args *
 putil_args_new(pam_handle_t *pamh, int flags)
 {
     struct pam_args *args;
-#ifdef HAVE_KRB5
-    krb5_error_code status;
-#endif
 
     args = calloc(1, sizeof(struct pam_args));
     if (args == NULL) {
@@ -70,30 +69,48 @@ putil_args_new(pam_handle_t *pamh, int flags)
     }
     args->pamh = pamh;
     args->silent = ((flags & PAM_SILENT) == PAM_SILENT);
+    return args;
+}
+
 
 #ifdef HAVE_KRB5
+/*
+ * Create the Kerberos context for a pam_args struct if it doesn't already
+ * have one, using a secure context if we're running setuid or setgid.
+ * Returns true on success and false on failure, which will already have been
+ * reported with putil_err_krb5().
+ */
+bool
+putil_args_krb5_context(struct pam_args *args)
+{
+    krb5_error_code status;
+
+    if (args->ctx != NULL)
+        return true;
     if (issetugid())
         status = krb5_init_secure_context(&args->ctx);
     else
         status = krb5_init_context(&args->ctx);
     if (status != 0) {
+        args->ctx = NULL;
         putil_err_krb5(args, status, "cannot create Kerberos context");
-        free(args);
-        return NULL;
+        return false;
     }
-#endif /* HAVE_KRB5 */
-    return args;
+    return true;
 }
+#endif /* HAVE_KRB5 */
 
 
 /*
- * Free a pam_args struct.  The config member must be freed separately.
+ * Free a pam_args struct, including any memory allocated from its arena.  The
+ * config member must be freed separately.
  */
 void
 putil_args_free(struct pam_args *args)
 {
     if (args == NULL)
         return;
+    putil_arena_free(args);
 #ifdef HAVE_KRB5
     free(args->realm);
     if (args->ctx != NULL)
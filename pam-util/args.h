@@ -48,12 +48,36 @@
 /* Opaque struct from the PAM utility perspective. */
 struct pam_config;
 
+/* Per-call memory arena, defined in pam-util/arena.c. */
+struct putil_arena;
+
+/* Ring buffer of suppressed debug messages, defined in pam-util/recorder.c. */
+struct putil_recorder;
+
+/* Formats for log messages. */
+enum putil_log_format {
+    PUTIL_LOG_TEXT,             /* Plain text, prefixed with the user. */
+    PUTIL_LOG_KV,               /* Space-separated key=value fields. */
+    PUTIL_LOG_JSON              /* A JSON object. */
+};
+
 struct pam_args {
     pam_handle_t *pamh;         /* Pointer back to the PAM handle. */
     struct pam_config *config;  /* Per-module PAM configuration. */
     bool debug;                 /* Log debugging information. */
     bool silent;                /* Do not pass text to the application. */
+    bool nonblocking_log;       /* Log through pam-util/logqueue.c. */
     const char *user;           /* User being authenticated. */
+    struct putil_arena *arena;  /* Memory freed by putil_args_free. */
+    struct putil_arena *secrets; /* Same, but wiped before freeing. */
+    struct putil_recorder *recorder; /* Debug messages kept if not logged. */
+
+    /* Fields added to structured log messages, set by the module. */
+    enum putil_log_format log_format; /* Format of log messages. */
+    unsigned long long start;   /* Start of the call in microseconds. */
+    const char *tid;            /* Transaction ID shared by related calls. */
+    const char *principal;      /* Principal being authenticated. */
+    const char *phase;          /* What the module is doing. */
 
 #ifdef HAVE_KRB5
     krb5_context ctx;           /* Context for Kerberos operations. */
@@ -74,6 +98,16 @@ BEGIN_DECLS
 struct pam_args *putil_args_new(pam_handle_t *, int flags);
 void putil_args_free(struct pam_args *);
 
+#ifdef HAVE_KRB5
+/*
+ * Create the Kerberos context in the ctx member of the pam_args struct if it
+ * isn't already set.  Returns false on failure, which will already have been
+ * reported.
+ */
+bool putil_args_krb5_context(struct pam_args *)
+    __attribute__((__nonnull__));
+#endif
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 
@@ -39,9 +39,12 @@
 #include <portable/system.h>
 
 #include <syslog.h>
+#include <time.h>
 
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
+#include <pam-util/logqueue.h>
+#include <pam-util/recorder.h>
 
 #ifndef LOG_AUTHPRIV
 # define LOG_AUTHPRIV LOG_AUTH
@@ -70,15 +73,43 @@ static const struct {
 };
 
 
+/* Messages shorter than this are formatted without allocating memory. */
+#define LOG_BUFFER 512
+
+/*
+ * The size of a structured log record.  The last few bytes are kept back so
+ * that a truncated message can still be closed off.
+ */
+#define LOG_RECORD (LOG_BUFFER * 2)
+#define LOG_RESERVE 3
+
+/* A structured log record being built. */
+struct record {
+    enum putil_log_format format;
+    char data[LOG_RECORD];
+    size_t used;
+    bool full;
+};
+
+
 /*
- * Utility function to format a message into newly allocated memory, reporting
- * an error via syslog if vasprintf fails.
+ * Utility function to format a message.  The message is formatted into the
+ * provided buffer if it fits and into newly allocated memory otherwise, so
+ * the caller must free the result if it isn't the buffer.  Reports an error
+ * via syslog and returns NULL if vasprintf fails.
  */
 static char *
-format(const char *fmt, va_list args)
+format(char *buffer, size_t size, const char *fmt, va_list args)
 {
+    va_list copy;
     char *msg;
+    int length;
 
+    va_copy(copy, args);
+    length = vsnprintf(buffer, size, fmt, copy);
+    va_end(copy);
+    if (length >= 0 && (size_t) length < size)
+        return buffer;
     if (vasprintf(&msg, fmt, args) < 0) {
         syslog(LOG_CRIT | LOG_AUTHPRIV, "vasprintf failed: %m");
         return NULL;
@@ -87,48 +118,257 @@ format(const char *fmt, va_list args)
 }
 
 
+/*
+ * Return the current monotonic time in microseconds.
+ */
+static unsigned long long
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+    return (unsigned long long) ts.tv_sec * 1000000ULL
+           + (unsigned long long) ts.tv_nsec / 1000ULL;
+}
+
+
+/*
+ * Append a string to a structured record, noting if it doesn't fit.
+ */
+static void
+record_add(struct record *record, const char *string, size_t length)
+{
+    if (record->used + length + LOG_RESERVE >= sizeof(record->data)) {
+        record->full = true;
+        return;
+    }
+    memcpy(record->data + record->used, string, length);
+    record->used += length;
+}
+
+
+/*
+ * Append a field to a structured record.  Strings are always quoted in JSON
+ * and are quoted in key=value records only if they contain spaces, quotes,
+ * equal signs, or control characters.  Quotes and backslashes are escaped
+ * with backslashes and control characters in hex.  If the field doesn't fit,
+ * it is dropped, unless truncate is set, in which case as much of the value
+ * as fits is kept.  Does nothing if the value is NULL.
+ */
+static void
+record_field(struct record *record, const char *key, const char *value,
+             bool number, bool truncate)
+{
+    size_t start = record->used;
+    const unsigned char *p;
+    char escape[8];
+    bool json = (record->format == PUTIL_LOG_JSON);
+    bool quote;
+
+    if (value == NULL || record->full)
+        return;
+    if (start > (json ? 1 : 0))
+        record_add(record, json ? "," : " ", 1);
+    if (json) {
+        record_add(record, "\"", 1);
+        record_add(record, key, strlen(key));
+        record_add(record, "\":", 2);
+    } else {
+        record_add(record, key, strlen(key));
+        record_add(record, "=", 1);
+    }
+    quote = json && !number;
+    if (!json && !number) {
+        quote = (value[0] == '\0');
+        for (p = (const unsigned char *) value; *p != '\0' && !quote; p++)
+            if (*p <= ' ' || *p == '"' || *p == '=' || *p == '\\')
+                quote = true;
+    }
+    if (quote)
+        record_add(record, "\"", 1);
+    for (p = (const unsigned char *) value; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            escape[0] = '\\';
+            escape[1] = (char) *p;
+            record_add(record, escape, 2);
+        } else if (*p < ' ') {
+            snprintf(escape, sizeof(escape), json ? "\\u%04x" : "\\x%02x",
+                     (unsigned int) *p);
+            record_add(record, escape, strlen(escape));
+        } else {
+            record_add(record, (const char *) p, 1);
+        }
+    }
+    if (record->full && !truncate) {
+        record->used = start;
+        return;
+    }
+    if (quote)
+        record->data[record->used++] = '"';
+}
+
+
+/*
+ * Return the name of a syslog priority for structured records.
+ */
+static const char *
+priority_name(int priority)
+{
+    switch (priority) {
+    case LOG_CRIT:   return "crit";
+    case LOG_ERR:    return "err";
+    case LOG_NOTICE: return "notice";
+    case LOG_INFO:   return "info";
+    case LOG_DEBUG:  return "debug";
+    default:         return "other";
+    }
+}
+
+
+/*
+ * Log an already-formatted message as a structured record with the fields
+ * from pam_args.  code is the Kerberos error code, if any.
+ */
+static void
+log_structured(struct pam_args *pargs, int priority, const int *code,
+               const char *msg)
+{
+    struct record record;
+    const char *service = NULL;
+    char number[32];
+
+    record.format = pargs->log_format;
+    record.used = 0;
+    record.full = false;
+    if (record.format == PUTIL_LOG_JSON)
+        record_add(&record, "{", 1);
+    pam_get_item(pargs->pamh, PAM_SERVICE, (PAM_CONST void **) &service);
+    record_field(&record, "tid", pargs->tid, false, false);
+    record_field(&record, "service", service, false, false);
+    record_field(&record, "user", pargs->user, false, false);
+    record_field(&record, "principal", pargs->principal, false, false);
+    record_field(&record, "phase", pargs->phase, false, false);
+    record_field(&record, "priority", priority_name(priority), false, false);
+    if (code != NULL) {
+        snprintf(number, sizeof(number), "%d", *code);
+        record_field(&record, "krb5_code", number, true, false);
+    }
+    if (pargs->start != 0) {
+        snprintf(number, sizeof(number), "%llu", now() - pargs->start);
+        record_field(&record, "duration_us", number, true, false);
+    }
+    record_field(&record, "msg", msg, false, true);
+    if (record.format == PUTIL_LOG_JSON)
+        record.data[record.used++] = '}';
+    record.data[record.used] = '\0';
+    if (pargs->nonblocking_log)
+        putil_logq_send(pargs, priority, NULL, "%s", record.data);
+    else
+        pam_syslog(pargs->pamh, priority, "%s", record.data);
+}
+
+
+/*
+ * Whether a message at the given priority is wanted.  Debug messages are
+ * only wanted if debugging is enabled or there is a recorder to keep them.
+ */
+static bool
+log_wanted(struct pam_args *pargs, int priority)
+{
+    if (priority != LOG_DEBUG)
+        return true;
+    if (pargs == NULL)
+        return false;
+    return pargs->debug || pargs->recorder != NULL;
+}
+
+
 /*
  * Log wrapper function that adds the user.  Log a message with the given
  * priority, prefixed by (user <user>) with the account name being
- * authenticated if known.
+ * authenticated if known, or as a structured record if a structured format
+ * was selected, in which case code is the Kerberos error code if there is
+ * one.  Debug messages when debugging is off go to the recorder instead.
+ * The non-blocking backend formats the message only once, directly into the
+ * syslog record with the prefix.
  */
 static void
-log_vplain(struct pam_args *pargs, int priority, const char *fmt, va_list args)
+log_vcode(struct pam_args *pargs, int priority, const int *code,
+          const char *fmt, va_list args)
 {
+    char buffer[LOG_BUFFER];
     char *msg;
 
-    if (priority == LOG_DEBUG && (pargs == NULL || !pargs->debug))
+    if (!log_wanted(pargs, priority))
         return;
-    if (pargs != NULL && pargs->user != NULL) {
-        msg = format(fmt, args);
+    if (priority == LOG_DEBUG && !pargs->debug) {
+        msg = format(buffer, sizeof(buffer), fmt, args);
+        if (msg == NULL)
+            return;
+        putil_recorder_add(pargs->recorder, msg, strlen(msg));
+        if (msg != buffer)
+            free(msg);
+    } else if (pargs != NULL && pargs->log_format != PUTIL_LOG_TEXT) {
+        msg = format(buffer, sizeof(buffer), fmt, args);
+        if (msg == NULL)
+            return;
+        log_structured(pargs, priority, code, msg);
+        if (msg != buffer)
+            free(msg);
+    } else if (pargs != NULL && pargs->nonblocking_log) {
+        putil_logq_vsend(pargs, priority, pargs->user, fmt, args);
+    } else if (pargs != NULL && pargs->user != NULL) {
+        msg = format(buffer, sizeof(buffer), fmt, args);
         if (msg == NULL)
             return;
         pam_syslog(pargs->pamh, priority, "(user %s) %s", pargs->user, msg);
-        free(msg);
+        if (msg != buffer)
+            free(msg);
     } else if (pargs != NULL) {
         pam_vsyslog(pargs->pamh, priority, fmt, args);
     } else {
-        msg = format(fmt, args);
+        msg = format(buffer, sizeof(buffer), fmt, args);
         if (msg == NULL)
             return;
         syslog(priority | LOG_AUTHPRIV, "%s", msg);
-        free(msg);
+        if (msg != buffer)
+            free(msg);
     }
 }
 
 
 /*
- * Wrapper around log_vplain with variadic arguments.
+ * Wrappers around log_vcode for messages without a Kerberos error code, the
+ * second with variadic arguments.
  */
+static void
+log_vplain(struct pam_args *pargs, int priority, const char *fmt, va_list args)
+{
+    log_vcode(pargs, priority, NULL, fmt, args);
+}
+
 static void
 log_plain(struct pam_args *pargs, int priority, const char *fmt, ...)
 {
     va_list args;
 
     va_start(args, fmt);
-    log_vplain(pargs, priority, fmt, args);
+    log_vcode(pargs, priority, NULL, fmt, args);
+    va_end(args);
+}
+
+#ifdef HAVE_KRB5
+static void
+log_code(struct pam_args *pargs, int priority, int code, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    log_vcode(pargs, priority, &code, fmt, args);
     va_end(args);
 }
+#endif
 
 
 /*
@@ -142,11 +382,12 @@ static void
 log_pam(struct pam_args *pargs, int priority, int status, const char *fmt,
         va_list args)
 {
+    char buffer[LOG_BUFFER];
     char *msg;
 
-    if (priority == LOG_DEBUG && (pargs == NULL || !pargs->debug))
+    if (!log_wanted(pargs, priority))
         return;
-    msg = format(fmt, args);
+    msg = format(buffer, sizeof(buffer), fmt, args);
     if (msg == NULL)
         return;
     if (pargs == NULL)
@@ -156,7 +397,8 @@ log_pam(struct pam_args *pargs, int priority, int status, const char *fmt,
     else
         log_plain(pargs, priority, "%s: %s", msg,
                   pam_strerror(pargs->pamh, status));
-    free(msg);
+    if (msg != buffer)
+        free(msg);
 }
 
 
@@ -191,6 +433,27 @@ LOG_FUNCTION(notice, LOG_NOTICE)
 LOG_FUNCTION(debug,  LOG_DEBUG)
 
 
+/*
+ * Select the format of log messages.  The structured formats report the time
+ * since they were first selected for this pam_args struct.
+ */
+bool
+putil_log_format(struct pam_args *pargs, const char *name)
+{
+    if (strcmp(name, "text") == 0)
+        pargs->log_format = PUTIL_LOG_TEXT;
+    else if (strcmp(name, "kv") == 0)
+        pargs->log_format = PUTIL_LOG_KV;
+    else if (strcmp(name, "json") == 0)
+        pargs->log_format = PUTIL_LOG_JSON;
+    else
+        return false;
+    if (pargs->log_format != PUTIL_LOG_TEXT && pargs->start == 0)
+        pargs->start = now();
+    return true;
+}
+
+
 /*
  * Report entry into a function.  Takes the PAM arguments, the function name,
  * and the flags and maps the flags to symbolic names.
@@ -244,6 +507,8 @@ putil_log_entry(struct pam_args *pargs, const char *func, int flags)
 void
 putil_log_failure(struct pam_args *pargs, const char *fmt, ...)
 {
+    char buffer[LOG_BUFFER];
+    char record[LOG_BUFFER];
     char *msg;
     va_list args;
     const char *ruser = NULL;
@@ -254,21 +519,40 @@ putil_log_failure(struct pam_args *pargs, const char *fmt, ...)
     if (pargs->user != NULL)
         name = pargs->user;
     va_start(args, fmt);
-    msg = format(fmt, args);
+    msg = format(buffer, sizeof(buffer), fmt, args);
     if (msg == NULL)
         return;
     va_end(args);
     pam_get_item(pargs->pamh, PAM_RUSER, (PAM_CONST void **) &ruser);
     pam_get_item(pargs->pamh, PAM_RHOST, (PAM_CONST void **) &rhost);
     pam_get_item(pargs->pamh, PAM_TTY, (PAM_CONST void **) &tty);
-    pam_syslog(pargs->pamh, LOG_NOTICE, "%s; logname=%s uid=%ld euid=%ld"
-               " tty=%s ruser=%s rhost=%s", msg,
-               (name  != NULL) ? name  : "",
-               (long) getuid(), (long) geteuid(),
-               (tty   != NULL) ? tty   : "",
-               (ruser != NULL) ? ruser : "",
-               (rhost != NULL) ? rhost : "");
-    free(msg);
+    if (pargs->log_format != PUTIL_LOG_TEXT) {
+        snprintf(record, sizeof(record), "%s; logname=%s uid=%ld euid=%ld"
+                 " tty=%s ruser=%s rhost=%s", msg,
+                 (name  != NULL) ? name  : "",
+                 (long) getuid(), (long) geteuid(),
+                 (tty   != NULL) ? tty   : "",
+                 (ruser != NULL) ? ruser : "",
+                 (rhost != NULL) ? rhost : "");
+        log_structured(pargs, LOG_NOTICE, NULL, record);
+    } else if (pargs->nonblocking_log)
+        putil_logq_send(pargs, LOG_NOTICE, NULL, "%s; logname=%s uid=%ld"
+                        " euid=%ld tty=%s ruser=%s rhost=%s", msg,
+                        (name  != NULL) ? name  : "",
+                        (long) getuid(), (long) geteuid(),
+                        (tty   != NULL) ? tty   : "",
+                        (ruser != NULL) ? ruser : "",
+                        (rhost != NULL) ? rhost : "");
+    else
+        pam_syslog(pargs->pamh, LOG_NOTICE, "%s; logname=%s uid=%ld euid=%ld"
+                   " tty=%s ruser=%s rhost=%s", msg,
+                   (name  != NULL) ? name  : "",
+                   (long) getuid(), (long) geteuid(),
+                   (tty   != NULL) ? tty   : "",
+                   (ruser != NULL) ? ruser : "",
+                   (rhost != NULL) ? rhost : "");
+    if (msg != buffer)
+        free(msg);
 }
 
 
@@ -289,21 +573,23 @@ static void
 log_krb5(struct pam_args *pargs, int priority, int status, const char *fmt,
          va_list args)
 {
+    char buffer[LOG_BUFFER];
     char *msg;
     const char *k5_msg = NULL;
 
-    if (priority == LOG_DEBUG && (pargs == NULL || !pargs->debug))
+    if (!log_wanted(pargs, priority))
         return;
-    msg = format(fmt, args);
+    msg = format(buffer, sizeof(buffer), fmt, args);
     if (msg == NULL)
         return;
     if (pargs != NULL && pargs->ctx != NULL) {
         k5_msg = krb5_get_error_message(pargs->ctx, status);
-        log_plain(pargs, priority, "%s: %s", msg, k5_msg);
+        log_code(pargs, priority, status, "%s: %s", msg, k5_msg);
     } else {
-        log_plain(pargs, priority, "%s", msg);
+        log_code(pargs, priority, status, "%s", msg);
     }
-    free(msg);
+    if (msg != buffer)
+        free(msg);
     if (k5_msg != NULL)
         krb5_free_error_message(pargs->ctx, k5_msg);
 }
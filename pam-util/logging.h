@@ -36,6 +36,7 @@
 # include <portable/krb5.h>
 #endif
 #include <portable/pam.h>
+#include <portable/stdbool.h>
 
 #include <stddef.h>
 #include <syslog.h>
@@ -87,6 +88,16 @@ void putil_debug_krb5(struct pam_args *, int, const char *, ...)
     __attribute__((__format__(printf, 3, 4)));
 #endif
 
+/*
+ * Select the format of log messages by name: text, kv, or json.  The
+ * structured formats log the message with the service, the user, the
+ * Kerberos error code for the _krb5 functions, the time since this was
+ * called, and the tid, principal, and phase members of pam_args if set.
+ * Returns false if the name is not recognized.
+ */
+bool putil_log_format(struct pam_args *, const char *)
+    __attribute__((__nonnull__));
+
 /* Log entry to a PAM function. */
 void putil_log_entry(struct pam_args *, const char *, int flags)
     __attribute__((__nonnull__));
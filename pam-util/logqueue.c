@@ -0,0 +1,402 @@
+/*
+ * Non-blocking logging for PAM modules.
+ *
+ * syslog(3) and pam_syslog block when the local syslog daemon isn't reading
+ * fast enough, which stalls every login going through the module.  Instead,
+ * format each message once into a syslog record on the stack and send it on
+ * a non-blocking datagram socket connected to the local log socket.  If the
+ * socket would block, the record is queued in a small process-wide queue,
+ * which is drained, most important records first, before anything else is
+ * sent.  When the queue is full, the least important record is dropped.
+ * Dropped records are counted, and the count is logged when records can be
+ * sent again, at most once per REPORT_INTERVAL.  If there is no syslog daemon
+ * listening on the socket, records are logged with pam_syslog instead, which
+ * may block but at least doesn't lose them.
+ *
+ * Without threads to protect the queue, messages are logged with pam_syslog
+ * as usual.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <pam-util/args.h>
+#include <pam-util/logqueue.h>
+
+#ifndef LOG_AUTHPRIV
+# define LOG_AUTHPRIV LOG_AUTH
+#endif
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+/* The local syslog socket.  The test suite uses its own. */
+#ifndef LOG_PATH
+# define LOG_PATH "/dev/log"
+#endif
+
+/* The longest record sent.  Longer messages are truncated. */
+#define LOG_RECORD 1024
+
+
+#ifndef HAVE_PTHREAD_H
+
+/*
+ * Log a message with pam_syslog.
+ */
+void
+putil_logq_vsend(struct pam_args *pargs, int priority, const char *user,
+                 const char *fmt, va_list args)
+{
+    char buffer[LOG_RECORD];
+
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    if (user != NULL)
+        pam_syslog(pargs->pamh, priority, "(user %s) %s", user, buffer);
+    else
+        pam_syslog(pargs->pamh, priority, "%s", buffer);
+}
+
+#else /* HAVE_PTHREAD_H */
+
+/* Number of records that can wait for the socket. */
+#define QUEUE_SLOTS 16
+
+/* Minimum seconds between reports of dropped records. */
+#define REPORT_INTERVAL 60
+
+/* The result of trying to send a record. */
+enum send_status {
+    SEND_OK,                    /* Sent. */
+    SEND_BUSY,                  /* The socket is full; try again later. */
+    SEND_FAILED                 /* No syslog daemon listening. */
+};
+
+/* A record waiting to be sent. */
+struct record {
+    int priority;               /* Priority, lower is more important. */
+    size_t length;              /* Length of the record. */
+    size_t message;             /* Offset of the message in the record. */
+    char data[LOG_RECORD];      /* The formatted record, nul-terminated. */
+};
+
+/*
+ * The queue, in the order the records were logged, and the socket.  All are
+ * protected by queue_lock.
+ */
+static struct record queue[QUEUE_SLOTS];
+static size_t queued = 0;
+static unsigned long dropped = 0;
+static time_t last_report = 0;
+static int log_fd = -1;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Close the socket at unload. */
+static void logq_free(void) __attribute__((__destructor__));
+
+
+/*
+ * Format a syslog record for a message into the provided buffer and return
+ * its length, storing in message the offset of the message after the syslog
+ * header.  The record is truncated if it doesn't fit.
+ */
+static size_t
+format_vrecord(char *buffer, size_t size, size_t *message,
+               struct pam_args *pargs, int priority, const char *user,
+               const char *fmt, va_list args)
+{
+    const char *service = NULL;
+    char stamp[32];
+    struct tm tm;
+    time_t now;
+    size_t length;
+    int status;
+
+    pam_get_item(pargs->pamh, PAM_SERVICE, (PAM_CONST void **) &service);
+    now = time(NULL);
+    if (localtime_r(&now, &tm) == NULL
+        || strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm) == 0)
+        stamp[0] = '\0';
+    status = snprintf(buffer, size, "<%d>%s %s[%lu]: %s: ",
+                      LOG_AUTHPRIV | priority, stamp,
+                      service != NULL ? service : "pam",
+                      (unsigned long) getpid(), PACKAGE_TARNAME);
+    if (status < 0)
+        return 0;
+    length = (size_t) status;
+    *message = (length < size) ? length : size - 1;
+    if (user != NULL && length < size) {
+        status = snprintf(buffer + length, size - length, "(user %s) ", user);
+        if (status < 0)
+            return 0;
+        length += (size_t) status;
+    }
+    if (length < size) {
+        status = vsnprintf(buffer + length, size - length, fmt, args);
+        if (status < 0)
+            return 0;
+        length += (size_t) status;
+    }
+    return (length < size) ? length : size - 1;
+}
+
+
+/*
+ * Wrapper around format_vrecord with variadic arguments.
+ */
+static size_t
+format_record(char *buffer, size_t size, size_t *message,
+              struct pam_args *pargs, int priority, const char *user,
+              const char *fmt, ...)
+{
+    va_list args;
+    size_t length;
+
+    va_start(args, fmt);
+    length = format_vrecord(buffer, size, message, pargs, priority, user, fmt,
+                            args);
+    va_end(args);
+    return length;
+}
+
+
+/*
+ * Connect the non-blocking socket to the local log socket if it isn't
+ * already.  Returns false on failure.
+ */
+static bool
+log_connect(void)
+{
+    struct sockaddr_un addr;
+    int fd, flags;
+
+    if (log_fd >= 0)
+        return true;
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return false;
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        goto fail;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, LOG_PATH, sizeof(addr.sun_path));
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        goto fail;
+    log_fd = fd;
+    return true;
+
+fail:
+    close(fd);
+    return false;
+}
+
+
+/*
+ * Send a record without blocking.  If the syslog daemon went away, reconnect
+ * and try once more.
+ */
+static enum send_status
+log_send(const char *data, size_t length)
+{
+    int tries;
+
+    for (tries = 0; tries < 2; tries++) {
+        if (!log_connect())
+            return SEND_FAILED;
+        if (send(log_fd, data, length, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+            return SEND_OK;
+        if (errno == EAGAIN || errno == ENOBUFS || errno == EINTR)
+            return SEND_BUSY;
+#if EWOULDBLOCK != EAGAIN
+        if (errno == EWOULDBLOCK)
+            return SEND_BUSY;
+#endif
+        close(log_fd);
+        log_fd = -1;
+    }
+    return SEND_FAILED;
+}
+
+
+/*
+ * Send a record, falling back on pam_syslog with just its message if there
+ * is no syslog daemon listening.  Returns false only if the socket is full.
+ */
+static bool
+log_deliver(struct pam_args *pargs, int priority, const char *data,
+            size_t length, size_t message)
+{
+    switch (log_send(data, length)) {
+    case SEND_BUSY:
+        return false;
+    case SEND_FAILED:
+        pam_syslog(pargs->pamh, priority, "%s", data + message);
+        break;
+    case SEND_OK:
+        break;
+    }
+    return true;
+}
+
+
+/*
+ * Remove the record at the given position from the queue.
+ */
+static void
+queue_remove(size_t i)
+{
+    queued--;
+    if (i < queued)
+        memmove(&queue[i], &queue[i + 1], (queued - i) * sizeof(queue[0]));
+}
+
+
+/*
+ * Send the queued records, most important first and otherwise in the order
+ * they were logged.  Returns true if the queue is now empty and false if the
+ * socket is still full.
+ */
+static bool
+queue_drain(struct pam_args *pargs)
+{
+    size_t i, best;
+
+    while (queued > 0) {
+        best = 0;
+        for (i = 1; i < queued; i++)
+            if (queue[i].priority < queue[best].priority)
+                best = i;
+        if (!log_deliver(pargs, queue[best].priority, queue[best].data,
+                         queue[best].length, queue[best].message))
+            return false;
+        queue_remove(best);
+    }
+    return true;
+}
+
+
+/*
+ * Queue a record that couldn't be sent.  If the queue is full, drop the most
+ * recent of its least important records if that is less important than this
+ * one, and otherwise drop this one.
+ */
+static void
+queue_add(int priority, const char *data, size_t length, size_t message)
+{
+    size_t i, worst;
+
+    if (queued == QUEUE_SLOTS) {
+        worst = 0;
+        for (i = 1; i < queued; i++)
+            if (queue[i].priority >= queue[worst].priority)
+                worst = i;
+        dropped++;
+        if (queue[worst].priority <= priority)
+            return;
+        queue_remove(worst);
+    }
+    queue[queued].priority = priority;
+    queue[queued].length = length;
+    queue[queued].message = message;
+    memcpy(queue[queued].data, data, length + 1);
+    queued++;
+}
+
+
+/*
+ * Report how many records were dropped, if any, and enough time has passed
+ * since the last report.  Called only when the socket has room.
+ */
+static void
+report_dropped(struct pam_args *pargs)
+{
+    char record[LOG_RECORD];
+    size_t length, message;
+    time_t now;
+
+    if (dropped == 0)
+        return;
+    now = time(NULL);
+    if (now - last_report < REPORT_INTERVAL)
+        return;
+    length = format_record(record, sizeof(record), &message, pargs,
+                           LOG_WARNING, NULL, "dropped %lu log messages",
+                           dropped);
+    if (length > 0
+        && log_deliver(pargs, LOG_WARNING, record, length, message)) {
+        dropped = 0;
+        last_report = now;
+    }
+}
+
+
+/*
+ * Log a message without blocking.
+ */
+void
+putil_logq_vsend(struct pam_args *pargs, int priority, const char *user,
+                 const char *fmt, va_list args)
+{
+    char record[LOG_RECORD];
+    size_t length, message;
+
+    length = format_vrecord(record, sizeof(record), &message, pargs,
+                            priority, user, fmt, args);
+    if (length == 0)
+        return;
+    pthread_mutex_lock(&queue_lock);
+    if (!queue_drain(pargs)
+        || !log_deliver(pargs, priority, record, length, message))
+        queue_add(priority, record, length, message);
+    else
+        report_dropped(pargs);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+
+/*
+ * Close the socket when the module is unloaded.  Anything still queued is
+ * lost.
+ */
+static void
+logq_free(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = -1;
+    queued = 0;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+
+/*
+ * Wrapper around putil_logq_vsend with variadic arguments.
+ */
+void
+putil_logq_send(struct pam_args *pargs, int priority, const char *user,
+                const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    putil_logq_vsend(pargs, priority, user, fmt, args);
+    va_end(args);
+}
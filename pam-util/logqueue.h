@@ -0,0 +1,47 @@
+/*
+ * Prototypes for non-blocking logging.
+ *
+ * When the nonblocking_log member of pam_args is set, the logging functions
+ * send their messages straight to the local syslog socket without waiting.
+ * If the socket is full, messages wait in a small process-wide queue and are
+ * sent ahead of later ones once it drains.  If the queue is full too, the
+ * least important message is dropped, so errors and authentication results
+ * are kept in preference to debugging output, and the number dropped is
+ * reported once messages can be sent again.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef PAM_UTIL_LOGQUEUE_H
+#define PAM_UTIL_LOGQUEUE_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+
+#include <stdarg.h>
+
+struct pam_args;
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all internal functions. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * Format a message and log it at the given priority without blocking,
+ * prefixed by (user <user>) if user is not NULL.  The message is formatted
+ * once, directly into the syslog record.
+ */
+void putil_logq_vsend(struct pam_args *, int priority, const char *user,
+                      const char *fmt, va_list)
+    __attribute__((__format__(printf, 4, 0)));
+void putil_logq_send(struct pam_args *, int priority, const char *user,
+                     const char *fmt, ...)
+    __attribute__((__format__(printf, 4, 5)));
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* !PAM_UTIL_LOGQUEUE_H */
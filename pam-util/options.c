@@ -38,6 +38,13 @@
 #include <portable/system.h>
 
 #include <errno.h>
+#ifdef HAVE_KRB5
+# ifdef HAVE_K5PROFILE_H
+#  include <k5profile.h>
+# elif defined(HAVE_PROFILE_H)
+#  include <profile.h>
+# endif
+#endif
 
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
@@ -67,6 +74,30 @@
 # define CONF_TIME(c, o) (long *)       (void *)((char *) (c) + (o))
 #endif
 
+/*
+ * We can read all of the krb5.conf settings in one pass if the Kerberos
+ * library exposes its profile iteration interface (MIT Kerberos does).
+ */
+#if defined(HAVE_KRB5) && defined(HAVE_KRB5_GET_PROFILE)       \
+    && defined(HAVE_PROFILE_ITERATOR_CREATE)                    \
+    && (defined(HAVE_K5PROFILE_H) || defined(HAVE_PROFILE_H))
+# define HAVE_PROFILE_ITERATION 1
+#endif
+
+
+/*
+ * Replace the value of a string setting, freeing the previous value unless it
+ * is the default for the option.  String defaults are referenced rather than
+ * copied, since they are normally string constants in the option table.
+ */
+static void
+replace_string(const struct option *option, char **setting, char *value)
+{
+    if (*setting != option->defaults.string)
+        free(*setting);
+    *setting = value;
+}
+
 
 /*
  * Set a vector argument to its default.  This needs to do a deep copy of the
@@ -161,16 +192,7 @@ putil_args_defaults(struct pam_args *args, const struct option options[],
             break;
         case TYPE_STRING:
             sp = CONF_STRING(args->config, options[opt].location);
-            if (options[opt].defaults.string == NULL)
-                *sp = NULL;
-            else {
-                *sp = strdup(options[opt].defaults.string);
-                if (*sp == NULL) {
-                    putil_crit(args, "cannot allocate memory: %s",
-                               strerror(errno));
-                    return false;
-                }
-            }
+            *sp = (char *) options[opt].defaults.string;
             break;
         case TYPE_LIST:
             vp = CONF_LIST(args->config, options[opt].location);
@@ -188,7 +210,149 @@ putil_args_defaults(struct pam_args *args, const struct option options[],
 }
 
 
+/*
+ * Free the string and list settings in a configuration struct for the first
+ * optlen entries of the option table and clear them.  String settings that
+ * still point to the default are not freed.
+ */
+void
+putil_args_free_settings(struct pam_config *config,
+                         const struct option options[], size_t optlen)
+{
+    size_t opt;
+    char **sp;
+    struct vector **vp;
+
+    for (opt = 0; opt < optlen; opt++) {
+        switch (options[opt].type) {
+        case TYPE_STRING:
+            sp = CONF_STRING(config, options[opt].location);
+            replace_string(&options[opt], sp, NULL);
+            break;
+        case TYPE_LIST:
+        case TYPE_STRLIST:
+            vp = CONF_LIST(config, options[opt].location);
+            vector_free(*vp);
+            *vp = NULL;
+            break;
+        case TYPE_BOOLEAN:
+        case TYPE_NUMBER:
+        case TYPE_TIME:
+            break;
+        }
+    }
+}
+
+
+/*
+ * Copy the settings for every option in the table from one configuration
+ * struct to another, making deep copies of strings and lists.  Any members of
+ * the struct that aren't described by the option table are left alone.
+ * The string and list settings in the destination must be NULL.  Returns
+ * true on success and false on memory allocation failure, which is also
+ * reported with putil_crit().  On failure, the destination is left with no
+ * allocated settings.
+ */
+bool
+putil_args_copy(struct pam_args *args, struct pam_config *dest,
+                const struct pam_config *src, const struct option options[],
+                size_t optlen)
+{
+    size_t opt;
+
+    for (opt = 0; opt < optlen; opt++) {
+        size_t offset = options[opt].location;
+        char *string;
+        struct vector *list;
+
+        switch (options[opt].type) {
+        case TYPE_BOOLEAN:
+            *CONF_BOOL(dest, offset) = *CONF_BOOL(src, offset);
+            break;
+        case TYPE_NUMBER:
+            *CONF_NUMBER(dest, offset) = *CONF_NUMBER(src, offset);
+            break;
+        case TYPE_TIME:
+            *CONF_TIME(dest, offset) = *CONF_TIME(src, offset);
+            break;
+        case TYPE_STRING:
+            string = *CONF_STRING(src, offset);
+            if (string != NULL && string != options[opt].defaults.string) {
+                string = strdup(string);
+                if (string == NULL)
+                    goto fail;
+            }
+            *CONF_STRING(dest, offset) = string;
+            break;
+        case TYPE_LIST:
+        case TYPE_STRLIST:
+            list = *CONF_LIST(src, offset);
+            if (list != NULL) {
+                list = vector_copy(list);
+                if (list == NULL)
+                    goto fail;
+            }
+            *CONF_LIST(dest, offset) = list;
+            break;
+        }
+    }
+    return true;
+
+fail:
+    putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+    putil_args_free_settings(dest, options, opt);
+    return false;
+}
+
+
 #ifdef HAVE_KRB5
+/*
+ * Convert the string value of a number setting from krb5.conf and store it
+ * in result.  An empty string leaves the setting unchanged, and an invalid
+ * number is reported and also leaves it unchanged.
+ */
+static void
+krb5conf_number(struct pam_args *args, const char *opt, char *string,
+                long *result)
+{
+    char *end;
+    long value;
+
+    if (string[0] == '\0')
+        return;
+    errno = 0;
+    value = strtol(string, &end, 10);
+    if (errno != 0 || *end != '\0')
+        putil_err(args, "invalid number in krb5.conf setting for %s: %s",
+                  opt, string);
+    else
+        *result = value;
+}
+
+
+/*
+ * Convert the string value of a time setting from krb5.conf using
+ * krb5_string_to_deltat and store it in result.  Empty and invalid values
+ * are handled the same as for krb5conf_number.
+ */
+static void
+krb5conf_time(struct pam_args *args, const char *opt, char *string,
+              krb5_deltat *result)
+{
+    krb5_deltat value;
+    krb5_error_code retval;
+
+    if (string[0] == '\0')
+        return;
+    retval = krb5_string_to_deltat(string, &value);
+    if (retval != 0)
+        putil_err(args, "invalid time in krb5.conf setting for %s: %s",
+                  opt, string);
+    else
+        *result = value;
+}
+
+
 /*
  * Load a boolean option from Kerberos appdefaults.  Takes the PAM argument
  * struct, the section name, the realm, the option, and the result location.
@@ -238,8 +402,6 @@ default_number(struct pam_args *args, const char *section, const char *realm,
                const char *opt, long *result)
 {
     char *tmp = NULL;
-    char *end;
-    long value;
 #ifdef HAVE_KRB5_REALM
     krb5_const_realm rdata = realm;
 #else
@@ -257,15 +419,8 @@ default_number(struct pam_args *args, const char *section, const char *realm,
 #endif
 
     krb5_appdefault_string(args->ctx, section, rdata, opt, "", &tmp);
-    if (tmp != NULL && tmp[0] != '\0') {
-        errno = 0;
-        value = strtol(tmp, &end, 10);
-        if (errno != 0 || *end != '\0')
-            putil_err(args, "invalid number in krb5.conf setting for %s: %s",
-                      opt, tmp);
-        else
-            *result = value;
-    }
+    if (tmp != NULL)
+        krb5conf_number(args, opt, tmp, result);
     free(tmp);
 }
 
@@ -281,8 +436,6 @@ default_time(struct pam_args *args, const char *section, const char *realm,
              const char *opt, krb5_deltat *result)
 {
     char *tmp = NULL;
-    krb5_deltat value;
-    krb5_error_code retval;
 #ifdef HAVE_KRB5_REALM
     krb5_const_realm rdata = realm;
 #else
@@ -300,14 +453,8 @@ default_time(struct pam_args *args, const char *section, const char *realm,
 #endif
 
     krb5_appdefault_string(args->ctx, section, rdata, opt, "", &tmp);
-    if (tmp != NULL && tmp[0] != '\0') {
-        retval = krb5_string_to_deltat(tmp, &value);
-        if (retval != 0)
-            putil_err(args, "invalid time in krb5.conf setting for %s: %s",
-                      opt, tmp);
-        else
-            *result = value;
-    }
+    if (tmp != NULL)
+        krb5conf_time(args, opt, tmp, result);
     free(tmp);
 }
 
@@ -388,34 +535,19 @@ default_list(struct pam_args *args, const char *section, const char *realm,
 
 
 /*
- * The public interface for getting configuration information from krb5.conf.
- * Takes the PAM arguments, the krb5.conf section, the options specification,
- * and the number of options in the options table.  The config member of the
- * args struct must already be allocated.  Iterate through the option list
- * and, for every option where krb5_config is true, see if it's set in the
- * Kerberos configuration.
- *
- * This looks obviously slow, but there haven't been any reports of problems
- * and there's no better interface.  But if you wonder where the cycles in
- * your computer are getting wasted, well, here's one place.
+ * Look up every option where krb5_config is true, one at a time, with the
+ * krb5_appdefault_* functions.  Each lookup searches the [appdefaults] section
+ * again, so this is linear in the number of options times the size of that
+ * section.  Used when the profile iteration interface isn't available.
+ * Returns false on memory allocation failure.
  */
-bool
-putil_args_krb5(struct pam_args *args, const char *section,
-                const struct option options[], size_t optlen)
+static bool
+load_options(struct pam_args *args, const char *section, const char *realm,
+             const struct option options[], size_t optlen)
 {
     size_t i;
-    char *realm;
-    bool free_realm = false;
+    char *value;
 
-    /* Having no local realm may be intentional, so don't report an error. */
-    if (args->realm != NULL)
-        realm = args->realm;
-    else {
-        if (krb5_get_default_realm(args->ctx, &realm) < 0)
-            realm = NULL;
-        else
-            free_realm = true;
-    }
     for (i = 0; i < optlen; i++) {
         const struct option *opt = &options[i];
 
@@ -435,8 +567,11 @@ putil_args_krb5(struct pam_args *args, const char *section,
                          CONF_TIME(args->config, opt->location));
             break;
         case TYPE_STRING:
-            default_string(args, section, realm, opt->name,
-                           CONF_STRING(args->config, opt->location));
+            value = NULL;
+            default_string(args, section, realm, opt->name, &value);
+            if (value != NULL)
+                replace_string(opt, CONF_STRING(args->config, opt->location),
+                               value);
             break;
         case TYPE_LIST:
         case TYPE_STRLIST:
@@ -446,9 +581,241 @@ putil_args_krb5(struct pam_args *args, const char *section,
             break;
         }
     }
+    return true;
+}
+
+
+#ifdef HAVE_PROFILE_ITERATION
+/*
+ * bsearch comparison function for finding a krb5.conf relation name in an
+ * array of struct options.
+ */
+static int
+name_compare(const void *key, const void *member)
+{
+    const char *name = key;
+    const struct option *option = member;
+
+    return strcmp(name, option->name);
+}
+
+
+/*
+ * Convert a boolean value from krb5.conf the way that MIT Kerberos's
+ * krb5_appdefault_boolean does.  Anything that isn't recognized as true is
+ * false.
+ */
+static bool
+krb5conf_boolean(const char *string)
+{
+    static const char *const yes[] = { "y", "yes", "true", "t", "1", "on" };
+    size_t i;
+
+    for (i = 0; i < sizeof(yes) / sizeof(yes[0]); i++)
+        if (strcasecmp(string, yes[i]) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Store the value of a krb5.conf relation in the setting for an option,
+ * converting it to the option's type with the same rules as the
+ * krb5_appdefault_* path.  Returns false on memory allocation failure.
+ */
+static bool
+set_krb5_option(struct pam_args *args, const struct option *opt,
+                char *value)
+{
+    char **sp;
+    char *copy;
+    struct vector **vp;
+    struct vector *list;
+
+    switch (opt->type) {
+    case TYPE_BOOLEAN:
+        *CONF_BOOL(args->config, opt->location) = krb5conf_boolean(value);
+        break;
+    case TYPE_NUMBER:
+        krb5conf_number(args, opt->name, value,
+                        CONF_NUMBER(args->config, opt->location));
+        break;
+    case TYPE_TIME:
+        krb5conf_time(args, opt->name, value,
+                      CONF_TIME(args->config, opt->location));
+        break;
+    case TYPE_STRING:
+        if (value[0] == '\0')
+            break;
+        copy = strdup(value);
+        if (copy == NULL) {
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+            return false;
+        }
+        sp = CONF_STRING(args->config, opt->location);
+        replace_string(opt, sp, copy);
+        break;
+    case TYPE_LIST:
+    case TYPE_STRLIST:
+        if (value[0] == '\0')
+            break;
+        list = vector_split_multi(value, " \t,", NULL);
+        if (list == NULL) {
+            putil_crit(args, "cannot allocate vector: %s", strerror(errno));
+            return false;
+        }
+        vp = CONF_LIST(args->config, opt->location);
+        vector_free(*vp);
+        *vp = list;
+        break;
+    }
+    return true;
+}
+
+
+/*
+ * Walk the relations directly inside one [appdefaults] section, given as a
+ * NULL-terminated list of names, and store the value of each one that names
+ * an option with krb5_config set and isn't already marked in seen.  The first
+ * value for an option wins, matching krb5_appdefault_*, and an empty value
+ * still counts as set.  A missing section is not an error.  Returns false on
+ * memory allocation failure.
+ */
+static bool
+load_section(struct pam_args *args, profile_t profile, const char **names,
+             const struct option options[], size_t optlen, bool *seen)
+{
+    const int flags = PROFILE_ITER_LIST_SECTION | PROFILE_ITER_RELATIONS_ONLY;
+    const struct option *opt;
+    void *iter;
+    char *name, *value;
+    size_t i;
+    bool okay = true;
+
+    if (profile_iterator_create(profile, names, flags, &iter) != 0)
+        return true;
+    while (okay) {
+        if (profile_iterator(&iter, &name, &value) != 0 || name == NULL)
+            break;
+        opt = bsearch(name, options, optlen, sizeof(struct option),
+                      name_compare);
+        if (opt != NULL && opt->krb5_config && value != NULL) {
+            i = (size_t) (opt - options);
+            if (!seen[i]) {
+                seen[i] = true;
+                okay = set_krb5_option(args, opt, value);
+            }
+        }
+        profile_release_string(name);
+        if (value != NULL)
+            profile_release_string(value);
+    }
+    profile_iterator_free(&iter);
+    return okay;
+}
+
+
+/*
+ * Load all of the options where krb5_config is true in a single pass over
+ * the [appdefaults] section using the profile iteration interface.  The four
+ * places an option can be set are visited in the same order of precedence
+ * that krb5_appdefault_* uses: section and then realm inside the
+ * application section, the application section, the realm section, and
+ * finally the top level.  Each relation is dispatched into the option table
+ * by name, so the cost doesn't depend on the number of options.
+ *
+ * Returns 1 on success, 0 on memory allocation failure, and -1 if the
+ * profile isn't available, in which case the caller should fall back on
+ * load_options.
+ */
+static int
+load_profile(struct pam_args *args, const char *section, const char *realm,
+             const struct option options[], size_t optlen)
+{
+    profile_t profile;
+    bool *seen;
+    const char *names[4];
+    int status = 0;
+
+    if (krb5_get_profile(args->ctx, &profile) != 0)
+        return -1;
+    seen = calloc(optlen, sizeof(bool));
+    if (seen == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        goto done;
+    }
+    names[0] = "appdefaults";
+    names[1] = section;
+    if (realm != NULL) {
+        names[2] = realm;
+        names[3] = NULL;
+        if (!load_section(args, profile, names, options, optlen, seen))
+            goto done;
+    }
+    names[2] = NULL;
+    if (!load_section(args, profile, names, options, optlen, seen))
+        goto done;
+    if (realm != NULL) {
+        names[1] = realm;
+        if (!load_section(args, profile, names, options, optlen, seen))
+            goto done;
+    }
+    names[1] = NULL;
+    if (!load_section(args, profile, names, options, optlen, seen))
+        goto done;
+    status = 1;
+
+done:
+    free(seen);
+    profile_release(profile);
+    return status;
+}
+#endif /* HAVE_PROFILE_ITERATION */
+
+
+/*
+ * The public interface for getting configuration information from krb5.conf.
+ * Takes the PAM arguments, the krb5.conf section, the options specification,
+ * and the number of options in the options table.  The config member of the
+ * args struct must already be allocated.  For every option where krb5_config
+ * is true, see if it's set in the Kerberos configuration.
+ *
+ * If the Kerberos library supports it, this reads [appdefaults] in a single
+ * pass.  Otherwise, it falls back on looking up each option separately,
+ * which is much slower for large krb5.conf files.
+ */
+bool
+putil_args_krb5(struct pam_args *args, const char *section,
+                const struct option options[], size_t optlen)
+{
+    char *realm;
+    bool free_realm = false;
+    bool okay;
+#ifdef HAVE_PROFILE_ITERATION
+    int status;
+#endif
+
+    /* Having no local realm may be intentional, so don't report an error. */
+    if (args->realm != NULL)
+        realm = args->realm;
+    else {
+        if (krb5_get_default_realm(args->ctx, &realm) < 0)
+            realm = NULL;
+        else
+            free_realm = true;
+    }
+#ifdef HAVE_PROFILE_ITERATION
+    status = load_profile(args, section, realm, options, optlen);
+    if (status < 0)
+        okay = load_options(args, section, realm, options, optlen);
+    else
+        okay = (status > 0);
+#else
+    okay = load_options(args, section, realm, options, optlen);
+#endif
     if (free_realm)
         krb5_free_default_realm(args->ctx, realm);
-    return true;
+    return okay;
 }
 
 #else /* !HAVE_KRB5 */
@@ -469,31 +836,69 @@ putil_args_krb5(struct pam_args *args UNUSED, const char *section UNUSED,
 
 
 /*
- * bsearch comparison function for finding PAM arguments in an array of struct
- * options.  We only compare up to the first '=' in the key so that we don't
- * have to munge the string before searching.
+ * A PAM argument split into the option name and its value.  Arguments are
+ * scanned once for the '=' and the result is used for both the option lookup
+ * and the conversion of the value.
+ */
+struct argument {
+    const char *arg;            /* The complete argument, for errors. */
+    size_t length;              /* Length of the option name. */
+    const char *value;          /* Value after the '=', or NULL if none. */
+};
+
+
+/*
+ * Split a PAM argument into the option name and value.
+ */
+static void
+split_argument(const char *arg, struct argument *argument)
+{
+    const char *p;
+
+    p = strchr(arg, '=');
+    argument->arg = arg;
+    if (p == NULL) {
+        argument->length = strlen(arg);
+        argument->value = NULL;
+    } else {
+        argument->length = (size_t) (p - arg);
+        argument->value = p + 1;
+    }
+}
+
+
+/*
+ * bsearch comparison function for finding a split PAM argument in an array of
+ * struct options.  The name length is already known, so this is a single
+ * bounded comparison followed by a check that the option name doesn't
+ * continue past the end of the argument name.
  */
 static int
 option_compare(const void *key, const void *member)
 {
-    const char *string = key;
+    const struct argument *argument = key;
     const struct option *option = member;
-    const char *p;
-    size_t length;
     int result;
 
-    p = strchr(string, '=');
-    if (p == NULL)
-        return strcmp(string, option->name);
-    else {
-        length = (size_t) (p - string);
-        if (length == 0)
-            return -1;
-        result = strncmp(string, option->name, length);
-        if (result == 0 && strlen(option->name) > length)
-            return -1;
-        return result;
-    }
+    if (argument->length == 0)
+        return -1;
+    result = strncmp(argument->arg, option->name, argument->length);
+    if (result == 0 && option->name[argument->length] != '\0')
+        return -1;
+    return result;
+}
+
+
+/*
+ * Find the option table entry for a split PAM argument, returning NULL if
+ * there is none.
+ */
+static const struct option *
+option_find(const struct argument *argument, const struct option options[],
+            size_t optlen)
+{
+    return bsearch(argument, options, optlen, sizeof(struct option),
+                   option_compare);
 }
 
 
@@ -504,15 +909,14 @@ option_compare(const void *key, const void *member)
  * error and leave the location unchanged.
  */
 static void
-convert_boolean(struct pam_args *args, const char *arg, bool *setting)
+convert_boolean(struct pam_args *args, const struct argument *argument,
+                bool *setting)
 {
-    const char *value;
+    const char *value = argument->value;
 
-    value = strchr(arg, '=');
     if (value == NULL)
         *setting = true;
     else {
-        value++;
         if      (   strcasecmp(value, "true") == 0
                  || strcasecmp(value, "yes")  == 0
                  || strcasecmp(value, "on")   == 0
@@ -524,7 +928,7 @@ convert_boolean(struct pam_args *args, const char *arg, bool *setting)
                  || strcmp    (value, "0")     == 0)
             *setting = false;
         else
-            putil_err(args, "invalid boolean in setting: %s", arg);
+            putil_err(args, "invalid boolean in setting: %s", argument->arg);
     }
 }
 
@@ -535,21 +939,21 @@ convert_boolean(struct pam_args *args, const char *arg, bool *setting)
  * number, report an error and leave the location unchanged.
  */
 static void
-convert_number(struct pam_args *args, const char *arg, long *setting)
+convert_number(struct pam_args *args, const struct argument *argument,
+               long *setting)
 {
-    const char *value;
+    const char *value = argument->value;
     char *end;
     long result;
 
-    value = strchr(arg, '=');
-    if (value == NULL || value[1] == '\0') {
-        putil_err(args, "value missing for option %s", arg);
+    if (value == NULL || value[0] == '\0') {
+        putil_err(args, "value missing for option %s", argument->arg);
         return;
     }
     errno = 0;
-    result = strtol(value + 1, &end, 10);
+    result = strtol(value, &end, 10);
     if (errno != 0 || *end != '\0') {
-        putil_err(args, "invalid number in setting: %s", arg);
+        putil_err(args, "invalid number in setting: %s", argument->arg);
         return;
     }
     *setting = result;
@@ -564,20 +968,20 @@ convert_number(struct pam_args *args, const char *arg, long *setting)
  */
 #ifdef HAVE_KRB5
 static void
-convert_time(struct pam_args *args, const char *arg, krb5_deltat *setting)
+convert_time(struct pam_args *args, const struct argument *argument,
+             krb5_deltat *setting)
 {
-    const char *value;
+    const char *value = argument->value;
     krb5_deltat result;
     krb5_error_code retval;
 
-    value = strchr(arg, '=');
-    if (value == NULL || value[1] == '\0') {
-        putil_err(args, "value missing for option %s", arg);
+    if (value == NULL || value[0] == '\0') {
+        putil_err(args, "value missing for option %s", argument->arg);
         return;
     }
-    retval = krb5_string_to_deltat((char *) value + 1, &result);
+    retval = krb5_string_to_deltat((char *) value, &result);
     if (retval != 0)
-        putil_err(args, "bad time value in setting: %s", arg);
+        putil_err(args, "bad time value in setting: %s", argument->arg);
     else
         *setting = result;
 }
@@ -585,9 +989,10 @@ convert_time(struct pam_args *args, const char *arg, krb5_deltat *setting)
 #else /* HAVE_KRB5 */
 
 static void
-convert_time(struct pam_args *args, const char *arg, long *setting)
+convert_time(struct pam_args *args, const struct argument *argument,
+             long *setting)
 {
-    convert_number(args, arg, setting);
+    convert_number(args, argument, setting);
 }
 
 #endif /* !HAVE_KRB5 */
@@ -601,23 +1006,21 @@ convert_time(struct pam_args *args, const char *arg, long *setting)
  * should abort.
  */
 static bool
-convert_string(struct pam_args *args, const char *arg, char **setting)
+convert_string(struct pam_args *args, const struct argument *argument,
+               const struct option *option, char **setting)
 {
-    const char *value;
     char *result;
 
-    value = strchr(arg, '=');
-    if (value == NULL) {
-        putil_err(args, "value missing for option %s", arg);
+    if (argument->value == NULL) {
+        putil_err(args, "value missing for option %s", argument->arg);
         return true;
     }
-    result = strdup(value + 1);
+    result = strdup(argument->value);
     if (result == NULL) {
         putil_crit(args, "cannot allocate memory: %s", strerror(errno));
         return false;
     }
-    free(*setting);
-    *setting = result;
+    replace_string(option, setting, result);
     return true;
 }
 
@@ -630,17 +1033,16 @@ convert_string(struct pam_args *args, const char *arg, char **setting)
  * should abort.
  */
 static bool
-convert_list(struct pam_args *args, const char *arg, struct vector **setting)
+convert_list(struct pam_args *args, const struct argument *argument,
+             struct vector **setting)
 {
-    const char *value;
     struct vector *result;
 
-    value = strchr(arg, '=');
-    if (value == NULL) {
-        putil_err(args, "value missing for option %s", arg);
+    if (argument->value == NULL) {
+        putil_err(args, "value missing for option %s", argument->arg);
         return true;
     }
-    result = vector_split_multi(value + 1, " \t,", NULL);
+    result = vector_split_multi(argument->value, " \t,", NULL);
     if (result == NULL) {
         putil_crit(args, "cannot allocate vector: %s", strerror(errno));
         return false;
@@ -651,6 +1053,72 @@ convert_list(struct pam_args *args, const char *arg, struct vector **setting)
 }
 
 
+/*
+ * Exchange the settings for every option given in the PAM arguments between
+ * two configuration structs.  Each setting is swapped at most once no matter
+ * how often the option appears, and unknown options are ignored, since
+ * putil_args_parse will already have reported them.
+ */
+void
+putil_args_swap(struct pam_config *a, struct pam_config *b, int argc,
+                const char *argv[], const struct option options[],
+                size_t optlen)
+{
+    struct argument argument;
+    size_t opt;
+    int i;
+
+    for (opt = 0; opt < optlen; opt++) {
+        size_t offset = options[opt].location;
+        bool given = false;
+        bool flag;
+        long number;
+#ifdef HAVE_KRB5
+        krb5_deltat delta;
+#else
+        long delta;
+#endif
+        char *string;
+        struct vector *list;
+
+        for (i = 0; i < argc && !given; i++) {
+            split_argument(argv[i], &argument);
+            given = (option_compare(&argument, &options[opt]) == 0);
+        }
+        if (!given)
+            continue;
+        switch (options[opt].type) {
+        case TYPE_BOOLEAN:
+            flag = *CONF_BOOL(a, offset);
+            *CONF_BOOL(a, offset) = *CONF_BOOL(b, offset);
+            *CONF_BOOL(b, offset) = flag;
+            break;
+        case TYPE_NUMBER:
+            number = *CONF_NUMBER(a, offset);
+            *CONF_NUMBER(a, offset) = *CONF_NUMBER(b, offset);
+            *CONF_NUMBER(b, offset) = number;
+            break;
+        case TYPE_TIME:
+            delta = *CONF_TIME(a, offset);
+            *CONF_TIME(a, offset) = *CONF_TIME(b, offset);
+            *CONF_TIME(b, offset) = delta;
+            break;
+        case TYPE_STRING:
+            string = *CONF_STRING(a, offset);
+            *CONF_STRING(a, offset) = *CONF_STRING(b, offset);
+            *CONF_STRING(b, offset) = string;
+            break;
+        case TYPE_LIST:
+        case TYPE_STRLIST:
+            list = *CONF_LIST(a, offset);
+            *CONF_LIST(a, offset) = *CONF_LIST(b, offset);
+            *CONF_LIST(b, offset) = list;
+            break;
+        }
+    }
+}
+
+
 /*
  * Parse the PAM arguments.  Takes the PAM argument struct, the argument count
  * and vector, the option table, and the number of elements in the option
@@ -660,6 +1128,10 @@ convert_list(struct pam_args *args, const char *arg, struct vector **setting)
  * also be diagnosed (to syslog at LOG_ERR using putil_err()), but are not
  * considered fatal errors and will still return true.
  *
+ * Each argument is scanned only once to find the end of the option name and
+ * the start of the value, which are then used for both the lookup and the
+ * conversion.
+ *
  * If options should be retrieved from krb5.conf, call putil_args_krb5()
  * first, before calling this function.
  */
@@ -668,6 +1140,7 @@ putil_args_parse(struct pam_args *args, int argc, const char *argv[],
                  const struct option options[], size_t optlen)
 {
     int i;
+    struct argument argument;
     const struct option *option;
 
     /*
@@ -675,33 +1148,33 @@ putil_args_parse(struct pam_args *args, int argc, const char *argv[],
      * configuration parameter.
      */
     for (i = 0; i < argc; i++) {
-        option = bsearch(argv[i], options, optlen, sizeof(struct option),
-                         option_compare);
+        split_argument(argv[i], &argument);
+        option = option_find(&argument, options, optlen);
         if (option == NULL) {
             putil_err(args, "unknown option %s", argv[i]);
             continue;
         }
         switch (option->type) {
         case TYPE_BOOLEAN:
-            convert_boolean(args, argv[i],
+            convert_boolean(args, &argument,
                             CONF_BOOL(args->config, option->location));
             break;
         case TYPE_NUMBER:
-            convert_number(args, argv[i],
+            convert_number(args, &argument,
                            CONF_NUMBER(args->config, option->location));
             break;
         case TYPE_TIME:
-            convert_time(args, argv[i],
+            convert_time(args, &argument,
                          CONF_TIME(args->config, option->location));
             break;
         case TYPE_STRING:
-            if (!convert_string(args, argv[i],
+            if (!convert_string(args, &argument, option,
                                 CONF_STRING(args->config, option->location)))
                 return false;
             break;
         case TYPE_LIST:
         case TYPE_STRLIST:
-            if (!convert_list(args, argv[i],
+            if (!convert_list(args, &argument,
                               CONF_LIST(args->config, option->location)))
                 return false;
             break;
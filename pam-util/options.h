@@ -144,11 +144,40 @@ BEGIN_DECLS
  *
  * This function must be called before either putil_args_krb5() or
  * putil_args_parse(), since neither of those functions set defaults.
+ *
+ * String defaults are not copied; the setting points to the string in the
+ * option table until it is changed, so the default strings must outlive the
+ * configuration.  Use putil_args_free_settings() to free the settings, since
+ * it knows not to free those pointers.
  */
 bool putil_args_defaults(struct pam_args *, const struct option options[],
                          size_t optlen)
     __attribute__((__nonnull__));
 
+/*
+ * Free the string and list settings described by the option table in a
+ * configuration struct and set them to NULL, skipping any string settings
+ * that still point to the default from the option table.  The configuration
+ * struct itself is not freed.
+ */
+void putil_args_free_settings(struct pam_config *,
+                              const struct option options[], size_t optlen)
+    __attribute__((__nonnull__));
+
+/*
+ * Copy the settings described by the option table from one configuration
+ * struct to another, making deep copies of all strings and lists other than
+ * string settings that point to the default, which are shared.  The string
+ * and list settings in the destination must be NULL (as after calloc).
+ * Returns true on success and false on memory allocation failure, which will
+ * already be reported using putil_crit().  On failure, no string or list
+ * settings in the destination will be allocated.
+ */
+bool putil_args_copy(struct pam_args *, struct pam_config *dest,
+                     const struct pam_config *src,
+                     const struct option options[], size_t optlen)
+    __attribute__((__nonnull__));
+
 /*
  * Fill out options from krb5.conf.  Takes the PAM args structure, the name of
  * the section for the software being configured, an option table defined as
@@ -192,6 +221,19 @@ bool putil_args_parse(struct pam_args *, int argc, const char *argv[],
                       const struct option options[], size_t optlen)
     __attribute__((__nonnull__));
 
+/*
+ * Exchange the settings of every option given in the PAM arguments between
+ * two configuration structs, leaving all other settings alone.  This allows
+ * the arguments to be parsed before krb5.conf is read: parse them into one
+ * struct, load the defaults and krb5.conf into another, and then swap, which
+ * gives the same result as calling putil_args_parse() last without reporting
+ * problems with the arguments a second time.
+ */
+void putil_args_swap(struct pam_config *, struct pam_config *, int argc,
+                     const char *argv[], const struct option options[],
+                     size_t optlen)
+    __attribute__((__nonnull__));
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 
@@ -0,0 +1,123 @@
+/*
+ * In-memory flight recorder for PAM modules.
+ *
+ * The recorder is a byte ring holding lines separated by newlines.  Adding a
+ * line is at most two copies into the ring, with no allocation or locking.
+ * Once the ring has wrapped, the oldest line may have been partly
+ * overwritten, so reading the contents starts after the first newline
+ * following the write position.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <pam-util/arena.h>
+#include <pam-util/args.h>
+#include <pam-util/recorder.h>
+
+struct putil_recorder {
+    char *data;                 /* The ring. */
+    size_t size;                /* Size of the ring. */
+    size_t pos;                 /* Offset of the next byte to write. */
+    bool wrapped;               /* Whether the ring has been filled. */
+};
+
+
+/*
+ * Copy bytes into the ring at the write position, wrapping around its end.
+ */
+static void
+ring_copy(struct putil_recorder *recorder, const char *data, size_t length)
+{
+    size_t room;
+
+    /* Only the end of data larger than the ring would survive anyway. */
+    if (length >= recorder->size) {
+        data += length - recorder->size;
+        length = recorder->size;
+    }
+    room = recorder->size - recorder->pos;
+    if (length < room) {
+        memcpy(recorder->data + recorder->pos, data, length);
+        recorder->pos += length;
+        return;
+    }
+    memcpy(recorder->data + recorder->pos, data, room);
+    memcpy(recorder->data, data + room, length - room);
+    recorder->pos = length - room;
+    recorder->wrapped = true;
+}
+
+
+/*
+ * Allocate a recorder from the arena and attach it to args.
+ */
+bool
+putil_recorder_start(struct pam_args *args, size_t size)
+{
+    struct putil_recorder *recorder;
+
+    if (size == 0)
+        return false;
+    recorder = putil_arena_alloc(args, sizeof(struct putil_recorder));
+    if (recorder == NULL)
+        return false;
+    recorder->data = putil_arena_alloc(args, size);
+    if (recorder->data == NULL)
+        return false;
+    recorder->size = size;
+    args->recorder = recorder;
+    return true;
+}
+
+
+/*
+ * Add a line to the recorder.
+ */
+void
+putil_recorder_add(struct putil_recorder *recorder, const char *line,
+                   size_t length)
+{
+    if (recorder == NULL)
+        return;
+    ring_copy(recorder, line, length);
+    ring_copy(recorder, "\n", 1);
+}
+
+
+/*
+ * Return the complete lines in the recorder.
+ */
+char *
+putil_recorder_contents(struct pam_args *args)
+{
+    struct putil_recorder *recorder = args->recorder;
+    char *contents, *start;
+    size_t length;
+
+    if (recorder == NULL || (recorder->pos == 0 && !recorder->wrapped))
+        return NULL;
+    length = recorder->wrapped ? recorder->size : recorder->pos;
+    contents = putil_arena_alloc(args, length + 1);
+    if (contents == NULL)
+        return NULL;
+    if (!recorder->wrapped)
+        memcpy(contents, recorder->data, length);
+    else {
+        memcpy(contents, recorder->data + recorder->pos,
+               recorder->size - recorder->pos);
+        memcpy(contents + recorder->size - recorder->pos, recorder->data,
+               recorder->pos);
+    }
+    contents[length] = '\0';
+
+    /* Drop the oldest line if it was partly overwritten. */
+    if (!recorder->wrapped)
+        return contents;
+    start = strchr(contents, '\n');
+    if (start == NULL || start[1] == '\0')
+        return NULL;
+    return start + 1;
+}
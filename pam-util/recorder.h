@@ -0,0 +1,59 @@
+/*
+ * Prototypes for the in-memory flight recorder.
+ *
+ * A recorder is a fixed-size ring buffer of log lines allocated from the
+ * per-call arena.  When one is attached to a pam_args struct, debugging
+ * messages that would otherwise be discarded because debugging is off are
+ * kept in it instead, so that the caller can decide at the end of the call
+ * whether they're worth logging.  Once the buffer is full, each new line
+ * overwrites the oldest ones.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef PAM_UTIL_RECORDER_H
+#define PAM_UTIL_RECORDER_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+
+#include <stddef.h>
+
+struct pam_args;
+struct putil_recorder;
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all internal functions. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * Allocate a recorder holding size bytes of log lines from the arena and
+ * attach it to args, so that suppressed debugging messages are recorded.
+ * Returns false on allocation failure and leaves reporting it to the caller.
+ */
+bool putil_recorder_start(struct pam_args *, size_t size)
+    __attribute__((__nonnull__));
+
+/*
+ * Add a line of the given length to the recorder.  The line should not
+ * contain a newline.  Does nothing if the recorder is NULL.
+ */
+void putil_recorder_add(struct putil_recorder *, const char *, size_t);
+
+/*
+ * Return the complete lines in the recorder, oldest first and each ending in
+ * a newline, as a nul-terminated string allocated from the arena.  Returns
+ * NULL if there is no recorder or nothing was recorded, or on allocation
+ * failure.
+ */
+char *putil_recorder_contents(struct pam_args *)
+    __attribute__((__nonnull__));
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* !PAM_UTIL_RECORDER_H */
@@ -0,0 +1,405 @@
+/*
+ * Concurrent initial credentials exchanges.
+ *
+ * Both search_k5login_parallel and realms try the same password with several
+ * principals, where doing the exchanges with the KDC one after another makes
+ * the user wait for the sum of their round trips.  Instead, the principals
+ * are handed out to several threads, each with its own Kerberos context since
+ * a context can't be used by several threads at once.  Where the library can
+ * copy a context, those of the threads are copied from the module's so that
+ * krb5.conf isn't read again for each.
+ *
+ * Either the first principal to succeed wins, or, if the candidates are
+ * ordered by priority, the first one in the list that succeeds.  No new
+ * exchanges are started once a winner is certain, but the Kerberos
+ * libraries have no way to abandon an exchange in progress, so those already
+ * running finish and their results are discarded.
+ *
+ * The threads don't log, fire probes, prompt, or otherwise change pam_args,
+ * none of which is safe from several threads.  There is nothing to prompt
+ * for since the password is already known.  The results are logged once all
+ * the threads have finished.  Without threads, the candidates are tried in
+ * turn.
+ *
+ * If nonblocking_kdc is set and the module can drive the exchanges itself,
+ * no threads are needed.  The same number of exchanges instead run at once
+ * in the calling thread, and those still running once a winner is certain
+ * are abandoned.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* The most threads started for one search. */
+#define MAX_THREADS 16
+
+/* The state of a search, shared by the threads. */
+struct search {
+    struct pam_args *args;          /* Only read, for the deadline. */
+    krb5_principal *candidates;     /* The principals to try. */
+    size_t count;                   /* Number of candidates. */
+    bool ordered;                   /* Prefer earlier candidates. */
+    krb5_get_init_creds_opt *opts;  /* Initial credential options. */
+    const char *service;            /* Service to get tickets for. */
+    const char *pass;               /* The password. */
+    krb5_error_code *status;        /* Result of each candidate. */
+    bool *tried;                    /* Whether each candidate was tried. */
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;           /* Protects the members below. */
+#endif
+    size_t next;                    /* Next candidate to hand out. */
+    bool found;                     /* Whether a candidate succeeded. */
+    size_t winner;                  /* The candidate that succeeded. */
+    krb5_creds creds;               /* Its credentials. */
+};
+
+/* A thread and its Kerberos context. */
+struct worker {
+#ifdef HAVE_PTHREAD_H
+    pthread_t thread;
+#endif
+    krb5_context context;
+    struct search *search;
+};
+
+#ifdef HAVE_PTHREAD_H
+# define LOCK(m)   pthread_mutex_lock(m)
+# define UNLOCK(m) pthread_mutex_unlock(m)
+#else
+# define LOCK(m)   do { } while (0)
+# define UNLOCK(m) do { } while (0)
+#endif
+
+
+/*
+ * The body of each thread.  Take the next candidate until there are none
+ * left or one has succeeded, and try the password with it.  A thread that
+ * succeeds hands its credentials over to the search if it is the first, or,
+ * if the candidates are ordered, if it beats the current winner.
+ */
+static void *
+attempt(void *data)
+{
+    struct worker *worker = data;
+    struct search *search = worker->search;
+    krb5_creds creds;
+    krb5_error_code retval;
+    size_t i;
+
+    for (;;) {
+        LOCK(&search->lock);
+        if (search->found || search->next >= search->count) {
+            UNLOCK(&search->lock);
+            break;
+        }
+        i = search->next++;
+        UNLOCK(&search->lock);
+
+        memset(&creds, 0, sizeof(creds));
+        retval = pamk5_init_creds_context(search->args, worker->context,
+                                          &creds, search->candidates[i],
+                                          search->pass, NULL, NULL,
+                                          search->service, search->opts);
+        search->status[i] = retval;
+        search->tried[i] = true;
+        if (retval != 0)
+            continue;
+        LOCK(&search->lock);
+        if (!search->found || (search->ordered && i < search->winner)) {
+            if (search->found)
+                krb5_free_cred_contents(worker->context, &search->creds);
+            search->found = true;
+            search->winner = i;
+            search->creds = creds;
+            memset(&creds, 0, sizeof(creds));
+        }
+        UNLOCK(&search->lock);
+        krb5_free_cred_contents(worker->context, &creds);
+    }
+    return NULL;
+}
+
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Create a Kerberos context for a thread.  If the library can, copy the
+ * module's, without the trace callback of the recorder, which isn't safe
+ * from several threads, but with trace logging to the configured file.
+ * Otherwise, create one the same way pam-util creates the main one, with the
+ * configured default realm.
+ */
+static krb5_error_code
+new_context(struct pam_args *args, krb5_context *context)
+{
+    krb5_error_code retval;
+
+#ifdef HAVE_KRB5_COPY_CONTEXT
+    retval = krb5_copy_context(args->ctx, context);
+    if (retval != 0) {
+        *context = NULL;
+        return retval;
+    }
+# ifdef HAVE_KRB5_SET_TRACE_CALLBACK
+    krb5_set_trace_callback(*context, NULL, NULL);
+# endif
+# ifdef HAVE_KRB5_SET_TRACE_FILENAME
+    if (args->config->trace != NULL)
+        krb5_set_trace_filename(*context, args->config->trace);
+# endif
+    return 0;
+#else
+    if (issetugid())
+        retval = krb5_init_secure_context(context);
+    else
+        retval = krb5_init_context(context);
+    if (retval != 0) {
+        *context = NULL;
+        return retval;
+    }
+    if (args->realm != NULL) {
+        retval = krb5_set_default_realm(*context, args->realm);
+        if (retval != 0) {
+            krb5_free_context(*context);
+            *context = NULL;
+        }
+    }
+    return retval;
+#endif
+}
+
+
+/*
+ * Start up to nthreads threads for the search and wait for them.  Returns
+ * false if none could be started, in which case the caller has to do the
+ * work itself.
+ */
+static bool
+run_threads(struct pam_args *args, struct search *search, size_t nthreads)
+{
+    struct worker *workers;
+    size_t started, i;
+    krb5_error_code retval;
+    int status;
+
+    workers = calloc(nthreads, sizeof(struct worker));
+    if (workers == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    for (started = 0, i = 0; i < nthreads; i++) {
+        retval = new_context(args, &workers[started].context);
+        if (retval != 0) {
+            putil_err_krb5(args, retval, "cannot create Kerberos context");
+            break;
+        }
+        workers[started].search = search;
+        status = pthread_create(&workers[started].thread, NULL, attempt,
+                                &workers[started]);
+        if (status != 0) {
+            putil_err(args, "cannot create thread: %s", strerror(status));
+            krb5_free_context(workers[started].context);
+            break;
+        }
+        started++;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        krb5_free_context(workers[i].context);
+    }
+    free(workers);
+    return started > 0;
+}
+#endif /* HAVE_PTHREAD_H */
+
+
+/*
+ * Run the search in up to nthreads threads.  If no thread could be started
+ * at all, or there are no threads, do the work here with the normal Kerberos
+ * context.
+ */
+static void
+run_search(struct pam_args *args, struct search *search,
+           size_t nthreads UNUSED)
+{
+    struct worker worker;
+
+#ifdef HAVE_PTHREAD_H
+    putil_debug(args, "trying %lu principals with %lu threads",
+                (unsigned long) search->count, (unsigned long) nthreads);
+    pthread_mutex_init(&search->lock, NULL);
+    if (!run_threads(args, search, nthreads)) {
+        worker.context = args->ctx;
+        worker.search = search;
+        attempt(&worker);
+    }
+    pthread_mutex_destroy(&search->lock);
+#else
+    worker.context = args->ctx;
+    worker.search = search;
+    attempt(&worker);
+#endif
+}
+
+
+/*
+ * Run the search as exchanges driven by the module, up to limit at a time,
+ * all in this thread.  Returns a Kerberos error code only if the exchanges
+ * couldn't be set up, and otherwise records the results in the search.
+ */
+static krb5_error_code
+run_exchanges(struct pam_args *args, struct search *search, size_t limit)
+{
+    struct pamk5_exchange **exchanges;
+    krb5_error_code retval = 0;
+    size_t i, winner;
+    bool finished;
+
+    exchanges = calloc(search->count, sizeof(struct pamk5_exchange *));
+    if (exchanges == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return errno;
+    }
+    for (i = 0; i < search->count; i++) {
+        retval = pamk5_exchange_new(args, search->candidates[i], search->pass,
+                                    pamk5_prompter_krb5, args,
+                                    search->service, search->opts,
+                                    &exchanges[i]);
+        if (retval != 0) {
+            putil_err_krb5(args, retval, "cannot start initial credentials"
+                           " exchange");
+            goto done;
+        }
+    }
+    putil_debug(args, "trying %lu principals, %lu at a time",
+                (unsigned long) search->count, (unsigned long) limit);
+    if (pamk5_exchange_run(args, exchanges, search->count, limit,
+                           search->ordered, &winner) == 0) {
+        search->found = true;
+        search->winner = winner;
+        pamk5_exchange_creds(exchanges[winner], &search->creds);
+    }
+    for (i = 0; i < search->count; i++) {
+        search->status[i] = pamk5_exchange_status(exchanges[i], &finished);
+        search->tried[i] = finished;
+    }
+
+done:
+    for (i = 0; i < search->count; i++)
+        pamk5_exchange_free(exchanges[i]);
+    free(exchanges);
+    return retval;
+}
+
+
+/*
+ * Try the password with each candidate at once, using up to nthreads
+ * threads.  On success, fill out creds and set winner to the index of the
+ * candidate that worked.
+ *
+ * On failure, return the error of the last candidate, the same as trying
+ * them in turn would, unless the candidates are ordered, in which case
+ * return the error of the first one whose principal the KDC knew (or of the
+ * first one if none were known).  Either way, set winner to the index of the
+ * candidate whose error was returned.  If no candidate decided the result,
+ * because the deadline had already passed or of a system error, set winner
+ * to count.  Returns errno for a system error.
+ */
+krb5_error_code
+pamk5_parallel_auth(struct pam_args *args, krb5_principal *candidates,
+                    size_t count, size_t nthreads, bool ordered,
+                    krb5_get_init_creds_opt *opts, const char *service,
+                    const char *pass, krb5_creds *creds, size_t *winner)
+{
+    struct search search;
+    krb5_error_code retval;
+    char *name;
+    size_t i;
+
+    *winner = count;
+    if (count == 0)
+        return KRB5KRB_AP_ERR_BAD_INTEGRITY;
+    if (pamk5_deadline_passed(args))
+        return KRB5_KDC_UNREACH;
+    if (nthreads > count)
+        nthreads = count;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+
+    /* Set up the search. */
+    memset(&search, 0, sizeof(search));
+    search.args = args;
+    search.candidates = candidates;
+    search.count = count;
+    search.ordered = ordered;
+    search.opts = opts;
+    search.service = service;
+    search.pass = pass;
+    search.status = calloc(count, sizeof(krb5_error_code));
+    search.tried = calloc(count, sizeof(bool));
+    if (search.status == NULL || search.tried == NULL) {
+        retval = errno;
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        goto done;
+    }
+
+    /* Log the candidates first, since the threads can't. */
+    for (i = 0; i < count; i++) {
+        if (krb5_unparse_name(args->ctx, candidates[i], &name) != 0)
+            continue;
+        if (service == NULL)
+            putil_debug(args, "attempting authentication as %s", name);
+        else
+            putil_debug(args, "attempting authentication as %s for %s", name,
+                        service);
+        krb5_free_unparsed_name(args->ctx, name);
+    }
+
+    /* Run the exchanges in this thread if possible, or else the threads. */
+    if (pamk5_exchange_enabled(args)) {
+        retval = run_exchanges(args, &search, nthreads);
+        if (retval != 0)
+            goto done;
+    } else
+        run_search(args, &search, nthreads);
+
+    /* Report the results. */
+    for (i = 0; i < count; i++)
+        if (search.tried[i] && search.status[i] != 0)
+            putil_debug_krb5(args, search.status[i],
+                             "authentication as candidate %lu failed",
+                             (unsigned long) i + 1);
+    if (search.found) {
+        *creds = search.creds;
+        *winner = search.winner;
+        retval = 0;
+    } else if (ordered) {
+        *winner = 0;
+        for (i = 0; i < count; i++)
+            if (search.status[i] != KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN) {
+                *winner = i;
+                break;
+            }
+        retval = search.status[*winner];
+    } else {
+        *winner = count - 1;
+        retval = search.status[count - 1];
+    }
+
+done:
+    free(search.status);
+    free(search.tried);
+    return retval;
+}
@@ -18,6 +18,7 @@
 #include <errno.h>
 
 #include <internal.h>
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
 
@@ -25,7 +26,8 @@
 /*
  * Get the new password.  Store it in PAM_AUTHTOK if we obtain it and verify
  * it successfully and return it in the pass parameter.  If pass is set to
- * NULL, only store the new password in PAM_AUTHTOK.
+ * NULL, only store the new password in PAM_AUTHTOK.  The returned password is
+ * in secret arena memory and must not be freed by the caller.
  *
  * Returns a PAM error code, usually either PAM_AUTHTOK_ERR or PAM_SUCCESS.
  */
@@ -47,7 +49,7 @@ pamk5_password_prompt(struct pam_args *args, char **pass)
             pamret = PAM_AUTHTOK_ERR;
             goto done;
         }
-        pass1 = strdup((const char *) tmp);
+        pass1 = putil_arena_secret_strdup(args, (const char *) tmp);
     }
 
     /* Prompt for the new password if necessary. */
@@ -62,22 +64,14 @@ pamk5_password_prompt(struct pam_args *args, char **pass)
         if (pamret != PAM_SUCCESS) {
             putil_debug_pam(args, pamret, "error getting new password");
             pamret = PAM_AUTHTOK_ERR;
-            memset(pass1, 0, strlen(pass1));
-            free(pass1);
             goto done;
         }
         if (strcmp(pass1, pass2) != 0) {
             putil_debug(args, "new passwords don't match");
             pamk5_conv(args, "Passwords don't match", PAM_ERROR_MSG, NULL);
-            memset(pass1, 0, strlen(pass1));
-            free(pass1);
-            memset(pass2, 0, strlen(pass2));
-            free(pass2);
             pamret = PAM_AUTHTOK_ERR;
             goto done;
         }
-        memset(pass2, 0, strlen(pass2));
-        free(pass2);
 
         /* Save the new password for other modules. */
         pamret = pam_set_item(args->pamh, PAM_AUTHTOK, pass1);
@@ -107,6 +101,7 @@ change_password(struct pam_args *args, const char *pass)
     int result_code;
     krb5_data result_code_string, result_string;
     const char *message;
+    unsigned long long start;
 
     /* Sanity check. */
     if (args == NULL || args->config == NULL || args->config->ctx == NULL
@@ -132,6 +127,8 @@ change_password(struct pam_args *args, const char *pass)
      * rather than the principal from the credentials, so we need to pass in a
      * principal for Heimdal.  So we're stuck with an #ifdef.
      */
+    pamk5_timing_start(args, PHASE_CHPW);
+    start = pamk5_metrics_start(args);
 #ifdef HAVE_KRB5_MIT
     retval = krb5_set_password(ctx->context, ctx->creds, (char *) pass,
                  NULL, &result_code, &result_code_string, &result_string);
@@ -140,6 +137,11 @@ change_password(struct pam_args *args, const char *pass)
                  ctx->princ, &result_code, &result_code_string,
                  &result_string);
 #endif
+    pamk5_timing_stop(args, PHASE_CHPW);
+    pamk5_metrics_record(args, METRICS_CHPW,
+                         (retval == 0 && result_code == 0) ? PAM_SUCCESS
+                                                           : PAM_AUTHTOK_ERR,
+                         retval, start);
 
     /* Everything from here on is just handling diagnostics and output. */
     if (retval != 0) {
@@ -152,23 +154,20 @@ change_password(struct pam_args *args, const char *pass)
     }
     if (result_code != 0) {
         char *output;
-        int status;
 
         putil_debug(args, "krb5_change_password: %s",
                     (char *) result_code_string.data);
         retval = PAM_AUTHTOK_ERR;
-        status = asprintf(&output, "%.*s%s%.*s",
-                          (int) result_code_string.length,
-                          (char *) result_code_string.data,
-                          result_string.length == 0 ? "" : ": ",
-                          (int) result_string.length,
-                          (char *) result_string.data);
-        if (status < 0)
-            putil_crit(args, "asprintf failed: %s", strerror(errno));
-        else {
+        output = putil_arena_sprintf(args, "%.*s%s%.*s",
+                                     (int) result_code_string.length,
+                                     (char *) result_code_string.data,
+                                     result_string.length == 0 ? "" : ": ",
+                                     (int) result_string.length,
+                                     (char *) result_string.data);
+        if (output == NULL)
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        else
             pamk5_conv(args, output, PAM_ERROR_MSG, NULL);
-            free(output);
-        }
     }
     krb5_free_data_contents(ctx->context, &result_string);
     krb5_free_data_contents(ctx->context, &result_code_string);
@@ -231,10 +230,6 @@ pamk5_password_change(struct pam_args *args, bool only_auth)
                    ctx->name);
 
 done:
-    if (pass != NULL) {
-        memset(pass, 0, strlen(pass));
-        free(pass);
-    }
     return pamret;
 }
 
@@ -253,8 +248,6 @@ pamk5_password(struct pam_args *args, bool only_auth)
     struct context *ctx = NULL;
     int pamret, status;
     PAM_CONST char *user;
-    char *pass = NULL;
-    bool set_context = false;
 
     /*
      * Check whether we should ignore this user.
@@ -273,11 +266,11 @@ pamk5_password(struct pam_args *args, bool only_auth)
         status = pam_get_user(args->pamh, &user, NULL);
         if (status == PAM_SUCCESS && pamk5_should_ignore(args, user)) {
             if (!only_auth) {
-                if (args->config->banner != NULL) {
-                    free(args->config->banner);
-                    args->config->banner = NULL;
-                }
+                char *banner = args->config->banner;
+
+                args->config->banner = NULL;
                 pamk5_password_prompt(args, NULL);
+                args->config->banner = banner;
             }
             pamret = PAM_IGNORE;
             goto done;
@@ -295,14 +288,12 @@ pamk5_password(struct pam_args *args, bool only_auth)
             pamret = PAM_AUTHTOK_ERR;
             goto done;
         }
-        pamret = pam_set_data(args->pamh, "pam_krb5", args->config->ctx,
-                              pamk5_context_destroy);
+        pamret = pamk5_context_store(args);
         if (pamret != PAM_SUCCESS) {
             putil_err_pam(args, pamret, "cannot set context data");
             pamret = PAM_AUTHTOK_ERR;
             goto done;
         }
-        set_context = true;
     }
     ctx = args->config->ctx;
 
@@ -359,18 +350,6 @@ pamk5_password(struct pam_args *args, bool only_auth)
     }
 
 done:
-    if (pass != NULL) {
-        memset(pass, 0, strlen(pass));
-        free(pass);
-    }
-
-    /*
-     * Don't free our Kerberos context if we set a context, since the context
-     * will take care of that.
-     */
-    if (set_context)
-        args->ctx = NULL;
-
     if (pamret != PAM_SUCCESS) {
         if (pamret == PAM_SERVICE_ERR || pamret == PAM_AUTH_ERR)
             pamret = PAM_AUTHTOK_ERR;
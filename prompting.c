@@ -22,6 +22,7 @@
 #include <errno.h>
 
 #include <internal.h>
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
 
@@ -50,9 +51,10 @@
  * username to principal mappings, plus may confuse some ssh clients if sshd
  * passes the prompt back to the client.
  *
- * The entered password is stored in password.  The memory is allocated by the
- * application and returned as part of the PAM conversation.  It must be freed
- * by the caller.
+ * The entered password is copied into secret memory in the arena for the PAM
+ * arguments and stored in password, and the copy returned by the PAM
+ * conversation is overwritten and freed.  The caller must not free it; it is
+ * overwritten and freed along with the PAM arguments.
  *
  * Returns a PAM success or error code.
  */
@@ -60,8 +62,9 @@ int
 pamk5_get_password(struct pam_args *args, const char *prefix, char **password)
 {
     struct context *ctx = args->config->ctx;
-    char *prompt = NULL;
+    const char *prompt;
     char *principal = NULL;
+    char *response;
     krb5_error_code k5_errno;
     int retval;
 
@@ -72,42 +75,33 @@ pamk5_get_password(struct pam_args *args, const char *prefix, char **password)
                 putil_debug_krb5(args, k5_errno, "krb5_unparse_name failed");
         }
     if (prefix == NULL) {
-        if (args->config->expose_account && principal != NULL) {
-            if (asprintf(&prompt, "Password for %s: ", principal) < 0)
-                goto fail;
-        } else {
-            prompt = strdup("Password: ");
-            if (prompt == NULL)
-                goto fail;
-        }
+        if (args->config->expose_account && principal != NULL)
+            prompt = putil_arena_sprintf(args, "Password for %s: ", principal);
+        else
+            prompt = "Password: ";
     } else {
         const char *banner;
         const char *bspace;
 
         banner = (args->config->banner == NULL) ? "" : args->config->banner;
         bspace = (args->config->banner == NULL) ? "" : " ";
-        if (args->config->expose_account && principal != NULL) {
-            retval = asprintf(&prompt, "%s%s%s password for %s: ", prefix,
-                              bspace, banner, principal);
-            if (retval < 0)
-                goto fail;
-        } else {
-            retval = asprintf(&prompt, "%s%s%s password: ", prefix, bspace,
-                              banner);
-            if (retval < 0)
-                goto fail;
-        }
+        if (args->config->expose_account && principal != NULL)
+            prompt = putil_arena_sprintf(args, "%s%s%s password for %s: ",
+                                         prefix, bspace, banner, principal);
+        else
+            prompt = putil_arena_sprintf(args, "%s%s%s password: ", prefix,
+                                         bspace, banner);
     }
     if (principal != NULL)
         krb5_free_unparsed_name(ctx->context, principal);
-    retval = pamk5_conv(args, prompt, PAM_PROMPT_ECHO_OFF, password);
-    free(prompt);
-    return retval;
-
-fail:
-    if (principal != NULL)
-        krb5_free_unparsed_name(ctx->context, principal);
-    return PAM_BUF_ERR;
+    if (prompt == NULL)
+        return PAM_BUF_ERR;
+    retval = pamk5_conv(args, prompt, PAM_PROMPT_ECHO_OFF, &response);
+    if (retval != PAM_SUCCESS)
+        return retval;
+    *password = putil_arena_secret_strdup(args, response);
+    putil_secret_free(response);
+    return (*password == NULL) ? PAM_BUF_ERR : PAM_SUCCESS;
 }
 
 
@@ -141,7 +135,9 @@ pamk5_conv(struct pam_args *args, const char *message, int type,
     pmsg = &msg;
     msg.msg_style = type;
     msg.msg = (PAM_CONST char *) message;
+    pamk5_timing_start(args, PHASE_PROMPT);
     pamret = conv->conv(1, &pmsg, &resp, conv->appdata_ptr);
+    pamk5_timing_stop(args, PHASE_PROMPT);
     if (pamret != PAM_SUCCESS)
 	return pamret;
 
@@ -162,8 +158,7 @@ pamk5_conv(struct pam_args *args, const char *message, int type,
         *response = resp->resp;
         pamret = PAM_SUCCESS;
     } else {
-        memset(resp->resp, 0, strlen(resp->resp));
-        free(resp->resp);
+        putil_secret_free(resp->resp);
         pamret = want_reply ? PAM_SUCCESS : PAM_CONV_ERR;
     }
     free(resp);
@@ -261,39 +256,32 @@ pamk5_prompter_krb5(krb5_context context UNUSED, void *data, const char *name,
      * other elements of the outer array to the storage allocated in the inner
      * array.
      *
-     * All this also means we have to be careful how we free the resulting
-     * structure since it's double-linked in a subtle way.  Thankfully, we get
-     * to free it ourselves.
+     * The structure and the prompt strings are allocated from the arena for
+     * the PAM arguments, so they don't have to be freed here.
      */
-    msg = calloc(total_prompts, sizeof(struct pam_message *));
+    msg = putil_arena_alloc(args,
+                            total_prompts * sizeof(struct pam_message *));
     if (msg == NULL)
         return ENOMEM;
-    *msg = calloc(total_prompts, sizeof(struct pam_message));
-    if (*msg == NULL) {
-        free(msg);
+    *msg = putil_arena_alloc(args, total_prompts * sizeof(struct pam_message));
+    if (*msg == NULL)
         return ENOMEM;
-    }
     for (i = 1; i < total_prompts; i++)
         msg[i] = msg[0] + i;
 
     /* pam_prompts is an index into msg and a count when we're done. */
     pam_prompts = 0;
     if (name != NULL && !args->silent) {
-        msg[pam_prompts]->msg = strdup(name);
-        if (msg[pam_prompts]->msg == NULL)
-            goto cleanup;
+        msg[pam_prompts]->msg = (PAM_CONST char *) name;
         msg[pam_prompts]->msg_style = PAM_TEXT_INFO;
         pam_prompts++;
     }
     if (banner != NULL && !args->silent) {
-        msg[pam_prompts]->msg = strdup(banner);
-        if (msg[pam_prompts]->msg == NULL)
-            goto cleanup;
+        msg[pam_prompts]->msg = (PAM_CONST char *) banner;
         msg[pam_prompts]->msg_style = PAM_TEXT_INFO;
         pam_prompts++;
     }
     for (i = 0; i < num_prompts; i++) {
-        int status;
         size_t len;
         bool has_colon;
 
@@ -306,9 +294,9 @@ pamk5_prompter_krb5(krb5_context context UNUSED, void *data, const char *name,
         has_colon = (len > 2
                      && prompts[i].prompt[len - 1] == ' '
                      && prompts[i].prompt[len - 2] == ':');
-        status = asprintf((char **) &msg[pam_prompts]->msg, "%s%s",
-                          prompts[i].prompt, has_colon ? "" : ": ");
-        if (status < 0)
+        msg[pam_prompts]->msg = putil_arena_sprintf(args, "%s%s",
+                prompts[i].prompt, has_colon ? "" : ": ");
+        if (msg[pam_prompts]->msg == NULL)
             goto cleanup;
         msg[pam_prompts]->msg_style = prompts[i].hidden ? PAM_PROMPT_ECHO_OFF
                                                         : PAM_PROMPT_ECHO_ON;
@@ -317,8 +305,10 @@ pamk5_prompter_krb5(krb5_context context UNUSED, void *data, const char *name,
 
     if (!prev_pass) {
         /* Call into the application conversation function. */
+        pamk5_timing_start(args, PHASE_PROMPT);
         pamret = conv->conv(pam_prompts, (PAM_CONST struct pam_message **) msg,
                         &resp, conv->appdata_ptr);
+        pamk5_timing_stop(args, PHASE_PROMPT);
         if (pamret != 0) 
             goto cleanup;
         if (resp == NULL)
@@ -344,8 +334,11 @@ pamk5_prompter_krb5(krb5_context context UNUSED, void *data, const char *name,
              * actual length of the password, but set length to just the length of
              * the password.
              */
-            prompts[i].reply->length = strlen(prev_pass);
-            memcpy(prompts[i].reply->data, prev_pass, prompts[i].reply->length + 1);
+            len = strlen(prev_pass);
+            if (len > prompts[i].reply->length)
+                goto cleanup;
+            memcpy(prompts[i].reply->data, prev_pass, len + 1);
+            prompts[i].reply->length = len;
             continue;
         }
 
@@ -367,22 +360,13 @@ pamk5_prompter_krb5(krb5_context context UNUSED, void *data, const char *name,
     retval = 0;
 
 cleanup:
-    for (i = 0; i < total_prompts; i++)
-        free((char *) msg[i]->msg);
-    free(*msg);
-    free(msg);
-
     /*
      * Clean up the responses.  These may contain passwords, so we overwrite
      * them before we free them.
      */
     if (resp != NULL) {
-        for (i = 0; i < total_prompts; i++) {
-            if (resp[i].resp != NULL) {
-                memset(resp[i].resp, 0, strlen(resp[i].resp));
-                free(resp[i].resp);
-            }
-        }
+        for (i = 0; i < total_prompts; i++)
+            putil_secret_free(resp[i].resp);
         free(resp);
     }
     return retval;
@@ -30,6 +30,7 @@
 #include <internal.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
+#include <usdt.h>
 
 
 /*
@@ -41,12 +42,18 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char **argv)
     struct pam_args *args;
     int pamret;
 
+    PROBE_CALL_ENTRY(flags);
     args = pamk5_init(pamh, flags, argc, argv);
     if (args == NULL) {
         pamret = PAM_AUTH_ERR;
         goto done;
     }
     pamret = pamk5_context_fetch(args);
+    if (pamret == PAM_SUCCESS && args->config->ctx != NULL)
+        if (!pamk5_load(args, argc, argv)) {
+            pamret = PAM_AUTH_ERR;
+            goto done;
+        }
     ENTRY(args, flags);
 
     /*
@@ -66,6 +73,8 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char **argv)
 
 done:
     EXIT(args, pamret);
+    PROBE_CALL_RETURN(args, pamret);
+    pamk5_recorder_finish(args, pamret);
     pamk5_free(args);
     return pamret;
 }
@@ -80,19 +89,45 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
                     const char **argv)
 {
     struct pam_args *args;
+    PAM_CONST char *user;
     int pamret;
 
+    PROBE_CALL_ENTRY(flags);
     args = pamk5_init(pamh, flags, argc, argv);
     if (args == NULL) {
         pamret = PAM_SERVICE_ERR;
         goto done;
     }
+
+    /*
+     * If our arguments already say to ignore the user, there's no need to
+     * read krb5.conf or create a Kerberos context.
+     */
+    if (pamk5_ignore_early(args, &user)) {
+        ENTRY(args, flags);
+        args->user = user;
+        pamk5_should_ignore(args, user);
+        pamret = PAM_USER_UNKNOWN;
+        goto done;
+    }
+
+    /*
+     * Pick up an authentication that an earlier call left incomplete before
+     * loading the settings, so that its Kerberos context is used.
+     */
+    pamk5_context_resume(args);
+    if (!pamk5_load(args, argc, argv)) {
+        pamret = PAM_SERVICE_ERR;
+        goto done;
+    }
     ENTRY(args, flags);
 
     pamret = pamk5_authenticate(args);
 
 done:
     EXIT(args, pamret);
+    PROBE_CALL_RETURN(args, pamret);
+    pamk5_recorder_finish(args, pamret);
     pamk5_free(args);
     return pamret;
 }
@@ -109,6 +144,7 @@ pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv)
     bool refresh = false;
     int pamret, allow;
 
+    PROBE_CALL_ENTRY(flags);
     args = pamk5_init(pamh, flags, argc, argv);
     if (args == NULL) {
         pamret = PAM_SERVICE_ERR;
@@ -146,7 +182,14 @@ pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv)
         goto done;
     }
 
-    /* Do the work. */
+    /*
+     * Do the work, first reading krb5.conf and creating a Kerberos context
+     * unless we can tell that there will be nothing to do.
+     */
+    if (!pamk5_setcred_noop(args) && !pamk5_load(args, argc, argv)) {
+        pamret = PAM_SERVICE_ERR;
+        goto done;
+    }
     pamret = pamk5_setcred(args, refresh);
 
     /*
@@ -166,6 +209,8 @@ pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv)
 
 done:
     EXIT(args, pamret);
+    PROBE_CALL_RETURN(args, pamret);
+    pamk5_recorder_finish(args, pamret);
     pamk5_free(args);
     return pamret;
 }
@@ -178,8 +223,10 @@ PAM_EXTERN int
 pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
     struct pam_args *args;
+    PAM_CONST char *user;
     int pamret;
 
+    PROBE_CALL_ENTRY(flags);
     args = pamk5_init(pamh, flags, argc, argv);
     if (args == NULL) {
         pamret = PAM_AUTHTOK_ERR;
@@ -195,10 +242,21 @@ pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
         goto done;
     }
 
+    /*
+     * Ignored users are handled without krb5.conf or a Kerberos context, so
+     * only load them if our arguments don't already say to ignore the user.
+     */
+    if (!pamk5_ignore_early(args, &user) && !pamk5_load(args, argc, argv)) {
+        pamret = PAM_AUTHTOK_ERR;
+        goto done;
+    }
+
     pamret = pamk5_password(args, (flags & PAM_PRELIM_CHECK) != 0);
 
 done:
     EXIT(args, pamret);
+    PROBE_CALL_RETURN(args, pamret);
+    pamk5_recorder_finish(args, pamret);
     pamk5_free(args);
     return pamret;
 }
@@ -214,16 +272,23 @@ pam_sm_open_session(pam_handle_t *pamh, int flags, int argc,
     struct pam_args *args;
     int pamret;
 
+    PROBE_CALL_ENTRY(flags);
     args = pamk5_init(pamh, flags, argc, argv);
     if (args == NULL) {
         pamret = PAM_SERVICE_ERR;
         goto done;
     }
     ENTRY(args, flags);
+    if (!pamk5_setcred_noop(args) && !pamk5_load(args, argc, argv)) {
+        pamret = PAM_SERVICE_ERR;
+        goto done;
+    }
     pamret = pamk5_setcred(args, 0);
 
 done:
     EXIT(args, pamret);
+    PROBE_CALL_RETURN(args, pamret);
+    pamk5_recorder_finish(args, pamret);
     pamk5_free(args);
     return pamret;
 }
@@ -239,6 +304,7 @@ pam_sm_close_session(pam_handle_t *pamh, int flags, int argc,
     struct pam_args *args;
     int pamret;
 
+    PROBE_CALL_ENTRY(flags);
     args = pamk5_init(pamh, flags, argc, argv);
     if (args == NULL) {
         pamret = PAM_SERVICE_ERR;
@@ -251,6 +317,8 @@ pam_sm_close_session(pam_handle_t *pamh, int flags, int argc,
 
 done:
     EXIT(args, pamret);
+    PROBE_CALL_RETURN(args, pamret);
+    pamk5_recorder_finish(args, pamret);
     pamk5_free(args);
     return pamret;
 }
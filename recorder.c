@@ -0,0 +1,220 @@
+/*
+ * Failure-triggered flight recorder.
+ *
+ * When the recorder option is set, debugging messages that are suppressed
+ * because debug is off, and the Kerberos library trace output if the library
+ * supports a trace callback and trace isn't set, are kept in a fixed-size
+ * in-memory ring for the duration of the PAM call.  If the call fails or takes
+ * longer than recorder_threshold, the contents are logged to syslog or
+ * appended to recorder_file; otherwise they are dropped with the rest of the
+ * arena.  A successful call costs formatting each message and copying it into
+ * the ring, but no system calls.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/arena.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <pam-util/recorder.h>
+
+/* Size of the ring, which holds the most recent messages. */
+#define RECORDER_SIZE (16 * 1024)
+
+/* Recorder state for one call, allocated from the arena. */
+struct pamk5_recorder {
+    unsigned long long start;   /* When recording started, in microseconds. */
+    bool traced;                /* Whether the trace callback is installed. */
+};
+
+
+/*
+ * Return the current monotonic time in microseconds.
+ */
+static unsigned long long
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+    return (unsigned long long) ts.tv_sec * 1000000ULL
+           + (unsigned long long) ts.tv_nsec / 1000ULL;
+}
+
+
+/*
+ * Record a message from the Kerberos library trace logging.  The library
+ * calls this with NULL info when the callback is replaced.
+ */
+#ifdef HAVE_KRB5_SET_TRACE_CALLBACK
+static void
+record_trace(krb5_context c UNUSED, const krb5_trace_info *info, void *data)
+{
+    struct pam_args *args = data;
+    size_t length;
+
+    if (info == NULL || info->message == NULL)
+        return;
+    length = strlen(info->message);
+    if (length > 0 && info->message[length - 1] == '\n')
+        length--;
+    putil_recorder_add(args->recorder, info->message, length);
+}
+#endif
+
+
+/*
+ * Start recording if the recorder option is set and recording hasn't already
+ * started, and install the trace callback once there is a Kerberos context.
+ * Called from pamk5_init with the settings from the arguments and again from
+ * pamk5_load once krb5.conf has been read.  Failure to allocate just means
+ * nothing is recorded.
+ */
+void
+pamk5_recorder_start(struct pam_args *args)
+{
+    struct pamk5_recorder *recorder = args->config->flight;
+
+    if (!args->config->recorder)
+        return;
+    if (recorder == NULL) {
+        recorder = putil_arena_alloc(args, sizeof(struct pamk5_recorder));
+        if (recorder == NULL)
+            return;
+        if (!putil_recorder_start(args, RECORDER_SIZE))
+            return;
+        recorder->start = now();
+        args->config->flight = recorder;
+    }
+#ifdef HAVE_KRB5_SET_TRACE_CALLBACK
+    if (!recorder->traced && args->ctx != NULL
+        && args->config->trace == NULL) {
+        if (krb5_set_trace_callback(args->ctx, record_trace, args) == 0)
+            recorder->traced = true;
+    }
+#endif
+}
+
+
+/*
+ * Append the recorded messages to the recorder file in one write, preceded
+ * by a line saying which call they came from.  Problems are logged but
+ * otherwise ignored.
+ */
+static void
+flush_file(struct pam_args *args, const char *reason,
+           unsigned long long elapsed, const char *contents)
+{
+    const char *path = args->config->recorder_file;
+    const char *service = NULL;
+    char stamp[32];
+    char *output;
+    struct tm tm;
+    time_t clock;
+    size_t length;
+    ssize_t status;
+    int fd;
+
+    pam_get_item(args->pamh, PAM_SERVICE, (PAM_CONST void **) &service);
+    clock = time(NULL);
+    if (localtime_r(&clock, &tm) == NULL
+        || strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm) == 0)
+        strlcpy(stamp, "unknown", sizeof(stamp));
+    output = putil_arena_sprintf(args, "%s pam_krb5[%lu]: user %s service"
+                                 " %s: %s after %lluus\n%s", stamp,
+                                 (unsigned long) getpid(),
+                                 args->user != NULL ? args->user : "UNKNOWN",
+                                 service != NULL ? service : "UNKNOWN",
+                                 reason, elapsed, contents);
+    if (output == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return;
+    }
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        putil_err(args, "cannot open recorder file %s: %s", path,
+                  strerror(errno));
+        return;
+    }
+    length = strlen(output);
+    status = write(fd, output, length);
+    if (status < 0 || (size_t) status != length)
+        putil_err(args, "cannot write to recorder file %s: %s", path,
+                  status < 0 ? strerror(errno) : "short write");
+    close(fd);
+}
+
+
+/*
+ * Log each recorded message to syslog, preceded by a line saying why.
+ */
+static void
+flush_syslog(struct pam_args *args, const char *reason,
+             unsigned long long elapsed, char *contents)
+{
+    const char *user = args->user != NULL ? args->user : "UNKNOWN";
+    char *line, *end;
+
+    pam_syslog(args->pamh, LOG_INFO, "user %s recorder: %s after %lluus",
+               user, reason, elapsed);
+    for (line = contents; *line != '\0'; line = end + 1) {
+        end = strchr(line, '\n');
+        if (end == NULL)
+            break;
+        *end = '\0';
+        pam_syslog(args->pamh, LOG_INFO, "user %s recorder: %s", user, line);
+    }
+}
+
+
+/*
+ * Finish recording at the end of a call.  If the call failed or was slower
+ * than recorder_threshold, log what was recorded.  Either way, remove the
+ * trace callback from the Kerberos context, which may outlive this call, and
+ * stop recording.  PAM_IGNORE is not a failure.
+ */
+void
+pamk5_recorder_finish(struct pam_args *args, int pamret)
+{
+    struct pamk5_recorder *recorder;
+    unsigned long long elapsed;
+    const char *reason = NULL;
+    char *contents;
+
+    if (args == NULL || args->config == NULL)
+        return;
+    recorder = args->config->flight;
+    if (recorder == NULL)
+        return;
+#ifdef HAVE_KRB5_SET_TRACE_CALLBACK
+    if (recorder->traced && args->ctx != NULL)
+        krb5_set_trace_callback(args->ctx, NULL, NULL);
+#endif
+    elapsed = now() - recorder->start;
+    if (pamret != PAM_SUCCESS && pamret != PAM_IGNORE)
+        reason = pam_strerror(args->pamh, pamret);
+    else if (args->config->recorder_threshold > 0
+             && elapsed >= (unsigned long long)
+                           args->config->recorder_threshold * 1000)
+        reason = "slow call";
+    if (reason != NULL) {
+        contents = putil_recorder_contents(args);
+        if (contents != NULL && args->config->recorder_file != NULL)
+            flush_file(args, reason, elapsed, contents);
+        else if (contents != NULL)
+            flush_syslog(args, reason, elapsed, contents);
+    }
+    args->recorder = NULL;
+    args->config->flight = NULL;
+}
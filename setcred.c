@@ -23,8 +23,10 @@
 #include <pwd.h>
 
 #include <internal.h>
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
+#include <usdt.h>
 
 
 /*
@@ -75,7 +77,9 @@ cache_init_from_cache(struct pam_args *args, const char *ccname,
      * and copy them just in case.
      */
     while (krb5_cc_next_cred(ctx->context, old, &cursor, &creds) == 0) {
+        PROBE_CC_STORE_START(args, creds.client);
         status = krb5_cc_store_cred(ctx->context, *cache, &creds);
+        PROBE_CC_STORE_DONE(args, creds.client, status);
         krb5_free_cred_contents(ctx->context, &creds);
         if (status != 0) {
             putil_err_krb5(args, status, "cannot store additional credentials"
@@ -98,7 +102,8 @@ done:
 
 /*
  * Determine the name of a new ticket cache.  Handles ccache and ccache_dir
- * PAM options and returns newly allocated memory.
+ * PAM options and returns memory allocated from the arena for the PAM
+ * arguments.
  *
  * The ccache option, if set, contains a string with possible %u and %p
  * escapes.  The former is replaced by the UID and the latter is replaced by
@@ -107,13 +112,12 @@ done:
 static char *
 build_ccache_name(struct pam_args *args, uid_t uid)
 {
-    char *cache_name = NULL;
-    int retval;
+    char *cache_name;
 
     if (args->config->ccache == NULL) {
-        retval = asprintf(&cache_name, "%s/krb5cc_%d_XXXXXX",
-                          args->config->ccache_dir, (int) uid);
-        if (retval < 0) {
+        cache_name = putil_arena_sprintf(args, "%s/krb5cc_%d_XXXXXX",
+                                         args->config->ccache_dir, (int) uid);
+        if (cache_name == NULL) {
             putil_crit(args, "malloc failure: %s", strerror(errno));
             return NULL;
         }
@@ -133,7 +137,7 @@ build_ccache_name(struct pam_args *args, uid_t uid)
             }
         }
         len++;
-        cache_name = malloc(len);
+        cache_name = putil_arena_alloc(args, len);
         if (cache_name == NULL) {
             putil_crit(args, "malloc failure: %s", strerror(errno));
             return NULL;
@@ -203,7 +207,9 @@ create_session_context(struct pam_args *args)
         goto fail;
     }
     putil_debug(args, "found initial ticket cache at %s", tmpname);
+    PROBE_CC_RESOLVE_START(args, tmpname);
     status = krb5_cc_resolve(ctx->context, tmpname, &ctx->cache);
+    PROBE_CC_RESOLVE_DONE(args, tmpname, status);
     if (status != 0) {
         putil_err_krb5(args, status, "cannot resolve cache %s", tmpname);
         pamret = PAM_SERVICE_ERR;
@@ -215,13 +221,14 @@ create_session_context(struct pam_args *args)
         pamret = PAM_SERVICE_ERR;
         goto fail;
     }
+    pamk5_context_principal(args);
 
     /*
      * We've rebuilt the context.  Push it back into the PAM state for any
      * further calls to session or account management, which OpenSSH does keep
      * the context for.
      */
-    pamret = pam_set_data(args->pamh, "pam_krb5", ctx, pamk5_context_destroy);
+    pamret = pamk5_context_store(args);
     if (pamret != PAM_SUCCESS) {
         putil_err_pam(args, pamret, "cannot set context data");
         goto fail;
@@ -234,6 +241,27 @@ fail:
 }
 
 
+/*
+ * Returns true if pamk5_setcred would return without doing anything, judging
+ * only by the settings loaded so far and the PAM data.  This is the case if
+ * no_ccache is set, if an earlier call already initialized the ticket cache,
+ * or if there is no context and the user will be ignored.  Used to avoid
+ * reading krb5.conf and creating a Kerberos context for such calls.
+ */
+bool
+pamk5_setcred_noop(struct pam_args *args)
+{
+    PAM_CONST char *user;
+
+    if (args->config->no_ccache)
+        return true;
+    pamk5_context_fetch(args);
+    if (args->config->ctx != NULL)
+        return args->config->ctx->initialized != 0;
+    return pamk5_ignore_early(args, &user);
+}
+
+
 /*
  * Sets user credentials by creating the permanent ticket cache and setting
  * the proper ownership.  This function may be called by either pam_sm_setcred
@@ -246,12 +274,12 @@ pamk5_setcred(struct pam_args *args, bool refresh)
     struct context *ctx = NULL;
     krb5_ccache cache = NULL;
     char *cache_name = NULL;
-    bool set_context = false;
     int status = 0;
     int pamret;
     struct passwd *pw = NULL;
     uid_t uid;
     gid_t gid;
+    unsigned long long start = pamk5_metrics_start(args);
 
     /* If configured not to create a cache, we have nothing to do. */
     if (args->config->no_ccache) {
@@ -270,7 +298,6 @@ pamk5_setcred(struct pam_args *args, bool refresh)
         pamret = create_session_context(args);
         if (pamret != PAM_SUCCESS || args->config->ctx == NULL)
             goto done;
-        set_context = true;
     }
     ctx = args->config->ctx;
 
@@ -372,7 +399,7 @@ pamk5_setcred(struct pam_args *args, bool refresh)
             }
         }
 
-        cache_name = strdup(name);
+        cache_name = putil_arena_strdup(args, name);
         if (cache_name == NULL) {
             putil_crit(args, "malloc failure: %s", strerror(errno));
             pamret = PAM_BUF_ERR;
@@ -414,7 +441,9 @@ pamk5_setcred(struct pam_args *args, bool refresh)
      * assumption that the default cache type is FILE; otherwise, due to the
      * type prefix, we'd end up with an invalid path.
      */
+    pamk5_timing_start(args, PHASE_COPY);
     pamret = cache_init_from_cache(args, cache_name, ctx->cache, &cache);
+    pamk5_timing_stop(args, PHASE_COPY);
     if (pamret != PAM_SUCCESS)
         goto done;
     if (strncmp(cache_name, "FILE:", strlen("FILE:")) == 0)
@@ -461,11 +490,6 @@ pamk5_setcred(struct pam_args *args, bool refresh)
 done:
     if (ctx != NULL && cache != NULL)
         krb5_cc_destroy(ctx->context, cache);
-    free(cache_name);
-
-    /* If we stored our Kerberos context in PAM data, don't free it. */
-    if (set_context)
-        args->ctx = NULL;
-
+    pamk5_metrics_record(args, METRICS_SETCRED, pamret, 0, start);
     return pamret;
 }
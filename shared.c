@@ -0,0 +1,234 @@
+/*
+ * Files mapped shared by every process using the module.
+ *
+ * The metrics and kdc_breaker options name files that each process maps
+ * shared the first time it needs them and keeps mapped for its lifetime, so
+ * that every process on the host works on the same data.  Both are created
+ * if they don't exist and must be owned by root or by the user running the
+ * module and not writable by group or other.  Each starts with a magic
+ * string, a layout version, and its size, which are stamped on a new file and
+ * checked on an existing one.
+ *
+ * Any problem with a file is only logged at debug level, since the features
+ * using them are optional, and is remembered so that the file isn't retried
+ * on every call.
+ *
+ * Finding a file that was already mapped takes no lock.  Mapping a new one
+ * does, but a thread that finds another already mapping a file doesn't wait
+ * for it and just goes without the file this time, so a slow file system
+ * never holds up more than the one call that opens the file.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* The start of every shared file, as laid out in metrics.h and breaker.h. */
+struct shared_header {
+    char magic[8];              /* The magic string with its nul. */
+    uint32_t version;           /* The layout version. */
+    uint32_t size;              /* The size of the file. */
+};
+
+/* The most shared files a process will map. */
+#define SHARED_MAPS 8
+
+/* A file mapped so far, which stays mapped until the module is unloaded. */
+struct shared_map {
+    const struct pamk5_shared_type *type;
+    char *path;
+    void *data;                 /* NULL if the file can't be used. */
+    int fd;                     /* Kept open for locking if asked for. */
+};
+
+/*
+ * The mappings are shared by all threads.  Entries are filled in under the
+ * lock and only then counted in nmaps, so they can be read without it.
+ */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t maps_lock = PTHREAD_MUTEX_INITIALIZER;
+# define maps_try()     (pthread_mutex_trylock(&maps_lock) == 0)
+# define maps_acquire() pthread_mutex_lock(&maps_lock)
+# define maps_release() pthread_mutex_unlock(&maps_lock)
+#else
+# define maps_try()     true
+# define maps_acquire() /* empty */
+# define maps_release() /* empty */
+#endif
+static struct shared_map maps[SHARED_MAPS];
+static size_t nmaps = 0;
+
+/* Unmap everything at unload. */
+static void shared_free(void) __attribute__((__destructor__));
+
+
+/*
+ * Map a shared file, creating it if necessary, and fill in map.  On any
+ * failure, the data is left NULL.
+ */
+static void
+shared_open(struct pam_args *args, struct shared_map *map)
+{
+    const struct pamk5_shared_type *type = map->type;
+    struct shared_header *header;
+    struct stat st;
+    void *data;
+    int fd;
+
+    map->data = NULL;
+    map->fd = -1;
+    fd = open(map->path, O_RDWR | O_CREAT | O_NOFOLLOW, 0644);
+    if (fd < 0) {
+        putil_debug(args, "cannot open %s file %s: %s", type->what,
+                    map->path, strerror(errno));
+        return;
+    }
+    if (fstat(fd, &st) < 0) {
+        putil_debug(args, "cannot stat %s file %s: %s", type->what,
+                    map->path, strerror(errno));
+        goto fail;
+    }
+    if (!S_ISREG(st.st_mode)
+        || (st.st_uid != 0 && st.st_uid != geteuid())
+        || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        putil_debug(args, "ignoring insecure %s file %s", type->what,
+                    map->path);
+        goto fail;
+    }
+
+    /*
+     * A new file is extended to full size and stamped.  Several processes
+     * may do this at once, but they all write the same thing.
+     */
+    if (st.st_size == 0 && ftruncate(fd, (off_t) type->size) < 0) {
+        putil_debug(args, "cannot extend %s file %s: %s", type->what,
+                    map->path, strerror(errno));
+        goto fail;
+    } else if (st.st_size != 0 && st.st_size != (off_t) type->size) {
+        putil_debug(args, "ignoring incompatible %s file %s", type->what,
+                    map->path);
+        goto fail;
+    }
+    data = mmap(NULL, type->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        putil_debug(args, "cannot map %s file %s: %s", type->what,
+                    map->path, strerror(errno));
+        goto fail;
+    }
+    header = data;
+    if (header->magic[0] == '\0') {
+        strlcpy(header->magic, type->magic, sizeof(header->magic));
+        header->version = type->version;
+        header->size = (uint32_t) type->size;
+    }
+    if (strncmp(header->magic, type->magic, sizeof(header->magic)) != 0
+        || header->version != type->version
+        || header->size != type->size) {
+        putil_debug(args, "ignoring incompatible %s file %s", type->what,
+                    map->path);
+        munmap(data, type->size);
+        goto fail;
+    }
+    map->data = data;
+    if (type->locked)
+        map->fd = fd;
+    else
+        close(fd);
+    return;
+
+fail:
+    close(fd);
+}
+
+
+/*
+ * Return the entry for the shared file of the given type at path among the
+ * first count entries, or NULL if there is none.
+ */
+static struct shared_map *
+shared_find(const struct pamk5_shared_type *type, const char *path,
+            size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        if (maps[i].type == type && strcmp(maps[i].path, path) == 0)
+            return &maps[i];
+    return NULL;
+}
+
+
+/*
+ * Return the mapping of the shared file of the given type at path, mapping
+ * it on first use, or NULL if it can't be used or another thread is mapping
+ * a file right now.  If fd is not NULL, it is set to the descriptor kept open
+ * for locking.
+ */
+void *
+pamk5_shared_map(struct pam_args *args, const struct pamk5_shared_type *type,
+                 const char *path, int *fd)
+{
+    struct shared_map *map;
+    size_t count;
+
+    count = __atomic_load_n(&nmaps, __ATOMIC_ACQUIRE);
+    map = shared_find(type, path, count);
+    if (map == NULL) {
+        if (!maps_try())
+            return NULL;
+        count = nmaps;
+        map = shared_find(type, path, count);
+        if (map == NULL && count < SHARED_MAPS) {
+            map = &maps[count];
+            map->type = type;
+            map->path = strdup(path);
+            if (map->path == NULL)
+                map = NULL;
+            else {
+                shared_open(args, map);
+                __atomic_store_n(&nmaps, count + 1, __ATOMIC_RELEASE);
+            }
+        }
+        maps_release();
+    }
+    if (map == NULL || map->data == NULL)
+        return NULL;
+    if (fd != NULL)
+        *fd = map->fd;
+    return map->data;
+}
+
+
+/*
+ * Unmap all shared files when the module is unloaded.
+ */
+static void
+shared_free(void)
+{
+    size_t i;
+
+    maps_acquire();
+    for (i = 0; i < nmaps; i++) {
+        free(maps[i].path);
+        if (maps[i].data != NULL)
+            munmap(maps[i].data, maps[i].type->size);
+        if (maps[i].fd >= 0)
+            close(maps[i].fd);
+    }
+    nmaps = 0;
+    maps_release();
+}
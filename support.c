@@ -22,6 +22,7 @@
 #include <pwd.h>
 
 #include <internal.h>
+#include <pam-util/arena.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
 
@@ -30,27 +31,66 @@
  * Given the PAM arguments and the user we're authenticating, see if we should
  * ignore that user because they're root or have a low-numbered UID and we
  * were configured to ignore such users.  Returns true if we should ignore
- * them, false otherwise.  Ignores any fully-qualified principal names.
+ * them, false otherwise.  Ignores any fully-qualified principal names.  Logs
+ * the reason at debug level unless quiet is set.
  */
-int
-pamk5_should_ignore(struct pam_args *args, PAM_CONST char *username)
+static bool
+ignore_user(struct pam_args *args, PAM_CONST char *username, bool quiet)
 {
     struct passwd *pwd;
 
     if (args->config->ignore_root && strcmp("root", username) == 0) {
-        putil_debug(args, "ignoring root user");
-        return 1;
+        if (!quiet)
+            putil_debug(args, "ignoring root user");
+        return true;
     }
     if (args->config->minimum_uid > 0 && strchr(username, '@') == NULL) {
         pwd = pam_modutil_getpwnam(args->pamh, username);
         if (pwd != NULL && pwd->pw_uid < (uid_t) args->config->minimum_uid) {
-            putil_debug(args, "ignoring low-UID user (%lu < %ld)",
-                        (unsigned long) pwd->pw_uid,
-                        args->config->minimum_uid);
-            return 1;
+            if (!quiet)
+                putil_debug(args, "ignoring low-UID user (%lu < %ld)",
+                            (unsigned long) pwd->pw_uid,
+                            args->config->minimum_uid);
+            return true;
         }
     }
-    return 0;
+    return false;
+}
+
+
+/*
+ * The general check for whether to ignore a user, which logs the reason.
+ */
+int
+pamk5_should_ignore(struct pam_args *args, PAM_CONST char *username)
+{
+    return ignore_user(args, username, false);
+}
+
+
+/*
+ * Check, before krb5.conf has been read, whether we will ignore the user.
+ * Settings from the PAM arguments override those from krb5.conf, so if the
+ * settings parsed so far say to ignore the user, loading the rest won't
+ * change that.  Only considers a user the application has already set, so
+ * this never prompts, and logs nothing.  If the user will be ignored, stores
+ * it in user and returns true.
+ */
+bool
+pamk5_ignore_early(struct pam_args *args, PAM_CONST char **user)
+{
+    PAM_CONST char *name;
+    int status;
+
+    if (!args->config->ignore_root && args->config->minimum_uid <= 0)
+        return false;
+    status = pam_get_item(args->pamh, PAM_USER, (PAM_CONST void **) &name);
+    if (status != PAM_SUCCESS || name == NULL)
+        return false;
+    if (!ignore_user(args, name, true))
+        return false;
+    *user = name;
+    return true;
 }
 
 
@@ -139,3 +179,27 @@ pamk5_authorized(struct pam_args *args)
 
     return PAM_SUCCESS;
 }
+
+
+/*
+ * Set a variable in the PAM environment, logging any failure.  Returns a PAM
+ * status code.
+ */
+int
+pamk5_setenv(struct pam_args *args, const char *key, const char *value)
+{
+    char *setting;
+    int pamret;
+
+    setting = putil_arena_sprintf(args, "%s=%s", key, value);
+    if (setting == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return PAM_BUF_ERR;
+    }
+    pamret = pam_putenv(args->pamh, setting);
+    if (pamret != PAM_SUCCESS) {
+        putil_err_pam(args, pamret, "pam_putenv failed");
+        return PAM_SERVICE_ERR;
+    }
+    return pamret;
+}
@@ -0,0 +1,583 @@
+/*
+ * End-to-end benchmark of PAM transactions.
+ *
+ * Runs PAM interaction scripts, in the same format as the test suite uses,
+ * many times in a row against the Kerberos test realm.  For each PAM call in
+ * the script, for the whole transaction, and for each internal phase measured
+ * by the probes, reports the 50th, 95th, and 99th percentile wall-clock time.
+ * Also reports the number of requests sent to the KDC and the number of
+ * allocations made per transaction.  Every call's status is checked against
+ * the script so that the benchmark can't silently measure failures.
+ *
+ * Usage: pam-bench [-m] [-f <faults>] [-k <program>] [-n <count>]
+ *                  [<script> ...]
+ *
+ *     -f  Apply the faults described by <faults> to the stand-in KDC, using
+ *         the syntax of kdc_script, such as "delay=20,loss=5".
+ *     -k  Start <program> in the background first, passing it the path to a
+ *         PID file that it should create once it is accepting requests, and
+ *         stop it again at exit.  Use this to run against a local KDC.
+ *     -m  Print one tab-separated line per measurement instead of a table,
+ *         for comparing results between builds.
+ *     -n  Run each script <count> times (default 100).
+ *
+ * If no scripts are given, data/scripts/bench/login is used.  The Kerberos
+ * test configuration in tests/config is used as for the tests in
+ * tests/module, including falling back on the stand-in KDC if there is none.
+ * With the stand-in, KDC requests are counted by the stand-in itself, since
+ * its relay runs in this process and would otherwise be counted too.
+ *
+ * The same source also builds pam-bench-mock, which is linked with the mock
+ * Kerberos library in tests/fakekrb5 instead of the probes.  It needs no
+ * Kerberos realm, replaces the KDC with canned credentials after a delay set
+ * with -d <usec>, and reports the time spent waiting on the mock KDC, the
+ * remaining time spent in the module itself, and the number of calls to
+ * each mocked Kerberos function per transaction.  -f and -k aren't
+ * supported, since there is no KDC.
+ *
+ * This is not part of the test suite.  Run it with make bench.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+
+#include <tests/bench/probes.h>
+#ifdef PAM_BENCH_MOCK
+# include <tests/fakekrb5/mock.h>
+#endif
+#include <tests/fakepam/internal.h>
+#include <tests/fakepam/pam.h>
+#include <tests/fakepam/script.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kdc.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/string.h>
+
+/* The script to run if none are given. */
+#define DEFAULT_SCRIPT "data/scripts/bench/login"
+
+/*
+ * The command-line options, and for the mock build the principal and
+ * password used and the number of extra series it reports.
+ */
+#ifdef PAM_BENCH_MOCK
+# define OPTIONS       "d:mn:"
+# define USAGE         "usage: pam-bench-mock [-m] [-d <usec>] [-n <count>]" \
+                       " [<script> ...]"
+# define MOCK_USER     "pamtest"
+# define MOCK_PASSWORD "mock password"
+# define MOCK_REALM    "MOCK.TEST"
+# define MOCK_SERIES   (2 + MOCK_CALL_MAX)
+#else
+# define OPTIONS       "f:k:mn:"
+# define USAGE         "usage: pam-bench [-m] [-f <faults>] [-k <program>]" \
+                       " [-n <count>] [<script> ...]"
+# define MOCK_SERIES   0
+#endif
+
+/* The samples of one measurement, one per transaction. */
+struct series {
+    char *name;
+    const char *unit;
+    double *samples;
+    size_t count;
+};
+
+
+/*
+ * The PAM conversation function.  Answers prompts in the order given in the
+ * script without checking them, since the test suite does that.
+ */
+static int
+converse(int num_msg, const struct pam_message **msg,
+         struct pam_response **resp, void *appdata_ptr)
+{
+    struct prompts *prompts = appdata_ptr;
+    struct prompt *prompt;
+    int i;
+
+    *resp = bcalloc(num_msg, sizeof(struct pam_response));
+    for (i = 0; i < num_msg; i++) {
+        if (prompts->current >= prompts->size)
+            continue;
+        prompt = &prompts->prompts[prompts->current];
+        prompts->current++;
+        if (prompt->style == msg[i]->msg_style && prompt->response != NULL)
+            (*resp)[i].resp = bstrdup(prompt->response);
+    }
+    return PAM_SUCCESS;
+}
+
+
+/*
+ * Free the parsed form of a script.
+ */
+static void
+free_work(struct work *work)
+{
+    struct action *action, *next;
+    size_t i, j;
+
+    for (action = work->actions; action != NULL; action = next) {
+        next = action->next;
+        free(action->name);
+        free(action);
+    }
+    for (i = 0; i < ARRAY_SIZE(work->options); i++)
+        if (work->options[i].argv != NULL) {
+            for (j = 0; work->options[i].argv[j] != NULL; j++)
+                free(work->options[i].argv[j]);
+            free(work->options[i].argv);
+        }
+    if (work->output != NULL)
+        pam_output_free(work->output);
+    if (work->prompts != NULL) {
+        for (i = 0; i < work->prompts->size; i++) {
+            free(work->prompts->prompts[i].prompt);
+            free(work->prompts->prompts[i].response);
+        }
+        free(work->prompts->prompts);
+        free(work->prompts);
+    }
+    free(work);
+}
+
+
+/*
+ * Sort comparison function for samples.
+ */
+static int
+compare_samples(const void *a, const void *b)
+{
+    const double *x = a;
+    const double *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+
+/*
+ * Return the given percentile of a sorted set of samples using the nearest
+ * rank method.
+ */
+static double
+percentile(const struct series *series, size_t percent)
+{
+    size_t rank;
+
+    rank = (percent * series->count + 99) / 100;
+    if (rank == 0)
+        rank = 1;
+    return series->samples[rank - 1];
+}
+
+
+/*
+ * Print the percentiles of each series, either as a table or, if machine is
+ * true, as tab-separated lines of script name, measurement name, unit,
+ * number of samples, and the three percentiles.
+ */
+static void
+report(const char *script, struct series *series, size_t count,
+       unsigned long iterations, bool machine)
+{
+    size_t i;
+
+    if (!machine) {
+        printf("%s: %lu transactions\n", script, iterations);
+        printf("    %-24s %12s %12s %12s\n", "", "p50", "p95", "p99");
+    }
+    for (i = 0; i < count; i++) {
+        qsort(series[i].samples, series[i].count, sizeof(double),
+              compare_samples);
+        if (machine)
+            printf("%s\t%s\t%s\t%lu\t%.1f\t%.1f\t%.1f\n", script,
+                   series[i].name, series[i].unit,
+                   (unsigned long) series[i].count,
+                   percentile(&series[i], 50), percentile(&series[i], 95),
+                   percentile(&series[i], 99));
+        else
+            printf("    %-24s %12.1f %12.1f %12.1f %s\n", series[i].name,
+                   percentile(&series[i], 50), percentile(&series[i], 95),
+                   percentile(&series[i], 99), series[i].unit);
+    }
+    if (!machine) {
+#ifdef PAM_BENCH_MOCK
+        if (!mock_krb5_ccache_counted())
+            printf("    (ticket cache calls not counted)\n");
+#else
+        if (!probes_phases_available())
+            printf("    (phase timings and KDC requests not available)\n");
+#endif
+        if (!probes_allocs_available())
+            printf("    (allocation counts not available)\n");
+        printf("\n");
+    }
+}
+
+
+/*
+ * Set up a series with room for the given number of samples.
+ */
+static void
+series_init(struct series *series, const char *name, const char *unit,
+            unsigned long size)
+{
+    series->name = bstrdup(name);
+    series->unit = unit;
+    series->samples = bcalloc(size, sizeof(double));
+    series->count = 0;
+}
+
+
+#ifdef PAM_BENCH_MOCK
+
+/* The generated krb5.conf for the mock realm and its directory. */
+static char *mock_tmpdir = NULL;
+static char *mock_krb5_conf = NULL;
+
+
+/*
+ * Remove the krb5.conf for the mock realm.  Registered with atexit.
+ */
+static void
+mock_cleanup(void)
+{
+    if (mock_krb5_conf != NULL) {
+        unlink(mock_krb5_conf);
+        free(mock_krb5_conf);
+        mock_krb5_conf = NULL;
+    }
+    test_tmpdir_free(mock_tmpdir);
+    mock_tmpdir = NULL;
+}
+
+
+/*
+ * Set up the mock Kerberos library and a krb5.conf whose default realm is
+ * the mock realm.  The realm needs no KDC entries since nothing contacts one.
+ */
+static void
+mock_setup(unsigned long delay)
+{
+    FILE *file;
+
+    mock_krb5_password(MOCK_PASSWORD);
+    mock_krb5_delay(delay);
+    mock_tmpdir = test_tmpdir();
+    basprintf(&mock_krb5_conf, "%s/krb5.conf", mock_tmpdir);
+    file = fopen(mock_krb5_conf, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", mock_krb5_conf);
+    fprintf(file, "[libdefaults]\n    default_realm = %s\n", MOCK_REALM);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", mock_krb5_conf);
+    if (setenv("KRB5_CONFIG", mock_krb5_conf, 1) < 0)
+        sysbail("cannot set KRB5_CONFIG");
+    if (atexit(mock_cleanup) != 0)
+        sysdiag("cannot register cleanup function");
+}
+
+#endif /* PAM_BENCH_MOCK */
+
+
+/*
+ * Run one script the given number of times and report the results.
+ */
+static void
+bench_script(const char *file, const struct script_config *config,
+             unsigned long iterations, bool machine)
+{
+    char *path;
+    const char *name;
+    FILE *script;
+    struct work *work;
+    struct action *action;
+    struct options *opts;
+    struct pam_conv conv = { NULL, NULL };
+    struct probe_counters counters;
+    struct series *series, *total;
+    struct series *phases = NULL, *requests = NULL;
+    struct series *allocs = NULL, *bytes = NULL;
+#ifdef PAM_BENCH_MOCK
+    struct mock_krb5_stats mock;
+    struct series *kdc_wait, *module, *calls;
+    size_t ncalls = 0;
+#endif
+    size_t nactions, nseries, i, k;
+    unsigned long n;
+    pam_handle_t *pamh;
+    int status;
+    unsigned long kdc_before = 0;
+    double start, call;
+    const char *argv_empty[] = { NULL };
+
+    /* Parse the script. */
+    if (access(file, R_OK) == 0)
+        path = bstrdup(file);
+    else {
+        path = test_file_path(file);
+        if (path == NULL)
+            bail("cannot find PAM script %s", file);
+    }
+    script = fopen(path, "r");
+    if (script == NULL)
+        sysbail("cannot open %s", path);
+    work = parse_script(script, config);
+    fclose(script);
+    name = strrchr(file, '/');
+    name = (name == NULL) ? file : name + 1;
+    if (work->prompts != NULL) {
+        conv.conv = converse;
+        conv.appdata_ptr = work->prompts;
+    }
+
+    /*
+     * Set up the series: one per action, naming repeated calls by their
+     * position, then the transaction, and then the phases and counters that
+     * the probes can measure on this system.
+     */
+    nactions = 0;
+    for (action = work->actions; action != NULL; action = action->next)
+        nactions++;
+    series = bcalloc(nactions + 1 + PHASE_MAX + 3 + MOCK_SERIES,
+                     sizeof(struct series));
+    for (i = 0, action = work->actions; action != NULL;
+         i++, action = action->next) {
+        struct action *prev;
+        unsigned long seen = 1;
+        char *label;
+
+        for (prev = work->actions; prev != action; prev = prev->next)
+            if (strcmp(prev->name, action->name) == 0)
+                seen++;
+        if (seen == 1)
+            label = bstrdup(action->name);
+        else
+            basprintf(&label, "%s.%lu", action->name, seen);
+        series_init(&series[i], label, "us", iterations);
+        free(label);
+    }
+    nseries = nactions;
+    total = &series[nseries++];
+    series_init(total, "transaction", "us", iterations);
+    if (probes_phases_available()) {
+        phases = &series[nseries];
+        for (k = 0; k < PHASE_MAX; k++)
+            series_init(&series[nseries++], probe_phase_names[k], "us",
+                        iterations);
+        requests = &series[nseries++];
+        series_init(requests, "kdc-requests", "count", iterations);
+    }
+    if (probes_allocs_available()) {
+        allocs = &series[nseries++];
+        series_init(allocs, "allocations", "count", iterations);
+        bytes = &series[nseries++];
+        series_init(bytes, "allocated", "bytes", iterations);
+    }
+#ifdef PAM_BENCH_MOCK
+    kdc_wait = &series[nseries++];
+    series_init(kdc_wait, "kdc-wait", "us", iterations);
+    module = &series[nseries++];
+    series_init(module, "module", "us", iterations);
+    calls = &series[nseries];
+    for (k = 0; k < MOCK_CALL_MAX; k++) {
+        if (k >= MOCK_CC_RESOLVE && !mock_krb5_ccache_counted())
+            break;
+        series_init(&series[nseries++], mock_krb5_names[k], "calls",
+                    iterations);
+        ncalls++;
+    }
+#endif
+
+    /* Run the transactions. */
+    for (n = 0; n < iterations; n++) {
+        if (work->prompts != NULL)
+            work->prompts->current = 0;
+        status = pam_start("bench", config->user, &conv, &pamh);
+        if (status != PAM_SUCCESS)
+            sysbail("cannot create PAM handle");
+        if (config->authtok != NULL)
+            pamh->authtok = bstrdup(config->authtok);
+        probes_reset();
+#ifdef PAM_BENCH_MOCK
+        mock_krb5_reset();
+#endif
+        if (kdc_active())
+            kdc_before = kdc_requests();
+        start = probes_now();
+        for (i = 0, action = work->actions; action != NULL;
+             i++, action = action->next) {
+            call = probes_now();
+            probes_enable(true);
+            if (work->options[action->group].argv == NULL)
+                status = (*action->call)(pamh, action->flags, 0, argv_empty);
+            else {
+                opts = &work->options[action->group];
+                status = (*action->call)(pamh, action->flags, opts->argc,
+                                         (const char **) opts->argv);
+            }
+            probes_enable(false);
+            series[i].samples[n] = (probes_now() - call) / 1e3;
+            if (status != action->status)
+                bail("%s: %s returned %d instead of %d", name, action->name,
+                     status, action->status);
+        }
+        probes_enable(true);
+        pam_end(pamh, PAM_SUCCESS);
+        probes_enable(false);
+        total->samples[n] = (probes_now() - start) / 1e3;
+        probes_read(&counters);
+        pam_output_free(pam_output());
+
+        /* Record the counters for this transaction. */
+        if (phases != NULL) {
+            for (k = 0; k < PHASE_MAX; k++)
+                phases[k].samples[n] = counters.phase[k] / 1e3;
+            if (kdc_active())
+                counters.requests = kdc_requests() - kdc_before;
+            requests->samples[n] = (double) counters.requests;
+        }
+        if (allocs != NULL) {
+            allocs->samples[n] = (double) counters.allocs;
+            bytes->samples[n] = (double) counters.alloc_bytes;
+        }
+#ifdef PAM_BENCH_MOCK
+        mock_krb5_read(&mock);
+        kdc_wait->samples[n] = mock.kdc_time / 1e3;
+        module->samples[n] = total->samples[n] - kdc_wait->samples[n];
+        for (k = 0; k < ncalls; k++)
+            calls[k].samples[n] = (double) mock.calls[k];
+#endif
+    }
+    for (i = 0; i < nseries; i++)
+        series[i].count = iterations;
+
+    /* Report and clean up. */
+    report(name, series, nseries, iterations, machine);
+    for (i = 0; i < nseries; i++) {
+        free(series[i].name);
+        free(series[i].samples);
+    }
+    free(series);
+    free_work(work);
+    free(path);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct script_config config;
+    struct passwd pwd;
+    const char *username;
+    const char *build;
+    const char *default_scripts[] = { DEFAULT_SCRIPT };
+    const char **scripts;
+    unsigned long iterations = 100;
+    bool machine = false;
+    int option, nscripts, i;
+#ifdef PAM_BENCH_MOCK
+    unsigned long delay = 0;
+#else
+    struct kerberos_config *krbconf;
+    const char *kdc = NULL;
+    const char *faults = NULL;
+#endif
+
+    while ((option = getopt(argc, argv, OPTIONS)) != EOF) {
+        switch (option) {
+#ifdef PAM_BENCH_MOCK
+        case 'd':
+            delay = strtoul(optarg, NULL, 10);
+            break;
+#else
+        case 'f':
+            faults = optarg;
+            break;
+        case 'k':
+            kdc = optarg;
+            break;
+#endif
+        case 'm':
+            machine = true;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            if (iterations == 0)
+                bail("invalid number of iterations");
+            break;
+        default:
+            bail("%s", USAGE);
+        }
+    }
+    if (optind < argc) {
+        scripts = (const char **) &argv[optind];
+        nscripts = argc - optind;
+    } else {
+        scripts = default_scripts;
+        nscripts = 1;
+    }
+    memset(&config, 0, sizeof(config));
+
+#ifdef PAM_BENCH_MOCK
+    /* Point the module at the mock realm.  No KDC is needed. */
+    mock_setup(delay);
+    username = MOCK_USER;
+    config.user = MOCK_USER;
+    config.authtok = MOCK_PASSWORD;
+    config.extra[0] = MOCK_USER "@" MOCK_REALM;
+#else
+    /* Start the KDC if one was given.  It's stopped at exit. */
+    if (kdc != NULL) {
+        const char *kdc_argv[3];
+        char *tmpdir, *pidfile;
+
+        tmpdir = test_tmpdir();
+        basprintf(&pidfile, "%s/kdc.pid", tmpdir);
+        kdc_argv[0] = kdc;
+        kdc_argv[1] = pidfile;
+        kdc_argv[2] = NULL;
+        process_start(kdc_argv, pidfile);
+    }
+
+    /* Load the Kerberos principal and password and generate krb5.conf. */
+    krbconf = kerberos_setup(TAP_KRB_NEEDS_PASSWORD);
+    kerberos_generate_conf(krbconf->realm);
+    if (faults != NULL) {
+        if (!kdc_active())
+            bail("-f requires the stand-in KDC");
+        kdc_script(faults);
+    }
+    username = krbconf->username;
+    config.user = krbconf->username;
+    config.authtok = krbconf->password;
+    config.extra[0] = krbconf->userprinc;
+#endif
+
+    /* Create a fake passwd struct for our user, as the module tests do. */
+    build = getenv("BUILD");
+    if (build == NULL)
+        bail("BUILD must be set to the tests build directory");
+    memset(&pwd, 0, sizeof(pwd));
+    pwd.pw_name = (char *) username;
+    pwd.pw_uid = getuid();
+    pwd.pw_gid = getgid();
+    basprintf(&pwd.pw_dir, "%s/tmp", build);
+    pam_set_pwd(&pwd);
+
+    /* Run the scripts. */
+    if (machine)
+        printf("# script\tmeasurement\tunit\tsamples\tp50\tp95\tp99\n");
+    for (i = 0; i < nscripts; i++)
+        bench_script(scripts[i], &config, iterations, machine);
+    free(pwd.pw_dir);
+    return 0;
+}
@@ -0,0 +1,401 @@
+/*
+ * Counters for the end-to-end PAM benchmark.
+ *
+ * Defines replacements for a handful of Kerberos library, socket, and memory
+ * allocation functions.  Because they are defined in the benchmark program,
+ * the module objects linked into it call these instead of the library
+ * versions.  Each replacement finds the real function with dlsym and
+ * RTLD_NEXT, calls it, and adds to the counters while counting is enabled.
+ *
+ * Kerberos calls are timed as phases.  Calls made while a phase is already
+ * being timed, such as a ticket cache store inside another timed call, are
+ * not counted a second time.  KDC requests are counted as messages written
+ * to sockets, which also includes retransmissions and kpasswd traffic.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#ifdef HAVE_DLFCN_H
+# include <dlfcn.h>
+#endif
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include <tests/bench/probes.h>
+#include <tests/tap/basic.h>
+
+/*
+ * The replacements need dlsym with RTLD_NEXT to find the real functions.
+ * pam-bench-mock is linked with the mock Kerberos library instead, which
+ * replaces the same Kerberos functions and has no KDC to send requests to.
+ */
+#if defined(HAVE_DLFCN_H) && defined(RTLD_NEXT) && !defined(PAM_BENCH_MOCK)
+# define HAVE_PROBES 1
+#endif
+
+/* Names of the phases, indexed by enum probe_phase. */
+const char *const probe_phase_names[PHASE_MAX] = {
+    "context", "initial-creds", "verify", "ccache"
+};
+
+/* The counters and whether they're currently being updated. */
+static struct probe_counters counters;
+static bool enabled = false;
+
+/* Whether a phase is being timed, so that nested calls aren't counted. */
+static bool in_phase = false;
+
+/* Holds the state of one timed call. */
+struct phase_timer {
+    bool active;
+    double start;
+};
+
+
+/*
+ * Return the current time in nanoseconds from an arbitrary starting point.
+ */
+double
+probes_now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        sysbail("cannot get time");
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+
+/*
+ * Zero all counters.
+ */
+void
+probes_reset(void)
+{
+    memset(&counters, 0, sizeof(counters));
+}
+
+
+/*
+ * Turn counting on or off.
+ */
+void
+probes_enable(bool enable)
+{
+    enabled = enable;
+}
+
+
+/*
+ * Copy the current counters into the provided struct.
+ */
+void
+probes_read(struct probe_counters *result)
+{
+    *result = counters;
+}
+
+
+#ifdef HAVE_PROBES
+
+/*
+ * Find the real version of a function that we're replacing.  The result is
+ * returned through a pointer to avoid converting between object and function
+ * pointers in an expression.
+ */
+static void
+find_real(const char *name, void *function)
+{
+    void *real;
+
+    real = dlsym(RTLD_NEXT, name);
+    if (real == NULL)
+        bail("cannot find %s: %s", name, dlerror());
+    memcpy(function, &real, sizeof(real));
+}
+
+
+/*
+ * Start and stop timing a phase.
+ */
+static void
+phase_begin(struct phase_timer *timer)
+{
+    timer->active = enabled && !in_phase;
+    if (timer->active) {
+        in_phase = true;
+        timer->start = probes_now();
+    }
+}
+
+static void
+phase_end(struct phase_timer *timer, enum probe_phase phase)
+{
+    if (timer->active) {
+        counters.phase[phase] += probes_now() - timer->start;
+        in_phase = false;
+    }
+}
+
+
+/*
+ * Count a message written to a file descriptor if that descriptor is a
+ * socket.  Only checked while counting so that normal output isn't slowed.
+ */
+static void
+count_write(int fd)
+{
+    struct stat st;
+
+    if (enabled && fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode))
+        counters.requests++;
+}
+
+
+bool
+probes_phases_available(void)
+{
+    return true;
+}
+
+
+/*
+ * The Kerberos library functions that make up the timed phases.
+ */
+krb5_error_code
+krb5_init_context(krb5_context *ctx)
+{
+    static krb5_error_code (*real)(krb5_context *) = NULL;
+    struct phase_timer timer;
+    krb5_error_code code;
+
+    if (real == NULL)
+        find_real("krb5_init_context", &real);
+    phase_begin(&timer);
+    code = real(ctx);
+    phase_end(&timer, PHASE_CONTEXT);
+    return code;
+}
+
+krb5_error_code
+krb5_get_init_creds_password(krb5_context ctx, krb5_creds *creds,
+                             krb5_principal client, const char *password,
+                             krb5_prompter_fct prompter, void *data,
+                             krb5_deltat start, const char *service,
+                             krb5_get_init_creds_opt *opts)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_creds *,
+                                   krb5_principal, const char *,
+                                   krb5_prompter_fct, void *, krb5_deltat,
+                                   const char *, krb5_get_init_creds_opt *)
+        = NULL;
+    struct phase_timer timer;
+    krb5_error_code code;
+
+    if (real == NULL)
+        find_real("krb5_get_init_creds_password", &real);
+    phase_begin(&timer);
+    code = real(ctx, creds, client, password, prompter, data, start, service,
+                opts);
+    phase_end(&timer, PHASE_INITIAL_CREDS);
+    return code;
+}
+
+krb5_error_code
+krb5_verify_init_creds(krb5_context ctx, krb5_creds *creds,
+                       krb5_principal server, krb5_keytab keytab,
+                       krb5_ccache *ccache, krb5_verify_init_creds_opt *opts)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_creds *,
+                                   krb5_principal, krb5_keytab,
+                                   krb5_ccache *,
+                                   krb5_verify_init_creds_opt *) = NULL;
+    struct phase_timer timer;
+    krb5_error_code code;
+
+    if (real == NULL)
+        find_real("krb5_verify_init_creds", &real);
+    phase_begin(&timer);
+    code = real(ctx, creds, server, keytab, ccache, opts);
+    phase_end(&timer, PHASE_VERIFY);
+    return code;
+}
+
+krb5_error_code
+krb5_cc_initialize(krb5_context ctx, krb5_ccache ccache,
+                   krb5_principal princ)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache,
+                                   krb5_principal) = NULL;
+    struct phase_timer timer;
+    krb5_error_code code;
+
+    if (real == NULL)
+        find_real("krb5_cc_initialize", &real);
+    phase_begin(&timer);
+    code = real(ctx, ccache, princ);
+    phase_end(&timer, PHASE_CCACHE);
+    return code;
+}
+
+krb5_error_code
+krb5_cc_store_cred(krb5_context ctx, krb5_ccache ccache, krb5_creds *creds)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache,
+                                   krb5_creds *) = NULL;
+    struct phase_timer timer;
+    krb5_error_code code;
+
+    if (real == NULL)
+        find_real("krb5_cc_store_cred", &real);
+    phase_begin(&timer);
+    code = real(ctx, ccache, creds);
+    phase_end(&timer, PHASE_CCACHE);
+    return code;
+}
+
+
+/*
+ * The socket functions used to send requests to the KDC.  UDP requests are
+ * sent with send or sendto, and TCP requests with writev or write.
+ */
+ssize_t
+send(int fd, const void *buffer, size_t length, int flags)
+{
+    static ssize_t (*real)(int, const void *, size_t, int) = NULL;
+
+    if (real == NULL)
+        find_real("send", &real);
+    if (enabled)
+        counters.requests++;
+    return real(fd, buffer, length, flags);
+}
+
+ssize_t
+sendto(int fd, const void *buffer, size_t length, int flags,
+       const struct sockaddr *addr, socklen_t addrlen)
+{
+    static ssize_t (*real)(int, const void *, size_t, int,
+                           const struct sockaddr *, socklen_t) = NULL;
+
+    if (real == NULL)
+        find_real("sendto", &real);
+    if (enabled)
+        counters.requests++;
+    return real(fd, buffer, length, flags, addr, addrlen);
+}
+
+ssize_t
+sendmsg(int fd, const struct msghdr *message, int flags)
+{
+    static ssize_t (*real)(int, const struct msghdr *, int) = NULL;
+
+    if (real == NULL)
+        find_real("sendmsg", &real);
+    if (enabled)
+        counters.requests++;
+    return real(fd, message, flags);
+}
+
+ssize_t
+writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    static ssize_t (*real)(int, const struct iovec *, int) = NULL;
+
+    if (real == NULL)
+        find_real("writev", &real);
+    count_write(fd);
+    return real(fd, iov, iovcnt);
+}
+
+ssize_t
+write(int fd, const void *buffer, size_t length)
+{
+    static ssize_t (*real)(int, const void *, size_t) = NULL;
+
+    if (real == NULL)
+        find_real("write", &real);
+    count_write(fd);
+    return real(fd, buffer, length);
+}
+
+#else /* !HAVE_PROBES */
+
+bool
+probes_phases_available(void)
+{
+    return false;
+}
+
+#endif /* !HAVE_PROBES */
+
+
+/*
+ * The GNU C Library supports replacing malloc by defining malloc, calloc,
+ * realloc, and free, and exports its own versions under other names so that
+ * they can be called without dlsym, which itself allocates memory.
+ */
+#ifdef __GLIBC__
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void __libc_free(void *);
+
+bool
+probes_allocs_available(void)
+{
+    return true;
+}
+
+void *
+malloc(size_t size)
+{
+    if (enabled) {
+        counters.allocs++;
+        counters.alloc_bytes += size;
+    }
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    if (enabled) {
+        counters.allocs++;
+        counters.alloc_bytes += n * size;
+    }
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+    if (enabled) {
+        counters.allocs++;
+        counters.alloc_bytes += size;
+    }
+    return __libc_realloc(p, size);
+}
+
+void
+free(void *p)
+{
+    __libc_free(p);
+}
+
+#else /* !__GLIBC__ */
+
+bool
+probes_allocs_available(void)
+{
+    return false;
+}
+
+#endif /* !__GLIBC__ */
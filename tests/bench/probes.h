@@ -0,0 +1,64 @@
+/*
+ * Counters for the end-to-end PAM benchmark.
+ *
+ * The benchmark program interposes on the Kerberos library calls that make
+ * up the expensive phases of a PAM transaction, on the socket calls used to
+ * talk to the KDC, and, with the GNU C Library, on malloc.  Each wrapper
+ * calls the real function and, while counting is enabled, adds to the
+ * counters declared here.  This measures the module as it is built, without
+ * any instrumentation in the module itself.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TESTS_BENCH_PROBES_H
+#define TESTS_BENCH_PROBES_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+
+#include <stddef.h>
+
+/* The internal phases of a PAM transaction that are timed separately. */
+enum probe_phase {
+    PHASE_CONTEXT,              /* Creating a Kerberos context. */
+    PHASE_INITIAL_CREDS,        /* Obtaining initial credentials. */
+    PHASE_VERIFY,               /* Verifying credentials against a keytab. */
+    PHASE_CCACHE,               /* Initializing and storing ticket caches. */
+    PHASE_MAX
+};
+
+/* The counters accumulated since the last call to probes_reset. */
+struct probe_counters {
+    double phase[PHASE_MAX];    /* Nanoseconds spent in each phase. */
+    unsigned long requests;     /* Messages sent on sockets. */
+    unsigned long allocs;       /* Calls to malloc, calloc, and realloc. */
+    unsigned long alloc_bytes;  /* Bytes requested by those calls. */
+};
+
+/* Names of the phases, indexed by enum probe_phase. */
+extern const char *const probe_phase_names[PHASE_MAX];
+
+BEGIN_DECLS
+
+/* Whether the phase timings and allocation counts are available. */
+bool probes_phases_available(void);
+bool probes_allocs_available(void);
+
+/* Return the current time in nanoseconds from an arbitrary starting point. */
+double probes_now(void);
+
+/* Zero all counters. */
+void probes_reset(void);
+
+/* Turn counting on or off.  Counting starts off. */
+void probes_enable(bool);
+
+/* Copy the current counters into the provided struct. */
+void probes_read(struct probe_counters *)
+    __attribute__((__nonnull__));
+
+END_DECLS
+
+#endif /* !TESTS_BENCH_PROBES_H */
@@ -0,0 +1,173 @@
+/*
+ * Counting wrappers for the Kerberos ticket cache calls.
+ *
+ * Each wrapper counts the call and then calls the real library function,
+ * found with dlsym and RTLD_NEXT, so the module's ticket caches work as
+ * usual, holding the canned credentials from the mock KDC calls.  If the
+ * Kerberos library calls these functions internally through its exported
+ * symbols, those calls are counted as well.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#ifdef HAVE_DLFCN_H
+# include <dlfcn.h>
+#endif
+
+#include <tests/fakekrb5/internal.h>
+#include <tests/fakekrb5/mock.h>
+
+/* The wrappers need dlsym with RTLD_NEXT to find the real functions. */
+#if defined(HAVE_DLFCN_H) && defined(RTLD_NEXT)
+
+/*
+ * Find the real version of a function that we're replacing, aborting if it
+ * can't be found since there's no way to continue.  The result is returned
+ * through a pointer to avoid converting between object and function pointers
+ * in an expression.
+ */
+static void
+find_real(const char *name, void *function)
+{
+    void *real;
+
+    real = dlsym(RTLD_NEXT, name);
+    if (real == NULL) {
+        fprintf(stderr, "cannot find %s: %s\n", name, dlerror());
+        abort();
+    }
+    memcpy(function, &real, sizeof(real));
+}
+
+
+bool
+mock_krb5_ccache_counted(void)
+{
+    return true;
+}
+
+
+krb5_error_code
+krb5_cc_resolve(krb5_context ctx, const char *name, krb5_ccache *ccache)
+{
+    static krb5_error_code (*real)(krb5_context, const char *,
+                                   krb5_ccache *) = NULL;
+
+    if (real == NULL)
+        find_real("krb5_cc_resolve", &real);
+    mock_krb5_count(MOCK_CC_RESOLVE);
+    return real(ctx, name, ccache);
+}
+
+krb5_error_code
+krb5_cc_initialize(krb5_context ctx, krb5_ccache ccache,
+                   krb5_principal princ)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache,
+                                   krb5_principal) = NULL;
+
+    if (real == NULL)
+        find_real("krb5_cc_initialize", &real);
+    mock_krb5_count(MOCK_CC_INITIALIZE);
+    return real(ctx, ccache, princ);
+}
+
+krb5_error_code
+krb5_cc_store_cred(krb5_context ctx, krb5_ccache ccache, krb5_creds *creds)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache,
+                                   krb5_creds *) = NULL;
+
+    if (real == NULL)
+        find_real("krb5_cc_store_cred", &real);
+    mock_krb5_count(MOCK_CC_STORE_CRED);
+    return real(ctx, ccache, creds);
+}
+
+krb5_error_code
+krb5_cc_get_principal(krb5_context ctx, krb5_ccache ccache,
+                      krb5_principal *princ)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache,
+                                   krb5_principal *) = NULL;
+
+    if (real == NULL)
+        find_real("krb5_cc_get_principal", &real);
+    mock_krb5_count(MOCK_CC_GET_PRINCIPAL);
+    return real(ctx, ccache, princ);
+}
+
+krb5_error_code
+krb5_cc_start_seq_get(krb5_context ctx, krb5_ccache ccache,
+                      krb5_cc_cursor *cursor)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache,
+                                   krb5_cc_cursor *) = NULL;
+
+    if (real == NULL)
+        find_real("krb5_cc_start_seq_get", &real);
+    mock_krb5_count(MOCK_CC_START_SEQ_GET);
+    return real(ctx, ccache, cursor);
+}
+
+krb5_error_code
+krb5_cc_next_cred(krb5_context ctx, krb5_ccache ccache,
+                  krb5_cc_cursor *cursor, krb5_creds *creds)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache,
+                                   krb5_cc_cursor *, krb5_creds *) = NULL;
+
+    if (real == NULL)
+        find_real("krb5_cc_next_cred", &real);
+    mock_krb5_count(MOCK_CC_NEXT_CRED);
+    return real(ctx, ccache, cursor, creds);
+}
+
+krb5_error_code
+krb5_cc_end_seq_get(krb5_context ctx, krb5_ccache ccache,
+                    krb5_cc_cursor *cursor)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache,
+                                   krb5_cc_cursor *) = NULL;
+
+    if (real == NULL)
+        find_real("krb5_cc_end_seq_get", &real);
+    mock_krb5_count(MOCK_CC_END_SEQ_GET);
+    return real(ctx, ccache, cursor);
+}
+
+krb5_error_code
+krb5_cc_close(krb5_context ctx, krb5_ccache ccache)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache) = NULL;
+
+    if (real == NULL)
+        find_real("krb5_cc_close", &real);
+    mock_krb5_count(MOCK_CC_CLOSE);
+    return real(ctx, ccache);
+}
+
+krb5_error_code
+krb5_cc_destroy(krb5_context ctx, krb5_ccache ccache)
+{
+    static krb5_error_code (*real)(krb5_context, krb5_ccache) = NULL;
+
+    if (real == NULL)
+        find_real("krb5_cc_destroy", &real);
+    mock_krb5_count(MOCK_CC_DESTROY);
+    return real(ctx, ccache);
+}
+
+#else /* !(HAVE_DLFCN_H && RTLD_NEXT) */
+
+bool
+mock_krb5_ccache_counted(void)
+{
+    return false;
+}
+
+#endif /* !(HAVE_DLFCN_H && RTLD_NEXT) */
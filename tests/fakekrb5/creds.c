@@ -0,0 +1,352 @@
+/*
+ * Mock versions of the Kerberos calls that contact the KDC.
+ *
+ * Replaces krb5_get_init_creds_password, krb5_verify_init_creds, and
+ * krb5_set_password.  Each waits for the configured delay and then succeeds
+ * or returns the configured error.  Successful initial credentials are for
+ * the requested client and either the krbtgt of its realm or the requested
+ * service, valid for ten hours, with a random session key and a fixed
+ * ticket that nothing ever decrypts.  Also holds the configuration and
+ * statistics for the whole mock library.  The statistics are protected by a
+ * lock if threads are available, since the module may call the library from
+ * several threads at once.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#include <time.h>
+
+#include <tests/fakekrb5/internal.h>
+#include <tests/fakekrb5/mock.h>
+
+#define UNUSED __attribute__((__unused__))
+
+/* The lifetime of the canned credentials. */
+#define MOCK_LIFETIME (10 * 60 * 60)
+
+/* The contents of the canned ticket. */
+#define MOCK_TICKET "mock ticket"
+
+/* Names of the replaced functions, indexed by enum mock_krb5_call. */
+const char *const mock_krb5_names[MOCK_CALL_MAX] = {
+    "krb5_get_init_creds_password", "krb5_verify_init_creds",
+    "krb5_set_password", "krb5_cc_resolve", "krb5_cc_initialize",
+    "krb5_cc_store_cred", "krb5_cc_get_principal", "krb5_cc_start_seq_get",
+    "krb5_cc_next_cred", "krb5_cc_end_seq_get", "krb5_cc_close",
+    "krb5_cc_destroy"
+};
+
+/* The configuration and statistics. */
+static const char *password_wanted = NULL;
+static const char *client_wanted = NULL;
+static unsigned long delay = 0;
+static krb5_error_code errors[MOCK_CALL_MAX];
+static struct mock_krb5_stats stats;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+# define STATS_LOCK()   pthread_mutex_lock(&stats_lock)
+# define STATS_UNLOCK() pthread_mutex_unlock(&stats_lock)
+#else
+# define STATS_LOCK()   do { } while (0)
+# define STATS_UNLOCK() do { } while (0)
+#endif
+
+
+/*
+ * Configuration and statistics.
+ */
+void
+mock_krb5_password(const char *password)
+{
+    password_wanted = password;
+}
+
+void
+mock_krb5_client(const char *client)
+{
+    client_wanted = client;
+}
+
+void
+mock_krb5_delay(unsigned long usec)
+{
+    delay = usec;
+}
+
+void
+mock_krb5_fail(enum mock_krb5_call call, krb5_error_code code)
+{
+    errors[call] = code;
+}
+
+void
+mock_krb5_reset(void)
+{
+    STATS_LOCK();
+    memset(&stats, 0, sizeof(stats));
+    STATS_UNLOCK();
+}
+
+void
+mock_krb5_read(struct mock_krb5_stats *result)
+{
+    STATS_LOCK();
+    *result = stats;
+    STATS_UNLOCK();
+}
+
+void
+mock_krb5_count(enum mock_krb5_call call)
+{
+    STATS_LOCK();
+    stats.calls[call]++;
+    STATS_UNLOCK();
+}
+
+
+/*
+ * Return the current time in nanoseconds from an arbitrary starting point.
+ */
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+
+/*
+ * Start and finish a call that would contact the KDC.  Counts the call,
+ * waits for the configured delay, and records the time spent, returning the
+ * configured error for that call.
+ */
+static double
+kdc_begin(enum mock_krb5_call call)
+{
+    struct timespec ts;
+    double start;
+
+    start = now();
+    STATS_LOCK();
+    stats.calls[call]++;
+    STATS_UNLOCK();
+    if (delay > 0) {
+        ts.tv_sec = (time_t) (delay / 1000000);
+        ts.tv_nsec = (long) (delay % 1000000) * 1000L;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+    return start;
+}
+
+static krb5_error_code
+kdc_end(enum mock_krb5_call call, double start, krb5_error_code code)
+{
+    STATS_LOCK();
+    stats.kdc_time += now() - start;
+    STATS_UNLOCK();
+    return (code != 0) ? code : errors[call];
+}
+
+
+/*
+ * Ask the prompter for a password, as the real library does when none is
+ * given.  Returns the password in newly allocated memory or NULL.
+ */
+static char *
+prompt_password(krb5_context ctx, krb5_prompter_fct prompter, void *data,
+                krb5_principal client)
+{
+    krb5_prompt prompt;
+    krb5_data reply;
+    char buffer[BUFSIZ];
+    char *name, *text, *result = NULL;
+
+    if (krb5_unparse_name(ctx, client, &name) != 0)
+        return NULL;
+    if (asprintf(&text, "Password for %s", name) < 0) {
+        krb5_free_unparsed_name(ctx, name);
+        return NULL;
+    }
+    krb5_free_unparsed_name(ctx, name);
+    memset(&prompt, 0, sizeof(prompt));
+    prompt.prompt = text;
+    prompt.hidden = 1;
+    prompt.reply = &reply;
+    reply.data = buffer;
+    reply.length = sizeof(buffer) - 1;
+    if ((*prompter)(ctx, data, NULL, NULL, 1, &prompt) == 0) {
+        buffer[reply.length] = '\0';
+        result = strdup(buffer);
+    }
+    free(text);
+    return result;
+}
+
+
+/*
+ * Fill in canned credentials for the given client and service.
+ */
+static krb5_error_code
+canned_creds(krb5_context ctx, krb5_creds *creds, krb5_principal client,
+             const char *service)
+{
+    krb5_error_code code;
+    krb5_keyblock key;
+    char *name, *realm, *server;
+    time_t issued;
+
+    memset(creds, 0, sizeof(*creds));
+    code = krb5_copy_principal(ctx, client, &creds->client);
+    if (code != 0)
+        return code;
+    if (service != NULL)
+        code = krb5_parse_name(ctx, service, &creds->server);
+    else {
+        code = krb5_unparse_name(ctx, client, &name);
+        if (code != 0)
+            goto fail;
+        realm = strrchr(name, '@');
+        realm = (realm == NULL) ? (char *) "" : realm + 1;
+        if (asprintf(&server, "krbtgt/%s@%s", realm, realm) < 0)
+            code = ENOMEM;
+        else {
+            code = krb5_parse_name(ctx, server, &creds->server);
+            free(server);
+        }
+        krb5_free_unparsed_name(ctx, name);
+    }
+    if (code != 0)
+        goto fail;
+
+    /* Session key, ticket, and times. */
+    code = krb5_c_make_random_key(ctx, ENCTYPE_AES256_CTS_HMAC_SHA1_96, &key);
+    if (code != 0)
+        goto fail;
+#ifdef HAVE_KRB5_MIT
+    creds->keyblock = key;
+#else
+    creds->session = key;
+#endif
+    creds->ticket.data = strdup(MOCK_TICKET);
+    if (creds->ticket.data == NULL) {
+        code = ENOMEM;
+        goto fail;
+    }
+    creds->ticket.length = strlen(MOCK_TICKET);
+    issued = time(NULL);
+    creds->times.authtime = (krb5_timestamp) issued;
+    creds->times.starttime = (krb5_timestamp) issued;
+    creds->times.endtime = (krb5_timestamp) (issued + MOCK_LIFETIME);
+    return 0;
+
+fail:
+    krb5_free_cred_contents(ctx, creds);
+    memset(creds, 0, sizeof(*creds));
+    return code;
+}
+
+
+/*
+ * Return whether a client is the one configured to succeed, if any.
+ */
+static bool
+client_ok(krb5_context ctx, krb5_principal client)
+{
+    char *name;
+    bool ok;
+
+    if (client_wanted == NULL)
+        return true;
+    if (krb5_unparse_name(ctx, client, &name) != 0)
+        return false;
+    ok = (strcmp(name, client_wanted) == 0);
+    krb5_free_unparsed_name(ctx, name);
+    return ok;
+}
+
+
+/*
+ * Obtain initial credentials.  Prompts for the password if none was given,
+ * checks it and the client against the configured ones, and returns canned
+ * credentials.  The options are ignored.
+ */
+krb5_error_code
+krb5_get_init_creds_password(krb5_context ctx, krb5_creds *creds,
+                             krb5_principal client, const char *password,
+                             krb5_prompter_fct prompter, void *data,
+                             krb5_deltat start UNUSED, const char *service,
+                             krb5_get_init_creds_opt *opts UNUSED)
+{
+    krb5_error_code code = 0;
+    char *prompted = NULL;
+    double began, prompt_began;
+
+    /* Prompting is done by the module, so don't count it as KDC time. */
+    began = kdc_begin(MOCK_GET_INIT_CREDS_PASSWORD);
+    if (password == NULL && prompter != NULL) {
+        prompt_began = now();
+        prompted = prompt_password(ctx, prompter, data, client);
+        password = prompted;
+        began += now() - prompt_began;
+    }
+    if (!client_ok(ctx, client))
+        code = KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN;
+    else if (password == NULL)
+        code = KRB5_LIBOS_CANTREADPWD;
+    else if (password_wanted != NULL && strcmp(password, password_wanted) != 0)
+        code = KRB5KDC_ERR_PREAUTH_FAILED;
+    if (code == 0 && errors[MOCK_GET_INIT_CREDS_PASSWORD] == 0)
+        code = canned_creds(ctx, creds, client, service);
+    free(prompted);
+    return kdc_end(MOCK_GET_INIT_CREDS_PASSWORD, began, code);
+}
+
+
+/*
+ * Verify credentials.  Always succeeds unless configured to fail, without
+ * looking at the keytab.
+ */
+krb5_error_code
+krb5_verify_init_creds(krb5_context ctx UNUSED, krb5_creds *creds UNUSED,
+                       krb5_principal server UNUSED,
+                       krb5_keytab keytab UNUSED, krb5_ccache *ccache,
+                       krb5_verify_init_creds_opt *opts UNUSED)
+{
+    double began;
+
+    began = kdc_begin(MOCK_VERIFY_INIT_CREDS);
+    if (ccache != NULL)
+        *ccache = NULL;
+    return kdc_end(MOCK_VERIFY_INIT_CREDS, began, 0);
+}
+
+
+/*
+ * Change a password.  Reports success with empty result strings unless
+ * configured to fail.
+ */
+krb5_error_code
+krb5_set_password(krb5_context ctx UNUSED, krb5_creds *creds UNUSED,
+                  const char *password UNUSED,
+                  krb5_principal principal UNUSED, int *result_code,
+                  krb5_data *result_code_string, krb5_data *result_string)
+{
+    double began;
+
+    began = kdc_begin(MOCK_SET_PASSWORD);
+    *result_code = 0;
+    memset(result_code_string, 0, sizeof(*result_code_string));
+    memset(result_string, 0, sizeof(*result_string));
+    return kdc_end(MOCK_SET_PASSWORD, began, 0);
+}
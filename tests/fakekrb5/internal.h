@@ -0,0 +1,22 @@
+/*
+ * Internal prototypes for the mock Kerberos library.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef FAKEKRB5_INTERNAL_H
+#define FAKEKRB5_INTERNAL_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+
+#include <tests/fakekrb5/mock.h>
+
+BEGIN_DECLS
+
+/* Count a call to one of the replaced functions. */
+void mock_krb5_count(enum mock_krb5_call);
+
+END_DECLS
+
+#endif /* !FAKEKRB5_INTERNAL_H */
@@ -0,0 +1,96 @@
+/*
+ * Testing interfaces to the mock Kerberos library.
+ *
+ * The mock Kerberos library replaces the Kerberos calls that talk to a KDC
+ * (krb5_get_init_creds_password, krb5_verify_init_creds, and
+ * krb5_set_password) at link time, the same way tests/fakepam/kuserok.c
+ * replaces krb5_kuserok.  Instead of contacting a KDC, the replacements wait
+ * for a configurable delay and then return canned credentials or a
+ * configured error.  The ticket cache calls are also replaced, but those
+ * only count the call and then call the real library function, since ticket
+ * caches are local and their cost belongs to the module.
+ *
+ * Programs linked with this library can run the module without any Kerberos
+ * realm and can separate the time the module spends in its own code from the
+ * time it spends waiting on the KDC.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef FAKEKRB5_MOCK_H
+#define FAKEKRB5_MOCK_H 1
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+
+/* The replaced Kerberos calls, used to index the call counts. */
+enum mock_krb5_call {
+    MOCK_GET_INIT_CREDS_PASSWORD,
+    MOCK_VERIFY_INIT_CREDS,
+    MOCK_SET_PASSWORD,
+    MOCK_CC_RESOLVE,
+    MOCK_CC_INITIALIZE,
+    MOCK_CC_STORE_CRED,
+    MOCK_CC_GET_PRINCIPAL,
+    MOCK_CC_START_SEQ_GET,
+    MOCK_CC_NEXT_CRED,
+    MOCK_CC_END_SEQ_GET,
+    MOCK_CC_CLOSE,
+    MOCK_CC_DESTROY,
+    MOCK_CALL_MAX
+};
+
+/* The statistics accumulated since the last call to mock_krb5_reset. */
+struct mock_krb5_stats {
+    unsigned long calls[MOCK_CALL_MAX]; /* Calls to each function. */
+    double kdc_time;                    /* Nanoseconds in the KDC calls. */
+};
+
+/* Names of the replaced functions, indexed by enum mock_krb5_call. */
+extern const char *const mock_krb5_names[MOCK_CALL_MAX];
+
+BEGIN_DECLS
+
+/*
+ * Set the password that krb5_get_init_creds_password accepts.  Any other
+ * password fails with KRB5KDC_ERR_PREAUTH_FAILED.  If never set or set to
+ * NULL, any password is accepted.  The string is not copied.
+ */
+void mock_krb5_password(const char *);
+
+/*
+ * Set the only client principal, in its unparsed form, for which
+ * krb5_get_init_creds_password succeeds.  Any other client fails with
+ * KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN.  If never set or set to NULL, any client
+ * is accepted.  The string is not copied.
+ */
+void mock_krb5_client(const char *);
+
+/* Set the delay in microseconds of each call that would contact the KDC. */
+void mock_krb5_delay(unsigned long usec);
+
+/*
+ * Make one of the KDC calls return the given error code instead of
+ * succeeding until changed again.  Pass 0 to restore success.  Ignored for
+ * the ticket cache calls, which always call the real library.
+ */
+void mock_krb5_fail(enum mock_krb5_call, krb5_error_code);
+
+/* Zero the statistics. */
+void mock_krb5_reset(void);
+
+/* Copy the current statistics into the provided struct. */
+void mock_krb5_read(struct mock_krb5_stats *)
+    __attribute__((__nonnull__));
+
+/*
+ * Whether the ticket cache calls are counted.  They need dlsym to find the
+ * real functions, so on systems without it they aren't replaced.
+ */
+bool mock_krb5_ccache_counted(void);
+
+END_DECLS
+
+#endif /* !FAKEKRB5_MOCK_H */
@@ -0,0 +1,200 @@
+/*
+ * Tests for compiled configuration files.
+ *
+ * Builds a compiled configuration with the same internal interfaces used by
+ * pam_krb5_compile and checks that the module uses it when it is current,
+ * ignores it when it is stale or insecure, and falls back on parsing the
+ * configuration normally in either case.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+#include <syslog.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <tests/fakepam/pam.h>
+#include <tests/fakepam/script.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Write a minimal krb5.conf to the given path, with an optional comment so
+ * that the file can be changed.
+ */
+static void
+write_krb5_conf(const char *path, const char *comment)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (comment != NULL)
+        fprintf(file, "# %s\n", comment);
+    fprintf(file, "[libdefaults]\n    default_realm = EXAMPLE.COM\n");
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+}
+
+
+/*
+ * Compile the configuration for the given arguments into path.  The banner
+ * is replaced with the provided string so that the tests can tell whether
+ * the compiled configuration was used.
+ */
+static void
+compile(pam_handle_t *pamh, const char *path, int argc, const char **argv,
+        const char *banner)
+{
+    struct pam_args *args;
+    struct config_stamp *stamps;
+    size_t nstamps, keylen;
+    char *key;
+
+    args = putil_args_new(pamh, 0);
+    if (args == NULL)
+        bail("cannot create PAM argument struct");
+    if (!pamk5_config_stamps(args, &stamps, &nstamps))
+        bail("cannot stamp Kerberos configuration files");
+    if (!pamk5_config_realm(args, argc, argv))
+        bail("cannot set realm");
+    if (!pamk5_config_load(args, argc, argv))
+        bail("cannot load configuration");
+    /* The banner is still the default, which is not allocated. */
+    args->config->banner = bstrdup(banner);
+    key = pamk5_config_key(args, argc, argv, &keylen);
+    if (key == NULL)
+        bail("cannot build configuration key");
+    if (!pamk5_compiled_write(args, path, stamps, nstamps, &key, &keylen,
+                              &args->config, 1))
+        bail("cannot write compiled configuration %s", path);
+    free(key);
+    pamk5_config_stamps_free(stamps, nstamps);
+    pamk5_free(args);
+}
+
+
+int
+main(void)
+{
+    struct script_config config;
+    struct pam_conv conv = { NULL, NULL };
+    pam_handle_t *pamh;
+    struct pam_args *args;
+    struct pam_config *compiled;
+    struct output *seen;
+    char *tmpdir, *krb5conf, *path, *option, *expected;
+    const char *argv[3];
+    FILE *file;
+
+    plan_lazy();
+
+    /* Use a private krb5.conf so that we can change it. */
+    tmpdir = test_tmpdir();
+    basprintf(&krb5conf, "%s/krb5.conf", tmpdir);
+    write_krb5_conf(krb5conf, NULL);
+    if (setenv("KRB5_CONFIG", krb5conf, 1) < 0)
+        sysbail("cannot set KRB5_CONFIG");
+
+    /* These must match the options in the test scripts. */
+    basprintf(&path, "%s/compiled", tmpdir);
+    basprintf(&option, "compiled_config=%s", path);
+    argv[0] = "ignore_root";
+    argv[1] = option;
+    argv[2] = "debug";
+    memset(&config, 0, sizeof(config));
+    config.user = "root";
+    config.extra[0] = path;
+
+    /* Without a compiled configuration, the module works as usual. */
+    run_script("data/scripts/compiled/missing", &config);
+
+    /* Compile the configuration and check it directly. */
+    if (pam_start("test", NULL, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("cannot create PAM handle");
+    compile(pamh, path, 3, argv, "Compiled");
+    args = putil_args_new(pamh, 0);
+    if (args == NULL)
+        bail("cannot create PAM argument struct");
+    compiled = pamk5_compiled_fetch(args, path, 3, argv);
+    ok(compiled != NULL, "Compiled configuration found");
+    if (compiled == NULL)
+        ok_block(3, false, "Compiled configuration found");
+    else {
+        is_string("Compiled", compiled->banner, "...with the compiled banner");
+        ok(compiled->ignore_root, "...ignore_root is set");
+        ok(compiled->debug, "...debug is set");
+    }
+    pamk5_config_free(compiled);
+    compiled = pamk5_compiled_fetch(args, path, 2, argv);
+    ok(compiled == NULL, "Different arguments are not found");
+    ok(pam_output() == NULL, "...with no errors");
+
+    /* The module uses the current compiled configuration. */
+    run_script("data/scripts/compiled/current", &config);
+
+    /* A writable compiled configuration is ignored with an error. */
+    if (chmod(path, 0666) < 0)
+        sysbail("cannot chmod %s", path);
+    compiled = pamk5_compiled_fetch(args, path, 3, argv);
+    ok(compiled == NULL, "Insecure compiled configuration ignored");
+    pamk5_config_free(compiled);
+    seen = pam_output();
+    basprintf(&expected, "ignoring insecure compiled configuration %s", path);
+    if (seen == NULL)
+        ok_block(2, false, "...with an error");
+    else {
+        is_int(LOG_ERR, seen->lines[0].priority, "...with an error");
+        is_string(expected, seen->lines[0].line, "...and the correct message");
+    }
+    pam_output_free(seen);
+    free(expected);
+    if (chmod(path, 0644) < 0)
+        sysbail("cannot chmod %s", path);
+
+    /* Changing krb5.conf makes the compiled configuration stale. */
+    write_krb5_conf(krb5conf, "changed");
+    compiled = pamk5_compiled_fetch(args, path, 3, argv);
+    ok(compiled == NULL, "Stale compiled configuration ignored");
+    pamk5_config_free(compiled);
+    ok(pam_output() == NULL, "...silently");
+    run_script("data/scripts/compiled/missing", &config);
+
+    /* A corrupt compiled configuration is rejected. */
+    compile(pamh, path, 3, argv, "Compiled");
+    file = fopen(path, "r+");
+    if (file == NULL)
+        sysbail("cannot open %s", path);
+    fprintf(file, "garbage");
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+    compiled = pamk5_compiled_fetch(args, path, 3, argv);
+    ok(compiled == NULL, "Corrupt compiled configuration ignored");
+    pamk5_config_free(compiled);
+    seen = pam_output();
+    basprintf(&expected, "invalid compiled configuration %s", path);
+    if (seen == NULL)
+        ok(false, "...with an error");
+    else
+        is_string(expected, seen->lines[0].line, "...with an error");
+    pam_output_free(seen);
+    free(expected);
+
+    /* Clean up. */
+    putil_args_free(args);
+    pam_end(pamh, PAM_SUCCESS);
+    unlink(path);
+    unlink(krb5conf);
+    free(option);
+    free(path);
+    free(krb5conf);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Tests for KDC failures, using the stand-in KDC.
+ *
+ * Injects delays, lost requests, and Kerberos errors between the module and
+ * the KDC and checks that the module retries or reports the right PAM error.
+ * Only runs when the stand-in KDC is in use, since a real KDC can't be told
+ * to misbehave.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <poll.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/fakepam/script.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kdc.h>
+#include <tests/tap/kerberos.h>
+
+
+/*
+ * Authenticate with nonblocking_auth the way an event-driven application
+ * would, calling pam_sm_authenticate again each time it returns
+ * PAM_INCOMPLETE once the descriptor it names is readable or its timeout
+ * passes.  Sets calls to the number of calls and returns the final status.
+ */
+static int
+authenticate_nonblocking(const struct script_config *config,
+                         unsigned long *calls)
+{
+    pam_handle_t *pamh;
+    struct pam_conv conv = { NULL, NULL };
+    const char *argv[] = {
+        "force_first_pass", "no_ccache", "nonblocking_auth"
+    };
+    const char *fd, *timeout;
+    struct pollfd pfd;
+    int status;
+
+    if (pam_start("test", config->user, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("Fake PAM initialization failed");
+    if (pam_set_item(pamh, PAM_AUTHTOK, config->authtok) != PAM_SUCCESS)
+        bail("cannot set PAM_AUTHTOK");
+    *calls = 0;
+    do {
+        status = pam_sm_authenticate(pamh, 0, 3, argv);
+        (*calls)++;
+        if (status != PAM_INCOMPLETE)
+            break;
+        fd = pam_getenv(pamh, "PAM_KRB5_POLL_FD");
+        timeout = pam_getenv(pamh, "PAM_KRB5_POLL_TIMEOUT");
+        if (fd == NULL || timeout == NULL)
+            bail("PAM_INCOMPLETE without a descriptor to wait on");
+        pfd.fd = atoi(fd);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, atoi(timeout));
+    } while (*calls < 100);
+    ok(pam_getenv(pamh, "PAM_KRB5_POLL_FD") == NULL,
+       "...and the descriptor is gone from the environment");
+    pam_output_free(pam_output());
+    pam_end(pamh, status);
+    return status;
+}
+
+
+int
+main(void)
+{
+    struct script_config config;
+    struct kerberos_config *krbconf;
+    unsigned long requests, retried, calls;
+    time_t started;
+
+    /* Load the Kerberos principal and password, starting the stand-in. */
+    krbconf = kerberos_setup(TAP_KRB_NEEDS_PASSWORD);
+    if (!kdc_active())
+        skip_all("stand-in KDC not available");
+    kerberos_generate_conf(krbconf->realm);
+    memset(&config, 0, sizeof(config));
+    config.user = krbconf->userprinc;
+    config.authtok = krbconf->password;
+
+    /* Don't keep track of the tests in each script. */
+    plan_lazy();
+
+    /* A normal authentication, counting the KDC requests it makes. */
+    requests = kdc_requests();
+    run_script("data/scripts/faults/pass", &config);
+    requests = kdc_requests() - requests;
+    ok(requests > 0, "authentication sends KDC requests");
+
+    /* A lost request is retransmitted, and delays don't cause failure. */
+    retried = kdc_requests();
+    kdc_inject(KDC_DROP, 1);
+    kdc_delay(200);
+    run_script("data/scripts/faults/pass", &config);
+    kdc_delay(0);
+    retried = kdc_requests() - retried;
+    ok(retried > requests, "lost request is retransmitted");
+
+    /* The KDC saying the principal doesn't exist. */
+    kdc_inject(KDC_PRINCIPAL_UNKNOWN, 1);
+    run_script("data/scripts/faults/unknown", &config);
+
+    /*
+     * An expired password.  The module checks the password by getting a
+     * password change ticket, which the stand-in passes.  Without the option
+     * to disable the library's own password change prompting, MIT Kerberos
+     * would try to change the password instead.
+     */
+#ifdef HAVE_KRB5_GET_INIT_CREDS_OPT_SET_CHANGE_PASSWORD_PROMPT
+    kdc_inject(KDC_KEY_EXPIRED, 1);
+    run_script("data/scripts/faults/expired", &config);
+#else
+    skip_block(4, "cannot disable library password prompting");
+#endif
+
+    /* Random loss with retransmission should still eventually succeed. */
+    kdc_loss(10);
+    run_script("data/scripts/faults/pass", &config);
+    kdc_loss(0);
+
+    /*
+     * The same with the module sending the requests itself, which should
+     * send the same requests as the library, retransmit a lost one, and
+     * report the KDC's errors the same way.
+     */
+    retried = kdc_requests();
+    run_script("data/scripts/faults/nonblocking-pass", &config);
+    is_int(requests, kdc_requests() - retried,
+           "nonblocking_kdc sends the same requests");
+    retried = kdc_requests();
+    kdc_inject(KDC_DROP, 1);
+    run_script("data/scripts/faults/nonblocking-pass", &config);
+    ok(kdc_requests() - retried > requests,
+       "nonblocking_kdc retransmits a lost request");
+    kdc_inject(KDC_PRINCIPAL_UNKNOWN, 1);
+    run_script("data/scripts/faults/nonblocking-unknown", &config);
+
+    /*
+     * With nonblocking_auth, the first call returns PAM_INCOMPLETE while the
+     * KDC is delayed, and later calls pick up the same exchange, including
+     * after a lost request, without sending any more than usual.
+     */
+    kdc_delay(200);
+    retried = kdc_requests();
+    is_int(PAM_SUCCESS, authenticate_nonblocking(&config, &calls),
+           "nonblocking_auth succeeds");
+    ok(calls > 1, "...after returning PAM_INCOMPLETE");
+    is_int(requests, kdc_requests() - retried, "...with the same requests");
+    kdc_inject(KDC_DROP, 1);
+    is_int(PAM_SUCCESS, authenticate_nonblocking(&config, &calls),
+           "nonblocking_auth survives a lost request");
+    kdc_delay(0);
+    kdc_inject(KDC_PRINCIPAL_UNKNOWN, 1);
+    is_int(PAM_USER_UNKNOWN, authenticate_nonblocking(&config, &calls),
+           "nonblocking_auth reports an unknown principal");
+
+    /*
+     * With auth_timeout, a KDC that never answers fails the authentication
+     * at the deadline rather than after every retransmission.
+     */
+    kdc_loss(100);
+    started = time(NULL);
+    run_script("data/scripts/faults/timeout", &config);
+    ok(time(NULL) - started < 4, "auth_timeout stops waiting for the KDC");
+    kdc_loss(0);
+
+    return 0;
+}
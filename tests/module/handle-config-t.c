@@ -0,0 +1,105 @@
+/*
+ * Tests for sharing the configuration between calls on one PAM handle.
+ *
+ * Loads the configuration several times on the same PAM handle, changing
+ * krb5.conf in between, and checks that calls with the same arguments reuse
+ * the saved settings, that calls with different arguments reuse the settings
+ * from krb5.conf but apply their own arguments, and that a new PAM handle
+ * reads krb5.conf again.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <tests/fakepam/pam.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Write a krb5.conf to the given path that sets the banner and minimum_uid
+ * for the module.
+ */
+static void
+write_krb5_conf(const char *path, const char *banner)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "[libdefaults]\n    default_realm = EXAMPLE.COM\n\n");
+    fprintf(file, "[appdefaults]\n    pam = {\n        banner = %s\n"
+            "        minimum_uid = 100\n    }\n", banner);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+}
+
+
+/*
+ * Load the configuration for the given arguments on a PAM handle, check the
+ * banner and minimum_uid, and free it again.
+ */
+static void
+check_load(pam_handle_t *pamh, int argc, const char **argv,
+           const char *banner, long minimum_uid, const char *desc)
+{
+    struct pam_args *args;
+
+    args = pamk5_init(pamh, 0, argc, argv);
+    if (args == NULL)
+        bail("cannot initialize PAM arguments");
+    ok(pamk5_load(args, argc, argv), "%s", desc);
+    is_string(banner, args->config->banner, "...banner");
+    is_int(minimum_uid, args->config->minimum_uid, "...minimum_uid");
+    pamk5_free(args);
+}
+
+
+int
+main(void)
+{
+    struct pam_conv conv = { NULL, NULL };
+    pam_handle_t *pamh;
+    char *tmpdir, *krb5conf;
+    const char *argv_first[] = { "no_ccache" };
+    const char *argv_other[] = { "no_ccache", "minimum_uid=5" };
+
+    plan(13);
+
+    /* Use a private krb5.conf so that we can change it. */
+    tmpdir = test_tmpdir();
+    basprintf(&krb5conf, "%s/krb5.conf", tmpdir);
+    write_krb5_conf(krb5conf, "First");
+    if (setenv("KRB5_CONFIG", krb5conf, 1) < 0)
+        sysbail("cannot set KRB5_CONFIG");
+
+    /* The first load reads krb5.conf. */
+    if (pam_start("test", NULL, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("cannot create PAM handle");
+    check_load(pamh, 1, argv_first, "First", 100, "Initial load");
+
+    /* Later loads on the same handle don't, whatever their arguments. */
+    write_krb5_conf(krb5conf, "Second");
+    check_load(pamh, 1, argv_first, "First", 100, "Same arguments");
+    check_load(pamh, 2, argv_other, "First", 5, "Different arguments");
+    pam_end(pamh, PAM_SUCCESS);
+
+    /* A new handle sees the new krb5.conf. */
+    if (pam_start("test", NULL, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("cannot create PAM handle");
+    check_load(pamh, 1, argv_first, "Second", 100, "New PAM handle");
+    pam_end(pamh, PAM_SUCCESS);
+    ok(pam_output() == NULL, "No errors");
+
+    /* Clean up. */
+    unlink(krb5conf);
+    free(krb5conf);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,492 @@
+/*
+ * Tests for the module against the mock Kerberos library.
+ *
+ * Runs the module without a Kerberos realm, with the calls that would
+ * contact the KDC replaced by tests/fakekrb5, and checks both the module's
+ * results and the Kerberos calls it makes.
+ *
+ * Each feature is tested by its own function, which sets up the mock library
+ * and the script configuration from scratch, so that nothing one test
+ * changes can affect the next.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <breaker.h>
+#include <internal.h>
+#include <metrics.h>
+#include <pam-util/args.h>
+
+#include <tests/fakekrb5/mock.h>
+#include <tests/fakepam/pam.h>
+#include <tests/fakepam/script.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Read a file into newly allocated memory, returning NULL if it can't be
+ * opened.
+ */
+static char *
+read_file(const char *path)
+{
+    FILE *file;
+    char *data = NULL;
+    size_t size = 0, length = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+    do {
+        size += BUFSIZ;
+        data = brealloc(data, size + 1);
+        length += fread(data + length, 1, size - length, file);
+    } while (length == size);
+    if (ferror(file))
+        sysbail("cannot read %s", path);
+    fclose(file);
+    data[length] = '\0';
+    return data;
+}
+
+
+/*
+ * Reset the mock Kerberos library and fill in the script configuration for
+ * the mock realm and the password it accepts.  Each test starts with this.
+ */
+static void
+setup(struct script_config *config)
+{
+    enum mock_krb5_call call;
+
+    memset(config, 0, sizeof(*config));
+    config->user = "pamtest";
+    config->authtok = "mock password";
+    config->extra[0] = "pamtest@MOCK.TEST";
+    config->extra[1] = "MOCK.TEST";
+    mock_krb5_password(config->authtok);
+    mock_krb5_client(NULL);
+    mock_krb5_delay(0);
+    for (call = 0; call < MOCK_CALL_MAX; call++)
+        mock_krb5_fail(call, 0);
+    mock_krb5_reset();
+}
+
+
+/*
+ * Write a .k5login file with the given contents in the home directory and
+ * return its path, which the caller removes and frees.
+ */
+static char *
+write_k5login(const char *home, const char *contents)
+{
+    char *path;
+    FILE *file;
+
+    basprintf(&path, "%s/.k5login", home);
+    file = fopen(path, "w");
+    if (file == NULL || fputs(contents, file) < 0 || fclose(file) < 0)
+        sysbail("cannot write %s", path);
+    return path;
+}
+
+
+/*
+ * A full login, a slow KDC, a wrong password, and an error from the KDC.
+ */
+static void
+test_login(void)
+{
+    struct script_config config;
+    struct mock_krb5_stats stats;
+
+    /* A full login gets credentials once, verifies them, and stores them. */
+    setup(&config);
+    run_script("data/scripts/mock/login", &config);
+    mock_krb5_read(&stats);
+    is_int(1, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+           "one initial credentials request");
+    is_int(1, stats.calls[MOCK_VERIFY_INIT_CREDS], "one verification");
+    is_int(0, stats.calls[MOCK_SET_PASSWORD], "no password change");
+    if (mock_krb5_ccache_counted()) {
+        ok(stats.calls[MOCK_CC_INITIALIZE] > 0, "ticket cache initialized");
+        ok(stats.calls[MOCK_CC_STORE_CRED] > 0, "credentials stored");
+        ok(stats.calls[MOCK_CC_DESTROY] > 0, "ticket cache destroyed");
+    } else {
+        skip_block(3, "ticket cache calls not counted");
+    }
+
+    /* The delay is counted as KDC time. */
+    mock_krb5_delay(10000);
+    mock_krb5_reset();
+    run_script("data/scripts/mock/login", &config);
+    mock_krb5_read(&stats);
+    ok(stats.kdc_time >= 2 * 10000 * 1e3, "delay counted as KDC time");
+    mock_krb5_delay(0);
+
+    /* A wrong password and an error from the KDC. */
+    config.authtok = "wrong password";
+    run_script("data/scripts/mock/bad-password", &config);
+    config.authtok = "mock password";
+    mock_krb5_fail(MOCK_GET_INIT_CREDS_PASSWORD,
+                   KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN);
+    run_script("data/scripts/mock/unknown", &config);
+}
+
+
+/*
+ * A login with timing logs the phases of each call.
+ */
+static void
+test_timing(void)
+{
+    struct script_config config;
+
+    setup(&config);
+    run_script("data/scripts/mock/timing", &config);
+}
+
+
+/*
+ * A login with metrics counts one successful authentication and one ticket
+ * cache creation.
+ */
+static void
+test_metrics(const char *home)
+{
+    struct script_config config;
+    const struct metrics_file *metrics;
+    char *path;
+    void *map;
+    int fd;
+
+    setup(&config);
+    basprintf(&path, "%s/metrics", home);
+    config.extra[2] = path;
+    run_script("data/scripts/mock/metrics", &config);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        sysbail("cannot open %s", path);
+    map = mmap(NULL, sizeof(struct metrics_file), PROT_READ, MAP_SHARED, fd,
+               0);
+    if (map == MAP_FAILED)
+        sysbail("cannot map %s", path);
+    metrics = map;
+    is_string(METRICS_MAGIC, metrics->magic, "metrics file stamped");
+    is_int(1, metrics->ops[METRICS_AUTH].results[METRICS_SUCCESS],
+           "one successful authentication counted");
+    is_int(1, metrics->ops[METRICS_SETCRED].results[METRICS_SUCCESS],
+           "one ticket cache creation counted");
+    is_int(0, metrics->ops[METRICS_CHPW].results[METRICS_SUCCESS],
+           "no password change counted");
+    munmap(map, sizeof(struct metrics_file));
+    close(fd);
+    unlink(path);
+    free(path);
+}
+
+
+/*
+ * With the recorder on, a successful login logs nothing extra and a failed
+ * one appends the suppressed debug output to the recorder file.
+ */
+static void
+test_recorder(const char *home)
+{
+    struct script_config config;
+    char *path, *output;
+
+    setup(&config);
+    run_script("data/scripts/mock/recorder", &config);
+    basprintf(&path, "%s/recorder", home);
+    config.extra[2] = path;
+    config.authtok = "wrong password";
+    run_script("data/scripts/mock/recorder-fail", &config);
+    output = read_file(path);
+    ok(output != NULL && strstr(output, "]: user pamtest service ") != NULL,
+       "recorder file names the failed call");
+    ok(output != NULL && strstr(output, "\nattempting authentication as ")
+       != NULL, "...and holds the debug output");
+    free(output);
+    unlink(path);
+    free(path);
+}
+
+
+/*
+ * search_k5login with only the third principal in .k5login accepted, first
+ * trying each in turn and then all at once.  Done in turn, the search stops
+ * at the third.  Done at once, the fourth may also have been tried by the
+ * time the third succeeds.
+ */
+static void
+test_search_k5login(const char *home)
+{
+    struct script_config config;
+    struct mock_krb5_stats stats;
+    char *path;
+
+    setup(&config);
+    path = write_k5login(home, "first@MOCK.TEST\nsecond@MOCK.TEST\n"
+                         "third@MOCK.TEST\nfourth@MOCK.TEST\n");
+    config.extra[2] = "third@MOCK.TEST";
+    mock_krb5_client(config.extra[2]);
+    mock_krb5_delay(10000);
+    mock_krb5_reset();
+    run_script("data/scripts/mock/search-k5login", &config);
+    mock_krb5_read(&stats);
+    is_int(3, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+           "search_k5login tries principals until one works");
+    mock_krb5_reset();
+    run_script("data/scripts/mock/search-k5login-parallel", &config);
+    mock_krb5_read(&stats);
+    ok(stats.calls[MOCK_GET_INIT_CREDS_PASSWORD] >= 3
+       && stats.calls[MOCK_GET_INIT_CREDS_PASSWORD] <= 4,
+       "search_k5login_parallel tries them at once");
+    unlink(path);
+    free(path);
+}
+
+
+/*
+ * With hints, the first search saves the principal that worked and the next
+ * tries it alone.  Once .k5login changes, the hint is ignored.  Hints are
+ * only saved when running as root.
+ */
+static void
+test_k5login_hints(const char *home)
+{
+    struct script_config config;
+    struct mock_krb5_stats stats;
+    char *path, *hints, *hint;
+    FILE *file;
+
+    setup(&config);
+    path = write_k5login(home, "first@MOCK.TEST\nsecond@MOCK.TEST\n"
+                         "third@MOCK.TEST\nfourth@MOCK.TEST\n");
+    basprintf(&hints, "%s/hints", home);
+    if (mkdir(hints, 0700) < 0)
+        sysbail("cannot create %s", hints);
+    config.extra[2] = "third@MOCK.TEST";
+    config.extra[3] = hints;
+    mock_krb5_client(config.extra[2]);
+    if (geteuid() != 0)
+        skip_block(3, "hints are only saved by root");
+    else {
+        mock_krb5_reset();
+        run_script("data/scripts/mock/search-k5login-hints", &config);
+        mock_krb5_read(&stats);
+        is_int(3, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+               "first search with hints tries each principal");
+        mock_krb5_reset();
+        run_script("data/scripts/mock/search-k5login-hints", &config);
+        mock_krb5_read(&stats);
+        is_int(1, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+               "...and the next only the hinted one");
+        file = fopen(path, "a");
+        if (file == NULL || fprintf(file, "fifth@MOCK.TEST\n") < 0
+            || fclose(file) < 0)
+            sysbail("cannot append to %s", path);
+        mock_krb5_reset();
+        run_script("data/scripts/mock/search-k5login-hints", &config);
+        mock_krb5_read(&stats);
+        is_int(3, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+               "...until .k5login changes");
+    }
+    basprintf(&hint, "%s/%s", hints, config.user);
+    unlink(hint);
+    free(hint);
+    rmdir(hints);
+    free(hints);
+    unlink(path);
+    free(path);
+}
+
+
+/*
+ * realms tries the user in each realm at once.  Only the mock realm knows
+ * the user in the first case.  In the second, both realms accept the user
+ * and the one listed first wins, which .k5login authorizes.
+ */
+static void
+test_realms(const char *home)
+{
+    struct script_config config;
+    struct mock_krb5_stats stats;
+    char *path;
+
+    setup(&config);
+    mock_krb5_client(config.extra[0]);
+    run_script("data/scripts/mock/realms", &config);
+    mock_krb5_read(&stats);
+    is_int(2, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+           "realms tries each realm");
+    mock_krb5_client(NULL);
+    path = write_k5login(home, "pamtest@MOCK.TEST\npamtest@TWO.TEST\n");
+    config.extra[2] = "TWO.TEST";
+    run_script("data/scripts/mock/realms-priority", &config);
+    unlink(path);
+    free(path);
+}
+
+
+/*
+ * A realms login whose auth_timeout has already run out fails before trying
+ * any realm, and since no realm decided the result, keeps the principal it
+ * started with.
+ */
+static void
+test_realms_deadline(void)
+{
+    struct script_config config;
+    struct mock_krb5_stats stats;
+    struct pam_args *args;
+    struct pam_conv conv = { NULL, NULL };
+    pam_handle_t *pamh;
+    krb5_creds *creds = NULL;
+    char *name = NULL;
+    const char *argv[] = {
+        "force_first_pass", "no_ccache", "realms=ONE.TEST,MOCK.TEST",
+        "realm=MOCK.TEST", "auth_timeout=1s"
+    };
+
+    setup(&config);
+    if (pam_start("test", config.user, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("Fake PAM initialization failed");
+    if (pam_set_item(pamh, PAM_AUTHTOK, config.authtok) != PAM_SUCCESS)
+        bail("cannot set PAM_AUTHTOK");
+    args = pamk5_init(pamh, 0, 5, argv);
+    if (args == NULL || !pamk5_load(args, 5, argv))
+        bail("cannot initialize PAM arguments");
+    if (pamk5_context_new(args) != PAM_SUCCESS)
+        bail("cannot create PAM context");
+    args->config->ctx->deadline = 1;
+    is_int(PAM_AUTHINFO_UNAVAIL, pamk5_password_auth(args, NULL, &creds),
+           "realms past the deadline fails");
+    ok(creds == NULL, "...without credentials");
+    if (args->config->ctx->princ != NULL)
+        krb5_unparse_name(args->ctx, args->config->ctx->princ, &name);
+    is_string(config.extra[0], name, "...keeps the original principal");
+    if (name != NULL)
+        krb5_free_unparsed_name(args->ctx, name);
+    mock_krb5_read(&stats);
+    is_int(0, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+           "...and tries no realm");
+    pam_output_free(pam_output());
+    pamk5_free(args);
+    pam_end(pamh, PAM_SUCCESS);
+}
+
+
+/*
+ * Move back the time the breaker for realm in the breaker file at path
+ * opened by the given number of seconds, so that its cooldown runs out
+ * without waiting for it.
+ */
+static void
+breaker_age(const char *path, const char *realm, int64_t seconds)
+{
+    struct breaker_file *breaker;
+    void *map;
+    size_t i;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        sysbail("cannot open %s", path);
+    map = mmap(NULL, sizeof(struct breaker_file), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        sysbail("cannot map %s", path);
+    breaker = map;
+    for (i = 0; i < BREAKER_REALMS; i++)
+        if (strcmp(breaker->realms[i].realm, realm) == 0)
+            break;
+    if (i == BREAKER_REALMS)
+        bail("no breaker for %s in %s", realm, path);
+    breaker->realms[i].opened -= seconds;
+    munmap(map, sizeof(struct breaker_file));
+    close(fd);
+}
+
+
+/*
+ * With kdc_breaker, two logins in a row that can't reach the KDC open the
+ * breaker, and the next fails without trying.  After the cooldown, which is
+ * aged out in the file rather than waited for, one login is let through to
+ * probe the KDC, and its success closes the breaker again.
+ */
+static void
+test_breaker(const char *home)
+{
+    struct script_config config;
+    struct mock_krb5_stats stats;
+    char *path;
+
+    setup(&config);
+    basprintf(&path, "%s/breaker", home);
+    config.extra[2] = path;
+    mock_krb5_fail(MOCK_GET_INIT_CREDS_PASSWORD, KRB5_KDC_UNREACH);
+    run_script("data/scripts/mock/breaker-unreach", &config);
+    run_script("data/scripts/mock/breaker-unreach", &config);
+    mock_krb5_read(&stats);
+    is_int(2, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+           "unreachable KDC tried for each login");
+    mock_krb5_reset();
+    run_script("data/scripts/mock/breaker-open", &config);
+    mock_krb5_read(&stats);
+    is_int(0, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+           "...and not at all once the breaker is open");
+    mock_krb5_fail(MOCK_GET_INIT_CREDS_PASSWORD, 0);
+    breaker_age(path, config.extra[1], 2);
+    mock_krb5_reset();
+    run_script("data/scripts/mock/breaker-pass", &config);
+    run_script("data/scripts/mock/breaker-pass", &config);
+    mock_krb5_read(&stats);
+    is_int(2, stats.calls[MOCK_GET_INIT_CREDS_PASSWORD],
+           "...until a probe after the cooldown closes it");
+    unlink(path);
+    free(path);
+}
+
+
+int
+main(void)
+{
+    struct passwd pwd;
+
+    /* The module needs a passwd entry to create the ticket cache. */
+    memset(&pwd, 0, sizeof(pwd));
+    pwd.pw_name = (char *) "pamtest";
+    pwd.pw_uid = getuid();
+    pwd.pw_gid = getgid();
+    pwd.pw_dir = test_tmpdir();
+    pam_set_pwd(&pwd);
+
+    /* Don't keep track of the tests in each script. */
+    plan_lazy();
+
+    test_login();
+    test_timing();
+    test_metrics(pwd.pw_dir);
+    test_recorder(pwd.pw_dir);
+    test_search_k5login(pwd.pw_dir);
+    test_k5login_hints(pwd.pw_dir);
+    test_realms(pwd.pw_dir);
+    test_realms_deadline();
+    test_breaker(pwd.pw_dir);
+
+    pam_set_pwd(NULL);
+    test_tmpdir_free(pwd.pw_dir);
+    return 0;
+}
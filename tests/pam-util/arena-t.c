@@ -0,0 +1,123 @@
+/*
+ * PAM utility per-call arena test suite.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pam-util/arena.h>
+#include <pam-util/args.h>
+#include <tests/fakepam/pam.h>
+#include <tests/tap/basic.h>
+
+
+int
+main(void)
+{
+    pam_handle_t *pamh;
+    struct pam_args *args;
+    struct pam_args *others[40];
+    char *kept[40];
+    struct pam_conv conv = { NULL, NULL };
+    char *first, *second, *large, *secret, *string;
+    size_t i;
+    bool zeroed, okay;
+
+    plan(22);
+
+    if (pam_start("test", NULL, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("Fake PAM initialization failed");
+    args = putil_args_new(pamh, 0);
+    if (args == NULL)
+        bail("cannot create PAM argument struct");
+
+    /* Small allocations come from the same block and don't overlap. */
+    first = putil_arena_alloc(args, 10);
+    second = putil_arena_alloc(args, 10);
+    ok(first != NULL && second != NULL, "Small allocations");
+    ok(second >= first + 10, "...do not overlap");
+    ok(((size_t) second - (size_t) first) % sizeof(void *) == 0,
+       "...and are aligned");
+    ok(first[0] == '\0' && first[9] == '\0', "...and are zeroed");
+
+    /* A large allocation gets its own block but is still usable. */
+    large = putil_arena_alloc(args, 100000);
+    ok(large != NULL, "Large allocation");
+    memset(large, 'a', 100000);
+    zeroed = true;
+    for (i = 0; i < 10; i++)
+        if (first[i] != '\0')
+            zeroed = false;
+    ok(zeroed, "...does not overlap earlier allocations");
+
+    /* Small allocations still go to the current block afterwards. */
+    second = putil_arena_alloc(args, 10);
+    ok(second != NULL, "Small allocation after large");
+    ok(second < large || second >= large + 100000, "...does not overlap");
+
+    /* String helpers. */
+    string = putil_arena_strdup(args, "foo");
+    is_string("foo", string, "putil_arena_strdup");
+    string = putil_arena_sprintf(args, "%s=%d", "bar", 42);
+    is_string("bar=42", string, "putil_arena_sprintf");
+    string = putil_arena_sprintf(args, "%s", "");
+    is_string("", string, "putil_arena_sprintf of the empty string");
+
+    /* Secret allocations are separate from normal allocations. */
+    secret = putil_arena_secret_strdup(args, "password");
+    is_string("password", secret, "putil_arena_secret_strdup");
+    ok(args->secrets != NULL, "...uses the secret arena");
+
+    /* A secret too large for the pool still works. */
+    large = putil_arena_secret(args, 4096);
+    ok(large != NULL, "Large secret allocation");
+    memset(large, 'a', 4096);
+    is_string("password", secret, "...does not overlap earlier secrets");
+
+    /* Many arenas holding secrets at once exhaust the pool and fall back. */
+    okay = true;
+    for (i = 0; i < ARRAY_SIZE(others); i++) {
+        others[i] = putil_args_new(pamh, 0);
+        if (others[i] == NULL)
+            bail("cannot create PAM argument struct");
+        string = putil_arena_secret_strdup(others[i], "secret");
+        if (string == NULL || strcmp(string, "secret") != 0)
+            okay = false;
+    }
+    ok(okay, "Secrets in many arenas at once");
+    for (i = 0; i < ARRAY_SIZE(others); i++)
+        putil_args_free(others[i]);
+    string = putil_arena_secret_strdup(args, "again");
+    is_string("again", string, "...and the pool is usable afterwards");
+
+    /* Secrets that outlive the arena are copied and freed on their own. */
+    secret = putil_secret_strdup("kept password");
+    is_string("kept password", secret, "putil_secret_strdup");
+    putil_secret_free(secret);
+    okay = true;
+    for (i = 0; i < ARRAY_SIZE(kept); i++) {
+        kept[i] = putil_secret_strdup("secret");
+        if (kept[i] == NULL || strcmp(kept[i], "secret") != 0)
+            okay = false;
+    }
+    ok(okay, "...even once the pool is exhausted");
+    for (i = 0; i < ARRAY_SIZE(kept); i++)
+        putil_secret_free(kept[i]);
+    secret = putil_secret_strdup("again");
+    is_string("again", secret, "...and the pool is usable afterwards");
+    putil_secret_free(secret);
+
+    /* Freeing the arena clears it and it can be used again. */
+    putil_arena_free(args);
+    ok(args->arena == NULL && args->secrets == NULL, "Arena freed");
+    string = putil_arena_strdup(args, "baz");
+    is_string("baz", string, "...and usable again");
+
+    /* putil_args_free releases the arena. */
+    putil_args_free(args);
+    pam_end(pamh, 0);
+    return 0;
+}
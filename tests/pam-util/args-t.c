@@ -43,14 +43,14 @@ main(void)
     struct pam_conv conv = { NULL, NULL };
     struct pam_args *args;
 
-    plan(12);
+    plan(13);
 
     if (pam_start("test", NULL, &conv, &pamh) != PAM_SUCCESS)
         sysbail("Fake PAM initialization failed");
     args = putil_args_new(pamh, 0);
     ok(args != NULL, "New args struct is not NULL");
     if (args == NULL)
-        ok_block(7, 0, "...args struct is NULL");
+        ok_block(8, 0, "...args struct is NULL");
     else {
         ok(args->pamh == pamh, "...and pamh is correct");
         ok(args->config == NULL, "...and config is NULL");
@@ -58,10 +58,12 @@ main(void)
         is_int(args->debug, false, "...and debug is false");
         is_int(args->silent, false, "...and silent is false");
 #ifdef HAVE_KRB5
-        ok(args->ctx != NULL, "...and the Kerberos context is initialized");
+        ok(args->ctx == NULL, "...and the Kerberos context is not created");
         ok(args->realm == NULL, "...and realm is NULL");
+        ok(putil_args_krb5_context(args) && args->ctx != NULL,
+           "...and the Kerberos context can be initialized");
 #else
-        skip_block(2, "Kerberos support not configured");
+        skip_block(3, "Kerberos support not configured");
 #endif
     }
     putil_args_free(args);
@@ -0,0 +1,117 @@
+/*
+ * PAM utility structured log format test suite.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <syslog.h>
+
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <tests/fakepam/pam.h>
+#include <tests/tap/basic.h>
+
+
+/*
+ * Log an error and return the single line logged, with the duration field
+ * and the separator before it removed since it varies, in newly allocated
+ * memory.
+ */
+static char *
+logged(struct pam_args *args, const char *msg)
+{
+    struct output *seen;
+    char *line, *duration, *end;
+
+    putil_err(args, "%s", msg);
+    seen = pam_output();
+    if (seen == NULL || seen->count != 1)
+        bail("expected one line of output");
+    line = bstrdup(seen->lines[0].line);
+    pam_output_free(seen);
+    duration = strstr(line, "duration_us");
+    if (duration != NULL) {
+        end = duration + strcspn(duration, "0123456789");
+        end += strspn(end, "0123456789");
+        while (duration > line && *duration != ' ' && *duration != ',')
+            duration--;
+        memmove(duration, end, strlen(end) + 1);
+    }
+    return line;
+}
+
+
+int
+main(void)
+{
+    pam_handle_t *pamh;
+    struct pam_args *args;
+    struct pam_conv conv = { NULL, NULL };
+    char message[4000];
+    char *line;
+
+    plan(9);
+
+    if (pam_start("test", NULL, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("Fake PAM initialization failed");
+    args = putil_args_new(pamh, 0);
+    if (args == NULL)
+        bail("cannot create PAM argument struct");
+    args->user = "testuser";
+
+    /* Unknown formats are rejected and change nothing. */
+    ok(!putil_log_format(args, "xml"), "Unknown format rejected");
+    line = logged(args, "plain");
+    is_string("(user testuser) plain", line, "...and text is the default");
+    free(line);
+
+    /* key=value quotes only values that need it. */
+    ok(putil_log_format(args, "kv"), "Select kv");
+    ok(args->start != 0, "...which starts the clock");
+    args->tid = "0123456789abcdef";
+    args->principal = "testuser@EXAMPLE.COM";
+    args->phase = "as";
+    line = logged(args, "cannot \"do\" it");
+    is_string("tid=0123456789abcdef service=test user=testuser"
+              " principal=testuser@EXAMPLE.COM phase=as priority=err"
+              " msg=\"cannot \\\"do\\\" it\"", line, "kv record");
+    free(line);
+
+    /* Unset fields are left out. */
+    args->principal = NULL;
+    args->phase = NULL;
+    line = logged(args, "simple");
+    is_string("tid=0123456789abcdef service=test user=testuser priority=err"
+              " msg=simple", line, "kv record without optional fields");
+    free(line);
+
+    /* JSON quotes every string and escapes control characters. */
+    ok(putil_log_format(args, "json"), "Select json");
+    args->phase = "prompt";
+    line = logged(args, "two\nlines");
+    is_string("{\"tid\":\"0123456789abcdef\",\"service\":\"test\","
+              "\"user\":\"testuser\",\"phase\":\"prompt\","
+              "\"priority\":\"err\",\"msg\":\"two\\u000alines\"}", line,
+              "json record");
+    free(line);
+
+    /* Long messages are truncated but the record is still complete. */
+    memset(message, 'x', sizeof(message) - 1);
+    message[sizeof(message) - 1] = '\0';
+    line = logged(args, message);
+    ok(strlen(line) < sizeof(message)
+           && strcmp(line + strlen(line) - 3, "x\"}") == 0,
+       "Long json record truncated and closed");
+    free(line);
+
+    args->user = NULL;
+    args->tid = NULL;
+    args->phase = NULL;
+    putil_args_free(args);
+    pam_end(pamh, 0);
+    return 0;
+}
@@ -104,6 +104,10 @@ main(void)
     args = putil_args_new(pamh, 0);
     if (args == NULL)
         bail("cannot create PAM argument struct");
+#ifdef HAVE_KRB5
+    if (!putil_args_krb5_context(args))
+        bail("cannot create Kerberos context");
+#endif
     TEST(putil_crit,  LOG_CRIT,  "putil_crit");
     TEST(putil_err,   LOG_ERR,   "putil_err");
     putil_debug(args, "%s", "foo");
@@ -0,0 +1,165 @@
+/*
+ * PAM utility non-blocking logging test suite.
+ *
+ * Built with LOG_PATH set to a relative socket name so that the test can
+ * stand in for the syslog daemon in its temporary directory.  The daemon
+ * never reads while messages are being logged, so the socket fills up and
+ * the queue comes into play.  Once the daemon goes away, messages go to
+ * pam_syslog instead.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <tests/fakepam/pam.h>
+#include <tests/tap/basic.h>
+
+/* The number of debug messages that is sure to fill the socket. */
+#define FLOOD 2000
+
+
+/*
+ * Read every record waiting on the socket and return them concatenated,
+ * each followed by a newline, in newly allocated memory.
+ */
+static char *
+read_records(int fd)
+{
+    char record[2048];
+    char *all = NULL;
+    size_t length = 0;
+    ssize_t status;
+
+    all = bstrdup("");
+    while ((status = recv(fd, record, sizeof(record) - 1, MSG_DONTWAIT)) > 0) {
+        all = brealloc(all, length + (size_t) status + 2);
+        memcpy(all + length, record, (size_t) status);
+        length += (size_t) status;
+        all[length++] = '\n';
+        all[length] = '\0';
+    }
+    if (status < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        sysbail("cannot read from log socket");
+    return all;
+}
+
+
+int
+main(void)
+{
+    pam_handle_t *pamh;
+    struct pam_args *args;
+    struct pam_conv conv = { NULL, NULL };
+    struct sockaddr_un addr;
+    struct output *seen;
+    char *tmpdir, *records, *more, *important, *debug;
+    int fd;
+    size_t i;
+    bool found;
+
+#ifndef HAVE_PTHREAD_H
+    skip_all("non-blocking logging requires threads");
+#endif
+    plan(11);
+
+    /* Stand in for the syslog daemon. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot chdir to %s", tmpdir);
+    unlink(LOG_PATH);
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0)
+        sysbail("cannot create socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, LOG_PATH, sizeof(addr.sun_path));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        sysbail("cannot bind %s", LOG_PATH);
+
+    if (pam_start("test", NULL, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("Fake PAM initialization failed");
+    args = putil_args_new(pamh, 0);
+    if (args == NULL)
+        bail("cannot create PAM argument struct");
+    args->nonblocking_log = true;
+    args->debug = true;
+    args->user = "testuser";
+
+    /* A message goes to the socket as a syslog record, not to PAM. */
+    putil_err(args, "%s", "first");
+    records = read_records(fd);
+    ok(strstr(records, "<83>") == records, "Record has the priority");
+    ok(strstr(records, " test[") != NULL, "...the PAM service");
+    ok(strstr(records, ": (user testuser) first\n") != NULL,
+       "...and the prefixed message");
+    free(records);
+    seen = pam_output();
+    ok(seen == NULL, "...and nothing is logged through PAM");
+    pam_output_free(seen);
+
+    /*
+     * Flood the socket with debug messages and then log an error.  None of
+     * this may block, and the error must displace a queued debug message.
+     */
+    for (i = 0; i < FLOOD; i++)
+        putil_debug(args, "debug %lu", (unsigned long) i);
+    putil_err(args, "%s", "important");
+    ok(true, "Flooding the socket does not block");
+
+    /* Empty the socket.  The error is still queued. */
+    records = read_records(fd);
+    ok(strstr(records, "important") == NULL, "Error queued while full");
+    free(records);
+
+    /*
+     * Later messages drain the queue, error first, and then report the
+     * dropped debug messages.  The socket may hold fewer records than the
+     * queue, so keep logging and reading until everything is through.
+     */
+    records = bstrdup("");
+    for (i = 0; i < 10; i++) {
+        putil_err(args, "%s", "after");
+        more = read_records(fd);
+        records = brealloc(records, strlen(records) + strlen(more) + 1);
+        strlcat(records, more, strlen(records) + strlen(more) + 1);
+        free(more);
+    }
+    important = strstr(records, ": (user testuser) important\n");
+    debug = strstr(records, ": (user testuser) debug ");
+    ok(important != NULL, "Queued error sent once there is room");
+    ok(debug == NULL || important < debug, "...ahead of debug messages");
+    ok(strstr(records, "]: " PACKAGE_TARNAME ": dropped ") != NULL,
+       "Dropped messages reported");
+    free(records);
+
+    /* Without a syslog daemon, messages are logged through PAM. */
+    close(fd);
+    unlink(LOG_PATH);
+    pam_output_free(pam_output());
+    putil_err(args, "%s", "orphan");
+    seen = pam_output();
+    ok(seen != NULL, "Message logged through PAM without a daemon");
+    found = false;
+    for (i = 0; seen != NULL && i < seen->count; i++)
+        if (seen->lines[i].priority == LOG_ERR
+            && strcmp(seen->lines[i].line, "(user testuser) orphan") == 0)
+            found = true;
+    ok(found, "...with its priority and prefixed message");
+    pam_output_free(seen);
+
+    args->user = NULL;
+    putil_args_free(args);
+    pam_end(pamh, 0);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Microbenchmark for loading PAM options from krb5.conf.
+ *
+ * Generates a large krb5.conf with many realms and applications and compares
+ * the time to load a table of options from it with one krb5_appdefault_string
+ * lookup per option (the traditional approach) against putil_args_krb5,
+ * which reads [appdefaults] in a single pass when the Kerberos library
+ * supports it.  The results of the two approaches are also compared.
+ *
+ * This is not part of the test suite.  Run it with make bench, optionally
+ * passing the number of iterations as the only argument.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <pam-util/args.h>
+#include <pam-util/options.h>
+#include <tests/fakepam/pam.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* The shape of the generated krb5.conf and the option table. */
+#define BENCH_OPTIONS 48
+#define BENCH_REALMS  500
+#define BENCH_APPS    50
+
+/* The realm used for the lookups, which is in the middle of the file. */
+#define BENCH_REALM "R0250.EXAMPLE.ORG"
+
+/* The configuration struct, which holds only string settings. */
+struct pam_config {
+    char *settings[BENCH_OPTIONS];
+};
+
+
+/*
+ * Write the krb5.conf file used for the benchmark.  Every realm has a
+ * [realms] entry and its own sections under [appdefaults], the PAM section
+ * sets half of the options, and there are many unrelated applications.
+ */
+static void
+write_krb5_conf(const char *path)
+{
+    FILE *file;
+    int i, j;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "[libdefaults]\n    default_realm = %s\n\n", BENCH_REALM);
+    fprintf(file, "[realms]\n");
+    for (i = 0; i < BENCH_REALMS; i++)
+        fprintf(file, "    R%04d.EXAMPLE.ORG = {\n"
+                "        kdc = kdc%04d.example.org\n"
+                "        admin_server = kdc%04d.example.org\n    }\n",
+                i, i, i);
+    fprintf(file, "\n[appdefaults]\n");
+    for (i = 0; i < BENCH_OPTIONS; i += 4)
+        fprintf(file, "    opt%02d = global-%d\n", i, i);
+    for (i = 0; i < BENCH_APPS; i++) {
+        fprintf(file, "    app%02d = {\n", i);
+        for (j = 0; j < BENCH_OPTIONS; j++)
+            fprintf(file, "        opt%02d = app%02d-%d\n", j, i, j);
+        fprintf(file, "    }\n");
+    }
+    fprintf(file, "    pam = {\n");
+    for (i = 0; i < BENCH_OPTIONS; i += 2)
+        fprintf(file, "        opt%02d = pam-%d\n", i, i);
+    for (i = 0; i < BENCH_REALMS; i++)
+        fprintf(file, "        R%04d.EXAMPLE.ORG = {\n"
+                "            opt%02d = pam-realm-%d\n        }\n",
+                i, i % BENCH_OPTIONS, i);
+    fprintf(file, "    }\n");
+    for (i = 0; i < BENCH_REALMS; i++)
+        fprintf(file, "    R%04d.EXAMPLE.ORG = {\n"
+                "        opt%02d = realm-%d\n    }\n",
+                i, (i + 1) % BENCH_OPTIONS, i);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+}
+
+
+/*
+ * Load every option with a separate krb5_appdefault_string call, the way
+ * putil_args_krb5 did before it could iterate over the profile.
+ */
+static void
+load_per_option(struct pam_args *args, const struct option options[],
+                size_t optlen)
+{
+    size_t i;
+    char *value;
+    char **setting;
+#ifdef HAVE_KRB5_REALM
+    krb5_const_realm rdata = args->realm;
+#else
+    krb5_data realm_struct;
+    const krb5_data *rdata = &realm_struct;
+
+    realm_struct.magic = KV5M_DATA;
+    realm_struct.data = args->realm;
+    realm_struct.length = strlen(args->realm);
+#endif
+
+    for (i = 0; i < optlen; i++) {
+        value = NULL;
+        krb5_appdefault_string(args->ctx, "pam", rdata, options[i].name, "",
+                               &value);
+        setting = &args->config->settings[i];
+        if (value != NULL && value[0] == '\0') {
+            free(value);
+            value = NULL;
+        }
+        if (value != NULL) {
+            free(*setting);
+            *setting = value;
+        }
+    }
+}
+
+
+/*
+ * Free all of the settings in the configuration struct.
+ */
+static void
+clear_settings(struct pam_config *config)
+{
+    size_t i;
+
+    for (i = 0; i < BENCH_OPTIONS; i++) {
+        free(config->settings[i]);
+        config->settings[i] = NULL;
+    }
+}
+
+
+/*
+ * Return the current time in nanoseconds from an arbitrary starting point.
+ */
+static double
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        sysbail("cannot get time");
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    pam_handle_t *pamh;
+    struct pam_conv conv = { NULL, NULL };
+    struct pam_args *args;
+    struct option options[BENCH_OPTIONS];
+    struct pam_config baseline;
+    char *tmpdir, *krb5conf;
+    char *names[BENCH_OPTIONS];
+    unsigned long iterations = 1000;
+    unsigned long n;
+    double start, old_ns, new_ns;
+    size_t i;
+
+    if (argc > 1)
+        iterations = strtoul(argv[1], NULL, 10);
+    if (iterations == 0)
+        bail("invalid number of iterations");
+
+    /* Build the option table.  The names sort in the order generated. */
+    memset(options, 0, sizeof(options));
+    for (i = 0; i < BENCH_OPTIONS; i++) {
+        basprintf(&names[i], "opt%02lu", (unsigned long) i);
+        options[i].name = names[i];
+        options[i].location = offsetof(struct pam_config, settings)
+            + i * sizeof(char *);
+        options[i].krb5_config = true;
+        options[i].type = TYPE_STRING;
+    }
+
+    /* Set up the krb5.conf file and the PAM argument struct. */
+    tmpdir = test_tmpdir();
+    basprintf(&krb5conf, "%s/krb5-bench.conf", tmpdir);
+    write_krb5_conf(krb5conf);
+    if (setenv("KRB5_CONFIG", krb5conf, 1) < 0)
+        sysbail("cannot set KRB5_CONFIG");
+    if (pam_start("bench", NULL, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("cannot create pam_handle_t");
+    args = putil_args_new(pamh, 0);
+    if (args == NULL)
+        bail("cannot create PAM argument struct");
+    if (!putil_args_krb5_context(args))
+        bail("cannot create Kerberos context");
+    args->realm = bstrdup(BENCH_REALM);
+    args->config = bcalloc(1, sizeof(struct pam_config));
+
+    /* Check that both approaches find the same settings. */
+    load_per_option(args, options, BENCH_OPTIONS);
+    baseline = *args->config;
+    memset(args->config, 0, sizeof(struct pam_config));
+    if (!putil_args_krb5(args, "pam", options, BENCH_OPTIONS))
+        bail("putil_args_krb5 failed");
+    for (i = 0; i < BENCH_OPTIONS; i++) {
+        const char *want = baseline.settings[i];
+        const char *seen = args->config->settings[i];
+
+        if (want == NULL && seen == NULL)
+            continue;
+        if (want == NULL || seen == NULL || strcmp(want, seen) != 0)
+            bail("results differ for %s: %s != %s", names[i],
+                 want == NULL ? "(null)" : want,
+                 seen == NULL ? "(null)" : seen);
+    }
+    clear_settings(&baseline);
+    clear_settings(args->config);
+
+    /* Time the per-option lookups. */
+    start = now();
+    for (n = 0; n < iterations; n++) {
+        load_per_option(args, options, BENCH_OPTIONS);
+        clear_settings(args->config);
+    }
+    old_ns = (now() - start) / (double) iterations;
+
+    /* Time putil_args_krb5. */
+    start = now();
+    for (n = 0; n < iterations; n++) {
+        if (!putil_args_krb5(args, "pam", options, BENCH_OPTIONS))
+            bail("putil_args_krb5 failed");
+        clear_settings(args->config);
+    }
+    new_ns = (now() - start) / (double) iterations;
+
+    /* Report the results. */
+    printf("krb5.conf: %d realms, %d applications, %d options, %lu"
+           " iterations\n", BENCH_REALMS, BENCH_APPS, BENCH_OPTIONS,
+           iterations);
+    printf("per-option lookups: %10.1f us per load\n", old_ns / 1000);
+    printf("putil_args_krb5:    %10.1f us per load\n", new_ns / 1000);
+    printf("speedup:            %10.1fx\n", old_ns / new_ns);
+
+    /* Clean up. */
+    free(args->config);
+    args->config = NULL;
+    putil_args_free(args);
+    pam_end(pamh, 0);
+    unlink(krb5conf);
+    free(krb5conf);
+    test_tmpdir_free(tmpdir);
+    for (i = 0; i < BENCH_OPTIONS; i++)
+        free(names[i]);
+    return 0;
+}
@@ -139,10 +139,12 @@ main(void)
     bool status;
     struct vector *cells;
     char *program;
+    struct pam_config *copy;
     struct output *seen;
     const char *argv_bool[2] = { NULL, NULL };
     const char *argv_err[2] = { NULL, NULL };
     const char *argv_empty[] = { NULL };
+    const char *argv_swap[] = { "debug", "program=/bin/false", "debug" };
 #ifdef HAVE_KRB5
     const char *argv_all[] = {
         "cells=stanford.edu,ir.stanford.edu", "debug", "expires=1d",
@@ -161,8 +163,12 @@ main(void)
     args = putil_args_new(pamh, 0);
     if (args == NULL)
         bail("cannot create PAM argument struct");
+#ifdef HAVE_KRB5
+    if (!putil_args_krb5_context(args))
+        bail("cannot create Kerberos context");
+#endif
 
-    plan(161);
+    plan(178);
 
     /* First, check just the defaults. */
     args->config = config_new();
@@ -203,6 +209,34 @@ main(void)
     is_int(true, args->config->ignore_root, "...ignore_root is set");
     is_int(1000, args->config->minimum_uid, "...minimum_uid is set");
     is_string("/bin/true", args->config->program, "...program is set");
+
+    /* Copy the resulting configuration and check that the copy is deep. */
+    copy = config_new();
+    status = putil_args_copy(args, copy, args->config, options, optlen);
+    ok(status, "Copying the configuration");
+    if (copy->cells == NULL)
+        ok_block(2, false, "...cells is copied");
+    else {
+        ok(copy->cells != args->config->cells, "...cells is a new vector");
+        is_string("ir.stanford.edu", copy->cells->strings[1],
+                  "...with the same contents");
+    }
+    is_int(true, copy->debug, "...debug is copied");
+    is_int(86400, copy->expires, "...expires is copied");
+    is_int(1000, copy->minimum_uid, "...minimum_uid is copied");
+    ok(copy->program != args->config->program, "...program is a new string");
+    is_string("/bin/true", copy->program, "...with the same contents");
+    config_free(copy);
+
+    /* Swap only the options named in an argument list. */
+    copy = config_new();
+    putil_args_swap(copy, args->config, 3, argv_swap, options, optlen);
+    is_int(true, copy->debug, "Swapping debug");
+    is_int(false, args->config->debug, "...in both directions");
+    is_string("/bin/true", copy->program, "...program is swapped");
+    ok(args->config->program == NULL, "...in both directions");
+    is_int(1000, args->config->minimum_uid, "...minimum_uid is untouched");
+    config_free(copy);
     config_free(args->config);
     args->config = NULL;
 
@@ -232,6 +266,7 @@ main(void)
     }
     is_string("/bin/false", args->config->program,
               "...program is /bin/false");
+    ok(args->config->program == program, "...and is not copied");
     status = putil_args_parse(args, 6, argv_all, options, optlen);
     ok(status, "Parse of full argv after defaults");
     if (args->config->cells == NULL)
@@ -257,6 +292,13 @@ main(void)
     is_string("foo.com", cells->strings[0], "...first cell after free");
     is_string("bar.com", cells->strings[1], "...second cell after free");
     is_string("/bin/false", program, "...string after free");
+    args->config = config_new();
+    status = putil_args_defaults(args, options, optlen);
+    putil_args_free_settings(args->config, options, optlen);
+    ok(args->config->program == NULL, "...default cleared by free_settings");
+    is_string("/bin/false", program, "...but not freed");
+    config_free(args->config);
+    args->config = NULL;
     options[0].defaults.list = NULL;
     options[5].defaults.string = NULL;
     vector_free(cells);
@@ -353,6 +395,8 @@ main(void)
     ok(status, "Options from krb5.conf (other-test)");
     is_int(-1000, args->config->minimum_uid,
            "...minimum_uid set from krb5.conf other-test");
+    is_int(3600, args->config->expires,
+           "...expires set from global krb5.conf setting");
 
     /* Test with a realm set, which should expose more settings. */
     krb5_free_context(args->ctx);
@@ -444,7 +488,7 @@ main(void)
 
 #else /* !HAVE_KRB5 */
 
-    skip_block(37, "Kerberos support not configured");
+    skip_block(38, "Kerberos support not configured");
 
 #endif
 
@@ -0,0 +1,288 @@
+/*
+ * Microbenchmark for parsing PAM module arguments.
+ *
+ * Parses realistic PAM argument lines of between 15 and 25 arguments against
+ * an option table the size of the one used by pam-krb5, and reports the time
+ * per line and per argument for putil_args_parse.  The settings from one
+ * parse are checked first so that the benchmark can't silently measure a
+ * broken parser.  Compare the results between builds to see the effect of a
+ * change to the parser.
+ *
+ * This is not part of the test suite.  Run it with make bench, optionally
+ * passing the number of iterations as the only argument.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <pam-util/args.h>
+#include <pam-util/options.h>
+#include <pam-util/vector.h>
+#include <tests/fakepam/pam.h>
+#include <tests/tap/basic.h>
+
+/* The configuration struct, matching the option table below. */
+struct pam_config {
+    char *alt_auth_map;
+    bool anon_fast;
+    char *banner;
+    char *ccache;
+    char *ccache_dir;
+    bool clear_on_fail;
+    bool debug;
+    bool defer_pwchange;
+    bool expose_account;
+    bool fail_pwchange;
+    char *fast_ccache;
+    bool force_alt_auth;
+    bool force_first_pass;
+    bool force_pwchange;
+    bool forwardable;
+    bool ignore_k5login;
+    bool ignore_root;
+    char *keytab;
+    long minimum_uid;
+    bool no_ccache;
+    bool no_prompt;
+    bool no_update_user;
+    bool only_alt_auth;
+    char *pkinit_anchors;
+    bool pkinit_prompt;
+    char *pkinit_user;
+    struct vector *preauth_opt;
+    bool prompt_principal;
+    char *realm;
+    krb5_deltat renew_lifetime;
+    bool retain_after_close;
+    bool search_k5login;
+    bool silent;
+    krb5_deltat ticket_lifetime;
+    char *trace;
+    bool try_first_pass;
+    bool try_pkinit;
+    bool use_authtok;
+    bool use_first_pass;
+    bool use_pkinit;
+    char *user_realm;
+};
+
+/* The option table, which must be sorted. */
+#define K(name) (#name), offsetof(struct pam_config, name)
+static const struct option options[] = {
+    { K(alt_auth_map),       true,  STRING (NULL)  },
+    { K(anon_fast),          true,  BOOL   (false) },
+    { K(banner),             true,  STRING ("Kerberos") },
+    { K(ccache),             true,  STRING (NULL)  },
+    { K(ccache_dir),         true,  STRING ("FILE:/tmp") },
+    { K(clear_on_fail),      true,  BOOL   (false) },
+    { K(debug),              true,  BOOL   (false) },
+    { K(defer_pwchange),     true,  BOOL   (false) },
+    { K(expose_account),     true,  BOOL   (false) },
+    { K(fail_pwchange),      true,  BOOL   (false) },
+    { K(fast_ccache),        true,  STRING (NULL)  },
+    { K(force_alt_auth),     true,  BOOL   (false) },
+    { K(force_first_pass),   false, BOOL   (false) },
+    { K(force_pwchange),     true,  BOOL   (false) },
+    { K(forwardable),        true,  BOOL   (false) },
+    { K(ignore_k5login),     true,  BOOL   (false) },
+    { K(ignore_root),        true,  BOOL   (false) },
+    { K(keytab),             true,  STRING (NULL)  },
+    { K(minimum_uid),        true,  NUMBER (0)     },
+    { K(no_ccache),          false, BOOL   (false) },
+    { K(no_prompt),          true,  BOOL   (false) },
+    { K(no_update_user),     true,  BOOL   (false) },
+    { K(only_alt_auth),      true,  BOOL   (false) },
+    { K(pkinit_anchors),     true,  STRING (NULL)  },
+    { K(pkinit_prompt),      true,  BOOL   (false) },
+    { K(pkinit_user),        true,  STRING (NULL)  },
+    { K(preauth_opt),        true,  LIST   (NULL)  },
+    { K(prompt_principal),   true,  BOOL   (false) },
+    { K(realm),              false, STRING (NULL)  },
+    { K(renew_lifetime),     true,  TIME   (0)     },
+    { K(retain_after_close), true,  BOOL   (false) },
+    { K(search_k5login),     true,  BOOL   (false) },
+    { K(silent),             false, BOOL   (false) },
+    { K(ticket_lifetime),    true,  TIME   (0)     },
+    { K(trace),              false, STRING (NULL)  },
+    { K(try_first_pass),     false, BOOL   (false) },
+    { K(try_pkinit),         true,  BOOL   (false) },
+    { K(use_authtok),        false, BOOL   (false) },
+    { K(use_first_pass),     false, BOOL   (false) },
+    { K(use_pkinit),         true,  BOOL   (false) },
+    { K(user_realm),         true,  STRING (NULL)  },
+};
+static const size_t optlen = sizeof(options) / sizeof(options[0]);
+
+/* The argument lines to parse, modeled on real PAM configurations. */
+static const char *line_short[] = {
+    "debug", "ignore_root", "minimum_uid=1000", "try_first_pass",
+    "forwardable", "search_k5login", "retain_after_close",
+    "ticket_lifetime=10h", "renew_lifetime=7d", "realm=EXAMPLE.COM",
+    "ccache_dir=FILE:/run/user", "banner=Kerberos", "no_update_user",
+    "clear_on_fail", "expose_account"
+};
+static const char *line_medium[] = {
+    "debug", "ignore_root", "minimum_uid=1000", "use_first_pass",
+    "forwardable=true", "search_k5login", "retain_after_close",
+    "ticket_lifetime=36000", "renew_lifetime=604800", "realm=EXAMPLE.COM",
+    "user_realm=USERS.EXAMPLE.COM", "ccache_dir=FILE:/run/user",
+    "ccache=FILE:/run/user/krb5cc_%u_XXXXXX", "keytab=/etc/krb5.keytab",
+    "banner=Kerberos", "no_update_user", "clear_on_fail", "expose_account",
+    "anon_fast", "fast_ccache=/var/lib/pam-krb5/armor"
+};
+static const char *line_long[] = {
+    "debug", "ignore_root", "minimum_uid=1000", "use_first_pass",
+    "forwardable=yes", "search_k5login=no", "retain_after_close",
+    "ticket_lifetime=10h", "renew_lifetime=7d", "realm=EXAMPLE.COM",
+    "user_realm=USERS.EXAMPLE.COM", "ccache_dir=FILE:/run/user",
+    "ccache=FILE:/run/user/krb5cc_%u_XXXXXX", "keytab=/etc/krb5.keytab",
+    "banner=Kerberos", "no_update_user", "clear_on_fail", "expose_account",
+    "try_pkinit", "pkinit_user=FILE:/etc/pki/user.pem",
+    "pkinit_anchors=FILE:/etc/pki/ca.pem",
+    "preauth_opt=X509_user_identity,flag_RSA_PROTOCOL", "pkinit_prompt",
+    "alt_auth_map=%s/admin", "defer_pwchange"
+};
+
+/* The lines and their names for the report. */
+static const struct {
+    const char *name;
+    const char **argv;
+    int argc;
+} lines[] = {
+    { "short",  line_short,  sizeof(line_short)  / sizeof(line_short[0])  },
+    { "medium", line_medium, sizeof(line_medium) / sizeof(line_medium[0]) },
+    { "long",   line_long,   sizeof(line_long)   / sizeof(line_long[0])   },
+};
+
+
+/*
+ * Free all of the string and list settings in the configuration struct so
+ * that the parse can be repeated without leaking memory.
+ */
+static void
+clear_settings(struct pam_config *config)
+{
+    size_t i;
+    char **string;
+    struct vector **list;
+
+    for (i = 0; i < optlen; i++) {
+        switch (options[i].type) {
+        case TYPE_STRING:
+            string = (char **) (void *) ((char *) config
+                                         + options[i].location);
+            free(*string);
+            *string = NULL;
+            break;
+        case TYPE_LIST:
+        case TYPE_STRLIST:
+            list = (struct vector **) (void *) ((char *) config
+                                                + options[i].location);
+            vector_free(*list);
+            *list = NULL;
+            break;
+        case TYPE_BOOLEAN:
+        case TYPE_NUMBER:
+        case TYPE_TIME:
+            break;
+        }
+    }
+}
+
+
+/*
+ * Parse the long line once and check a sample of the resulting settings.
+ */
+static void
+check_parse(struct pam_args *args)
+{
+    struct pam_config *config = args->config;
+
+    if (!putil_args_parse(args, lines[2].argc, lines[2].argv, options,
+                          optlen))
+        bail("putil_args_parse failed");
+    if (!config->debug || !config->use_first_pass || config->search_k5login)
+        bail("boolean settings not parsed correctly");
+    if (config->minimum_uid != 1000)
+        bail("minimum_uid not parsed correctly");
+    if (config->ticket_lifetime != 36000)
+        bail("ticket_lifetime not parsed correctly");
+    if (config->realm == NULL || strcmp(config->realm, "EXAMPLE.COM") != 0)
+        bail("realm not parsed correctly");
+    if (config->preauth_opt == NULL || config->preauth_opt->count != 2)
+        bail("preauth_opt not parsed correctly");
+    if (pam_output() != NULL)
+        bail("unexpected diagnostics from putil_args_parse");
+    clear_settings(config);
+    memset(config, 0, sizeof(struct pam_config));
+}
+
+
+/*
+ * Return the current time in nanoseconds from an arbitrary starting point.
+ */
+static double
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        sysbail("cannot get time");
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    pam_handle_t *pamh;
+    struct pam_conv conv = { NULL, NULL };
+    struct pam_args *args;
+    unsigned long iterations = 1000000;
+    unsigned long n;
+    double start, ns;
+    size_t i;
+
+    if (argc > 1)
+        iterations = strtoul(argv[1], NULL, 10);
+    if (iterations == 0)
+        bail("invalid number of iterations");
+
+    /* Set up the PAM argument struct. */
+    if (pam_start("bench", NULL, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("cannot create pam_handle_t");
+    args = putil_args_new(pamh, 0);
+    if (args == NULL)
+        bail("cannot create PAM argument struct");
+    args->config = bcalloc(1, sizeof(struct pam_config));
+    check_parse(args);
+
+    /* Time each line. */
+    printf("%lu options, %lu iterations\n", (unsigned long) optlen,
+           iterations);
+    for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        start = now();
+        for (n = 0; n < iterations; n++) {
+            if (!putil_args_parse(args, lines[i].argc, lines[i].argv, options,
+                                  optlen))
+                bail("putil_args_parse failed");
+            clear_settings(args->config);
+        }
+        ns = (now() - start) / (double) iterations;
+        printf("%-6s (%2d arguments): %8.1f ns per line, %6.1f ns per"
+               " argument\n", lines[i].name, lines[i].argc, ns,
+               ns / lines[i].argc);
+    }
+
+    /* Clean up. */
+    free(args->config);
+    args->config = NULL;
+    putil_args_free(args);
+    pam_end(pamh, 0);
+    return 0;
+}
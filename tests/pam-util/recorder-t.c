@@ -0,0 +1,99 @@
+/*
+ * PAM utility flight recorder test suite.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <pam-util/recorder.h>
+#include <tests/fakepam/pam.h>
+#include <tests/tap/basic.h>
+
+
+int
+main(void)
+{
+    pam_handle_t *pamh;
+    struct pam_args *args;
+    struct pam_conv conv = { NULL, NULL };
+    struct output *seen;
+    char *contents;
+    char line[100];
+    size_t i;
+
+    plan(13);
+
+    if (pam_start("test", NULL, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("Fake PAM initialization failed");
+    args = putil_args_new(pamh, 0);
+    if (args == NULL)
+        bail("cannot create PAM argument struct");
+
+    /* Without a recorder, suppressed debug messages go nowhere. */
+    putil_debug(args, "%s", "lost");
+    ok(putil_recorder_contents(args) == NULL, "Nothing without a recorder");
+    seen = pam_output();
+    ok(seen == NULL, "...and nothing logged");
+    pam_output_free(seen);
+
+    /* With one, they are kept in order and not logged. */
+    ok(putil_recorder_start(args, 64), "Start recorder");
+    ok(putil_recorder_contents(args) == NULL, "...which starts empty");
+    putil_debug(args, "%s", "first");
+    putil_debug_pam(args, PAM_SUCCESS, "%s", "second");
+    contents = putil_recorder_contents(args);
+    is_string("first\nsecond\n", contents, "Debug messages recorded");
+    seen = pam_output();
+    ok(seen == NULL, "...and not logged");
+    pam_output_free(seen);
+
+    /* Other priorities are logged as usual and not recorded. */
+    putil_err(args, "%s", "error");
+    seen = pam_output();
+    ok(seen != NULL && seen->count == 1, "Errors still logged");
+    pam_output_free(seen);
+    is_string("first\nsecond\n", putil_recorder_contents(args),
+              "...and not recorded");
+
+    /* With debugging enabled, debug messages are logged instead. */
+    args->debug = true;
+    putil_debug(args, "%s", "logged");
+    seen = pam_output();
+    ok(seen != NULL && seen->count == 1, "Debug logged when enabled");
+    pam_output_free(seen);
+    is_string("first\nsecond\n", putil_recorder_contents(args),
+              "...and not recorded");
+    args->debug = false;
+
+    /*
+     * Once the ring wraps, only the most recent complete lines are kept.
+     * Each line is 12 bytes with its newline, so the 64-byte ring holds the
+     * last five whole lines and part of the sixth, which is dropped.
+     */
+    for (i = 0; i < 20; i++)
+        putil_debug(args, "message %03lu", (unsigned long) i);
+    contents = putil_recorder_contents(args);
+    is_string("message 015\nmessage 016\nmessage 017\nmessage 018\n"
+              "message 019\n", contents, "Ring keeps the newest lines");
+
+    /* A line longer than the ring keeps only its end, which is dropped. */
+    memset(line, 'a', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    putil_recorder_add(args->recorder, line, strlen(line));
+    putil_recorder_add(args->recorder, "tail", strlen("tail"));
+    is_string("tail\n", putil_recorder_contents(args),
+              "Overlong line does not corrupt the ring");
+
+    /* Adding to a NULL recorder is harmless. */
+    putil_recorder_add(NULL, "nothing", strlen("nothing"));
+    ok(true, "Adding to a NULL recorder");
+
+    putil_args_free(args);
+    pam_end(pamh, 0);
+    return 0;
+}
@@ -0,0 +1,1024 @@
+/*
+ * Stand-in KDC for tests and benchmarks.
+ *
+ * The realm is created with kdb5_util and kadmin.local in a temporary
+ * directory and served by krb5kdc and kadmind on free loopback ports.  A
+ * thread in the test process listens on the ports that clients are given in
+ * krb5.conf, applies any queued faults, and relays the remaining requests to
+ * the daemons.  Injected errors are built here as minimal KRB-ERROR messages
+ * so that the relay doesn't need the Kerberos libraries.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/kdc.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/string.h>
+
+/* The generated realm and its principals. */
+#define KDC_REALM    "PAM-KRB5.TEST"
+#define KDC_USER     "pamtest"
+#define KDC_PASSWORD "stand-in 4 pam-krb5"
+#define KDC_SERVICE  "host/localhost"
+#define KDC_MASTER   "stand-in master key"
+
+/* Kerberos protocol error codes used for injected faults. */
+#define ERR_C_PRINCIPAL_UNKNOWN 6
+#define ERR_KEY_EXPIRED         23
+#define ERR_PREAUTH_REQUIRED    25
+
+/* The first byte of AS-REQ and TGS-REQ messages (APPLICATION 10 and 12). */
+#define TAG_AS_REQ  0x6a
+#define TAG_TGS_REQ 0x6c
+
+/* The largest message relayed and the time to wait for a daemon's reply. */
+#define MAX_MESSAGE   65536
+#define RELAY_TIMEOUT 10
+
+/* The most faults that can be queued at once. */
+#define MAX_QUEUE 64
+
+/* Where to look for the KDC programs if they're not on the PATH. */
+static const char *const program_dirs[] = {
+    "/usr/sbin", "/usr/local/sbin", "/usr/lib/mit/sbin", "/usr/kerberos/sbin",
+    NULL
+};
+
+/* A relayed service: the sockets clients use and the daemon's port. */
+struct service {
+    int udp;
+    int tcp;
+    unsigned short port;
+    unsigned short backend;
+    bool kdc;
+};
+
+/* A buffer for a message being built or relayed. */
+struct message {
+    unsigned char data[MAX_MESSAGE];
+    size_t length;
+};
+
+#ifdef HAVE_PTHREAD_H
+
+/* The running stand-in KDC. */
+static struct {
+    bool active;
+    char *tmpdir;
+    char *dir;
+    struct process *daemons[2];
+    struct service services[2];
+    unsigned short kadmin_port;
+    int wakeup[2];
+    pthread_t thread;
+} kdc;
+
+/* The fault state, shared between the test and the relay thread. */
+static struct {
+    unsigned long delay;
+    unsigned int loss;
+    unsigned long seed;
+    enum kdc_fault queue[MAX_QUEUE];
+    size_t head;
+    size_t count;
+    unsigned long requests;
+} faults;
+static pthread_mutex_t fault_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Find one of the KDC programs, searching the PATH and then the usual
+ * system directories.  Returns newly allocated memory or NULL.
+ */
+static char *
+find_program(const char *name)
+{
+    char *path, *dirs, *dir, *saveptr;
+    const char *env;
+    size_t i;
+
+    env = getenv("PATH");
+    if (env != NULL) {
+        dirs = bstrdup(env);
+        for (dir = strtok_r(dirs, ":", &saveptr); dir != NULL;
+             dir = strtok_r(NULL, ":", &saveptr)) {
+            basprintf(&path, "%s/%s", dir, name);
+            if (access(path, X_OK) == 0) {
+                free(dirs);
+                return path;
+            }
+            free(path);
+        }
+        free(dirs);
+    }
+    for (i = 0; program_dirs[i] != NULL; i++) {
+        basprintf(&path, "%s/%s", program_dirs[i], name);
+        if (access(path, X_OK) == 0)
+            return path;
+        free(path);
+    }
+    return NULL;
+}
+
+
+/*
+ * Run a setup command with its output discarded and return whether it
+ * succeeded.  Unlike run_setup, failure isn't fatal, since it usually means
+ * that the installed Kerberos isn't suitable and the tests should skip.
+ */
+static bool
+run_quietly(const char *const argv[])
+{
+    pid_t child;
+    int status, fd;
+
+    fflush(stdout);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        fd = open("/dev/null", O_RDWR);
+        if (fd >= 0) {
+            dup2(fd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execv(argv[0], (char *const *) argv);
+        _exit(127);
+    }
+    if (waitpid(child, &status, 0) < 0)
+        sysbail("cannot wait for %s", argv[0]);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+/*
+ * Bind a UDP and a TCP socket to the same free loopback port, returning the
+ * port.  Tries a few times in case the UDP port is taken.
+ */
+static unsigned short
+bind_pair(int *udp, int *tcp)
+{
+    struct sockaddr_in addr;
+    socklen_t length;
+    int i;
+
+    for (i = 0; i < 20; i++) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *tcp = socket(AF_INET, SOCK_STREAM, 0);
+        if (*tcp < 0)
+            sysbail("cannot create socket");
+        if (bind(*tcp, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            sysbail("cannot bind TCP socket");
+        length = sizeof(addr);
+        if (getsockname(*tcp, (struct sockaddr *) &addr, &length) < 0)
+            sysbail("cannot get socket address");
+        *udp = socket(AF_INET, SOCK_DGRAM, 0);
+        if (*udp < 0)
+            sysbail("cannot create socket");
+        if (bind(*udp, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+            return ntohs(addr.sin_port);
+        close(*udp);
+        close(*tcp);
+    }
+    bail("cannot find a free port");
+    return 0;
+}
+
+
+/*
+ * Find a port that is free for both UDP and TCP for one of the daemons.  The
+ * port could be taken again before the daemon binds it, but that's unlikely
+ * on a test machine.
+ */
+static unsigned short
+free_port(void)
+{
+    unsigned short port;
+    int udp, tcp;
+
+    port = bind_pair(&udp, &tcp);
+    close(udp);
+    close(tcp);
+    return port;
+}
+
+
+/*
+ * Write a file, calling bail on any error.
+ */
+static void
+write_file(const char *path, const char *format, ...)
+{
+    FILE *file;
+    va_list args;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    va_start(args, format);
+    vfprintf(file, format, args);
+    va_end(args);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+}
+
+
+/*
+ * Append a DER tag, length, and contents to a message.
+ */
+static void
+der_add(struct message *message, unsigned char tag, const void *data,
+        size_t length)
+{
+    unsigned char header[4];
+    size_t size;
+
+    header[0] = tag;
+    if (length < 0x80) {
+        header[1] = (unsigned char) length;
+        size = 2;
+    } else if (length < 0x100) {
+        header[1] = 0x81;
+        header[2] = (unsigned char) length;
+        size = 3;
+    } else {
+        header[1] = 0x82;
+        header[2] = (unsigned char) (length >> 8);
+        header[3] = (unsigned char) (length & 0xff);
+        size = 4;
+    }
+    if (message->length + size + length > sizeof(message->data))
+        bail("KRB-ERROR too large");
+    memcpy(message->data + message->length, header, size);
+    memcpy(message->data + message->length + size, data, length);
+    message->length += size + length;
+}
+
+
+/*
+ * Append a context-tagged INTEGER, GeneralString, or GeneralizedTime field
+ * to a message.  The values are always small and non-negative.
+ */
+static void
+der_integer(struct message *message, unsigned char field, unsigned long value)
+{
+    struct message inner;
+    unsigned char bytes[sizeof(value) + 1];
+    size_t i = sizeof(bytes);
+
+    do {
+        bytes[--i] = (unsigned char) (value & 0xff);
+        value >>= 8;
+    } while (value > 0);
+    if (bytes[i] & 0x80)
+        bytes[--i] = 0;
+    inner.length = 0;
+    der_add(&inner, 0x02, bytes + i, sizeof(bytes) - i);
+    der_add(message, 0xa0 | field, inner.data, inner.length);
+}
+
+static void
+der_string(struct message *message, unsigned char field, const char *value)
+{
+    struct message inner;
+
+    inner.length = 0;
+    der_add(&inner, 0x1b, value, strlen(value));
+    der_add(message, 0xa0 | field, inner.data, inner.length);
+}
+
+static void
+der_time(struct message *message, unsigned char field, time_t value)
+{
+    struct message inner;
+    struct tm tm;
+    char buffer[32];
+
+    if (gmtime_r(&value, &tm) == NULL)
+        bail("cannot convert time");
+    strftime(buffer, sizeof(buffer), "%Y%m%d%H%M%SZ", &tm);
+    inner.length = 0;
+    der_add(&inner, 0x18, buffer, strlen(buffer));
+    der_add(message, 0xa0 | field, inner.data, inner.length);
+}
+
+
+/*
+ * Build a KRB-ERROR message with the given error code, naming the krbtgt
+ * service of the stand-in realm.  Only the mandatory fields are included.
+ */
+static void
+build_error(struct message *reply, unsigned long code)
+{
+    struct message fields, sname, strings, names, sequence;
+
+    /* PrincipalName for krbtgt/REALM with name type NT-SRV-INST. */
+    strings.length = 0;
+    der_add(&strings, 0x1b, "krbtgt", strlen("krbtgt"));
+    der_add(&strings, 0x1b, KDC_REALM, strlen(KDC_REALM));
+    names.length = 0;
+    der_integer(&names, 0, 2);
+    sequence.length = 0;
+    der_add(&sequence, 0x30, strings.data, strings.length);
+    der_add(&names, 0xa1, sequence.data, sequence.length);
+    sname.length = 0;
+    der_add(&sname, 0x30, names.data, names.length);
+
+    /* The KRB-ERROR fields in order. */
+    fields.length = 0;
+    der_integer(&fields, 0, 5);
+    der_integer(&fields, 1, 30);
+    der_time(&fields, 4, time(NULL));
+    der_integer(&fields, 5, 0);
+    der_integer(&fields, 6, code);
+    der_string(&fields, 9, KDC_REALM);
+    der_add(&fields, 0xaa, sname.data, sname.length);
+
+    /* Wrap in SEQUENCE and APPLICATION 30. */
+    sequence.length = 0;
+    der_add(&sequence, 0x30, fields.data, fields.length);
+    reply->length = 0;
+    der_add(reply, 0x7e, sequence.data, sequence.length);
+}
+
+
+/*
+ * Decide what to do with the next request to a service and return the delay
+ * to apply before doing it.
+ */
+static enum kdc_fault
+next_fault(const struct service *service, const struct message *request,
+           unsigned long *delay)
+{
+    enum kdc_fault fault = KDC_PASS;
+    bool kdc_request;
+
+    kdc_request = service->kdc && request->length > 0
+        && (request->data[0] == TAG_AS_REQ
+            || request->data[0] == TAG_TGS_REQ);
+    pthread_mutex_lock(&fault_lock);
+    if (kdc_request)
+        faults.requests++;
+    if (kdc_request && faults.count > 0) {
+        fault = faults.queue[faults.head];
+        faults.head = (faults.head + 1) % MAX_QUEUE;
+        faults.count--;
+    } else if (faults.loss > 0) {
+        faults.seed = faults.seed * 1103515245UL + 12345UL;
+        if ((faults.seed >> 16) % 100 < faults.loss)
+            fault = KDC_DROP;
+    }
+    *delay = faults.delay;
+    pthread_mutex_unlock(&fault_lock);
+    if (!kdc_request && fault != KDC_DROP)
+        fault = KDC_PASS;
+    return fault;
+}
+
+
+/*
+ * Read or write exactly the given number of bytes, returning false on error,
+ * timeout, or end of file.
+ */
+static bool
+read_all(int fd, void *buffer, size_t length)
+{
+    size_t done = 0;
+    ssize_t status;
+
+    while (done < length) {
+        status = read(fd, (char *) buffer + done, length - done);
+        if (status <= 0)
+            return false;
+        done += (size_t) status;
+    }
+    return true;
+}
+
+static bool
+write_all(int fd, const void *buffer, size_t length)
+{
+    size_t done = 0;
+    ssize_t status;
+
+    while (done < length) {
+        status = write(fd, (const char *) buffer + done, length - done);
+        if (status <= 0)
+            return false;
+        done += (size_t) status;
+    }
+    return true;
+}
+
+
+/*
+ * Read a TCP message with its four-byte length prefix.
+ */
+static bool
+read_framed(int fd, struct message *message)
+{
+    uint32_t length;
+
+    if (!read_all(fd, &length, sizeof(length)))
+        return false;
+    length = ntohl(length);
+    if (length > sizeof(message->data))
+        return false;
+    message->length = length;
+    return read_all(fd, message->data, length);
+}
+
+static bool
+write_framed(int fd, const struct message *message)
+{
+    uint32_t length;
+
+    length = htonl((uint32_t) message->length);
+    return write_all(fd, &length, sizeof(length))
+        && write_all(fd, message->data, message->length);
+}
+
+
+/*
+ * Relay a request to a daemon over the same transport the client used and
+ * read its reply.  Returns false if the daemon doesn't answer.
+ */
+static bool
+relay(unsigned short port, bool tcp, const struct message *request,
+      struct message *reply)
+{
+    struct sockaddr_in addr;
+    struct timeval timeout;
+    ssize_t status;
+    int fd;
+    bool okay = false;
+
+    fd = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (fd < 0)
+        return false;
+    timeout.tv_sec = RELAY_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        goto done;
+    if (tcp)
+        okay = write_framed(fd, request) && read_framed(fd, reply);
+    else {
+        if (send(fd, request->data, request->length, 0) < 0)
+            goto done;
+        status = recv(fd, reply->data, sizeof(reply->data), 0);
+        if (status > 0) {
+            reply->length = (size_t) status;
+            okay = true;
+        }
+    }
+
+done:
+    close(fd);
+    return okay;
+}
+
+
+/*
+ * Handle one request, returning false if there should be no reply.
+ */
+static bool
+handle(const struct service *service, bool tcp,
+       const struct message *request, struct message *reply)
+{
+    enum kdc_fault fault;
+    unsigned long delay;
+    struct timespec ts;
+
+    fault = next_fault(service, request, &delay);
+    if (delay > 0) {
+        ts.tv_sec = (time_t) (delay / 1000);
+        ts.tv_nsec = (long) (delay % 1000) * 1000000L;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+    switch (fault) {
+    case KDC_PASS:
+        return relay(service->backend, tcp, request, reply);
+    case KDC_DROP:
+        return false;
+    case KDC_PREAUTH_REQUIRED:
+        build_error(reply, ERR_PREAUTH_REQUIRED);
+        return true;
+    case KDC_KEY_EXPIRED:
+        build_error(reply, ERR_KEY_EXPIRED);
+        return true;
+    case KDC_PRINCIPAL_UNKNOWN:
+        build_error(reply, ERR_C_PRINCIPAL_UNKNOWN);
+        return true;
+    }
+    return false;
+}
+
+
+/*
+ * Serve one UDP request or one TCP connection.  TCP connections carry a
+ * single request, which is all the Kerberos libraries send.
+ */
+static void
+serve_udp(const struct service *service)
+{
+    static struct message request, reply;
+    struct sockaddr_storage from;
+    socklen_t length = sizeof(from);
+    ssize_t status;
+
+    status = recvfrom(service->udp, request.data, sizeof(request.data), 0,
+                      (struct sockaddr *) &from, &length);
+    if (status <= 0)
+        return;
+    request.length = (size_t) status;
+    if (handle(service, false, &request, &reply))
+        sendto(service->udp, reply.data, reply.length, 0,
+               (struct sockaddr *) &from, length);
+}
+
+static void
+serve_tcp(const struct service *service)
+{
+    static struct message request, reply;
+    struct timeval timeout;
+    int fd;
+
+    fd = accept(service->tcp, NULL, NULL);
+    if (fd < 0)
+        return;
+    timeout.tv_sec = RELAY_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (read_framed(fd, &request) && handle(service, true, &request, &reply))
+        write_framed(fd, &reply);
+    close(fd);
+}
+
+
+/*
+ * The relay thread.  Serves requests until something is written to the
+ * wakeup pipe.
+ */
+static void *
+serve(void *data UNUSED)
+{
+    struct pollfd fds[5];
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        fds[i * 2].fd = kdc.services[i].udp;
+        fds[i * 2 + 1].fd = kdc.services[i].tcp;
+    }
+    fds[4].fd = kdc.wakeup[0];
+    for (i = 0; i < 5; i++)
+        fds[i].events = POLLIN;
+    while (true) {
+        if (poll(fds, 5, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            sysdiag("stand-in KDC poll failed");
+            break;
+        }
+        if (fds[4].revents != 0)
+            break;
+        for (i = 0; i < 2; i++) {
+            if (fds[i * 2].revents & POLLIN)
+                serve_udp(&kdc.services[i]);
+            if (fds[i * 2 + 1].revents & POLLIN)
+                serve_tcp(&kdc.services[i]);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Write a krb5.conf that points at the stand-in KDC.
+ */
+void
+kdc_write_conf(const char *path, const char *realm)
+{
+    if (realm == NULL)
+        realm = KDC_REALM;
+    write_file(path,
+               "[libdefaults]\n"
+               "    default_realm = %s\n"
+               "    dns_lookup_kdc = false\n"
+               "    dns_lookup_realm = false\n"
+               "    rdns = false\n\n"
+               "[realms]\n"
+               "    %s = {\n"
+               "        kdc = 127.0.0.1:%u\n"
+               "        admin_server = 127.0.0.1:%u\n"
+               "        kpasswd_server = 127.0.0.1:%u\n"
+               "    }\n\n"
+               "[domain_realm]\n"
+               "    localhost = %s\n",
+               realm, KDC_REALM, kdc.services[0].port, kdc.kadmin_port,
+               kdc.services[1].port, KDC_REALM);
+}
+
+
+/*
+ * Create the realm database and principals and start the daemons.  Returns
+ * false if creating the realm fails.
+ */
+static bool
+create_realm(void)
+{
+    char *krb5kdc, *kadmind, *kdb5_util, *kadmin_local;
+    char *path, *keytab, *query, *pidfile;
+    bool okay = false;
+
+    krb5kdc = find_program("krb5kdc");
+    kadmind = find_program("kadmind");
+    kdb5_util = find_program("kdb5_util");
+    kadmin_local = find_program("kadmin.local");
+    if (krb5kdc == NULL || kadmind == NULL || kdb5_util == NULL
+        || kadmin_local == NULL)
+        goto done;
+
+    /* Configuration for the daemons and for kinit. */
+    basprintf(&path, "%s/kdc.conf", kdc.dir);
+    write_file(path,
+               "[kdcdefaults]\n"
+               "    kdc_ports = %u\n"
+               "    kdc_tcp_ports = %u\n"
+               "    kdc_listen = 127.0.0.1:%u\n"
+               "    kdc_tcp_listen = 127.0.0.1:%u\n\n"
+               "[realms]\n"
+               "    %s = {\n"
+               "        database_name = %s/principal\n"
+               "        key_stash_file = %s/stash\n"
+               "        acl_file = %s/kadm5.acl\n"
+               "        kadmind_port = %u\n"
+               "        kadmind_listen = 127.0.0.1:%u\n"
+               "        kpasswd_port = %u\n"
+               "        kpasswd_listen = 127.0.0.1:%u\n"
+               "        max_life = 1d\n"
+               "        max_renewable_life = 7d\n"
+               "    }\n\n"
+               "[logging]\n"
+               "    kdc = FILE:%s/krb5kdc.log\n"
+               "    admin_server = FILE:%s/kadmind.log\n",
+               kdc.services[0].backend, kdc.services[0].backend,
+               kdc.services[0].backend, kdc.services[0].backend, KDC_REALM,
+               kdc.dir, kdc.dir, kdc.dir, kdc.kadmin_port, kdc.kadmin_port,
+               kdc.services[1].backend, kdc.services[1].backend, kdc.dir,
+               kdc.dir);
+    if (setenv("KRB5_KDC_PROFILE", path, 1) < 0)
+        sysbail("cannot set KRB5_KDC_PROFILE");
+    free(path);
+    basprintf(&path, "%s/kadm5.acl", kdc.dir);
+    write_file(path, "");
+    free(path);
+    basprintf(&path, "%s/krb5.conf", kdc.dir);
+    kdc_write_conf(path, NULL);
+    if (setenv("KRB5_CONFIG", path, 1) < 0)
+        sysbail("cannot set KRB5_CONFIG");
+    free(path);
+    if (setenv("KRB5RCACHETYPE", "none", 1) < 0)
+        sysbail("cannot set KRB5RCACHETYPE");
+
+    /* Create the database, the principals, and the keytab. */
+    {
+        const char *argv[] = {
+            kdb5_util, "-r", KDC_REALM, "-P", KDC_MASTER, "create", "-s", NULL
+        };
+
+        if (!run_quietly(argv))
+            goto done;
+    }
+    basprintf(&keytab, "%s/keytab", kdc.dir);
+    {
+        const char *argv[] = { kadmin_local, "-r", KDC_REALM, "-q", NULL, NULL };
+
+        basprintf(&query, "addprinc -pw \"%s\" %s", KDC_PASSWORD, KDC_USER);
+        argv[4] = query;
+        okay = run_quietly(argv);
+        free(query);
+        if (okay) {
+            argv[4] = "addprinc -randkey " KDC_SERVICE;
+            okay = run_quietly(argv);
+        }
+        if (okay) {
+            basprintf(&query, "ktadd -k %s %s", keytab, KDC_SERVICE);
+            argv[4] = query;
+            okay = run_quietly(argv);
+            free(query);
+        }
+    }
+    free(keytab);
+    if (!okay)
+        goto done;
+
+    /* Start the daemons.  They're stopped by kdc_stop or at exit. */
+    basprintf(&pidfile, "%s/krb5kdc.pid", kdc.dir);
+    {
+        const char *argv[] = {
+            krb5kdc, "-n", "-r", KDC_REALM, "-P", pidfile, NULL
+        };
+
+        kdc.daemons[0] = process_start(argv, pidfile);
+    }
+    free(pidfile);
+    basprintf(&pidfile, "%s/kadmind.pid", kdc.dir);
+    {
+        const char *argv[] = {
+            kadmind, "-nofork", "-r", KDC_REALM, "-P", pidfile, NULL
+        };
+
+        kdc.daemons[1] = process_start(argv, pidfile);
+    }
+    free(pidfile);
+
+done:
+    free(krb5kdc);
+    free(kadmind);
+    free(kdb5_util);
+    free(kadmin_local);
+    return okay;
+}
+
+
+/*
+ * Remove the realm directory and everything in it.
+ */
+static void
+remove_realm(void)
+{
+    const char *argv[] = { "/bin/rm", "-rf", NULL, NULL };
+
+    argv[2] = kdc.dir;
+    run_quietly(argv);
+    free(kdc.dir);
+    kdc.dir = NULL;
+    test_tmpdir_free(kdc.tmpdir);
+    kdc.tmpdir = NULL;
+}
+
+
+/*
+ * Start the stand-in KDC and fill in the test configuration.
+ */
+bool
+kdc_start(struct kerberos_config *config)
+{
+    size_t i;
+
+    if (kdc.active)
+        kdc_stop();
+    memset(&faults, 0, sizeof(faults));
+    faults.seed = 1;
+
+    /* Set up the ports and the realm. */
+    kdc.tmpdir = test_tmpdir();
+    basprintf(&kdc.dir, "%s/kdc", kdc.tmpdir);
+    if (mkdir(kdc.dir, 0700) < 0 && errno != EEXIST)
+        sysbail("cannot create %s", kdc.dir);
+    for (i = 0; i < 2; i++) {
+        kdc.services[i].port = bind_pair(&kdc.services[i].udp,
+                                         &kdc.services[i].tcp);
+        if (listen(kdc.services[i].tcp, 16) < 0)
+            sysbail("cannot listen on TCP socket");
+        kdc.services[i].backend = free_port();
+        kdc.services[i].kdc = (i == 0);
+    }
+    kdc.kadmin_port = free_port();
+    if (!create_realm()) {
+        for (i = 0; i < 2; i++) {
+            close(kdc.services[i].udp);
+            close(kdc.services[i].tcp);
+        }
+        remove_realm();
+        unsetenv("KRB5_KDC_PROFILE");
+        return false;
+    }
+
+    /* Start the relay. */
+    if (pipe(kdc.wakeup) < 0)
+        sysbail("cannot create pipe");
+    if (pthread_create(&kdc.thread, NULL, serve, NULL) != 0)
+        bail("cannot create stand-in KDC thread");
+    kdc.active = true;
+
+    /* Fill in the configuration the same way as for a real realm. */
+    basprintf(&config->keytab, "%s/keytab", kdc.dir);
+    config->userprinc = bstrdup(KDC_USER "@" KDC_REALM);
+    config->username = bstrdup(config->userprinc);
+    config->realm = strchr(config->username, '@');
+    *config->realm = '\0';
+    config->realm++;
+    config->password = bstrdup(KDC_PASSWORD);
+    return true;
+}
+
+
+/*
+ * Stop the relay thread and the daemons and remove the realm.
+ */
+void
+kdc_stop(void)
+{
+    size_t i;
+
+    if (!kdc.active)
+        return;
+    if (write(kdc.wakeup[1], "", 1) < 1)
+        sysbail("cannot stop stand-in KDC thread");
+    pthread_join(kdc.thread, NULL);
+    close(kdc.wakeup[0]);
+    close(kdc.wakeup[1]);
+    for (i = 0; i < 2; i++) {
+        process_stop(kdc.daemons[i]);
+        kdc.daemons[i] = NULL;
+        close(kdc.services[i].udp);
+        close(kdc.services[i].tcp);
+    }
+    remove_realm();
+    unsetenv("KRB5_KDC_PROFILE");
+    kdc.active = false;
+}
+
+
+bool
+kdc_active(void)
+{
+    return kdc.active;
+}
+
+
+/*
+ * Fault controls.
+ */
+void
+kdc_delay(unsigned long msec)
+{
+    pthread_mutex_lock(&fault_lock);
+    faults.delay = msec;
+    pthread_mutex_unlock(&fault_lock);
+}
+
+void
+kdc_loss(unsigned int percent)
+{
+    pthread_mutex_lock(&fault_lock);
+    faults.loss = percent;
+    pthread_mutex_unlock(&fault_lock);
+}
+
+void
+kdc_inject(enum kdc_fault fault, unsigned long count)
+{
+    pthread_mutex_lock(&fault_lock);
+    if (faults.count + count > MAX_QUEUE) {
+        pthread_mutex_unlock(&fault_lock);
+        bail("too many queued stand-in KDC faults");
+    }
+    for (; count > 0; count--) {
+        faults.queue[(faults.head + faults.count) % MAX_QUEUE] = fault;
+        faults.count++;
+    }
+    pthread_mutex_unlock(&fault_lock);
+}
+
+unsigned long
+kdc_requests(void)
+{
+    unsigned long requests;
+
+    pthread_mutex_lock(&fault_lock);
+    requests = faults.requests;
+    pthread_mutex_unlock(&fault_lock);
+    return requests;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+/* Without threads there is no relay, so the stand-in is never available. */
+bool
+kdc_start(struct kerberos_config *config UNUSED)
+{
+    return false;
+}
+
+void
+kdc_stop(void)
+{
+}
+
+bool
+kdc_active(void)
+{
+    return false;
+}
+
+void
+kdc_write_conf(const char *path UNUSED, const char *realm UNUSED)
+{
+    bail("stand-in KDC not available");
+}
+
+void
+kdc_delay(unsigned long msec UNUSED)
+{
+}
+
+void
+kdc_loss(unsigned int percent UNUSED)
+{
+}
+
+void
+kdc_inject(enum kdc_fault fault UNUSED, unsigned long count UNUSED)
+{
+}
+
+unsigned long
+kdc_requests(void)
+{
+    return 0;
+}
+
+#endif /* !HAVE_PTHREAD_H */
+
+
+/*
+ * Parse a fault script.  This only uses the functions above, so it works the
+ * same with or without threads.
+ */
+void
+kdc_script(const char *script)
+{
+    static const struct {
+        const char *name;
+        enum kdc_fault fault;
+    } words[] = {
+        { "drop",    KDC_DROP              },
+        { "keyexp",  KDC_KEY_EXPIRED       },
+        { "pass",    KDC_PASS              },
+        { "preauth", KDC_PREAUTH_REQUIRED  },
+        { "unknown", KDC_PRINCIPAL_UNKNOWN },
+    };
+    char *copy, *word, *saveptr, *end;
+    unsigned long value;
+    size_t i;
+
+    copy = bstrdup(script);
+    for (word = strtok_r(copy, " \t,", &saveptr); word != NULL;
+         word = strtok_r(NULL, " \t,", &saveptr)) {
+        if (strncmp(word, "delay=", strlen("delay=")) == 0) {
+            value = strtoul(word + strlen("delay="), &end, 10);
+            if (*end != '\0')
+                bail("invalid stand-in KDC delay: %s", word);
+            kdc_delay(value);
+            continue;
+        }
+        if (strncmp(word, "loss=", strlen("loss=")) == 0) {
+            value = strtoul(word + strlen("loss="), &end, 10);
+            if (*end != '\0' || value > 100)
+                bail("invalid stand-in KDC loss: %s", word);
+            kdc_loss((unsigned int) value);
+            continue;
+        }
+        if (strcmp(word, "clear") == 0) {
+            kdc_delay(0);
+            kdc_loss(0);
+            continue;
+        }
+        for (i = 0; i < ARRAY_SIZE(words); i++)
+            if (strcmp(word, words[i].name) == 0)
+                break;
+        if (i == ARRAY_SIZE(words))
+            bail("unknown stand-in KDC fault: %s", word);
+        kdc_inject(words[i].fault, 1);
+    }
+    free(copy);
+}
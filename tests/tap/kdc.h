@@ -0,0 +1,91 @@
+/*
+ * Stand-in KDC for tests and benchmarks.
+ *
+ * When the Kerberos tests are not configured with a real realm, the test
+ * suite can instead generate a throwaway realm served by the MIT Kerberos KDC
+ * and kadmind programs, if they are installed, listening only on loopback.
+ * Clients don't talk to those daemons directly.  A thread in the test
+ * process listens on separate loopback UDP and TCP ports for the KDC and
+ * kpasswd services and relays each request, which lets tests delay or drop
+ * requests or answer them with a Kerberos error instead.
+ *
+ * kerberos_setup starts the stand-in automatically and kerberos_generate_conf
+ * points krb5.conf at it, so most callers never use this interface
+ * directly.  Tests use it to inject faults and to count KDC requests.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TAP_KDC_H
+#define TAP_KDC_H 1
+
+#include <config.h>
+#include <portable/stdbool.h>
+
+#include <tests/tap/macros.h>
+
+/* Forward declarations to avoid unnecessary includes. */
+struct kerberos_config;
+
+/* What to do with a request to the stand-in KDC. */
+enum kdc_fault {
+    KDC_PASS,                   /* Relay the request normally. */
+    KDC_DROP,                   /* Drop the request without a reply. */
+    KDC_PREAUTH_REQUIRED,       /* Reply with KDC_ERR_PREAUTH_REQUIRED. */
+    KDC_KEY_EXPIRED,            /* Reply with KDC_ERR_KEY_EXP. */
+    KDC_PRINCIPAL_UNKNOWN       /* Reply with KDC_ERR_C_PRINCIPAL_UNKNOWN. */
+};
+
+BEGIN_DECLS
+
+/*
+ * Generate a realm with a user principal and a keytab and start the stand-in
+ * KDC for it, filling in the keytab, userprinc, username, realm, and
+ * password members of the provided struct.  Sets KRB5_CONFIG to a krb5.conf
+ * for that realm.  Returns false if the KDC programs aren't available or the
+ * realm can't be created, and calls bail if the KDC fails to start.
+ */
+bool kdc_start(struct kerberos_config *)
+    __attribute__((__nonnull__));
+
+/* Stop the stand-in KDC and remove its realm.  Harmless if not running. */
+void kdc_stop(void);
+
+/* Whether the stand-in KDC is running. */
+bool kdc_active(void);
+
+/*
+ * Write a krb5.conf that points at the stand-in KDC to the given path, with
+ * the given default realm or the stand-in realm if that is NULL.
+ */
+void kdc_write_conf(const char *path, const char *realm)
+    __attribute__((__nonnull__(1)));
+
+/*
+ * Control the faults applied to requests.  kdc_delay sets a delay in
+ * milliseconds before every reply, and kdc_loss drops the given percentage
+ * of requests with a fixed pseudo-random sequence so that runs are
+ * repeatable.  kdc_inject queues a fault for the next count KDC requests,
+ * ahead of the random losses.  Kerberos errors are only injected into AS
+ * and TGS requests, while delays and drops apply to kpasswd as well.
+ */
+void kdc_delay(unsigned long msec);
+void kdc_loss(unsigned int percent);
+void kdc_inject(enum kdc_fault, unsigned long count);
+
+/*
+ * Set up faults from a string of words separated by spaces or commas, for
+ * use from the command line of a benchmark.  The words are delay=<msec>,
+ * loss=<percent>, clear (remove all faults), and pass, drop, preauth,
+ * keyexp, and unknown, which queue the corresponding fault.  Calls bail on
+ * an invalid script.
+ */
+void kdc_script(const char *)
+    __attribute__((__nonnull__));
+
+/* Return the number of AS and TGS requests received since starting. */
+unsigned long kdc_requests(void);
+
+END_DECLS
+
+#endif /* !TAP_KDC_H */
@@ -46,6 +46,7 @@
 #include <sys/stat.h>
 
 #include <tests/tap/basic.h>
+#include <tests/tap/kdc.h>
 #include <tests/tap/kerberos.h>
 #include <tests/tap/macros.h>
 #include <tests/tap/process.h>
@@ -266,10 +267,32 @@ kerberos_cleanup(void)
 static void
 kerberos_cleanup_handler(int success UNUSED, int primary)
 {
-    if (primary)
+    if (primary) {
         kerberos_cleanup();
-    else
+        kdc_stop();
+    } else {
         kerberos_free();
+    }
+}
+
+
+/*
+ * Return true if either config/keytab or config/password is present.
+ */
+static bool
+kerberos_configured(void)
+{
+    char *path;
+    bool found = false;
+    size_t i;
+    static const char *const files[] = { "config/keytab", "config/password" };
+
+    for (i = 0; i < ARRAY_SIZE(files) && !found; i++) {
+        path = test_file_path(files[i]);
+        found = (path != NULL);
+        test_file_path_free(path);
+    }
+    return found;
 }
 
 
@@ -295,6 +318,24 @@ kerberos_setup(enum kerberos_needs needs)
         kerberos_cleanup();
     config = bcalloc(1, sizeof(struct kerberos_config));
 
+    /*
+     * If neither config/keytab nor config/password exist, try to run a
+     * stand-in KDC for a generated realm instead.  This provides both, so
+     * none of the other configuration is needed.
+     */
+    if ((needs & TAP_KRB_NEEDS_BOTH) != 0 && (needs & TAP_KRB_NEEDS_PKINIT) == 0
+        && !kerberos_configured() && kdc_start(config)) {
+        tmpdir_ticket = test_tmpdir();
+        basprintf(&config->cache, "%s/krb5cc_test", tmpdir_ticket);
+        basprintf(&krb5ccname, "KRB5CCNAME=%s/krb5cc_test", tmpdir_ticket);
+        basprintf(&krb5_ktname, "KRB5_KTNAME=%s", config->keytab);
+        putenv(krb5ccname);
+        putenv(krb5_ktname);
+        kerberos_kinit();
+        test_cleanup_register(kerberos_cleanup_handler);
+        return config;
+    }
+
     /*
      * If we have a config/keytab file, set the KRB5CCNAME and KRB5_KTNAME
      * environment variables and obtain initial tickets.
@@ -431,15 +472,21 @@ kerberos_generate_conf(const char *realm)
 
     if (tmpdir_conf != NULL)
         kerberos_cleanup_conf();
-    path = test_file_path("data/generate-krb5-conf");
-    if (path == NULL)
-        bail("cannot find generate-krb5-conf");
-    argv[0] = path;
-    argv[1] = realm;
-    argv[2] = NULL;
-    run_setup(argv);
-    test_file_path_free(path);
     tmpdir_conf = test_tmpdir();
+    if (kdc_active()) {
+        basprintf(&path, "%s/krb5.conf", tmpdir_conf);
+        kdc_write_conf(path, realm);
+        free(path);
+    } else {
+        path = test_file_path("data/generate-krb5-conf");
+        if (path == NULL)
+            bail("cannot find generate-krb5-conf");
+        argv[0] = path;
+        argv[1] = realm;
+        argv[2] = NULL;
+        run_setup(argv);
+        test_file_path_free(path);
+    }
     basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir_conf);
     putenv(krb5_config);
     if (atexit(kerberos_cleanup_conf) != 0)
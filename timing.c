@@ -0,0 +1,258 @@
+/*
+ * Per-phase timing of module calls.
+ *
+ * When the timing option is set, the module records a monotonic timestamp at
+ * the start and end of each phase of a call that may be slow: parsing the
+ * principal, PKINIT, anonymous FAST armor, the initial credentials exchange,
+ * credential verification, writing ticket caches, password changes, and
+ * waiting on the conversation function.  When the call finishes, the time
+ * spent in each phase and the number of KDC exchanges are logged in a single
+ * line at LOG_INFO.
+ *
+ * Phases may nest, since the Kerberos library calls back into the module to
+ * prompt during the initial credentials exchange.  Each phase is charged only
+ * with the time not spent in the phases nested inside it.
+ *
+ * If the Kerberos library supports krb5_set_kdc_send_hook, every message sent
+ * to a KDC is counted.  Otherwise, each run of a phase that talks to the KDC
+ * counts as one exchange, which undercounts retries and referrals.
+ *
+ * Independent of the timing option, the running phases are also tracked when
+ * a structured log format is in use, so that each log message can say which
+ * phase it came from.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/arena.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* Names of the phases in the log message, indexed by enum pamk5_phase. */
+static const char *const phase_names[PHASE_MAX] = {
+    "name", "pkinit", "fast", "as", "verify", "cache", "copy", "chpw",
+    "prompt"
+};
+
+/* A running phase. */
+struct frame {
+    enum pamk5_phase phase;     /* The phase. */
+    unsigned long long start;   /* When it started, in microseconds. */
+    unsigned long long nested;  /* Time spent in nested phases. */
+};
+
+/* The timing data for one call, allocated from the arena on first use. */
+struct pamk5_timing {
+    unsigned long long first;   /* Start of the first phase. */
+    unsigned long long usec[PHASE_MAX]; /* Time charged to each phase. */
+    bool ran[PHASE_MAX];        /* Whether each phase ran. */
+    struct frame stack[PHASE_MAX]; /* The running phases, innermost last. */
+    size_t depth;               /* Number of running phases. */
+    unsigned long exchanges;    /* Messages sent to a KDC. */
+    bool hooked;                /* Whether the send hook is installed. */
+};
+
+
+/*
+ * Return the current monotonic time in microseconds.
+ */
+static unsigned long long
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+    return (unsigned long long) ts.tv_sec * 1000000ULL
+           + (unsigned long long) ts.tv_nsec / 1000ULL;
+}
+
+
+/*
+ * Count a message sent to a KDC, if the Kerberos library lets us see them.
+ * The message and reply are passed through unchanged.
+ */
+#ifdef HAVE_KRB5_SET_KDC_SEND_HOOK
+static krb5_error_code
+count_send(krb5_context context UNUSED, void *data,
+           const krb5_data *realm UNUSED, const krb5_data *message UNUSED,
+           krb5_data **new_message UNUSED, krb5_data **new_reply UNUSED)
+{
+    struct pamk5_timing *timing = data;
+
+    timing->exchanges++;
+    return 0;
+}
+#endif
+
+
+/*
+ * Track the innermost running phase for structured logs.
+ */
+static void
+phase_push(struct pam_args *args, enum pamk5_phase phase)
+{
+    struct pam_config *config = args->config;
+
+    if (args->log_format == PUTIL_LOG_TEXT)
+        return;
+    if (config->running_depth >= PHASE_MAX)
+        return;
+    config->running[config->running_depth++] = phase;
+    args->phase = phase_names[phase];
+}
+
+static void
+phase_pop(struct pam_args *args, enum pamk5_phase phase)
+{
+    struct pam_config *config = args->config;
+    size_t depth = config->running_depth;
+
+    if (depth == 0 || config->running[depth - 1] != phase)
+        return;
+    config->running_depth = --depth;
+    args->phase = (depth > 0) ? phase_names[config->running[depth - 1]] : NULL;
+}
+
+
+/*
+ * Start timing a phase, allocating the timing data for the call if needed.
+ * Failure to allocate just means nothing is timed.
+ */
+void
+pamk5_timing_start(struct pam_args *args, enum pamk5_phase phase)
+{
+    struct pamk5_timing *timing;
+    struct frame *frame;
+
+    phase_push(args, phase);
+    if (!args->config->timing)
+        return;
+    timing = args->config->phases;
+    if (timing == NULL) {
+        timing = putil_arena_alloc(args, sizeof(struct pamk5_timing));
+        if (timing == NULL)
+            return;
+        memset(timing, 0, sizeof(struct pamk5_timing));
+        timing->first = now();
+        args->config->phases = timing;
+#ifdef HAVE_KRB5_SET_KDC_SEND_HOOK
+        if (args->ctx != NULL) {
+            krb5_set_kdc_send_hook(args->ctx, count_send, timing);
+            timing->hooked = true;
+        }
+#endif
+    }
+    if (timing->depth >= PHASE_MAX)
+        return;
+    frame = &timing->stack[timing->depth++];
+    frame->phase = phase;
+    frame->nested = 0;
+    frame->start = now();
+}
+
+
+/*
+ * Stop timing a phase, which must be the innermost running one.  The time
+ * not spent in nested phases is charged to this phase, and all of it to the
+ * phase enclosing this one as nested time.
+ */
+void
+pamk5_timing_stop(struct pam_args *args, enum pamk5_phase phase)
+{
+    struct pamk5_timing *timing = args->config->phases;
+    struct frame *frame;
+    unsigned long long elapsed;
+
+    phase_pop(args, phase);
+    if (timing == NULL || timing->depth == 0)
+        return;
+    frame = &timing->stack[timing->depth - 1];
+    if (frame->phase != phase)
+        return;
+    timing->depth--;
+    elapsed = now() - frame->start;
+    timing->usec[phase] += elapsed - frame->nested;
+    timing->ran[phase] = true;
+    if (timing->depth > 0)
+        timing->stack[timing->depth - 1].nested += elapsed;
+
+    /* Without the send hook, count the phases that talk to the KDC. */
+    if (!timing->hooked)
+        switch (phase) {
+        case PHASE_PKINIT:
+        case PHASE_FAST:
+        case PHASE_AS:
+        case PHASE_VERIFY:
+        case PHASE_CHPW:
+            timing->exchanges++;
+            break;
+        case PHASE_NAME:
+        case PHASE_CACHE:
+        case PHASE_COPY:
+        case PHASE_PROMPT:
+        case PHASE_MAX:
+            break;
+        }
+}
+
+
+/*
+ * Count a message sent to a KDC by the module for nonblocking_kdc, which the
+ * send hook doesn't see.  Without the hook, the phase is counted instead.
+ */
+void
+pamk5_timing_exchange(struct pam_args *args)
+{
+    struct pamk5_timing *timing = args->config->phases;
+
+    if (timing != NULL && timing->hooked)
+        timing->exchanges++;
+}
+
+
+/*
+ * Log the time spent in each phase that ran, the number of KDC exchanges,
+ * and the total time since the first phase started, and then remove the send
+ * hook from the Kerberos context since it may outlive this call.  Also forget
+ * any phases left running for structured logs.
+ */
+void
+pamk5_timing_report(struct pam_args *args)
+{
+    struct pamk5_timing *timing = args->config->phases;
+    char buffer[512];
+    size_t used = 0;
+    int phase, status;
+
+    args->config->running_depth = 0;
+    args->phase = NULL;
+    if (timing == NULL)
+        return;
+    buffer[0] = '\0';
+    for (phase = 0; phase < PHASE_MAX; phase++) {
+        if (!timing->ran[phase])
+            continue;
+        status = snprintf(buffer + used, sizeof(buffer) - used, " %s=%lluus",
+                          phase_names[phase], timing->usec[phase]);
+        if (status < 0 || (size_t) status >= sizeof(buffer) - used)
+            break;
+        used += (size_t) status;
+    }
+    pam_syslog(args->pamh, LOG_INFO, "user %s timing:%s kdc=%lu total=%lluus",
+               args->user != NULL ? args->user : "UNKNOWN", buffer,
+               timing->exchanges, now() - timing->first);
+#ifdef HAVE_KRB5_SET_KDC_SEND_HOOK
+    if (timing->hooked && args->ctx != NULL)
+        krb5_set_kdc_send_hook(args->ctx, NULL, NULL);
+#endif
+    args->config->phases = NULL;
+}
@@ -0,0 +1,250 @@
+/*
+ * Compile pam-krb5 configurations into a file the module can map directly.
+ *
+ * Reads lines of pam_krb5 module arguments, one PAM configuration line's
+ * worth per line, resolves each against krb5.conf exactly as the module
+ * would, and writes the results to the compiled configuration file given on
+ * the command line.  See pam_krb5_compile(8) for details.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <syslog.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <pam-util/vector.h>
+
+/* The longest line of module arguments we accept. */
+#define MAX_LINE 8192
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: pam_krb5_compile <output> [<input>]\n\
+\n\
+Each line of <input> (standard input by default) is a set of pam_krb5\n\
+module arguments exactly as written in the PAM configuration.  Blank lines\n\
+and lines starting with # are ignored.\n";
+
+/* The configurations compiled so far. */
+struct compiled {
+    char **keys;
+    size_t *keylens;
+    struct pam_config **configs;
+    size_t count;
+    size_t allocated;
+};
+
+
+/*
+ * Split a line of module arguments into a vector.  Arguments are separated
+ * by whitespace, except that, as in the Linux PAM configuration syntax, an
+ * argument enclosed in square brackets may contain spaces and the brackets
+ * are removed.  Returns NULL on a syntax error or memory allocation failure.
+ */
+static struct vector *
+split_line(char *line)
+{
+    struct vector *result;
+    char *p, *start;
+
+    result = vector_new();
+    if (result == NULL)
+        return NULL;
+    p = line;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0')
+            break;
+        if (*p == '[') {
+            start = ++p;
+            p = strchr(p, ']');
+            if (p == NULL)
+                goto fail;
+        } else {
+            start = p;
+            p += strcspn(p, " \t");
+        }
+        if (*p != '\0')
+            *p++ = '\0';
+        if (!vector_add(result, start))
+            goto fail;
+    }
+    return result;
+
+fail:
+    vector_free(result);
+    return NULL;
+}
+
+
+/*
+ * Resolve the configuration for one line of module arguments and add it to
+ * the compiled set.  Returns true on success and false on failure, which will
+ * already have been reported.
+ */
+static bool
+compile_line(struct compiled *compiled, struct vector *line)
+{
+    struct pam_args *args;
+    int argc = (int) line->count;
+    const char **argv = (const char **) line->strings;
+    size_t size;
+    void *p;
+    char *key = NULL;
+    size_t keylen;
+
+    args = putil_args_new(NULL, 0);
+    if (args == NULL)
+        return false;
+    if (!pamk5_config_realm(args, argc, argv))
+        goto fail;
+    if (!pamk5_config_load(args, argc, argv))
+        goto fail;
+    key = pamk5_config_key(args, argc, argv, &keylen);
+    if (key == NULL)
+        goto fail;
+    if (compiled->count == compiled->allocated) {
+        size = (compiled->allocated == 0) ? 16 : compiled->allocated * 2;
+        p = reallocarray(compiled->keys, size, sizeof(char *));
+        if (p == NULL)
+            goto nomem;
+        compiled->keys = p;
+        p = reallocarray(compiled->keylens, size, sizeof(size_t));
+        if (p == NULL)
+            goto nomem;
+        compiled->keylens = p;
+        p = reallocarray(compiled->configs, size, sizeof(struct pam_config *));
+        if (p == NULL)
+            goto nomem;
+        compiled->configs = p;
+        compiled->allocated = size;
+    }
+    compiled->keys[compiled->count] = key;
+    compiled->keylens[compiled->count] = keylen;
+    compiled->configs[compiled->count] = args->config;
+    compiled->count++;
+    args->config = NULL;
+    pamk5_free(args);
+    return true;
+
+nomem:
+    putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+fail:
+    free(key);
+    pamk5_free(args);
+    return false;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct pam_args *args;
+    struct compiled compiled;
+    struct config_stamp *stamps = NULL;
+    size_t nstamps = 0;
+    struct vector *line_args;
+    char line[MAX_LINE];
+    const char *input = NULL;
+    FILE *in = stdin;
+    size_t i, length;
+    unsigned long lineno = 0;
+    bool okay = true;
+
+    if (argc < 2 || argc > 3 || argv[1][0] == '-') {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+    if (argc == 3) {
+        input = argv[2];
+        in = fopen(input, "r");
+        if (in == NULL) {
+            fprintf(stderr, "pam_krb5_compile: cannot open %s: %s\n", input,
+                    strerror(errno));
+            exit(1);
+        }
+    } else {
+        input = "standard input";
+    }
+
+    /* All diagnostics from the module code go through syslog. */
+    openlog("pam_krb5_compile", LOG_PERROR, LOG_AUTHPRIV);
+    args = putil_args_new(NULL, 0);
+    if (args == NULL)
+        exit(1);
+
+    /*
+     * Record the configuration files before reading them, so that a change
+     * made while we run makes the result stale rather than wrongly current.
+     */
+    if (!pamk5_config_stamps(args, &stamps, &nstamps)) {
+        fprintf(stderr, "pam_krb5_compile: cannot determine Kerberos"
+                " configuration files\n");
+        exit(1);
+    }
+
+    /* Resolve each line. */
+    memset(&compiled, 0, sizeof(compiled));
+    while (fgets(line, sizeof(line), in) != NULL) {
+        lineno++;
+        length = strlen(line);
+        if (length > 0 && line[length - 1] == '\n')
+            line[length - 1] = '\0';
+        else if (!feof(in)) {
+            fprintf(stderr, "pam_krb5_compile: %s:%lu: line too long\n",
+                    input, lineno);
+            okay = false;
+            break;
+        }
+        if (line[strspn(line, " \t")] == '#')
+            continue;
+        line_args = split_line(line);
+        if (line_args == NULL) {
+            fprintf(stderr, "pam_krb5_compile: %s:%lu: invalid line\n",
+                    input, lineno);
+            okay = false;
+            break;
+        }
+        if (line_args->count > 0 && !compile_line(&compiled, line_args)) {
+            fprintf(stderr, "pam_krb5_compile: %s:%lu: cannot resolve"
+                    " configuration\n", input, lineno);
+            okay = false;
+        }
+        vector_free(line_args);
+        if (!okay)
+            break;
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "pam_krb5_compile: cannot read %s: %s\n", input,
+                strerror(errno));
+        okay = false;
+    }
+    if (in != stdin)
+        fclose(in);
+
+    /* Write the output. */
+    if (okay)
+        okay = pamk5_compiled_write(args, argv[1], stamps, nstamps,
+                                    compiled.keys, compiled.keylens,
+                                    compiled.configs, compiled.count);
+
+    /* Clean up. */
+    for (i = 0; i < compiled.count; i++) {
+        free(compiled.keys[i]);
+        pamk5_config_free(compiled.configs[i]);
+    }
+    free(compiled.keys);
+    free(compiled.keylens);
+    free(compiled.configs);
+    pamk5_config_stamps_free(stamps, nstamps);
+    pamk5_free(args);
+    exit(okay ? 0 : 1);
+}
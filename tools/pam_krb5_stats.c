@@ -0,0 +1,148 @@
+/*
+ * Print the shared pam-krb5 metrics for Prometheus.
+ *
+ * Maps the metrics file written by the module when the metrics option is
+ * set and prints its counters in the Prometheus text exposition format on
+ * standard output.  See pam_krb5_stats(8) for details.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <metrics.h>
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: pam_krb5_stats <metrics-file>\n\
+\n\
+Prints the counters in <metrics-file>, as named by the pam_krb5 metrics\n\
+option, in the Prometheus text format.\n";
+
+/* Names of the operations, indexed by enum metrics_op. */
+static const char *const op_names[METRICS_OP_MAX] = {
+    "auth", "setcred", "chpw"
+};
+
+/* Names of the outcomes, indexed by enum metrics_result. */
+static const char *const result_names[METRICS_RESULT_MAX] = {
+    "success", "principal_unknown", "preauth_failed", "kdc_unreach",
+    "key_exp", "other"
+};
+
+
+/*
+ * Print the counters.  They are read while other processes may be updating
+ * them, so a histogram may be off by an operation in progress.
+ */
+static void
+print_metrics(const struct metrics_file *file)
+{
+    const struct metrics_counters *counters;
+    unsigned long long total;
+    size_t op, i;
+
+    printf("# HELP pam_krb5_operations_total PAM operations by outcome.\n");
+    printf("# TYPE pam_krb5_operations_total counter\n");
+    for (op = 0; op < METRICS_OP_MAX; op++)
+        for (i = 0; i < METRICS_RESULT_MAX; i++)
+            printf("pam_krb5_operations_total{operation=\"%s\","
+                   "result=\"%s\"} %llu\n", op_names[op], result_names[i],
+                   (unsigned long long) file->ops[op].results[i]);
+
+    printf("# HELP pam_krb5_operation_duration_seconds Latency of PAM"
+           " operations.\n");
+    printf("# TYPE pam_krb5_operation_duration_seconds histogram\n");
+    for (op = 0; op < METRICS_OP_MAX; op++) {
+        counters = &file->ops[op];
+        total = 0;
+        for (i = 0; i < METRICS_BUCKETS; i++) {
+            total += counters->buckets[i];
+            if (i < METRICS_BUCKETS - 1)
+                printf("pam_krb5_operation_duration_seconds_bucket"
+                       "{operation=\"%s\",le=\"%.6f\"} %llu\n", op_names[op],
+                       (double) (1ULL << i) / 1e6, total);
+            else
+                printf("pam_krb5_operation_duration_seconds_bucket"
+                       "{operation=\"%s\",le=\"+Inf\"} %llu\n", op_names[op],
+                       total);
+        }
+        printf("pam_krb5_operation_duration_seconds_sum{operation=\"%s\"}"
+               " %.6f\n", op_names[op], (double) counters->usec / 1e6);
+        printf("pam_krb5_operation_duration_seconds_count{operation=\"%s\"}"
+               " %llu\n", op_names[op], total);
+    }
+
+    printf("# HELP pam_krb5_fast_total Authentications protected by FAST.\n");
+    printf("# TYPE pam_krb5_fast_total counter\n");
+    printf("pam_krb5_fast_total %llu\n",
+           (unsigned long long) file->events[METRICS_FAST]);
+    printf("# HELP pam_krb5_pkinit_total Authentications attempted with"
+           " PKINIT.\n");
+    printf("# TYPE pam_krb5_pkinit_total counter\n");
+    printf("pam_krb5_pkinit_total %llu\n",
+           (unsigned long long) file->events[METRICS_PKINIT]);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *path;
+    const struct metrics_file *file;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (argc != 2) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+    path = argv[1];
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "pam_krb5_stats: cannot open %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "pam_krb5_stats: cannot stat %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    if (st.st_size != (off_t) sizeof(struct metrics_file)) {
+        fprintf(stderr, "pam_krb5_stats: %s is not a metrics file for this"
+                " version\n", path);
+        exit(1);
+    }
+    map = mmap(NULL, sizeof(struct metrics_file), PROT_READ, MAP_SHARED, fd,
+               0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "pam_krb5_stats: cannot map %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    file = map;
+    if (memcmp(file->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC)) != 0
+        || file->version != METRICS_VERSION
+        || file->size != sizeof(struct metrics_file)) {
+        fprintf(stderr, "pam_krb5_stats: %s is not a metrics file for this"
+                " version\n", path);
+        exit(1);
+    }
+    print_metrics(file);
+    munmap(map, sizeof(struct metrics_file));
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        fprintf(stderr, "pam_krb5_stats: cannot write output: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Support for the USDT probes.
+ *
+ * Defines the semaphores for the probes declared in usdt.h, which the tracer
+ * finds through the probe notes and increments while attached, and the
+ * helper that formats principals for probe arguments.  Empty unless built
+ * with --enable-probes.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <internal.h>
+#include <pam-util/arena.h>
+#include <pam-util/args.h>
+#include <usdt.h>
+
+#ifdef HAVE_SDT_PROBES
+
+/* The semaphores go in the section where SystemTap's tools look for them. */
+# define USDT_DEFINE(name) \
+    unsigned short USDT_SEMAPHORE(name) __attribute__((section(".probes")));
+
+USDT_PROBES(USDT_DEFINE)
+
+
+/*
+ * Unparse a principal into the arena for a probe argument.  Returns NULL if
+ * there is no principal or Kerberos context or on any failure, since a probe
+ * has no way to report errors.
+ */
+const char *
+pamk5_probe_principal(struct pam_args *args, krb5_const_principal princ)
+{
+    char *name, *result;
+
+    if (args == NULL || args->ctx == NULL || princ == NULL)
+        return NULL;
+    if (krb5_unparse_name(args->ctx, princ, &name) != 0)
+        return NULL;
+    result = putil_arena_strdup(args, name);
+    krb5_free_unparsed_name(args->ctx, name);
+    return result;
+}
+
+#endif /* HAVE_SDT_PROBES */
@@ -0,0 +1,143 @@
+/*
+ * USDT probes for tracing pam-krb5.
+ *
+ * When built with --enable-probes, the module contains static probes under
+ * the provider pam_krb5 that bpftrace, perf, and SystemTap can attach to.
+ * They mark entry to and return from each PAM interface and the start and
+ * end of each initial credentials exchange, credential verification, and
+ * ticket cache resolve, initialize, and store.  An unattached probe is a
+ * single nop, and the arguments of each probe are only evaluated while
+ * something is attached to it, so unparsing principals costs nothing
+ * otherwise.  Without --enable-probes, the probe macros expand to nothing.
+ *
+ * The probes and their arguments are:
+ *
+ *     call_entry(function, flags)
+ *     call_return(function, user, status)
+ *     as_start(user, principal, service)
+ *     as_done(user, principal, service, krb5 status)
+ *     verify_start(user, principal)
+ *     verify_done(user, principal, krb5 status)
+ *     cc_resolve_start(user, cache name)
+ *     cc_resolve_done(user, cache name, krb5 status)
+ *     cc_initialize_start(user, principal)
+ *     cc_initialize_done(user, principal, krb5 status)
+ *     cc_store_start(user, principal)
+ *     cc_store_done(user, principal, krb5 status)
+ *
+ * All strings may be NULL.  The service is NULL when getting a TGT.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef USDT_H
+#define USDT_H 1
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/macros.h>
+
+/* Forward declarations to avoid unnecessary includes. */
+struct pam_args;
+
+/*
+ * The probes, for defining and declaring their semaphores.  The semaphore
+ * for each probe is incremented by the tracer while it is attached.
+ */
+#define USDT_PROBES(P)                                                  \
+    P(call_entry) P(call_return) P(as_start) P(as_done)                 \
+    P(verify_start) P(verify_done) P(cc_resolve_start)                  \
+    P(cc_resolve_done) P(cc_initialize_start) P(cc_initialize_done)     \
+    P(cc_store_start) P(cc_store_done)
+
+#ifdef HAVE_SDT_PROBES
+
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+
+# define USDT_SEMAPHORE(name) pam_krb5_##name##_semaphore
+# define USDT_DECLARE(name) extern unsigned short USDT_SEMAPHORE(name);
+
+/* Default to a hidden visibility for all internal functions. */
+# pragma GCC visibility push(hidden)
+
+USDT_PROBES(USDT_DECLARE)
+
+/*
+ * Return the unparsed form of a principal in memory from the arena, or NULL
+ * if it is NULL or can't be unparsed.  Only called when a probe is attached.
+ */
+const char *pamk5_probe_principal(struct pam_args *, krb5_const_principal);
+
+/* Undo default visibility change. */
+# pragma GCC visibility pop
+
+# define USDT_ENABLED(name) __builtin_expect(USDT_SEMAPHORE(name) != 0, 0)
+# define USDT2(name, a, b)                                              \
+    do {                                                                \
+        if (USDT_ENABLED(name))                                         \
+            DTRACE_PROBE2(pam_krb5, name, a, b);                        \
+    } while (0)
+# define USDT3(name, a, b, c)                                           \
+    do {                                                                \
+        if (USDT_ENABLED(name))                                         \
+            DTRACE_PROBE3(pam_krb5, name, a, b, c);                     \
+    } while (0)
+# define USDT4(name, a, b, c, d)                                        \
+    do {                                                                \
+        if (USDT_ENABLED(name))                                         \
+            DTRACE_PROBE4(pam_krb5, name, a, b, c, d);                  \
+    } while (0)
+# define USDT_PRINC(args, princ) pamk5_probe_principal((args), (princ))
+
+#else /* !HAVE_SDT_PROBES */
+
+# define USDT2(name, a, b)       do { } while (0)
+# define USDT3(name, a, b, c)    do { } while (0)
+# define USDT4(name, a, b, c, d) do { } while (0)
+
+#endif /* !HAVE_SDT_PROBES */
+
+/* The user for a probe, which may not be known yet. */
+#define USDT_USER(args) ((args) != NULL ? (args)->user : (const char *) NULL)
+
+/* Entry to and return from a PAM interface, named by the calling function. */
+#define PROBE_CALL_ENTRY(flags)                                         \
+    USDT2(call_entry, (const char *) __func__, (flags))
+#define PROBE_CALL_RETURN(args, status)                                 \
+    USDT3(call_return, (const char *) __func__, USDT_USER(args), (status))
+
+/* An initial credentials exchange for a principal and optional service. */
+#define PROBE_AS_START(args, princ, service)                            \
+    USDT3(as_start, USDT_USER(args), USDT_PRINC((args), (princ)),       \
+          (const char *) (service))
+#define PROBE_AS_DONE(args, princ, service, retval)                     \
+    USDT4(as_done, USDT_USER(args), USDT_PRINC((args), (princ)),        \
+          (const char *) (service), (retval))
+
+/* Verification of the credentials for a principal. */
+#define PROBE_VERIFY_START(args, princ)                                 \
+    USDT2(verify_start, USDT_USER(args), USDT_PRINC((args), (princ)))
+#define PROBE_VERIFY_DONE(args, princ, retval)                          \
+    USDT3(verify_done, USDT_USER(args), USDT_PRINC((args), (princ)),    \
+          (retval))
+
+/* Ticket cache operations. */
+#define PROBE_CC_RESOLVE_START(args, name)                              \
+    USDT2(cc_resolve_start, USDT_USER(args), (const char *) (name))
+#define PROBE_CC_RESOLVE_DONE(args, name, retval)                       \
+    USDT3(cc_resolve_done, USDT_USER(args), (const char *) (name),      \
+          (retval))
+#define PROBE_CC_INITIALIZE_START(args, princ)                          \
+    USDT2(cc_initialize_start, USDT_USER(args),                         \
+          USDT_PRINC((args), (princ)))
+#define PROBE_CC_INITIALIZE_DONE(args, princ, retval)                   \
+    USDT3(cc_initialize_done, USDT_USER(args),                          \
+          USDT_PRINC((args), (princ)), (retval))
+#define PROBE_CC_STORE_START(args, princ)                               \
+    USDT2(cc_store_start, USDT_USER(args), USDT_PRINC((args), (princ)))
+#define PROBE_CC_STORE_DONE(args, princ, retval)                        \
+    USDT3(cc_store_done, USDT_USER(args), USDT_PRINC((args), (princ)),  \
+          (retval))
+
+#endif /* !USDT_H */